@@ -0,0 +1,15 @@
+-- application configuration of gtytest.lua with the users spread over two
+-- postgres shards, used by the sharding tests
+local dir = debug and debug.getinfo(1, 'S').source:match('^@(.*/)') or 'res/'
+dofile(dir..'gtytest.lua')
+
+app.postgres.shards = {
+    shard2 = {
+        connect = {
+            dbname = "build",
+            user   = "build",
+            passwd = "passwd",
+            host   = "postgres-shard"
+        }
+    }
+}
@@ -24,7 +24,30 @@ app = {
     --
     secrets = {
         -- key used to generate user salt
-        passwdkey = "8xF1nfomq1u5LzVB"
+        passwdkey = "8xF1nfomq1u5LzVB",
+        -- number of threads used to hash passwords, 0 hashes on the event loop
+        kdfThreads = 2,
+        -- maximum number of hashes waiting for a thread before requests are rejected
+        kdfQueueDepth = 256,
+        -- hash concurrent logins together with the multi-buffer PBKDF2 engine
+        kdfBatch = true,
+        -- microseconds a KDF thread waits for more logins to fill its SIMD lanes
+        kdfBatchWindow = 200,
+        -- hashing of new passwords, hashes created with other parameters are
+        -- upgraded the next time the user logs in. Without it passwords keep
+        -- the legacy hash (passwdkey and kdfIterations)
+        passwd = {
+            -- one of legacy, pbkdf2-sha1 (multi-buffer engine), pbkdf2-sha256 or argon2id
+            scheme = 'pbkdf2-sha256',
+            -- PBKDF2 iterations or argon2id passes
+            cost = 100000,
+            -- argon2id memory in KiB and lanes
+            memory = 65536,
+            parallelism = 1,
+            -- when set, cost is calibrated at startup so that a hash takes
+            -- this many milliseconds on the current machine
+            budget = 0
+        }
     },
 
     --
@@ -40,7 +63,33 @@ app = {
         -- JWT domain
         domain = 'gty.semausu.com',
         -- JWT path
-        path   = ''
+        path   = '',
+        -- tokens verified by the authorization middleware are cached until
+        -- they expire, revocations are broadcast to all instances over redis
+        cache = {
+            -- maximum number of cached tokens, 0 disables the cache
+            capacity = 10000,
+            -- redis channel on which revocations are broadcast
+            channel = 'semausu_jwt'
+        },
+        -- logged out and blocked users are kept in memory for the lifetime of
+        -- a token, so that checking a token never needs redis
+        revocations = {
+            -- seconds covered by each bucket of the filter
+            width = 60,
+            -- expected revocations per bucket, 0 disables the filter
+            capacity = 1000,
+            -- false positive rate of the filter, a false positive revokes a valid token
+            fpr = 1e-7,
+            -- redis channel on which revocations are broadcast
+            channel = 'semausu_revocations'
+        },
+        -- refresh tokens returned on login (X-Refresh-Token), swapped on
+        -- /users/refresh for a new access token without the password
+        refresh = {
+            -- seconds a refresh token is valid, 0 disables refresh tokens
+            lifetime = 2592000
+        }
     },
 
     --
@@ -63,7 +112,87 @@ app = {
         -- connection timeout in milliseconds
         timeout = 5000,
         -- time to keep connection alive in seconds
-        keepAlive = 9000
+        keepAlive = 9000,
+        -- circuit breaker, opens when too many calls fail or are slow in a
+        -- window, calls then fail right away until probes succeed again
+        breaker = {
+            -- fraction of failed calls that opens the breaker
+            errorRate = 0.5,
+            -- calls slower than this many milliseconds are slow, 0 to ignore
+            slow = 2000,
+            -- fraction of slow calls that opens the breaker
+            slowRate = 0.8,
+            -- calls needed before the breaker can open
+            minCalls = 20,
+            -- milliseconds over which calls are counted
+            window = 10000,
+            -- milliseconds the breaker stays open before probing
+            cooldown = 5000,
+            -- probes that must succeed to close the breaker
+            probes = 3
+        },
+        -- read replicas, the login and refresh lookups are read from the least
+        -- busy healthy replica and fall back to the primary. Keyed by the name
+        -- used in metrics, each takes the connect, timeout and keepAlive
+        -- parameters of the primary, timeout and keepAlive default to the primary's.
+        -- The replicas' user needs pg_read_all_stats to see that they are streaming
+        -- replicas = {
+        --     replica1 = { connect = { dbname = "build", user = "build", passwd = "passwd", host = "localhost", port = 5433 } },
+        --     replica2 = { connect = { env = "SEMAUSU_REPLICA2" } }
+        -- },
+        -- the users table can be spread over more databases (shards), users live on
+        -- the shard their email hashes to. The database above is the first shard.
+        -- Keyed by the name the placement of users derives from, never rename a
+        -- shard. Each takes the same parameters as the replicas, a retired shard
+        -- gets no new users and is drained by `gateway reshard`. Stop the gateway
+        -- and run `gateway reshard -C <config>` after changing the shards
+        -- shards = {
+        --     shard1 = { connect = { dbname = "build", user = "build", passwd = "passwd", host = "localhost", port = 5434 } },
+        --     shard2 = { connect = { env = "SEMAUSU_SHARD2" }, retired = true }
+        -- },
+        sharding = {
+            -- name of the first shard
+            name = "primary",
+            -- points of each shard on the hash ring, more spreads users more evenly
+            vnodes = 128,
+            -- the shard holding the application settings, the first shard if not set
+            -- settings = "primary"
+        },
+        routing = {
+            -- milliseconds between replica health and lag checks
+            interval = 1000,
+            -- replicas lagging by more than this many milliseconds are not read from
+            maxLag = 1000,
+            -- milliseconds the reads of a user that was just written go to the primary
+            pin = 2000
+        }
+    },
+
+    --
+    -- in-process caches
+    --
+    cache = {
+        -- login fields of active users
+        users = {
+            -- maximum number of cached users, 0 disables the cache
+            size = 10000,
+            -- time to keep a user in cache in milliseconds
+            ttl = 60000,
+            -- postgres NOTIFY channel used to invalidate other instances
+            channel = 'semausu_users'
+        },
+        -- Bloom filter of registered emails, rejects logins of unknown emails
+        -- without querying postgres
+        emails = {
+            -- expected number of registered users, 0 disables the filter
+            capacity = 100000,
+            -- targeted false positive rate at capacity
+            fpr = 0.01,
+            -- postgres NOTIFY channel used to broadcast registrations
+            channel = 'semausu_emails',
+            -- start from a snapshot saved in redis by other instances
+            snapshot = true
+        }
     },
 
     --
@@ -79,7 +208,100 @@ app = {
             port = 6379
         },
         -- keep connections alive for 30 seconds
-        keepAlive = 30000
+        keepAlive = 30000,
+        -- circuit breaker, see postgres.breaker
+        breaker = {
+            errorRate = 0.5,
+            slow = 500,
+            minCalls = 20,
+            window = 10000,
+            cooldown = 5000,
+            probes = 3
+        }
+    },
+
+    --
+    -- time in milliseconds requests have to complete, requests still waiting
+    -- on postgres or redis when it passes are answered 504 DeadlineExceeded
+    --
+    deadlines = {
+        -- routes without their own deadline, 0 for none
+        default = 5000,
+        login = 2000,
+        refresh = 1000,
+        register = 3000,
+        verify = 1000,
+        logout = 1000,
+        block = 2000
+    },
+
+    --
+    -- rate limiting of the expensive routes, requests over the limits get a
+    -- 429 before any database or password hashing work is done
+    --
+    ratelimit = {
+        -- number of trusted proxies in front of the gateway, the client is the address
+        -- the outermost of them appended to X-Forwarded-For. 0 uses the peer address
+        proxies = 0,
+        -- maximum number of IPs/emails tracked per route, the least recently used are dropped first
+        keys = 100000,
+        -- limits per route (login, register, verify, changepasswd), each with
+        -- ip and email token buckets (tokens per second and burst) and windows
+        -- shared by all instances in redis (requests per window seconds)
+        login = {
+            ip     = { rate = 10, burst = 50 },
+            email  = { rate = 0.2, burst = 10 },
+            shared = { ip = 600, email = 30, window = 60 }
+        },
+        register = {
+            ip     = { rate = 1, burst = 20 },
+            email  = { rate = 0.1, burst = 5 }
+        },
+        verify = {
+            email  = { rate = 0.1, burst = 10 }
+        }
+    },
+
+    --
+    -- admission control, requests over a route's concurrency limit wait in a
+    -- bounded queue and are shed with a 503 when it is full or they waited
+    -- too long. Limits adapt to the latency of the route between min and max
+    --
+    admission = {
+        -- seconds shed clients are told to wait before retrying
+        retryAfter = 1,
+        login = {
+            -- initial, minimum and maximum concurrent requests
+            limit = 64, min = 4, max = 512,
+            -- requests waiting for a slot and milliseconds they wait
+            queue = 128, wait = 50,
+            -- latency increase tolerated before the limit shrinks
+            tolerance = 1.5
+        },
+        register = { limit = 32, min = 4, max = 256, queue = 64, wait = 50 },
+        verify   = { limit = 32, min = 4, max = 256, queue = 64, wait = 50 }
+    },
+
+    --
+    -- request tracing, traces are downloaded from /gateway/traces
+    --
+    tracing = {
+        -- fraction of the requests traced
+        sample = 0.01,
+        -- requests slower than this many milliseconds are always traced
+        slow = 500,
+        -- number of traces kept
+        capacity = 256
+    },
+
+    --
+    -- mail templates, compiled at startup
+    --
+    templates = {
+        -- directory containing the templates
+        dir = 'templates',
+        -- recompile templates changed on disk without restarting
+        watch = true
     },
 
     --
@@ -91,7 +313,23 @@ app = {
             host = '10.5.0.5',
             port = 25,
             username = 'devops@suilteam.com',
-            passwd = 'passwd'
+            passwd = 'passwd',
+            -- number of sessions used to deliver mail concurrently
+            connections = 4,
+            -- pipeline commands when the server advertises PIPELINING
+            pipelining = true,
+            -- milliseconds to wait for each server reply
+            timeout = 5000,
+            -- messages sent on a session before it is recycled
+            maxPerSession = 100,
+            -- circuit breaker of session logins, see postgres.breaker
+            breaker = {
+                errorRate = 0.5,
+                minCalls = 4,
+                window = 60000,
+                cooldown = 30000,
+                probes = 1
+            }
         },
 
         -- Sender address
@@ -99,6 +337,23 @@ app = {
             -- email
             email = 'devops@suilteam.com',
             name  = 'DevOps Suilteam'
+        },
+
+        -- durable queue of outgoing mail
+        queue = {
+            -- maximum number of mails sent per batch
+            batch = 32,
+            -- milliseconds between polls of an idle queue
+            poll = 1000,
+            -- failed deliveries after which a mail is kept as a dead letter
+            attempts = 8,
+            -- milliseconds before the first retry, doubled on every attempt
+            backoff = 1000,
+            maxBackoff = 300000,
+            -- milliseconds a batch being sent is hidden from other instances
+            lease = 60000,
+            -- postgres NOTIFY channel used to wake up senders
+            channel = 'semausu_outbox'
         }
     }
 }
\ No newline at end of file
@@ -0,0 +1,190 @@
+//
+// Created by Carter Mbotho on 2020-04-23.
+//
+
+#include <chrono>
+#include <cmath>
+
+#include "admission.h"
+
+namespace {
+
+    inline int64_t usnow() {
+        using namespace std::chrono;
+        return duration_cast<microseconds>(steady_clock::now().time_since_epoch()).count();
+    }
+
+    /// weights of a new sample in the short and long term latency averages
+    constexpr double SHORT_WEIGHT{0.1};
+    constexpr double LONG_WEIGHT{0.005};
+    /// weight of a new limit, smooths the limit over several samples
+    constexpr double SMOOTHING{0.2};
+
+    std::string metric(const suil::String& path, const char *suffix)
+    {
+        // /users/login becomes admission_users_login_<suffix>
+        std::string name{"admission"};
+        for (size_t i = 0; i < path.size(); i++) {
+            name += isalnum(path.data()[i])? path.data()[i] : '_';
+        }
+        return name + "_" + suffix;
+    }
+}
+
+namespace suil::nozama {
+
+    Admission::Route::Route(Limits l)
+        : limits{std::move(l)},
+          limit{limits.limit}
+    {
+        names[0] = metric(limits.path, "admitted_total");
+        names[1] = metric(limits.path, "queued_total");
+        names[2] = metric(limits.path, "shed_total");
+        names[3] = metric(limits.path, "limit");
+        admitted = &Counters::get().counter(names[0].c_str(), "Requests admitted by the admission controller");
+        queued   = &Counters::get().counter(names[1].c_str(), "Requests that waited for an admission slot");
+        shed     = &Counters::get().counter(names[2].c_str(), "Requests shed by the admission controller");
+    }
+
+    void Admission::setup(Config config)
+    {
+        mConfig = std::move(config);
+        for (auto& route: mRoutes) {
+            // the gauge outlives the route, it must not sample it anymore
+            Counters::get().gauge(route->names[3].c_str(), "Current concurrency limit of the route", [] {
+                return int64_t{0};
+            });
+        }
+        mRoutes.clear();
+        for (auto& limits: mConfig.routes) {
+            limits.min   = std::max(limits.min, 1.0);
+            limits.max   = std::max(limits.max, limits.min);
+            limits.limit = std::min(std::max(limits.limit, limits.min), limits.max);
+            limits.tolerance = std::max(limits.tolerance, 1.0);
+            idebug("admission control %s {limit: %g [%g, %g], queue: %zu, wait: %ld ms}",
+                   limits.path(), limits.limit, limits.min, limits.max, limits.queue, limits.wait);
+            mRoutes.push_back(std::make_unique<Route>(limits));
+            auto route = mRoutes.back().get();
+            Counters::get().gauge(route->names[3].c_str(), "Current concurrency limit of the route", [route] {
+                return (int64_t) route->limit;
+            });
+        }
+    }
+
+    void Admission::before(http::Request& req, http::Response& resp, Context& ctx)
+    {
+        ctx.route = route(req.url);
+        ctx.admitted = false;
+        if (ctx.route >= 0 && !admit(ctx)) {
+            shed(resp);
+        }
+    }
+
+    void Admission::after(http::Request&, http::Response& resp, Context& ctx)
+    {
+        release(ctx, resp.status() >= 500);
+    }
+
+    int Admission::route(const String& path) const
+    {
+        for (size_t i = 0; i < mRoutes.size(); i++) {
+            if (mRoutes[i]->limits.path == path) {
+                return (int) i;
+            }
+        }
+        return -1;
+    }
+
+    bool Admission::admit(Context& ctx)
+    {
+        auto& route = *mRoutes[ctx.route];
+        if (route.inflight < (size_t) route.limit && route.waiting.empty()) {
+            route.inflight++;
+        }
+        else if (route.waiting.size() < route.limits.queue && route.limits.wait > 0) {
+            // slots are handed over in order by release(), wait for one until the deadline
+            Waiter waiter;
+            waiter.ready = chmake(bool, 1);
+            route.queued->inc();
+            auto it = route.waiting.insert(route.waiting.end(), &waiter);
+            choose {
+            in(waiter.ready, bool, signalled):
+                (void) signalled;
+            deadline(mnow() + route.limits.wait):
+                // a slot handed over as the wait expired is still taken below
+            end
+            }
+            chclose(waiter.ready);
+            if (!waiter.admitted) {
+                route.waiting.erase(it);
+                route.shed->inc();
+                return false;
+            }
+        }
+        else {
+            route.shed->inc();
+            return false;
+        }
+
+        route.admitted->inc();
+        ctx.admitted = true;
+        ctx.start = usnow();
+        return true;
+    }
+
+    void Admission::release(Context& ctx, bool failed)
+    {
+        if (!ctx.admitted) {
+            return;
+        }
+        ctx.admitted = false;
+        auto& route = *mRoutes[ctx.route];
+        route.inflight--;
+        sample(route, usnow() - ctx.start, failed);
+
+        // hand the freed slots to the oldest waiters
+        while (!route.waiting.empty() && route.inflight < (size_t) route.limit) {
+            auto waiter = route.waiting.front();
+            route.waiting.pop_front();
+            route.inflight++;
+            waiter->admitted = true;
+            // buffered, never blocks
+            chs(waiter->ready, bool, true);
+        }
+    }
+
+    void Admission::sample(Route& route, int64_t rtt, bool failed)
+    {
+        auto& limits = route.limits;
+        if (route.longRtt == 0) {
+            route.shortRtt = route.longRtt = (double) rtt;
+            return;
+        }
+        route.shortRtt += SHORT_WEIGHT * (rtt - route.shortRtt);
+        route.longRtt  += LONG_WEIGHT * (rtt - route.longRtt);
+        if (route.longRtt > 2 * route.shortRtt) {
+            // latency dropped for good, forget the slow past quickly
+            route.longRtt = 2 * route.shortRtt;
+        }
+
+        double next{0};
+        if (failed) {
+            next = route.limit / 2;
+        }
+        else {
+            auto gradient = std::max(0.5, std::min(1.0, limits.tolerance * route.longRtt / route.shortRtt));
+            // only grow when the limit is being used, an idle route keeps its limit
+            auto growth = (route.inflight + 1 >= route.limit / 2)? std::sqrt(route.limit) : 0.0;
+            next = route.limit * gradient + growth;
+        }
+        route.limit = route.limit * (1 - SMOOTHING) + next * SMOOTHING;
+        route.limit = std::min(std::max(route.limit, limits.min), limits.max);
+    }
+
+    void Admission::shed(http::Response& resp)
+    {
+        Endpoint::Controller::fail(resp, "ServerBusy", "Server is busy, try again later");
+        resp.header("Retry-After", mConfig.retryAfter);
+        resp.end(http::Status::SERVICE_UNAVAILABLE);
+    }
+}
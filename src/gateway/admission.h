@@ -0,0 +1,126 @@
+//
+// Created by Carter Mbotho on 2020-04-23.
+//
+
+#ifndef SUIL_ADMISSION_H
+#define SUIL_ADMISSION_H
+
+#include <list>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "common.h"
+#include "counters.h"
+
+namespace suil::nozama {
+
+    /**
+     * Admission control of the routes that wait on backends. Each controlled route
+     * admits up to `limit` concurrent requests, requests over the limit wait in a
+     * bounded FIFO queue for at most `wait` milliseconds and are shed with a 503 and
+     * `Retry-After` when the queue is full or their wait expires. Under overload some
+     * requests fail fast instead of every request timing out on the postgres pool.
+     *
+     * The limit follows the latency of admitted requests (gradient style): a long term
+     * average latency is compared to a short term one, when the short term latency
+     * grows the limit shrinks proportionally and when they agree the limit grows by
+     * about the square root of itself. Server errors halve the limit's headroom.
+     *
+     * @note limits are per process and only accessed from the event loop
+     */
+    struct Admission final : LOGGER(NZM_GATEWAY) {
+
+        struct Limits {
+            String  path;
+            /// initial, minimum and maximum number of concurrent requests
+            double  limit{64};
+            double  min{4};
+            double  max{1024};
+            /// requests allowed to wait for a slot, 0 sheds as soon as the limit is reached
+            size_t  queue{128};
+            /// milliseconds a request waits for a slot before being shed
+            int64_t wait{50};
+            /// short term latency allowed over the long term one before the limit shrinks
+            double  tolerance{1.5};
+        };
+
+        struct Config {
+            std::vector<Limits> routes{};
+            /// seconds shed clients are told to wait before retrying
+            int64_t retryAfter{1};
+        };
+
+        struct Context {
+            int     route{-1};
+            bool    admitted{false};
+            /// when the request was admitted (us)
+            int64_t start{0};
+        };
+
+        Admission() = default;
+
+        void setup(Config config);
+
+        void before(http::Request& req, http::Response& resp, Context& ctx);
+
+        void after(http::Request& req, http::Response& resp, Context& ctx);
+
+        /**
+         * @return the index of the limits of the given route, -1 if it is not controlled
+         */
+        int route(const String& path) const;
+
+        /**
+         * Takes a slot of the context's route, waiting in the route's queue if needed
+         * @return false if the request must be shed
+         */
+        bool admit(Context& ctx);
+
+        /**
+         * Gives back the slot of an admitted request and adapts the route's limit
+         * @param failed true if the request failed on the server
+         */
+        void release(Context& ctx, bool failed);
+
+        /**
+         * @return the current concurrency limit of the given route
+         */
+        double limit(int route) const { return mRoutes[route]->limit; }
+
+        /**
+         * @return seconds shed clients are told to wait before retrying
+         */
+        int64_t retryAfter() const { return mConfig.retryAfter; }
+
+    private:
+        struct Waiter {
+            bool admitted{false};
+            /// signalled by release() once the waiter was handed a slot
+            chan ready{nullptr};
+        };
+
+        struct Route {
+            Route(Limits limits);
+
+            Limits      limits;
+            double      limit;
+            size_t      inflight{0};
+            std::list<Waiter*> waiting{};
+            /// exponentially weighted latencies (us)
+            double      shortRtt{0};
+            double      longRtt{0};
+            std::string names[4];
+            Counter    *admitted{nullptr};
+            Counter    *queued{nullptr};
+            Counter    *shed{nullptr};
+        };
+
+        void sample(Route& route, int64_t rtt, bool failed);
+        void shed(http::Response& resp);
+
+        Config mConfig{};
+        std::vector<std::unique_ptr<Route>> mRoutes{};
+    };
+}
+#endif //SUIL_ADMISSION_H
@@ -0,0 +1,75 @@
+//
+// Created by Carter Mbotho on 2020-04-14.
+//
+
+#ifndef SUIL_BLOOM_H
+#define SUIL_BLOOM_H
+
+#include <algorithm>
+#include <cmath>
+#include <string>
+#include <vector>
+
+namespace suil::nozama {
+
+    /**
+     * The hashing and bit layout shared by the Bloom filters of the gateway (see
+     * EmailFilter and Revocations). A key's bits are derived by double hashing
+     * of its 64-bit FNV-1a hash.
+     *
+     * @note the hashes are stable across builds and platforms, filter snapshots and
+     * shard placement (see Shards) depend on them
+     */
+    struct Bloom {
+
+        /// splitmix64 finalizer
+        static inline uint64_t mix(uint64_t x) {
+            x ^= x >> 30; x *= 0xbf58476d1ce4e5b9ull;
+            x ^= x >> 27; x *= 0x94d049bb133111ebull;
+            x ^= x >> 31;
+            return x;
+        }
+
+        static inline uint64_t fnv1a(const std::string& key) {
+            uint64_t h = 0xcbf29ce484222325ull;
+            for (auto c: key) {
+                h ^= (uint8_t) c;
+                h *= 0x100000001b3ull;
+            }
+            return h;
+        }
+
+        /**
+         * Optimal sizing, m = -n.ln(p)/ln(2)^2 and k = (m/n).ln(2)
+         * @param bits set to the number of bits, a multiple of 64
+         * @param hashes set to the number of hashes
+         * @param keys the expected number of keys
+         * @param fpr the targeted false positive rate at capacity
+         */
+        static inline void size(uint64_t& bits, uint32_t& hashes, size_t keys, double fpr) {
+            auto m = (uint64_t) std::ceil(-(double) keys * std::log(fpr) / (M_LN2 * M_LN2));
+            bits = ((m + 63) / 64) * 64;
+            hashes = (uint32_t) std::max(1.0, std::round((double) bits / keys * M_LN2));
+        }
+
+        static inline void add(std::vector<uint64_t>& words, uint64_t bits, uint32_t hashes, const std::string& key) {
+            auto h1 = fnv1a(key), h2 = mix(h1) | 1;
+            for (uint32_t i = 0; i < hashes; i++) {
+                auto bit = (h1 + i*h2) % bits;
+                words[bit / 64] |= (1ull << (bit % 64));
+            }
+        }
+
+        static inline bool test(const std::vector<uint64_t>& words, uint64_t bits, uint32_t hashes, const std::string& key) {
+            auto h1 = fnv1a(key), h2 = mix(h1) | 1;
+            for (uint32_t i = 0; i < hashes; i++) {
+                auto bit = (h1 + i*h2) % bits;
+                if ((words[bit / 64] & (1ull << (bit % 64))) == 0) {
+                    return false;
+                }
+            }
+            return true;
+        }
+    };
+}
+#endif //SUIL_BLOOM_H
@@ -0,0 +1,196 @@
+//
+// Created by Carter Mbotho on 2020-04-25.
+//
+
+#include <chrono>
+
+#include "breaker.h"
+#include "clock.h"
+
+namespace {
+
+    inline int64_t usnow() {
+        using namespace std::chrono;
+        return duration_cast<microseconds>(steady_clock::now().time_since_epoch()).count();
+    }
+
+    const char *STATES[] = {"closed", "open", "half-open"};
+}
+
+namespace suil::nozama {
+
+    Breaker::Call::Call(Breaker& breaker)
+        : mBreaker{breaker},
+          mStart{usnow()},
+          mAllowed{breaker.allow()}
+    {}
+
+    Breaker::Call::~Call()
+    {
+        if (mAllowed && !mDone) {
+            mBreaker.record(false, usnow() - mStart);
+        }
+    }
+
+    void Breaker::Call::ok()
+    {
+        if (mAllowed && !mDone) {
+            mDone = true;
+            mBreaker.record(true, usnow() - mStart);
+        }
+    }
+
+    void Breaker::Call::abandon()
+    {
+        if (mAllowed && !mDone) {
+            mDone = true;
+            mBreaker.release();
+        }
+    }
+
+    Breaker::Breaker(const char *name)
+        : Name{name},
+          mNames{std::string("breaker_") + name + "_opened_total",
+                 std::string("breaker_") + name + "_rejected_total",
+                 std::string("breaker_") + name + "_state"},
+          mOpened{Counters::get().counter(mNames[0].c_str(), "Times the circuit breaker opened")},
+          mRejected{Counters::get().counter(mNames[1].c_str(), "Calls refused by the open circuit breaker")}
+    {
+        Counters::get().gauge(mNames[2].c_str(), "State of the circuit breaker (0 closed, 1 open, 2 half-open)", [this] {
+            return (int64_t) mState;
+        });
+    }
+
+    void Breaker::setup(const Config& config)
+    {
+        mConfig = config;
+        mConfig.minCalls = std::max(mConfig.minCalls, size_t{1});
+        mConfig.probes   = std::max(mConfig.probes, size_t{1});
+        mConfig.window   = std::max(mConfig.window, int64_t{1});
+        reset(Clock::now());
+        idebug("%s circuit breaker {errors: %g, slow: %ld ms at %g, window: %ld ms, cooldown: %ld ms}",
+               Name, mConfig.errorRate, mConfig.slow, mConfig.slowRate, mConfig.window, mConfig.cooldown);
+    }
+
+    bool Breaker::allow()
+    {
+        switch (mState) {
+            case Closed:
+                return true;
+            case Open:
+                if (Clock::now() - mOpenedAt < mConfig.cooldown) {
+                    mRejected.inc();
+                    return false;
+                }
+                idebug("%s circuit breaker half-open, probing", Name);
+                mState = HalfOpen;
+                mProbing = mProbed = 0;
+                // fall through, this call is the first probe
+            case HalfOpen:
+            default:
+                if (mProbing >= mConfig.probes) {
+                    mRejected.inc();
+                    return false;
+                }
+                mProbing++;
+                return true;
+        }
+    }
+
+    void Breaker::record(bool ok, int64_t us)
+    {
+        auto now = Clock::now();
+        bool slow = mConfig.slow > 0 && us >= mConfig.slow * 1000;
+        if (mState == HalfOpen) {
+            if (!ok || slow) {
+                trip(now);
+                return;
+            }
+            mProbing = mProbing? mProbing - 1 : 0;
+            if (++mProbed >= mConfig.probes) {
+                iinfo("%s circuit breaker closed", Name);
+                reset(now);
+            }
+            return;
+        }
+        if (mState == Open) {
+            // a call that started before the breaker opened
+            return;
+        }
+
+        if (now - mWindowStart >= mConfig.window) {
+            reset(now);
+        }
+        mCalls++;
+        mFailures += !ok;
+        mSlow += slow;
+        if (mCalls >= mConfig.minCalls &&
+            (mFailures >= mConfig.errorRate * mCalls || (mConfig.slow > 0 && mSlow >= mConfig.slowRate * mCalls)))
+        {
+            iwarn("%s circuit breaker opened {calls: %zu, failed: %zu, slow: %zu}", Name, mCalls, mFailures, mSlow);
+            trip(now);
+        }
+    }
+
+    int64_t Breaker::retryAfter() const
+    {
+        if (mState != Open) {
+            return 0;
+        }
+        auto remaining = mOpenedAt + mConfig.cooldown - Clock::now();
+        return std::max((remaining + 999) / 1000, int64_t{1});
+    }
+
+    void Breaker::release()
+    {
+        // a probe that never completed, another call can probe in its place
+        if (mState == HalfOpen && mProbing > 0) {
+            mProbing--;
+        }
+    }
+
+    void Breaker::trip(int64_t now)
+    {
+        mState = Open;
+        mOpenedAt = now;
+        mProbing = mProbed = 0;
+        mOpened.inc();
+    }
+
+    void Breaker::reset(int64_t now)
+    {
+        mState = Closed;
+        mWindowStart = now;
+        mCalls = mFailures = mSlow = 0;
+        mProbing = mProbed = 0;
+    }
+
+    void Breaker::toJson(OBuffer& ob) const
+    {
+        ob << "{\"name\":\"" << Name << "\""
+           << ",\"state\":\"" << STATES[mState] << "\""
+           << ",\"calls\":" << mCalls
+           << ",\"failures\":" << mFailures
+           << ",\"slow\":" << mSlow
+           << ",\"retryAfter\":" << retryAfter()
+           << ",\"opened\":" << mOpened.value()
+           << ",\"rejected\":" << mRejected.value() << "}";
+    }
+
+    Breakers& Breakers::get()
+    {
+        static Breakers sBreakers;
+        return sBreakers;
+    }
+
+    void Breakers::toJson(OBuffer& ob) const
+    {
+        ob << "[";
+        Postgres.toJson(ob);
+        ob << ",";
+        Redis.toJson(ob);
+        ob << ",";
+        Smtp.toJson(ob);
+        ob << "]";
+    }
+}
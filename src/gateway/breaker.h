@@ -0,0 +1,144 @@
+//
+// Created by Carter Mbotho on 2020-04-25.
+//
+
+#ifndef SUIL_BREAKER_H
+#define SUIL_BREAKER_H
+
+#include <string>
+
+#include "common.h"
+#include "counters.h"
+
+namespace suil::nozama {
+
+    /**
+     * A circuit breaker around a backend. While closed, calls go through and their
+     * outcome is counted over a window, when enough of them fail or are slow the
+     * breaker opens and calls are refused without touching the backend. After a cool
+     * down the breaker lets a few probe calls through (half-open), it closes if they
+     * all succeed and opens again as soon as one fails.
+     *
+     * @code
+     *   Breaker::Call call(Breakers::get().Postgres);
+     *   if (!call) {
+     *       // fail fast, postgres is down
+     *   }
+     *   scoped(conn, pq.conn());
+     *   call.ok();
+     * @endcode
+     *
+     * @note breakers are per process and only accessed from the event loop
+     */
+    struct Breaker final : LOGGER(NZM_GATEWAY) {
+
+        enum State : uint8_t {
+            Closed,
+            Open,
+            HalfOpen
+        };
+
+        struct Config {
+            /// fraction of failed calls in a window that opens the breaker
+            double  errorRate{0.5};
+            /// calls slower than this many milliseconds count as slow, 0 to ignore latency
+            int64_t slow{0};
+            /// fraction of slow calls in a window that opens the breaker
+            double  slowRate{0.8};
+            /// calls needed in a window before the rates are considered
+            size_t  minCalls{20};
+            /// length of the window in milliseconds
+            int64_t window{10000};
+            /// milliseconds the breaker stays open before letting probes through
+            int64_t cooldown{5000};
+            /// probe calls that must succeed to close the breaker
+            size_t  probes{3};
+        };
+
+        /**
+         * Scopes a call through the breaker, the call is recorded as a failure
+         * unless `ok` is called before it goes out of scope
+         */
+        struct Call {
+            Call(Breaker& breaker);
+            ~Call();
+            /// false if the breaker refused the call
+            explicit operator bool() const { return mAllowed; }
+            void ok();
+            /// the call ended without an outcome (e.g its deadline passed), nothing is recorded
+            void abandon();
+        private:
+            Breaker& mBreaker;
+            int64_t  mStart{0};
+            bool     mAllowed{false};
+            bool     mDone{false};
+        };
+
+        Breaker(const char *name);
+
+        void setup(const Config& config);
+
+        /**
+         * @return true if a call can go through, a call allowed while half-open is a probe
+         */
+        bool allow();
+
+        /**
+         * Records the outcome of a call, once and only for calls admitted by `allow`
+         * (see Call). While half-open every recorded outcome is taken as a probe
+         * @param ok false if the call failed
+         * @param us the duration of the call in microseconds
+         */
+        void record(bool ok, int64_t us);
+
+        State state() const { return mState; }
+
+        /**
+         * @return seconds until the breaker lets probes through, 0 if it is not open
+         */
+        int64_t retryAfter() const;
+
+        void toJson(OBuffer& ob) const;
+
+        const char *Name;
+
+    private:
+        void trip(int64_t now);
+        void reset(int64_t now);
+        void release();
+
+        Config   mConfig{};
+        State    mState{Closed};
+        int64_t  mOpenedAt{0};
+        int64_t  mWindowStart{0};
+        size_t   mCalls{0};
+        size_t   mFailures{0};
+        size_t   mSlow{0};
+        size_t   mProbing{0};
+        size_t   mProbed{0};
+
+        std::string mNames[3];
+        Counter& mOpened;
+        Counter& mRejected;
+    };
+
+    /**
+     * The breakers of the backends the gateway depends on
+     */
+    struct Breakers final {
+        static Breakers& get();
+
+        /**
+         * Renders the state of all the breakers as a JSON array
+         */
+        void toJson(OBuffer& ob) const;
+
+        Breaker Postgres{"postgres"};
+        Breaker Redis{"redis"};
+        Breaker Smtp{"smtp"};
+
+    private:
+        Breakers() = default;
+    };
+}
+#endif //SUIL_BREAKER_H
@@ -0,0 +1,65 @@
+//
+// Created by Carter Mbotho on 2020-05-02.
+//
+
+#ifndef SUIL_CLOCK_H
+#define SUIL_CLOCK_H
+
+#include <chrono>
+
+#include "common.h"
+
+namespace suil::nozama {
+
+    /**
+     * The clock the time based state of the gateway (rate limit buckets, circuit
+     * breakers, cached tokens and revocations) is kept with. It is the system's
+     * clock, tests move it forward instead of sleeping.
+     *
+     * @code
+     *   Clock::advance(1100);
+     *   REQUIRE(limits.throttleIp(0, "10.0.0.1") == 0);
+     * @endcode
+     *
+     * @note only accessed from the event loop
+     */
+    struct Clock final {
+
+        /**
+         * @return monotonic time in milliseconds, comparable with mnow()
+         */
+        static int64_t now() {
+            return mnow() + offset();
+        }
+
+        /**
+         * @return wall clock time in seconds since the epoch
+         */
+        static int64_t wall() {
+            return wallms() / 1000;
+        }
+
+        /**
+         * @return wall clock time in milliseconds since the epoch
+         */
+        static int64_t wallms() {
+            using namespace std::chrono;
+            return duration_cast<milliseconds>(system_clock::now().time_since_epoch()).count() + offset();
+        }
+
+        /**
+         * Moves the clock forward, for tests
+         * @param ms the number of milliseconds to move it by
+         */
+        static void advance(int64_t ms) {
+            offset() += ms;
+        }
+
+    private:
+        static int64_t& offset() {
+            static int64_t sOffset{0};
+            return sOffset;
+        }
+    };
+}
+#endif //SUIL_CLOCK_H
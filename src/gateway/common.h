@@ -14,17 +14,36 @@
 #include "gateway.scc.h"
 
 namespace suil::nozama {
+    define_log_tag(NZM_GATEWAY);
+}
+
+#include "tracing.h"
+#include "deadline.h"
+#include "ratelimit.h"
+#include "admission.h"
+#include "jwtcache.h"
+
+namespace suil::nozama {
+
+    struct Tracing;
+    struct Deadline;
+    struct RateLimit;
+    struct Admission;
+    struct JwtAuth;
+    struct JwtSessions;
 
     using Endpoint = http::TcpEndpoint<
+            Tracing,                   /// request tracing, first so that it sees the whole request
+            Deadline,                  /// per request deadlines, before any middleware that can wait
+            RateLimit,                 /// rejects abusive clients before any other work is done
+            Admission,                 /// sheds load when backends saturate
             http::mw::Initializer,     /// needed for initializing the application
             http::SystemAttrs,         /// needed for by routes and other middle-wares
-            http::JwtAuthorization,    /// needed for authorization
+            JwtAuth,                   /// needed for authorization, caches verified tokens
             http::mw::Redis,           /// needed by most routes and auth middleware
             http::mw::EndpointAdmin,   /// needed for administering the endpoint
             sql::mw::Postgres,         /// needed by most routes
-            http::mw::JwtSession,      /// needed for provisioning JWT tokens
+            JwtSessions,               /// needed for provisioning JWT tokens
             http::Cors>;               /// needed for CORS
-
-    define_log_tag(NZM_GATEWAY);
 }
 #endif //SUIL_COMMON_H
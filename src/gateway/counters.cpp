@@ -0,0 +1,159 @@
+//
+// Created by Carter Mbotho on 2020-04-06.
+//
+
+#include "counters.h"
+
+namespace {
+
+    /// upper bounds (us) of the buckets reported to prometheus
+    constexpr uint64_t BOUNDS[] = {
+        100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000,
+        100000, 250000, 500000, 1000000, 2500000, 5000000, 10000000
+    };
+
+    void seconds(OBuffer& ob, uint64_t us)
+    {
+        char buf[32];
+        auto n = snprintf(buf, sizeof(buf), "%g", us / 1e6);
+        ob << suil::String{buf, (size_t) n, false};
+    }
+}
+
+namespace suil::nozama {
+
+    uint64_t Histogram::quantile(double q) const
+    {
+        auto total = count();
+        if (total == 0) {
+            return 0;
+        }
+        auto rank = (uint64_t) (q * total);
+        uint64_t seen{0};
+        for (size_t i = 0; i < Buckets; i++) {
+            seen += bucket(i);
+            if (seen > rank) {
+                return lowest(i);
+            }
+        }
+        return lowest(Buckets - 1);
+    }
+
+    Counters& Counters::get()
+    {
+        static Counters sCounters;
+        return sCounters;
+    }
+
+    Counter& Counters::counter(const char *name, const char *help)
+    {
+        for (auto& c: mCounters) {
+            if (strcmp(c.Name, name) == 0) {
+                // counters are shared by name
+                return c;
+            }
+        }
+        return mCounters.emplace_back(intern(name), intern(help));
+    }
+
+    void Counters::gauge(const char *name, const char *help, Gauge::Sampler sampler)
+    {
+        for (auto& g: mGauges) {
+            if (strcmp(g.Name, name) == 0) {
+                // re-registering a gauge replaces the sampler
+                g.Sample = std::move(sampler);
+                return;
+            }
+        }
+        mGauges.emplace_back(intern(name), intern(help), std::move(sampler));
+    }
+
+    Histogram& Counters::histogram(const char *name, const char *help, const char *labels)
+    {
+        for (auto& h: mHistograms) {
+            if (strcmp(h.Name, name) == 0 && strcmp(h.Labels, labels) == 0) {
+                return h;
+            }
+        }
+        return mHistograms.emplace_back(intern(name), intern(help), intern(labels));
+    }
+
+    const char* Counters::intern(const char *str)
+    {
+        for (auto& s: mStrings) {
+            if (s == str) {
+                return s.c_str();
+            }
+        }
+        // a list, the strings never move
+        return mStrings.emplace_back(str).c_str();
+    }
+
+    void Counters::toJson(OBuffer& ob) const
+    {
+        bool first{true};
+        ob << "{";
+        for (auto& c: mCounters) {
+            ob << (first? "\"" : ",\"") << c.Name << "\":" << c.value();
+            first = false;
+        }
+        for (auto& g: mGauges) {
+            ob << (first? "\"" : ",\"") << g.Name << "\":" << g.Sample();
+            first = false;
+        }
+        ob << "}";
+    }
+
+    void Counters::toPrometheus(OBuffer& ob) const
+    {
+        for (auto& c: mCounters) {
+            ob << "# HELP semausu_" << c.Name << " " << c.Help << "\n"
+               << "# TYPE semausu_" << c.Name << " counter\n"
+               << "semausu_" << c.Name << " " << c.value() << "\n";
+        }
+        for (auto& g: mGauges) {
+            ob << "# HELP semausu_" << g.Name << " " << g.Help << "\n"
+               << "# TYPE semausu_" << g.Name << " gauge\n"
+               << "semausu_" << g.Name << " " << g.Sample() << "\n";
+        }
+
+        for (auto it = mHistograms.begin(); it != mHistograms.end(); it++) {
+            bool seen{false};
+            for (auto prev = mHistograms.begin(); prev != it; prev++) {
+                if (strcmp(prev->Name, it->Name) == 0) {
+                    seen = true;
+                    break;
+                }
+            }
+            if (seen) {
+                // samples of a family are rendered together with its first histogram
+                continue;
+            }
+
+            ob << "# HELP semausu_" << it->Name << " " << it->Help << "\n"
+               << "# TYPE semausu_" << it->Name << " histogram\n";
+            for (auto h = it; h != mHistograms.end(); h++) {
+                if (strcmp(h->Name, it->Name) != 0) {
+                    continue;
+                }
+                auto sep = h->Labels[0] == '\0'? "" : ",";
+                uint64_t cumulative{0};
+                size_t i{0};
+                for (auto bound: BOUNDS) {
+                    // a bucket is reported under the first bound above all its values
+                    while (i < Histogram::Buckets && Histogram::lowest(i + 1) <= bound + 1) {
+                        cumulative += h->bucket(i++);
+                    }
+                    ob << "semausu_" << h->Name << "_bucket{" << h->Labels << sep << "le=\"";
+                    seconds(ob, bound);
+                    ob << "\"} " << cumulative << "\n";
+                }
+                ob << "semausu_" << h->Name << "_bucket{" << h->Labels << sep << "le=\"+Inf\"} " << h->count() << "\n"
+                   << "semausu_" << h->Name << "_sum{" << h->Labels << "} ";
+                seconds(ob, h->sum());
+                ob << "\n"
+                   << "semausu_" << h->Name << "_count{" << h->Labels << "} " << h->count() << "\n";
+            }
+        }
+    }
+}
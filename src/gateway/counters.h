@@ -0,0 +1,166 @@
+//
+// Created by Carter Mbotho on 2020-04-06.
+//
+
+#ifndef SUIL_COUNTERS_H
+#define SUIL_COUNTERS_H
+
+#include <suil/base.h>
+
+#include <atomic>
+#include <functional>
+#include <list>
+#include <string>
+
+namespace suil::nozama {
+
+    /**
+     * A monotonic counter that can be bumped from any thread
+     */
+    struct Counter {
+        Counter(const char *name, const char *help)
+            : Name{name}, Help{help}
+        {}
+
+        inline void inc(uint64_t n = 1) {
+            mValue.fetch_add(n, std::memory_order_relaxed);
+        }
+
+        inline uint64_t value() const {
+            return mValue.load(std::memory_order_relaxed);
+        }
+
+        const char *Name;
+        const char *Help;
+    private:
+        std::atomic<uint64_t> mValue{0};
+    };
+
+    /**
+     * A gauge reports an instantaneous value that is sampled when
+     * the counters are rendered
+     */
+    struct Gauge {
+        using Sampler = std::function<int64_t()>;
+        Gauge(const char *name, const char *help, Sampler sampler)
+            : Name{name}, Help{help}, Sample{std::move(sampler)}
+        {}
+
+        const char *Name;
+        const char *Help;
+        Sampler     Sample;
+    };
+
+    /**
+     * A log-linear (HDR style) histogram of microsecond durations. Every power of two
+     * is split into 8 sub-buckets, so a value is recorded with a relative error of at
+     * most 12.5% over a range of 1us to ~2^40us. Recording is a couple of relaxed
+     * atomic increments, it never locks nor allocates.
+     */
+    struct Histogram {
+        static constexpr size_t SubBuckets{8};
+        static constexpr size_t Buckets{SubBuckets * 38};
+
+        /**
+         * @param name the name of the histogram, histograms can share a name
+         * @param help a description of the histogram
+         * @param labels prometheus labels distinguishing histograms sharing a name,
+         *        e.g `route="users_login",phase="kdf"`
+         */
+        Histogram(const char *name, const char *help, const char *labels)
+            : Name{name}, Help{help}, Labels{labels}
+        {}
+
+        inline void record(uint64_t us) {
+            mBuckets[index(us)].fetch_add(1, std::memory_order_relaxed);
+            mCount.fetch_add(1, std::memory_order_relaxed);
+            mSum.fetch_add(us, std::memory_order_relaxed);
+        }
+
+        inline uint64_t count() const {
+            return mCount.load(std::memory_order_relaxed);
+        }
+
+        inline uint64_t sum() const {
+            return mSum.load(std::memory_order_relaxed);
+        }
+
+        inline uint64_t bucket(size_t i) const {
+            return mBuckets[i].load(std::memory_order_relaxed);
+        }
+
+        /**
+         * @param q the quantile to compute, between 0 and 1
+         * @return the lowest value of the bucket the quantile falls in
+         */
+        uint64_t quantile(double q) const;
+
+        static inline size_t index(uint64_t us) {
+            if (us < SubBuckets) {
+                return us;
+            }
+            size_t mag = 63 - __builtin_clzll(us);
+            size_t i = (mag - 2) * SubBuckets + ((us >> (mag - 3)) & (SubBuckets - 1));
+            return i < Buckets? i : Buckets - 1;
+        }
+
+        /**
+         * @return the lowest value recorded in bucket {@param i}
+         */
+        static inline uint64_t lowest(size_t i) {
+            if (i < SubBuckets) {
+                return i;
+            }
+            size_t mag = i / SubBuckets + 2;
+            return (SubBuckets + (i % SubBuckets)) << (mag - 3);
+        }
+
+        const char *Name;
+        const char *Help;
+        const char *Labels;
+    private:
+        std::atomic<uint64_t> mBuckets[Buckets]{};
+        std::atomic<uint64_t> mCount{0};
+        std::atomic<uint64_t> mSum{0};
+    };
+
+    /**
+     * Registry of all the counters, gauges and histograms exported by the gateway.
+     * Counters are registered once at startup and live for the lifetime of the process,
+     * references returned by the registry are therefore stable. The registry keeps
+     * copies of the names, they can be built on the fly.
+     */
+    struct Counters final {
+        static Counters& get();
+
+        Counter& counter(const char *name, const char *help);
+
+        void gauge(const char *name, const char *help, Gauge::Sampler sampler);
+
+        Histogram& histogram(const char *name, const char *help, const char *labels);
+
+        /**
+         * Renders all registered counters and gauges as a flat JSON object
+         * @param ob the buffer to render to
+         */
+        void toJson(OBuffer& ob) const;
+
+        /**
+         * Renders all registered counters, gauges and histograms in the prometheus
+         * text exposition format, names are prefixed with `semausu_` and histograms
+         * are reported in seconds
+         * @param ob the buffer to render to
+         */
+        void toPrometheus(OBuffer& ob) const;
+
+    private:
+        Counters() = default;
+        const char *intern(const char *str);
+
+        std::list<std::string> mStrings{};
+        std::list<Counter> mCounters{};
+        std::list<Gauge>   mGauges{};
+        std::list<Histogram> mHistograms{};
+    };
+}
+#endif //SUIL_COUNTERS_H
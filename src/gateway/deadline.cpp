@@ -0,0 +1,108 @@
+//
+// Created by Carter Mbotho on 2020-04-24.
+//
+
+#include <memory>
+
+#include "deadline.h"
+
+namespace {
+
+    /// a connection being acquired, shared with the coroutine acquiring it
+    struct Acquisition {
+        suil::sql::PgSqlConnection *conn{nullptr};
+        std::string error{};
+        bool        abandoned{false};
+    };
+
+    coroutine void acquire(suil::sql::mw::Postgres& pool, std::shared_ptr<Acquisition> state, chan done)
+    {
+        try {
+            state->conn = &pool.conn();
+        }
+        catch (...) {
+            state->error = suil::Exception::fromCurrent().what();
+        }
+        if (state->abandoned) {
+            // the request stopped waiting
+            if (state->conn != nullptr) {
+                state->conn->close();
+            }
+        }
+        else {
+            chs(done, bool, true);
+        }
+        chclose(done);
+    }
+}
+
+namespace suil::nozama {
+
+    void Deadline::Context::check(const char *what) const
+    {
+        if (expired()) {
+            throw Exception::create("request deadline exceeded before ", what);
+        }
+    }
+
+    sql::PgSqlConnection& Deadline::Context::conn(sql::mw::Postgres& pool) const
+    {
+        check("postgres.conn");
+        if (at < 0) {
+            return pool.conn();
+        }
+
+        auto state = std::make_shared<Acquisition>();
+        chan done = chmake(bool, 1);
+        go(acquire(pool, state, chdup(done)));
+        bool acquired{false};
+        choose {
+        in(done, bool, signalled):
+            acquired = signalled;
+        deadline(at):
+            state->abandoned = true;
+        end
+        }
+        chclose(done);
+
+        if (!acquired) {
+            throw Exception::create("request deadline exceeded acquiring a postgres connection");
+        }
+        if (state->conn == nullptr) {
+            throw Exception::create(state->error);
+        }
+        return *state->conn;
+    }
+
+    Deadline::Deadline()
+        : mExceeded{Counters::get().counter("deadline_exceeded_total", "Requests answered after their deadline passed")}
+    {}
+
+    void Deadline::setup(Config config)
+    {
+        mConfig = std::move(config);
+        for (auto& route: mConfig.routes) {
+            idebug("deadline of %s is %ld ms", route.path(), route.timeout);
+        }
+    }
+
+    void Deadline::before(http::Request& req, http::Response&, Context& ctx)
+    {
+        auto timeout = mConfig.fallback;
+        for (auto& route: mConfig.routes) {
+            if (route.path == req.url) {
+                timeout = route.timeout;
+                break;
+            }
+        }
+        ctx.at = timeout > 0? utils::after(timeout) : -1;
+    }
+
+    void Deadline::after(http::Request&, http::Response&, Context& ctx)
+    {
+        if (ctx.expired()) {
+            mExceeded.inc();
+        }
+        ctx.at = -1;
+    }
+}
@@ -0,0 +1,91 @@
+//
+// Created by Carter Mbotho on 2020-04-24.
+//
+
+#ifndef SUIL_DEADLINE_H
+#define SUIL_DEADLINE_H
+
+#include <vector>
+
+#include "common.h"
+#include "counters.h"
+
+namespace suil::nozama {
+
+    /**
+     * Per request deadlines. The middleware stamps every request with the time by
+     * which it must be answered, configured per route, and handlers pass the context
+     * down to the backend calls they make. A call that cannot complete before the
+     * deadline stops waiting and throws, the handler then answers 504 right away
+     * instead of holding on to a coroutine and a pooled connection.
+     *
+     * @code
+     *   auto& deadline = api.context<Deadline>(req);
+     *   scoped(conn, deadline.conn(pq));
+     *   Statements::get()(conn, deadline, Stmt::UserByEmail, email);
+     * @endcode
+     */
+    struct Deadline final : LOGGER(NZM_GATEWAY) {
+
+        struct Route {
+            String  path;
+            /// milliseconds the route has to answer, 0 for no deadline
+            int64_t timeout{0};
+        };
+
+        struct Config {
+            std::vector<Route> routes{};
+            /// deadline of the routes that are not configured, 0 for no deadline
+            int64_t fallback{0};
+        };
+
+        struct Context {
+            /// absolute deadline (ms), -1 if the request has none
+            int64_t at{-1};
+
+            /**
+             * @return true if the request has a deadline that passed
+             */
+            bool expired() const { return at >= 0 && mnow() >= at; }
+
+            /**
+             * @param timeout a timeout in milliseconds of the call, -1 for none
+             * @return the earliest of the request deadline and the call timeout
+             * as an absolute time, -1 if neither is set
+             */
+            int64_t bound(int64_t timeout) const {
+                if (timeout < 0) return at;
+                auto after = utils::after(timeout);
+                return at < 0? after : std::min(at, after);
+            }
+
+            /**
+             * Fails the request before starting work that cannot complete in time
+             * @param what the work about to start, used in the error
+             * @throws Exception if the deadline passed
+             */
+            void check(const char *what) const;
+
+            /**
+             * Acquires a connection of the pool, connecting included, waiting no longer
+             * than the deadline. A connection acquired after the deadline passed goes
+             * back to the pool
+             * @throws Exception if the deadline passed or the connection failed
+             */
+            sql::PgSqlConnection& conn(sql::mw::Postgres& pool) const;
+        };
+
+        Deadline();
+
+        void setup(Config config);
+
+        void before(http::Request& req, http::Response& resp, Context& ctx);
+
+        void after(http::Request& req, http::Response& resp, Context& ctx);
+
+    private:
+        Config   mConfig{};
+        Counter& mExceeded;
+    };
+}
+#endif //SUIL_DEADLINE_H
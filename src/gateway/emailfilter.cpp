@@ -0,0 +1,260 @@
+//
+// Created by Carter Mbotho on 2020-04-14.
+//
+
+#include <cmath>
+
+#include "bloom.h"
+#include "emailfilter.h"
+#include "pgnotify.h"
+#include "shards.h"
+#include "statements.h"
+#include "usercache.h"
+
+namespace {
+
+    constexpr int64_t PAGE_SIZE{10000};
+    /// ids are assigned before commit, rows can become visible slightly out of order
+    constexpr int64_t RESYNC_MARGIN{1000};
+    constexpr const char *SNAPSHOT_META{"semausu:emails:meta"};
+    constexpr const char *SNAPSHOT_BITS{"semausu:emails:bits"};
+
+    typedef decltype(iod::D(
+            prop(Id,    int),
+            prop(Email, suil::String)
+    )) EmailRow;
+}
+
+namespace suil::nozama {
+
+    EmailFilter& EmailFilter::get()
+    {
+        static EmailFilter sFilter;
+        return sFilter;
+    }
+
+    EmailFilter::EmailFilter()
+        : mRejects{Counters::get().counter("email_filter_rejects_total", "Logins rejected by the email filter")},
+          mPasses{Counters::get().counter("email_filter_passes_total", "Logins the email filter let through to the database")},
+          mFalsePositives{Counters::get().counter("email_filter_false_positives_total",
+                                                  "Logins the email filter let through for unregistered emails")}
+    {
+        Counters::get().gauge("email_filter_bytes", "Memory used by the email filter", [this] {
+            return (int64_t) (mBits.size() * sizeof(uint64_t));
+        });
+        Counters::get().gauge("email_filter_entries", "Number of emails added to the email filter", [this] {
+            return (int64_t) mEntries;
+        });
+        Counters::get().gauge("email_filter_fpr_ppm", "Estimated false positive rate of the email filter (ppm)", [this] {
+            return (int64_t) (estimatedFpr() * 1e6);
+        });
+    }
+
+    void EmailFilter::setup(size_t capacity, double fpr, const String& channel)
+    {
+        mReady = false;
+        mEntries = 0;
+        mLastIds.clear();
+        mBits.clear();
+        mNumBits = 0;
+        if (capacity == 0) {
+            idebug("email filter disabled");
+            return;
+        }
+
+        fpr = std::min(std::max(fpr, 1e-6), 0.5);
+        Bloom::size(mNumBits, mNumHashes, capacity, fpr);
+        mBits.assign(mNumBits / 64, 0);
+        mChannel = channel.dup();
+
+        PgListener::get().subscribe(mChannel,
+            [this](const char *email) { insert(UserCache::normalize(email, strlen(email))); },
+            // registrations broadcast while not listening are caught up on the next lookup
+            [this] { mStale = true; });
+        idebug("email filter configured {capacity: %zu, fpr: %f, bytes: %zu, hashes: %u}",
+               capacity, fpr, mBits.size() * sizeof(uint64_t), mNumHashes);
+    }
+
+    void EmailFilter::insert(const std::string& key)
+    {
+        if (test(key)) {
+            // already there (or a false positive), do not count twice
+            return;
+        }
+        Bloom::add(mBits, mNumBits, mNumHashes, key);
+        mEntries++;
+    }
+
+    bool EmailFilter::test(const std::string& key) const
+    {
+        return Bloom::test(mBits, mNumBits, mNumHashes, key);
+    }
+
+    double EmailFilter::estimatedFpr() const
+    {
+        if (mNumBits == 0) {
+            return 1.0;
+        }
+        uint64_t set{0};
+        for (auto word: mBits) {
+            set += __builtin_popcountll(word);
+        }
+        return std::pow((double) set / mNumBits, mNumHashes);
+    }
+
+    bool EmailFilter::mayContain(const String& email)
+    {
+        if (!mReady) {
+            return true;
+        }
+        auto& listener = PgListener::get();
+        listener.start();
+        if (!listener.listening()) {
+            // registrations on other instances might be missed until the listener is connected,
+            // it then resyncs and the filter catches up on the next lookup
+            mPasses.inc();
+            return true;
+        }
+        if (mStale) {
+            mStale = false;
+            try {
+                catchup(RESYNC_MARGIN);
+            }
+            catch (...) {
+                // try again on next lookup, without the filter being trusted meanwhile
+                mStale = true;
+                iwarn("catching up email filter failed: %s", Exception::fromCurrent().what());
+                return true;
+            }
+        }
+
+        if (test(UserCache::normalize(email.data(), email.size()))) {
+            mPasses.inc();
+            return true;
+        }
+        mRejects.inc();
+        return false;
+    }
+
+    void EmailFilter::add(const String& email)
+    {
+        if (mNumBits == 0) {
+            return;
+        }
+        insert(UserCache::normalize(email.data(), email.size()));
+    }
+
+    void EmailFilter::build(redis::Client *redis)
+    {
+        if (mNumBits == 0) {
+            return;
+        }
+
+        auto started = mnow();
+        mLastIds.assign(Shards::get().size(), 0);
+        if (redis != nullptr && load(*redis)) {
+            idebug("email filter loaded from snapshot {entries: %lu}", mEntries);
+        }
+
+        // users not in the snapshot
+        catchup(0);
+        if (redis != nullptr) {
+            save(*redis);
+        }
+        mReady = true;
+        idebug("email filter built in %ld ms {entries: %lu, estimated fpr: %f}",
+               mnow() - started, mEntries, estimatedFpr());
+    }
+
+    void EmailFilter::catchup(int64_t margin)
+    {
+        auto& shards = Shards::get();
+        for (size_t i = 0; i < shards.size(); i++) {
+            scoped(conn, shards[i].pool->conn());
+            Statements::get().settle(conn);
+            catchup(conn, i, mLastIds[i] - margin);
+        }
+    }
+
+    void EmailFilter::catchup(sql::PgSqlConnection& conn, size_t shard, int64_t fromId)
+    {
+        // page through users in id order
+        std::vector<EmailRow> rows;
+        do {
+            rows.clear();
+            conn("SELECT Id, Email FROM users WHERE Id > $1 ORDER BY Id LIMIT $2")(fromId, PAGE_SIZE) >> rows;
+            for (auto& row: rows) {
+                insert(UserCache::normalize(row.Email.data(), row.Email.size()));
+                fromId = std::max<int64_t>(fromId, row.Id);
+            }
+        } while ((int64_t) rows.size() == PAGE_SIZE);
+        mLastIds[shard] = std::max(mLastIds[shard], fromId);
+    }
+
+    void EmailFilter::save(redis::Client& redis)
+    {
+        try {
+            // <bits>:<hashes>:<entries>:<shard>=<last id>,...
+            auto& shards = Shards::get();
+            OBuffer meta{64};
+            meta << mNumBits << ":" << mNumHashes << ":" << mEntries << ":";
+            for (size_t i = 0; i < shards.size(); i++) {
+                meta << (i? "," : "") << shards[i].name << "=" << mLastIds[i];
+            }
+            redis.set(SNAPSHOT_BITS, String{(const char *) mBits.data(), mBits.size() * sizeof(uint64_t), false});
+            redis.set(SNAPSHOT_META, String(meta));
+        }
+        catch (...) {
+            iwarn("saving email filter snapshot failed: %s", Exception::fromCurrent().what());
+        }
+    }
+
+    bool EmailFilter::load(redis::Client& redis)
+    {
+        try {
+            auto meta = redis.get<String>(SNAPSHOT_META);
+            uint64_t bits{0}, entries{0};
+            uint32_t hashes{0};
+            int      consumed{0};
+            if (!meta || sscanf(meta(), "%lu:%u:%lu:%n", &bits, &hashes, &entries, &consumed) != 3 || !consumed) {
+                return false;
+            }
+            if (bits != mNumBits || hashes != mNumHashes) {
+                // filter was resized, snapshot cannot be used
+                idebug("ignoring email filter snapshot of different size");
+                return false;
+            }
+            auto data = redis.get<String>(SNAPSHOT_BITS);
+            if (data.size() != mBits.size() * sizeof(uint64_t)) {
+                return false;
+            }
+            // shards missing from the snapshot are read from the start
+            auto& shards = Shards::get();
+            std::vector<int64_t> lastIds(shards.size(), 0);
+            std::string ids{meta.data() + consumed, meta.size() - consumed};
+            size_t pos{0};
+            while (pos < ids.size()) {
+                auto end = std::min(ids.find(',', pos), ids.size());
+                auto eq  = ids.rfind('=', end);
+                if (eq != std::string::npos && eq >= pos) {
+                    String name{ids.data() + pos, eq - pos, false};
+                    for (size_t i = 0; i < shards.size(); i++) {
+                        if (shards[i].name == name) {
+                            lastIds[i] = strtoll(ids.c_str() + eq + 1, nullptr, 10);
+                        }
+                    }
+                }
+                pos = end + 1;
+            }
+
+            memcpy(mBits.data(), data.data(), data.size());
+            mEntries = entries;
+            mLastIds = std::move(lastIds);
+            return true;
+        }
+        catch (...) {
+            iwarn("loading email filter snapshot failed: %s", Exception::fromCurrent().what());
+            return false;
+        }
+    }
+}
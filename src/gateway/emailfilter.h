@@ -0,0 +1,98 @@
+//
+// Created by Carter Mbotho on 2020-04-14.
+//
+
+#ifndef SUIL_EMAILFILTER_H
+#define SUIL_EMAILFILTER_H
+
+#include <string>
+#include <vector>
+
+#include "common.h"
+#include "counters.h"
+
+namespace suil::nozama {
+
+    /**
+     * A Bloom filter of the (normalized) emails of all registered users, used to
+     * reject logins for unregistered emails without a database round trip. The filter
+     * is built at startup by paging through the users table (optionally starting from
+     * a snapshot stored in redis) and kept up to date across instances through a
+     * Postgres NOTIFY channel on which registrations are broadcast.
+     *
+     * When the listener (re)connects, registrations broadcast while it was not
+     * listening are caught up from the database on the next lookup. Users are
+     * paged through on every shard (see Shards), ids are tracked per shard.
+     *
+     * @note the filter never produces false negatives, while it is not built or
+     * the listener is not yet listening every lookup is a maybe
+     */
+    struct EmailFilter final : LOGGER(NZM_GATEWAY) {
+
+        static EmailFilter& get();
+
+        /**
+         * Size the filter
+         * @param capacity the expected number of registered users, 0 disables the filter
+         * @param fpr the targeted false positive rate at capacity
+         * @param channel the NOTIFY channel on which registrations are broadcast
+         */
+        void setup(size_t capacity, double fpr, const String& channel);
+
+        /**
+         * Populates the filter from the users table of every shard
+         * @param redis when not null, the snapshot to start from and to update after the build
+         */
+        void build(redis::Client *redis = nullptr);
+
+        /**
+         * @return false if the email is definitely not registered
+         */
+        bool mayContain(const String& email);
+
+        /**
+         * Adds a newly registered user to the local filter, other instances
+         * receive it on the registrations channel
+         */
+        void add(const String& email);
+
+        /**
+         * @return the NOTIFY channel on which registrations are broadcast
+         */
+        const String& channel() const { return mChannel; }
+
+        /**
+         * Records that a lookup the filter passed did not find a user
+         */
+        void falsePositive() { mFalsePositives.inc(); }
+
+        /**
+         * @return the estimated false positive rate given the current fill ratio
+         */
+        double estimatedFpr() const;
+
+    private:
+        EmailFilter();
+        void insert(const std::string& key);
+        void catchup(int64_t margin);
+        void catchup(sql::PgSqlConnection& conn, size_t shard, int64_t fromId);
+        bool test(const std::string& key) const;
+        void save(redis::Client& redis);
+        bool load(redis::Client& redis);
+
+        std::vector<uint64_t> mBits{};
+        uint64_t mNumBits{0};
+        uint32_t mNumHashes{0};
+        uint64_t mEntries{0};
+        /// highest user id included in the filter, by shard
+        std::vector<int64_t> mLastIds{};
+        bool     mReady{false};
+        bool     mStale{false};
+        String   mChannel{"semausu_emails"};
+
+        Counter& mRejects;
+        Counter& mPasses;
+        Counter& mFalsePositives;
+    };
+}
+#endif //SUIL_EMAILFILTER_H
@@ -2,12 +2,89 @@
 // Created by Carter Mbotho on 2020-03-25.
 //
 
+#include <algorithm>
+
 #include <suil/sql/pgsql.h>
+#include <suil/http/validators.h>
 #include "users.h"
 #include "gateway.h"
+#include "kdf.h"
+#include "passwd.h"
+#include "usercache.h"
+#include "emailfilter.h"
+#include "pgnotify.h"
+#include "statements.h"
+#include "migrations.h"
+#include "mailqueue.h"
+#include "smtp.h"
+#include "templates.h"
+#include "breaker.h"
+#include "jwtcache.h"
+#include "redisnotify.h"
+#include "revocations.h"
+#include "refresh.h"
+#include "replicas.h"
+#include "shards.h"
+
+namespace {
+
+    /// routes that can be configured and their name in the configuration
+    const std::pair<const char *, const char *> ROUTES[] = {
+        {"/users/login",        "login"},
+        {"/users/refresh",      "refresh"},
+        {"/users/register",     "register"},
+        {"/users/verify",       "verify"},
+        {"/users/logout",       "logout"},
+        {"/users/block",        "block"},
+        {"/users/changepasswd", "changepasswd"}
+    };
+}
 
 namespace suil::nozama {
 
+    static void setupBreaker(Breaker& breaker, const json::Object& obj)
+    {
+        Breaker::Config config;
+        if (obj) {
+            config.errorRate = obj("errorRate") || config.errorRate;
+            config.slow      = obj("slow") || config.slow;
+            config.slowRate  = obj("slowRate") || config.slowRate;
+            config.minCalls  = (size_t) (obj("minCalls") || (int) config.minCalls);
+            config.window    = obj("window") || config.window;
+            config.cooldown  = obj("cooldown") || config.cooldown;
+            config.probes    = (size_t) (obj("probes") || (int) config.probes);
+        }
+        breaker.setup(config);
+    }
+
+    static String pgConnStr(const json::Object& obj)
+    {
+        auto fromEnv = obj("connect.env") or String{};
+        if (fromEnv) {
+            // connect using environment variable
+            String connStr = utils::env(fromEnv(), String{});
+            if (connStr == nullptr) {
+                // cannot continue without connection parameters
+                throw Exception::create(
+                        "Postgres connection string not found in environment variable ", fromEnv);
+            }
+            return connStr;
+        }
+
+        // build connection string from variables
+        OBuffer ob{128};
+        auto dbName   = (String) obj("connect.dbname", true);
+        auto dbUser   = (String) obj("connect.user", true);
+        auto dbPasswd = (String) obj("connect.passwd", true);
+        auto dbHost   = obj("connect.host") || String{"localhost"};
+        auto dbPort   = obj("connect.port") || 0;
+
+        ob << "host=" << dbHost << " user=" << dbUser << " password="
+           << dbPasswd << " dbname=" << dbName;
+        if (dbPort) ob << " port=" << dbPort;
+        return String(ob);
+    }
+
     Gateway::UPtr sGateway{nullptr};
 
     Gateway& Gateway::get()
@@ -49,6 +126,8 @@ namespace suil::nozama {
         }
 #endif
 
+        // mail queued before a restart is delivered without waiting for a request
+        MailQueue::get().start();
         return ep->start();
     }
 
@@ -63,14 +142,23 @@ namespace suil::nozama {
             throw Exception::create("Gateway already initialized");
         }
         initLogging();
+        initKdf();
         initEndpoint();
+        initTracing();
+        initDeadlines();
         initPgsql();
         initRedis();
+        initRateLimit();
+        initAdmission();
         initJwtAuth();
+        initTemplates();
         initOutbox();
         initAdminEndpoint();
+        initEmailFilter();
 
-        scoped(conn, ep->middleware<sql::mw::Postgres>().conn());
+        /* application settings live on a single shard */
+        scoped(conn, Shards::get().settings().conn());
+        Statements::get().settle(conn);
         Settings settings(conn);
         auto initialized = settings["initialized"] || false;
         if (!initialized) {
@@ -125,26 +213,251 @@ namespace suil::nozama {
         idebug("initializing AdminEndpoint middleware");
         auto admin = ep->middleware<http::mw::EndpointAdmin>();
         admin.setup(*ep);
+
+        eproute(*ep, "/gateway/stats")
+        ("GET"_method)
+        .attrs(opt(AUTHORIZE, Auth{http::mw::EndpointAdmin::Role}))
+        ([](const http::Request& req, http::Response& resp) {
+            OBuffer ob{256};
+            Counters::get().toJson(ob);
+            resp << String(ob);
+            resp.setContentType("application/json");
+            resp.end();
+        });
+
+        eproute(*ep, "/gateway/metrics")
+        ("GET"_method)
+        .attrs(opt(AUTHORIZE, Auth{http::mw::EndpointAdmin::Role}))
+        ([](const http::Request& req, http::Response& resp) {
+            OBuffer ob{4096};
+            Counters::get().toPrometheus(ob);
+            resp << String(ob);
+            resp.setContentType("text/plain; version=0.0.4");
+            resp.end();
+        });
+
+        eproute(*ep, "/gateway/breakers")
+        ("GET"_method)
+        .attrs(opt(AUTHORIZE, Auth{http::mw::EndpointAdmin::Role}))
+        ([](const http::Request& req, http::Response& resp) {
+            OBuffer ob{512};
+            Breakers::get().toJson(ob);
+            resp << String(ob);
+            resp.setContentType("application/json");
+            resp.end();
+        });
+
+        eproute(*ep, "/gateway/replicas")
+        ("GET"_method)
+        .attrs(opt(AUTHORIZE, Auth{http::mw::EndpointAdmin::Role}))
+        ([](const http::Request& req, http::Response& resp) {
+            OBuffer ob{512};
+            Replicas::get().toJson(ob);
+            resp << String(ob);
+            resp.setContentType("application/json");
+            resp.end();
+        });
+
+        eproute(*ep, "/gateway/traces")
+        ("GET"_method)
+        .attrs(opt(AUTHORIZE, Auth{http::mw::EndpointAdmin::Role}))
+        ([this](const http::Request& req, http::Response& resp) {
+            /* ?format=otlp for OTLP-JSON, Chrome trace-event JSON otherwise */
+            auto format = req.query<String>("format") == "otlp"? Tracing::Otlp : Tracing::Chrome;
+            OBuffer ob{16384};
+            ep->middleware<Tracing>().toJson(ob, format);
+            resp << String(ob);
+            resp.setContentType("application/json");
+            resp.end();
+        });
+    }
+
+    void Gateway::initKdf()
+    {
+        idebug("initializing KDF executor");
+        auto threads = Ego.mConfig("secrets.kdfThreads") || 2;
+        auto depth   = Ego.mConfig("secrets.kdfQueueDepth") || 256;
+        auto window  = Ego.mConfig("secrets.kdfBatchWindow") || 200;
+        KdfExecutor::get().setup((size_t) threads, (size_t) depth, (int64_t) window);
+
+        Ego.KdfIterations = (uint32_t) (Ego.mConfig("secrets.kdfIterations") || 1000);
+        Ego.KdfKeyLen     = (size_t) (Ego.mConfig("secrets.kdfKeyLen") || 20);
+        if (Ego.mConfig("secrets.kdfBatch") || true) {
+            // stored hashes must keep verifying, only batch if the engine agrees with suil's hash.
+            // The probe derives with the key and salt the batched path (PasswdHasher::legacy) uses
+            try {
+                String passwd{"semausu-kdf-probe"};
+                auto salt = http::rand_8byte_salt()(passwd);
+                auto expected = http::pbkdf2_sha1_hash(Ego.PasswdKey())(passwd, salt);
+
+                uint8_t dk[64];
+                auto salted = kdf::legacy_salt(Ego.PasswdKey.data(), Ego.PasswdKey.size(), salt.data(), salt.size());
+                kdf::Pbkdf2Job probe{(const uint8_t *) passwd.data(), passwd.size(),
+                                     (const uint8_t *) salted.data(), salted.size(),
+                                     Ego.KdfIterations, dk, std::min(Ego.KdfKeyLen, sizeof(dk))};
+                kdf::pbkdf2_sha1_scalar(probe);
+                Ego.KdfBatching = expected == kdf::hex(dk, probe.outLen);
+                if (!Ego.KdfBatching) {
+                    iwarn("multi-buffer PBKDF2 disabled, engine output does not match the legacy hash "
+                          "{iterations: %u, keyLen: %zu, passwdkey: %s}", Ego.KdfIterations, Ego.KdfKeyLen,
+                          (Ego.PasswdKey.empty()? "unset" : "set"));
+                }
+            }
+            catch (...) {
+                Ego.KdfBatching = false;
+                iwarn("multi-buffer PBKDF2 disabled, probe failed: %s", Exception::fromCurrent().what());
+            }
+        }
+        // batching applies to pbkdf2-sha1 (legacy) hashes only, new hashes use the configured scheme
+        idebug("KDF batching %s (legacy pbkdf2-sha1 hashes)", (Ego.KdfBatching? "enabled" : "disabled"));
+
+        // parameters used to hash new passwords, old hashes are upgraded on login. Without
+        // a scheme passwords keep the legacy hash, the other schemes are opted into
+        auto passwdObj = Ego.mConfig["secrets"]("passwd");
+        PasswdHasher::Params params;
+        if (passwdObj) {
+            auto scheme = passwdObj("scheme") || String{"legacy"};
+            params.scheme      = PasswdHasher::scheme(scheme());
+            if (params.scheme == PasswdHasher::Legacy && scheme != "legacy") {
+                throw Exception::create("unsupported password hashing scheme '", scheme, "'");
+            }
+            params.cost        = (uint32_t) (passwdObj("cost") || (int) params.cost);
+            params.memory      = (uint32_t) (passwdObj("memory") || (int) params.memory);
+            params.parallelism = (uint32_t) (passwdObj("parallelism") || (int) params.parallelism);
+            auto budget        = passwdObj("budget") || 0;
+            if (budget > 0) {
+                // pick the cost that takes budget milliseconds per hash on this machine
+                params = PasswdHasher::calibrate(params, budget);
+                iinfo("calibrated password hashing cost %u for a %d ms budget", params.cost, budget);
+            }
+        }
+        PasswdHasher::get().setup(params);
+    }
+
+    void Gateway::initTracing()
+    {
+        idebug("initializing request tracing");
+        auto tracingObj = Ego.mConfig["tracing"];
+        Tracing::Config config;
+        config.sample   = tracingObj("sample") || config.sample;
+        config.slow     = tracingObj("slow") || config.slow;
+        config.capacity = tracingObj("capacity") || config.capacity;
+        ep->middleware<Tracing>().setup(std::move(config));
+    }
+
+    void Gateway::initDeadlines()
+    {
+        idebug("initializing request deadlines");
+        auto deadlinesObj = Ego.mConfig["deadlines"];
+        Deadline::Config config;
+        config.fallback = deadlinesObj("default") || config.fallback;
+        for (auto& route: ROUTES) {
+            auto timeoutObj = deadlinesObj(route.second);
+            if (timeoutObj) {
+                config.routes.push_back(Deadline::Route{String{route.first}, (int64_t) timeoutObj});
+            }
+        }
+        ep->middleware<Deadline>().setup(std::move(config));
+    }
+
+    void Gateway::initRateLimit()
+    {
+        idebug("initializing rate limiting");
+        auto limitsObj = Ego.mConfig["ratelimit"];
+        RateLimit::Config config;
+        config.keys    = (size_t) (limitsObj("keys") || (int) config.keys);
+        config.proxies = (size_t) (limitsObj("proxies") || (int) config.proxies);
+        bool shared{false};
+        for (auto& route: ROUTES) {
+            auto routeObj = limitsObj(route.second);
+            if (!routeObj) {
+                continue;
+            }
+            RateLimit::Limits limits;
+            limits.path          = String{route.first};
+            limits.ip.rate       = routeObj("ip.rate") || 0.0;
+            limits.ip.burst      = routeObj("ip.burst") || std::max(limits.ip.rate, 1.0);
+            limits.email.rate    = routeObj("email.rate") || 0.0;
+            limits.email.burst   = routeObj("email.burst") || std::max(limits.email.rate, 1.0);
+            limits.shared.ip     = routeObj("shared.ip") || int64_t(0);
+            limits.shared.email  = routeObj("shared.email") || int64_t(0);
+            limits.shared.window = routeObj("shared.window") || limits.shared.window;
+            shared |= limits.shared.ip || limits.shared.email;
+            config.routes.push_back(std::move(limits));
+        }
+        ep->middleware<RateLimit>().setup(std::move(config),
+                                          shared? &ep->middleware<http::mw::Redis>() : nullptr);
+    }
+
+    void Gateway::initAdmission()
+    {
+        idebug("initializing admission control");
+        auto admissionObj = Ego.mConfig["admission"];
+        Admission::Config config;
+        config.retryAfter = admissionObj("retryAfter") || config.retryAfter;
+        for (auto& route: ROUTES) {
+            auto routeObj = admissionObj(route.second);
+            if (!routeObj) {
+                continue;
+            }
+            Admission::Limits limits;
+            limits.path      = String{route.first};
+            limits.limit     = routeObj("limit") || limits.limit;
+            limits.min       = routeObj("min") || limits.min;
+            limits.max       = routeObj("max") || limits.max;
+            limits.queue     = (size_t) (routeObj("queue") || (int) limits.queue);
+            limits.wait      = routeObj("wait") || limits.wait;
+            limits.tolerance = routeObj("tolerance") || limits.tolerance;
+            config.routes.push_back(std::move(limits));
+        }
+        ep->middleware<Admission>().setup(std::move(config));
+    }
+
+    void Gateway::initTemplates()
+    {
+        idebug("initializing mail templates");
+        auto templatesObj = Ego.mConfig["templates"];
+        Templates::get().setup(templatesObj("dir") || String{"templates"},
+                               templatesObj("watch") || true);
     }
 
     void Gateway::initOutbox()
     {
         idebug("initializing mailer");
         auto mailerObj = Ego.mConfig["mail"];
-        auto server = (String) mailerObj("stmp.host", true);
-        mOutbox = MailOutbox::mkshared(server,
-                (int) mailerObj("stmp.port", true),
-                Email::Address{(String) mailerObj("sender.email", true),
-                               mailerObj("sender.name") || String{}});
-
-        if (!mOutbox->login(
-                (String) mailerObj("stmp.username", true),
-                (String) mailerObj("stmp.passwd", true)))
-        {
-            throw Exception::create("Logging into STMP server failed");
-        }
+        SmtpPool::Config smtp;
+        smtp.host          = ((String) mailerObj("stmp.host", true)).dup();
+        smtp.port          = (int) mailerObj("stmp.port", true);
+        smtp.username      = ((String) mailerObj("stmp.username", true)).dup();
+        smtp.passwd        = ((String) mailerObj("stmp.passwd", true)).dup();
+        smtp.senderEmail   = ((String) mailerObj("sender.email", true)).dup();
+        smtp.senderName    = (mailerObj("sender.name") || String{}).dup();
+        smtp.connections   = (size_t) (mailerObj("stmp.connections") || (int) smtp.connections);
+        smtp.timeout       = mailerObj("stmp.timeout") || smtp.timeout;
+        smtp.pipelining    = mailerObj("stmp.pipelining") || smtp.pipelining;
+        smtp.maxPerSession = (size_t) (mailerObj("stmp.maxPerSession") || (int) smtp.maxPerSession);
+        setupBreaker(Breakers::get().Smtp, mailerObj("stmp.breaker"));
+        auto server = smtp.host.dup();
+        auto& pool = SmtpPool::get();
+        pool.setup(std::move(smtp));
+        // fail early on bad configuration, sessions are opened by the process sending mail
+        pool.verify();
 
         itrace("Logged in to STMP server %s", server());
+
+        // mail is queued in postgres and delivered over the pool in the background
+        auto queueObj = mailerObj("queue");
+        MailQueue::Config queue;
+        if (queueObj) {
+            queue.batch      = queueObj("batch") || queue.batch;
+            queue.poll       = queueObj("poll") || queue.poll;
+            queue.attempts   = queueObj("attempts") || queue.attempts;
+            queue.backoff    = queueObj("backoff") || queue.backoff;
+            queue.maxBackoff = queueObj("maxBackoff") || queue.maxBackoff;
+            queue.lease      = queueObj("lease") || queue.lease;
+            queue.channel    = queueObj("channel") || String{"semausu_outbox"};
+        }
+        MailQueue::get().setup(std::move(queue));
     }
 
     void Gateway::initPgsql()
@@ -153,59 +466,136 @@ namespace suil::nozama {
         auto& pq = ep->middleware<sql::mw::Postgres>();
 
         auto postgresObj = Ego.mConfig["postgres"];
-        auto fromEnv = postgresObj("connect.env") or String{};
-        String connStr{};
-        if (fromEnv) {
-            // connect using environment variable
-            connStr = utils::env(fromEnv(), String{});
-            if (connStr == nullptr) {
-                // cannot continue without connection parameters
-                throw Exception::create(
-                        "Postgres connection string not found in environment variable ", fromEnv);
+        setupBreaker(Breakers::get().Postgres, postgresObj("breaker"));
+        auto connStr = initShards(pq);
+        Statements::get().setup(postgresObj("timeout") || -1);
+
+        /* reads of the hot paths can be served by replicas, each with a pool of its own */
+        auto replicasObj = postgresObj("replicas");
+        if (replicasObj) {
+            for (auto [name, replicaObj]: replicasObj) {
+                Replicas::get().add(String{name},
+                                    pgConnStr(replicaObj),
+                                    replicaObj("timeout") || (postgresObj("timeout") || -1),
+                                    replicaObj("keepAlive") || (postgresObj("keepAlive") || -1));
             }
         }
-        else {
-            // build connection string from variables
-            OBuffer ob{128};
-            auto dbName   = (String) postgresObj("connect.dbname", true);
-            auto dbUser   = (String) postgresObj("connect.user", true);
-            auto dbPasswd = (String) postgresObj("connect.passwd", true);
-            auto dbHost   = postgresObj("connect.host") || String{"localhost"};
-            auto dbPort   = postgresObj("connect.port") || 0;
-
-            ob << "host=" << dbHost << " user=" << dbUser << " password="
-               << dbPasswd << " dbname=" << dbName;
-            if (dbPort) ob << " port=" << dbPort;
-            connStr = String(ob);
+        auto routingObj = postgresObj("routing");
+        Replicas::Config routing;
+        routing.interval = routingObj("interval") || routing.interval;
+        routing.maxLag   = routingObj("maxLag") || routing.maxLag;
+        routing.pin      = routingObj("pin") || routing.pin;
+
+        /* caches are kept in sync across instances with notifications on the same databases */
+        auto& shards = Shards::get();
+        PgListener::get().setup(connStr);
+        for (size_t i = 1; i < shards.size(); i++) {
+            PgListener::get().add(shards[i].connStr);
+        }
+        auto cacheObj = Ego.mConfig["cache"]("users");
+        UserCache::get().setup((size_t) (cacheObj("size") || 0),
+                               (int64_t) (cacheObj("ttl") || 60000),
+                               cacheObj("channel") || String{"semausu_users"});
+        auto filterObj = Ego.mConfig["cache"]("emails");
+        EmailFilter::get().setup((size_t) (filterObj("capacity") || 0),
+                                 (double) (filterObj("fpr") || 0.01),
+                                 filterObj("channel") || String{"semausu_emails"});
+        /* writes to users are broadcast on the users cache channel */
+        routing.channel = UserCache::get().channel().dup();
+        Replicas::get().setup(std::move(routing), pq);
+
+        /* initialize schemas, every shard has all the tables */
+        for (size_t i = 0; i < shards.size(); i++) {
+            scoped(conn, shards[i].pool->conn());
+            Statements::get().settle(conn);
+
+            /* initialize in transaction block, changes will be reverted on failure */
+            {
+                sql::PgSqlTransaction txn(conn);
+                try {
+                    /* initialize settings, also holds the shard's schema version */
+                    Settings(conn).init(Ego.mResetRequested);
+                    /* create users */
+                    Users::Table users(conn);
+                    if (users.cifne(Ego.mResetRequested)) {
+                        /* add default user */
+                    }
+                    /* bring the schema up to date */
+                    auto version = Migrations::run(conn);
+                    idebug("database schema of shard %s at version %d/%d",
+                           shards[i].name(), version, Migrations::latest());
+                }
+                catch (...) {
+                    // abort by rolling back changes on the transaction
+                    txn.rollback();
+                    throw;
+                }
+            }
+            /* tables exist now, fail early if any statement is invalid */
+            Statements::get().prepare(conn);
         }
+
+        itrace("postgres database middleware initialized");
+    }
+
+    String Gateway::initShards(sql::mw::Postgres& pq)
+    {
+        auto postgresObj = Ego.mConfig["postgres"];
+        auto connStr = pgConnStr(postgresObj);
         pq.setup(connStr(),
                  opt(ASYNC, true),
                  opt(TIMEOUT, postgresObj("timeout")   || -1),
                  opt(EXPIRES, postgresObj("keepAlive") || -1));
 
-        /* initialize schemas */
-        scoped(conn, pq.conn());
-
-        /* initialize in transaction block, changes will be reverted on failure */
-        {
-            sql::PgSqlTransaction txn(conn);
-            try {
-                /* initialize settings */
-                Settings(conn).init(Ego.mResetRequested);
-                /* create users */
-                Users::Table users(conn);
-                if (users.cifne(Ego.mResetRequested)) {
-                    /* add default user */
-                }
+        /* the users table can be spread over more databases, the primary being the first shard */
+        auto shardingObj = postgresObj("sharding");
+        auto& shards = Shards::get();
+        shards.add(shardingObj("name") || String{"primary"}, pq, connStr);
+        auto shardsObj = postgresObj("shards");
+        if (shardsObj) {
+            // shards are ordered by name, whatever the order of the configuration
+            std::vector<std::pair<std::string, json::Object>> entries;
+            for (auto [name, shardObj]: shardsObj) {
+                entries.emplace_back(name, shardObj);
             }
-            catch (...) {
-                // abort by rolling back changes on the transaction
-                txn.rollback();
-                throw;
+            std::sort(entries.begin(), entries.end(), [](auto& a, auto& b) { return a.first < b.first; });
+            for (auto& [name, shardObj]: entries) {
+                shards.add(String{name.data(), name.size(), false},
+                           pgConnStr(shardObj),
+                           shardObj("timeout") || (postgresObj("timeout") || -1),
+                           shardObj("keepAlive") || (postgresObj("keepAlive") || -1),
+                           shardObj("retired") || false);
             }
         }
+        Shards::Config sharding;
+        sharding.vnodes   = (size_t) (shardingObj("vnodes") || (int) sharding.vnodes);
+        sharding.settings = shardingObj("settings") || String{};
+        shards.setup(std::move(sharding));
+        return connStr;
+    }
 
-        itrace("postgres database middleware initialized");
+    void Gateway::reshard(cmdl::Cmd& cmd)
+    {
+        auto& self = Gateway::get();
+        auto configPath = cmd.getvalue("config", String{});
+        sdebug("resharding users {config: %s}", configPath());
+        self.mConfig = json::Object::fromLuaFile(configPath);
+        self.initLogging();
+
+        // the gateway is not running, the primary gets a pool of its own
+        sql::mw::Postgres pq;
+        self.initShards(pq);
+        auto dryRun = cmd.getvalue("dry", false);
+        auto moved = Shards::get().reshard((size_t) cmd.getvalue("batch", 1000), dryRun);
+        printf("%zu user(s) %s\n", moved, (dryRun? "to move" : "moved"));
+#ifdef SWEPT
+        if (!utils::fs::exists(".sweep")) {
+            // reshard is launched like the gateway, report that it succeeded
+            int code{0};
+            size_t size{sizeof(code)};
+            utils::fs::append(".sweep", &code, size);
+        }
+#endif
     }
 
     void Gateway::initRedis()
@@ -218,6 +608,9 @@ namespace suil::nozama {
         auto password = redisObj("connect.passwd") || String{};
         auto keepAlive = redisObj("keepAlive") || uint64_t(0);
 
+        setupBreaker(Breakers::get().Redis, redisObj("breaker"));
+        // pub/sub needs a connection of its own
+        RedisListener::get().setup(host, port, password);
         redis.setup(host(), port,
                     opt(passwd, std::move(password)),
                     opt(keep_alive, keepAlive));
@@ -232,10 +625,23 @@ namespace suil::nozama {
         itrace("redis database module initialized");
     }
 
+    void Gateway::initEmailFilter()
+    {
+        idebug("building registered emails filter");
+        if (Ego.mConfig["cache"]("emails.snapshot") || false) {
+            // start from, and refresh, the snapshot shared by all instances
+            scoped(redis, ep->middleware<http::mw::Redis>().conn(0));
+            EmailFilter::get().build(&redis);
+        }
+        else {
+            EmailFilter::get().build();
+        }
+    }
+
     void Gateway::initJwtAuth()
     {
         idebug("initializing JWT auth middleware");
-        auto& jwt = ep->middleware<http::JwtAuthorization>();
+        auto& jwt = ep->middleware<JwtAuth>();
         auto  jwtObj = Ego.mConfig("jwt.*", true);
         jwt.setup(
                 opt(expires, jwtObj["expires"] || 900),
@@ -244,6 +650,26 @@ namespace suil::nozama {
                 opt(domain,  jwtObj["domain"]  || String{}),
                 opt(path,    jwtObj["path"]    || String{}));
 
+        // verified tokens are cached until they expire or are revoked
+        JwtCache::get().setup((size_t) (jwtObj("cache.capacity") || 0),
+                              jwtObj("cache.channel") || String{"semausu_jwt"});
+
+        // revoked tokens are rejected without asking redis, starting with the revocations recorded so far
+        auto& redis = ep->middleware<http::mw::Redis>();
+        Revocations::Config revocations;
+        revocations.lifetime = jwtObj["expires"] || 900;
+        revocations.width    = jwtObj("revocations.width") || revocations.width;
+        revocations.capacity = (size_t) (jwtObj("revocations.capacity") || (int) revocations.capacity);
+        revocations.fpr      = jwtObj("revocations.fpr") || revocations.fpr;
+        revocations.channel  = jwtObj("revocations.channel") || String{"semausu_revocations"};
+        Revocations::get().setup(std::move(revocations), &redis);
+        // refresh tokens outlive access tokens, clients refresh without the password
+        RefreshTokens::get().setup(jwtObj("refresh.lifetime") || int64_t(0));
+        if (Revocations::get().enabled()) {
+            scoped(conn, redis.conn(0));
+            Revocations::get().resync(conn);
+        }
+
         itrace("JWT authorization middleware initialized");
     }
 
@@ -269,7 +695,9 @@ namespace suil::nozama {
             return false;
         }
 
-        scoped(conn, ep->middleware<sql::mw::Postgres>().conn());
+        auto& shard = Shards::get().pool(initRequest.Administrator.Email);
+        scoped(conn, shard.conn());
+        Statements::get().settle(conn);
         sql::PgSqlTransaction txn(conn);
 
         try {
@@ -281,10 +709,20 @@ namespace suil::nozama {
                 throw Exception::create("Activating administrator account failed");
             }
 
-            // modify application settings
-            auto settings = Settings(conn);
-            settings.set("initialized", true);
-            settings.set("admin_email", initRequest.Administrator.Email);
+            // modify application settings, on the settings shard which might not be the user's
+            auto initialize = [&](sql::PgSqlConnection& db) {
+                auto settings = Settings(db);
+                settings.set("initialized", true);
+                settings.set("admin_email", initRequest.Administrator.Email);
+            };
+            if (&Shards::get().settings() == &shard) {
+                initialize(conn);
+            }
+            else {
+                scoped(settingsConn, Shards::get().settings().conn());
+                Statements::get().settle(settingsConn);
+                initialize(settingsConn);
+            }
 
             resp.clear();
             resp << "Application successfully initialized"
@@ -302,7 +740,8 @@ namespace suil::nozama {
         }
 
         try {
-            scoped(conn2, ep->middleware<sql::mw::Postgres>().conn());
+            scoped(conn2, shard.conn());
+            Statements::get().settle(conn2);
             // try removing created user
             if (initRequest.Administrator.Email) {
                 conn2("DELETE FROM users WHERE Email=$1")(initRequest.Administrator.Email);
@@ -5,7 +5,6 @@
 #ifndef SUIL_GATEWAY_H
 #define SUIL_GATEWAY_H
 
-#include <suil/email.h>
 #include <suil/cmdl.h>
 
 #include <typeindex>
@@ -15,24 +14,30 @@
 namespace suil::nozama {
 
     struct Gateway final: LOGGER(NZM_GATEWAY) {
-#ifndef SWEPT
-        using MailOutbox = SslMailOutbox;
-#else
-        using MailOutbox = TcpMailOutbox;
-#endif
         sptr(Gateway);
 
         static Gateway& get();
 
         static void start(cmdl::Cmd& cmd);
 
+        /**
+         * Moves users to the shard they hash to, the gateway must be stopped
+         */
+        static void reshard(cmdl::Cmd& cmd);
+
     public:
         String AdminEmail;
         String PasswdKey;
         String Url;
+        /// PBKDF2 parameters that reproduce http::pbkdf2_sha1_hash with the multi-buffer engine
+        uint32_t KdfIterations{1000};
+        size_t   KdfKeyLen{20};
+        /// true when the multi-buffer engine is verified to produce the same hashes,
+        /// it only computes pbkdf2-sha1 so only legacy hashes are batched (new ones
+        /// default to pbkdf2-sha256, see secrets.passwd.scheme)
+        bool     KdfBatching{false};
 
         json::Object& Config() { return mConfig; }
-        MailOutbox::WPtr Outbox() { return mOutbox; }
 
         template <typename C>
         C& Controller() {
@@ -63,12 +68,20 @@ namespace suil::nozama {
         }
 
         void initEndpoint();
+        void initTracing();
+        void initDeadlines();
+        void initRateLimit();
+        void initAdmission();
         void initAdminEndpoint();
         void initOutbox();
+        void initTemplates();
         void initPgsql();
+        String initShards(sql::mw::Postgres& pq);
         void initJwtAuth();
         void initRedis();
+        void initEmailFilter();
         void initLogging();
+        void initKdf();
 
         /**
          * first use handler will be invoked when the user installs the application
@@ -81,7 +94,6 @@ namespace suil::nozama {
         using ControllerBox = std::unordered_map<std::type_index, Endpoint::Controller::UPtr>;
         Endpoint& api() { return *ep; }
         Endpoint::unique_ptr ep;
-        MailOutbox::Ptr   mOutbox;
         ControllerBox        mControllers;
         json::Object         mConfig;
         bool                 mResetRequested{false};
@@ -0,0 +1,213 @@
+//
+// Created by Carter Mbotho on 2020-04-26.
+//
+
+#include <chrono>
+#include <openssl/sha.h>
+
+#include "clock.h"
+#include "jwtcache.h"
+#include "redisnotify.h"
+#include "revocations.h"
+#include "usercache.h"
+
+namespace {
+
+    inline int64_t usnow() {
+        using namespace std::chrono;
+        return duration_cast<microseconds>(steady_clock::now().time_since_epoch()).count();
+    }
+}
+
+namespace suil::nozama {
+
+    JwtCache& JwtCache::get()
+    {
+        static JwtCache sCache;
+        return sCache;
+    }
+
+    JwtCache::JwtCache()
+        : mHits{Counters::get().counter("jwt_cache_hits_total", "Requests authorized from the JWT cache")},
+          mMisses{Counters::get().counter("jwt_cache_misses_total", "Requests whose token had to be verified")},
+          mEvictions{Counters::get().counter("jwt_cache_evictions_total", "Tokens evicted from the JWT cache")},
+          mInvalidations{Counters::get().counter("jwt_cache_invalidations_total", "Tokens dropped from the JWT cache on revocation")},
+          mVerifyUs{Counters::get().counter("jwt_verify_us_total", "Microseconds spent verifying tokens")},
+          mSavedUs{Counters::get().counter("jwt_cache_saved_us_total", "Estimated microseconds of token verification saved by the JWT cache")}
+    {
+        Counters::get().gauge("jwt_cache_size", "Number of tokens in the JWT cache", [this] {
+            return (int64_t) mIndex.size();
+        });
+        Counters::get().gauge("jwt_cache_hit_ratio_percent", "Percentage of authorized requests served from the JWT cache", [this] {
+            auto total = mHits.value() + mMisses.value();
+            return total? (int64_t) (mHits.value() * 100 / total) : 0;
+        });
+        Counters::get().gauge("jwt_cache_saved_ns_per_request", "Average nanoseconds of token verification saved per authorized request", [this] {
+            auto total = mHits.value() + mMisses.value();
+            return total? (int64_t) (mSavedUs.value() * 1000 / total) : 0;
+        });
+    }
+
+    void JwtCache::setup(size_t capacity, const String& channel)
+    {
+        clear();
+        mCapacity = capacity;
+        mChannel  = channel.dup();
+        if (mCapacity) {
+            RedisListener::get().subscribe(mChannel,
+                [this](const char *email, size_t len) { evict(String{email, len, false}); },
+                // revocations might have been missed, cached tokens could be revoked
+                [this] { clear(); });
+        }
+        idebug("JWT cache configured {capacity: %zu, channel: %s}", mCapacity, mChannel());
+    }
+
+    std::string JwtCache::digest(const String& token, const String& route)
+    {
+        unsigned char md[SHA256_DIGEST_LENGTH];
+        SHA256_CTX sha;
+        SHA256_Init(&sha);
+        SHA256_Update(&sha, token.data(), token.size());
+        SHA256_Update(&sha, "\n", 1);
+        SHA256_Update(&sha, route.data(), route.size());
+        SHA256_Final(md, &sha);
+        return std::string{(const char *) md, sizeof(md)};
+    }
+
+    const http::Jwt* JwtCache::find(const String& token, const String& route)
+    {
+        if (mCapacity == 0) {
+            return nullptr;
+        }
+        // without the listener entries would never be revoked by other instances
+        RedisListener::get().start();
+
+        auto it = mIndex.find(digest(token, route));
+        if (it == mIndex.end()) {
+            return nullptr;
+        }
+        auto node = it->second;
+        if (node->exp <= Clock::wall()) {
+            drop(node);
+            return nullptr;
+        }
+
+        // most recently used goes to the front
+        mLru.splice(mLru.begin(), mLru, node);
+        mHits.inc();
+        // credit the hit with the average cost of a verification
+        if (auto misses = mMisses.value()) {
+            mSavedUs.inc(mVerifyUs.value() / misses);
+        }
+        return &node->jwt;
+    }
+
+    void JwtCache::put(const String& token, const String& route, const http::Jwt& jwt, int64_t us)
+    {
+        if (mCapacity == 0) {
+            return;
+        }
+        auto exp = (int64_t) jwt.exp();
+        auto user = jwt.aud();
+        if (exp <= Clock::wall() || user.empty()) {
+            // not a token that was authorized (e.g the route is public)
+            return;
+        }
+        mMisses.inc();
+        mVerifyUs.inc((uint64_t) std::max(us, int64_t{0}));
+
+        auto key = digest(token, route);
+        auto it = mIndex.find(key);
+        if (it != mIndex.end()) {
+            drop(it->second);
+        }
+        while (mIndex.size() >= mCapacity) {
+            drop(std::prev(mLru.end()));
+            mEvictions.inc();
+        }
+
+        mLru.push_front(Node{key, UserCache::normalize(user.data(), user.size()), jwt, exp});
+        mIndex.emplace(std::move(key), mLru.begin());
+        mUsers.emplace(mLru.front().user, mLru.begin());
+    }
+
+    void JwtCache::revoke(redis::Client& redis, const String& email)
+    {
+        if (mCapacity == 0) {
+            return;
+        }
+        evict(email);
+        // other instances (and processes) drop the tokens when they receive this
+        RedisListener::publish(redis, mChannel, email);
+    }
+
+    void JwtCache::evict(const String& email)
+    {
+        if (mCapacity == 0) {
+            return;
+        }
+        auto range = mUsers.equal_range(UserCache::normalize(email.data(), email.size()));
+        std::vector<Lru::iterator> nodes;
+        for (auto it = range.first; it != range.second; it++) {
+            nodes.push_back(it->second);
+        }
+        for (auto node: nodes) {
+            drop(node);
+            mInvalidations.inc();
+        }
+    }
+
+    void JwtCache::drop(Lru::iterator node)
+    {
+        auto range = mUsers.equal_range(node->user);
+        for (auto it = range.first; it != range.second; it++) {
+            if (it->second == node) {
+                mUsers.erase(it);
+                break;
+            }
+        }
+        mIndex.erase(node->key);
+        mLru.erase(node);
+    }
+
+    void JwtCache::clear()
+    {
+        mLru.clear();
+        mIndex.clear();
+        mUsers.clear();
+    }
+
+    void JwtAuth::before(http::Request& req, http::Response& resp, Context& ctx)
+    {
+        auto& cache = JwtCache::get();
+        String token{req.header("Authorization")};
+        if (token.empty()) {
+            http::JwtAuthorization::before(req, resp, ctx);
+            return;
+        }
+
+        if (auto jwt = cache.find(token, req.url)) {
+            ctx.jwt = *jwt;
+        }
+        else {
+            auto started = usnow();
+            http::JwtAuthorization::before(req, resp, ctx);
+            if (resp.status() >= 400) {
+                return;
+            }
+            cache.put(token, req.url, ctx.jwt, usnow() - started);
+        }
+
+        auto user = ctx.jwt.aud();
+        if (!user.empty() && Revocations::get().revoked(user, Revocations::issued(ctx.jwt))) {
+            // logged out or blocked, known without asking redis
+            Endpoint::Controller::fail(resp, "Unauthorized", "Access to resource denied.");
+            resp.end(http::Status::UNAUTHORIZED);
+        }
+    }
+
+    void JwtSessions::before(http::Request&, http::Response&, Context&)
+    {
+        // the token was checked against the revocations by JwtAuth
+    }
+}
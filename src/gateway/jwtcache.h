@@ -0,0 +1,115 @@
+//
+// Created by Carter Mbotho on 2020-04-26.
+//
+
+#ifndef SUIL_JWTCACHE_H
+#define SUIL_JWTCACHE_H
+
+#include <list>
+#include <string>
+#include <unordered_map>
+
+#include "common.h"
+#include "counters.h"
+
+namespace suil::nozama {
+
+    /**
+     * A bounded LRU cache of the tokens verified by the authorization middleware.
+     * Entries are keyed by the SHA-256 digest of the bearer token and the route it
+     * was authorized for, so that the roles of a route are only checked once per
+     * token, and live until the token's `exp`. Revoking a user's tokens drops its
+     * entries locally and on every other gateway instance through a Redis channel
+     * (see RedisListener).
+     *
+     * @note the cache is per process and only accessed from the event loop
+     */
+    struct JwtCache final : LOGGER(NZM_GATEWAY) {
+
+        static JwtCache& get();
+
+        /**
+         * Configure the cache
+         * @param capacity the maximum number of entries, 0 disables the cache
+         * @param channel the redis channel on which revocations are broadcast
+         */
+        void setup(size_t capacity, const String& channel);
+
+        bool enabled() const { return mCapacity != 0; }
+
+        /**
+         * @param token the bearer token of the request
+         * @param route the route the request is for
+         * @return the decoded token if it was already authorized for the route
+         * and has not expired, nullptr otherwise
+         */
+        const http::Jwt* find(const String& token, const String& route);
+
+        /**
+         * Caches a token that was verified and authorized for the given route
+         * @param us the time spent verifying the token in microseconds
+         */
+        void put(const String& token, const String& route, const http::Jwt& jwt, int64_t us);
+
+        /**
+         * Drops the tokens of the given user from this instance's cache and
+         * broadcasts the revocation to other instances
+         */
+        void revoke(redis::Client& redis, const String& email);
+
+        /**
+         * Drops the tokens of the given user from this instance's cache only
+         */
+        void evict(const String& email);
+
+    private:
+        struct Node {
+            std::string key;
+            std::string user;
+            http::Jwt   jwt;
+            /// the token's exp, in seconds since the epoch
+            int64_t     exp;
+        };
+        using Lru = std::list<Node>;
+
+        JwtCache();
+        static std::string digest(const String& token, const String& route);
+        void drop(Lru::iterator node);
+        void clear();
+
+        Lru          mLru{};
+        std::unordered_map<std::string, Lru::iterator> mIndex{};
+        std::unordered_multimap<std::string, Lru::iterator> mUsers{};
+        size_t       mCapacity{0};
+        String       mChannel{"semausu_jwt"};
+
+        Counter& mHits;
+        Counter& mMisses;
+        Counter& mEvictions;
+        Counter& mInvalidations;
+        Counter& mVerifyUs;
+        Counter& mSavedUs;
+    };
+
+    /**
+     * The authorization middleware, suil's JwtAuthorization with the tokens it
+     * verifies kept in the JwtCache. A request bearing a token that was already
+     * authorized for the route skips parsing and HMAC verification, tokens that
+     * were revoked are rejected from the local Revocations filter.
+     */
+    struct JwtAuth final : http::JwtAuthorization {
+
+        void before(http::Request& req, http::Response& resp, Context& ctx);
+    };
+
+    /**
+     * suil's JwtSession without its per request lookup of the user's token in
+     * redis, JwtAuth already rejects revoked tokens. Sessions are still provisioned
+     * and revoked in redis by the routes that log users in and out.
+     */
+    struct JwtSessions final : http::mw::JwtSession {
+
+        void before(http::Request& req, http::Response& resp, Context& ctx);
+    };
+}
+#endif //SUIL_JWTCACHE_H
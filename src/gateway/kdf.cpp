@@ -0,0 +1,289 @@
+//
+// Created by Carter Mbotho on 2020-04-06.
+//
+
+#include <sys/eventfd.h>
+
+#include <chrono>
+
+#include "kdf.h"
+
+namespace {
+
+    inline int64_t usnow() {
+        using namespace std::chrono;
+        return duration_cast<microseconds>(steady_clock::now().time_since_epoch()).count();
+    }
+}
+
+namespace suil::nozama {
+
+    String kdf::hex(const uint8_t *data, size_t len)
+    {
+        static const char *HEX = "0123456789abcdef";
+        OBuffer ob{2*len + 1};
+        for (size_t i = 0; i < len; i++) {
+            ob << HEX[data[i] >> 4] << HEX[data[i] & 0x0F];
+        }
+        return String(ob);
+    }
+
+    KdfExecutor& KdfExecutor::get()
+    {
+        static KdfExecutor sExecutor;
+        return sExecutor;
+    }
+
+    KdfExecutor::KdfExecutor()
+        : mJobs{Counters::get().counter("kdf_jobs_total", "Number of hashes computed by the KDF executor")},
+          mRejected{Counters::get().counter("kdf_rejected_total", "Number of hashes rejected because the queue was full")},
+          mWaitTime{Counters::get().counter("kdf_queue_wait_us_total", "Time hashes spent waiting in the KDF queue")},
+          mHashTime{Counters::get().counter("kdf_hash_us_total", "Time spent computing hashes")},
+          mBatches{Counters::get().counter("kdf_batches_total", "Number of multi-buffer PBKDF2 batches computed")}
+    {
+        Counters::get().gauge("kdf_queue_depth", "Number of hashes waiting in the KDF queue", [this] {
+            std::lock_guard<std::mutex> lk(mLock);
+            return (int64_t) mQueue.size();
+        });
+    }
+
+    KdfExecutor::~KdfExecutor()
+    {
+        stop();
+    }
+
+    void KdfExecutor::setup(size_t threads, size_t depth, int64_t window)
+    {
+        stop();
+        std::lock_guard<std::mutex> lk(mLock);
+        mNumThreads = threads;
+        mDepth = std::max(depth, size_t{1});
+        mWindow = std::max(window, int64_t{0});
+        idebug("KDF executor configured {threads: %zu, depth: %zu, window: %ld us, lanes: %zu}",
+                mNumThreads, mDepth, mWindow, kdf::pbkdf2_lanes());
+    }
+
+    void KdfExecutor::start()
+    {
+        // threads do not survive a fork, start them in the process actually hashing
+        for (auto& th: mThreads) {
+            // inherited from parent process, there is nothing to join
+            if (th.joinable()) th.detach();
+        }
+        mThreads.clear();
+        mOwner = getpid();
+        mStopped = false;
+        for (size_t i = 0; i < mNumThreads; i++) {
+            mThreads.emplace_back(&KdfExecutor::worker, this);
+        }
+        itrace("started %zu KDF threads in process %d", mNumThreads, mOwner);
+    }
+
+    void KdfExecutor::stop()
+    {
+        {
+            std::lock_guard<std::mutex> lk(mLock);
+            mStopped = true;
+        }
+        mCond.notify_all();
+        if (mOwner == getpid()) {
+            for (auto& th: mThreads) {
+                if (th.joinable()) th.join();
+            }
+        }
+        else {
+            // inherited from parent process, there is nothing to join
+            for (auto& th: mThreads) {
+                if (th.joinable()) th.detach();
+            }
+        }
+        mThreads.clear();
+        mOwner = -1;
+    }
+
+    bool KdfExecutor::exec(Task task)
+    {
+        if (mNumThreads == 0) {
+            // hashing on the event loop
+            auto started = usnow();
+            task();
+            mHashTime.inc(usnow() - started);
+            mJobs.inc();
+            return true;
+        }
+
+        Job job;
+        job.task = std::move(task);
+        return submit(job);
+    }
+
+    bool KdfExecutor::pbkdf2(kdf::Pbkdf2Job& pbkdf2)
+    {
+        if (mNumThreads == 0) {
+            // hashing on the event loop
+            auto started = usnow();
+            kdf::pbkdf2_sha1_scalar(pbkdf2);
+            mHashTime.inc(usnow() - started);
+            mJobs.inc();
+            return true;
+        }
+
+        Job job;
+        job.pbkdf2 = &pbkdf2;
+        return submit(job);
+    }
+
+    bool KdfExecutor::pbkdf2(String& out, const String& passwd, const String& salt, uint32_t iterations,
+                             size_t keyLen, const String& key)
+    {
+        uint8_t dk[64];
+        auto salted = kdf::legacy_salt(key.data(), key.size(), salt.data(), salt.size());
+        kdf::Pbkdf2Job job{(const uint8_t *) passwd.data(), passwd.size(),
+                           (const uint8_t *) salted.data(), salted.size(),
+                           iterations, dk, std::min(keyLen, sizeof(dk))};
+        if (!Ego.pbkdf2(job)) {
+            return false;
+        }
+        out = kdf::hex(dk, job.outLen);
+        return true;
+    }
+
+    bool KdfExecutor::submit(Job& job)
+    {
+        if (mOwner != getpid()) {
+            start();
+        }
+
+        job.evfd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+        if (job.evfd < 0) {
+            throw Exception::create("creating KDF job eventfd failed: ", errno_s);
+        }
+        job.queuedAt = usnow();
+        {
+            std::lock_guard<std::mutex> lk(mLock);
+            if (mQueue.size() >= mDepth) {
+                mRejected.inc();
+                ::close(job.evfd);
+                return false;
+            }
+            mQueue.push_back(&job);
+        }
+        // wake everyone, a thread collecting a batch might be waiting for this job
+        mCond.notify_all();
+
+        // park this coroutine until the worker signals completion
+        uint64_t done{0};
+        while (::read(job.evfd, &done, sizeof(done)) != sizeof(done)) {
+            fdwait(job.evfd, FDW_IN, -1);
+        }
+        fdclean(job.evfd);
+        ::close(job.evfd);
+
+        if (job.error) {
+            std::rethrow_exception(job.error);
+        }
+        return true;
+    }
+
+    void KdfExecutor::complete(Job *job)
+    {
+        mJobs.inc();
+        // job belongs to the waiting coroutine, must not be touched after this
+        auto evfd = job->evfd;
+        uint64_t one{1};
+        int retries{0};
+        ssize_t rc{0};
+        while ((rc = ::write(evfd, &one, sizeof(one))) != sizeof(one)) {
+            if (rc < 0 && errno == EINTR) {
+                continue;
+            }
+            if (rc < 0 && errno == EAGAIN && retries++ < 100) {
+                // the counter is full until the coroutine reads it
+                std::this_thread::yield();
+                continue;
+            }
+            // the waiting coroutine is never woken up
+            ierror("signalling KDF job completion on eventfd %d failed: %s", evfd, errno_s);
+            break;
+        }
+    }
+
+    void KdfExecutor::batch(std::unique_lock<std::mutex>& lk, std::vector<Job*>& jobs)
+    {
+        const size_t lanes = kdf::pbkdf2_lanes();
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::microseconds(mWindow);
+        bool expired{false};
+        while (true) {
+            // pick up every waiting derivation, leaving other tasks in order
+            for (auto it = mQueue.begin(); it != mQueue.end() && jobs.size() < lanes;) {
+                if ((*it)->pbkdf2) {
+                    jobs.push_back(*it);
+                    it = mQueue.erase(it);
+                }
+                else {
+                    ++it;
+                }
+            }
+
+            if (jobs.size() >= lanes || mStopped || expired) {
+                // either all lanes are filled or a partial batch has waited long enough
+                break;
+            }
+            expired = mCond.wait_until(lk, deadline) == std::cv_status::timeout;
+        }
+    }
+
+    void KdfExecutor::worker()
+    {
+        std::vector<Job*> jobs;
+        std::vector<kdf::Pbkdf2Job> derivations;
+        while (true) {
+            jobs.clear();
+            {
+                std::unique_lock<std::mutex> lk(mLock);
+                mCond.wait(lk, [this] { return mStopped || !mQueue.empty(); });
+                if (mQueue.empty()) {
+                    // stopped and all pending jobs drained
+                    break;
+                }
+                jobs.push_back(mQueue.front());
+                mQueue.pop_front();
+                if (jobs[0]->pbkdf2) {
+                    batch(lk, jobs);
+                }
+            }
+
+            auto started = usnow();
+            for (auto job: jobs) {
+                mWaitTime.inc(started - job->queuedAt);
+            }
+
+            if (jobs[0]->pbkdf2) {
+                derivations.clear();
+                for (auto job: jobs) {
+                    derivations.push_back(*job->pbkdf2);
+                }
+                try {
+                    kdf::pbkdf2_sha1(derivations.data(), derivations.size());
+                }
+                catch (...) {
+                    for (auto job: jobs) job->error = std::current_exception();
+                }
+                mBatches.inc();
+            }
+            else {
+                try {
+                    jobs[0]->task();
+                }
+                catch (...) {
+                    jobs[0]->error = std::current_exception();
+                }
+            }
+            mHashTime.inc(usnow() - started);
+
+            for (auto job: jobs) {
+                complete(job);
+            }
+        }
+    }
+}
@@ -0,0 +1,113 @@
+//
+// Created by Carter Mbotho on 2020-04-06.
+//
+
+#ifndef SUIL_KDF_H
+#define SUIL_KDF_H
+
+#include <suil/logging.h>
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+#include "common.h"
+#include "counters.h"
+#include "pbkdf2.h"
+
+namespace suil::nozama {
+
+    namespace kdf {
+        /**
+         * @return the lower case hex encoding of the given derived key
+         */
+        String hex(const uint8_t *data, size_t len);
+    }
+
+    /**
+     * Runs password hashing (key derivation) on a pool of worker threads so that
+     * the coroutine scheduler is not blocked for the duration of a hash. The calling
+     * coroutine is parked on an eventfd until the worker completes the job.
+     *
+     * @note worker threads are started lazily in the process that submits the first
+     * job, this makes the executor safe to configure before the endpoint forks workers
+     */
+    struct KdfExecutor final : LOGGER(NZM_GATEWAY) {
+        using Task = std::function<void()>;
+
+        static KdfExecutor& get();
+
+        /**
+         * Configure the executor
+         * @param threads the number of hashing threads, 0 runs tasks inline
+         * @param depth the maximum number of jobs waiting to be picked by a thread
+         * @param window the time in microseconds a thread waits for more PBKDF2
+         *        jobs to fill all SIMD lanes before hashing a partial batch
+         */
+        void setup(size_t threads, size_t depth, int64_t window = 200);
+
+        /**
+         * Runs the given task on the pool and yields the calling coroutine until
+         * the task completes. Exceptions thrown by the task are re-thrown here
+         * @param task the task to execute
+         * @return false if the job queue is full and the task was not executed
+         */
+        bool exec(Task task);
+
+        /**
+         * Computes the given PBKDF2-HMAC-SHA1 derivation on the pool. Concurrent
+         * derivations are batched and computed together by the multi-buffer engine
+         * @param job the derivation to compute, buffers must outlive the call
+         * @return false if the job queue is full and the job was not executed
+         */
+        bool pbkdf2(kdf::Pbkdf2Job& job);
+
+        /**
+         * Derives a hex encoded legacy PBKDF2-HMAC-SHA1 hash on the pool
+         * @param out the hex encoded derived key
+         * @param keyLen the length of the derived key in bytes, at most 64
+         * @param key the password key, applied to the salt (see kdf::legacy_salt)
+         * @return false if the job queue is full and the job was not executed
+         */
+        bool pbkdf2(String& out, const String& passwd, const String& salt, uint32_t iterations,
+                    size_t keyLen, const String& key);
+
+        ~KdfExecutor();
+
+    private:
+        struct Job {
+            Task    task;
+            kdf::Pbkdf2Job *pbkdf2{nullptr};
+            int     evfd{-1};
+            int64_t queuedAt{0};
+            std::exception_ptr error{nullptr};
+        };
+
+        KdfExecutor();
+        void start();
+        void stop();
+        void worker();
+        bool submit(Job& job);
+        void complete(Job *job);
+        void batch(std::unique_lock<std::mutex>& lk, std::vector<Job*>& jobs);
+
+        std::mutex              mLock;
+        std::condition_variable mCond;
+        std::deque<Job*>        mQueue;
+        std::vector<std::thread> mThreads;
+        size_t                  mNumThreads{2};
+        size_t                  mDepth{256};
+        int64_t                 mWindow{200};
+        pid_t                   mOwner{-1};
+        bool                    mStopped{false};
+
+        Counter& mJobs;
+        Counter& mRejected;
+        Counter& mWaitTime;
+        Counter& mHashTime;
+        Counter& mBatches;
+    };
+}
+#endif //SUIL_KDF_H
@@ -0,0 +1,222 @@
+//
+// Created by Carter Mbotho on 2020-04-16.
+//
+
+#include <chrono>
+
+#include "mailqueue.h"
+#include "metrics.h"
+#include "pgnotify.h"
+#include "shards.h"
+#include "smtp.h"
+#include "statements.h"
+
+namespace {
+
+    /// how often the queue depth is sampled from the database
+    constexpr int64_t SAMPLE_INTERVAL{5000};
+
+    inline int64_t usnow() {
+        using namespace std::chrono;
+        return duration_cast<microseconds>(steady_clock::now().time_since_epoch()).count();
+    }
+}
+
+namespace suil::nozama {
+
+    MailQueue& MailQueue::get()
+    {
+        static MailQueue sQueue;
+        return sQueue;
+    }
+
+    MailQueue::MailQueue()
+        : mSent{Counters::get().counter("mail_sent_total", "Mails delivered by the sender")},
+          mFailed{Counters::get().counter("mail_failed_total", "Mail deliveries that failed and will be retried")},
+          mDeadLettered{Counters::get().counter("mail_dead_letters_total", "Mails given up on after too many failures")},
+          mQueueLatency{Counters::get().counter("mail_queue_latency_ms_total",
+                                                "Time delivered mails spent in the queue (ms)")},
+          mSendTime{Counters::get().counter("mail_send_us_total", "Time spent delivering mail batches (us)")}
+    {
+        Counters::get().gauge("mail_queue_depth", "Mails waiting to be delivered", [this] {
+            return mDepth;
+        });
+        Counters::get().gauge("mail_queue_dead", "Dead letters kept in the mail queue", [this] {
+            return mDead;
+        });
+    }
+
+    void MailQueue::setup(Config config)
+    {
+        mConfig = std::move(config);
+        mConfig.batch = std::max(mConfig.batch, 1);
+        mConfig.attempts = std::max(mConfig.attempts, 1);
+        PgListener::get().subscribe(mConfig.channel,
+            [this](const char *) { wake(); },
+            // mail might have been queued while not listening
+            [this] { wake(); });
+        idebug("mail queue configured {batch: %d, poll: %ld ms, attempts: %d, backoff: %ld ms}",
+               mConfig.batch, mConfig.poll, mConfig.attempts, mConfig.backoff);
+    }
+
+    void MailQueue::start()
+    {
+        if (mOwner == getpid()) {
+            return;
+        }
+        mOwner = getpid();
+        // a single pending wake up is enough, the sender drains everything queued
+        mWake = chmake(bool, 1);
+        PgListener::get().start();
+        go(sender(Ego));
+    }
+
+    void MailQueue::wake()
+    {
+        if (mOwner != getpid()) {
+            return;
+        }
+        choose {
+        out(mWake, bool, true):
+        otherwise:
+            // already woken
+        end
+        }
+    }
+
+    int64_t MailQueue::backoff(int attempts) const
+    {
+        auto delay = mConfig.backoff;
+        for (int i = 1; i < attempts && delay < mConfig.maxBackoff; i++) {
+            delay *= 2;
+        }
+        delay = std::min(delay, mConfig.maxBackoff);
+        // jitter spreads out retries of mails that failed together
+        return delay + (rand() % (delay/4 + 1));
+    }
+
+    coroutine void MailQueue::sender(MailQueue& Self)
+    {
+        const pid_t owner = getpid();
+        strace("mail sender started in process %d", owner);
+        while (Self.mOwner == owner) {
+            bool backedUp{false};
+            bool sample = Self.mSampled + SAMPLE_INTERVAL <= mnow();
+            int64_t depth{0}, dead{0};
+            auto& shards = Shards::get();
+            for (size_t i = 0; i < shards.size(); i++) {
+                try {
+                    scoped(conn, shards[i].pool->conn());
+                    backedUp |= Self.drain(conn) == (size_t) Self.mConfig.batch;
+                    if (sample) {
+                        Self.sample(conn, depth, dead);
+                    }
+                }
+                catch (...) {
+                    swarn("mail sender (shard %s): %s", shards[i].name(), Exception::fromCurrent().what());
+                }
+            }
+            if (sample) {
+                // the depth of the queue is the sum over all shards
+                Self.mDepth = depth;
+                Self.mDead  = dead;
+                Self.mSampled = mnow();
+            }
+
+            if (backedUp) {
+                // queue is backed up, keep draining
+                continue;
+            }
+
+            choose {
+            in(Self.mWake, bool, woken):
+                (void) woken;
+            deadline(mnow() + Self.mConfig.poll):
+            end
+            }
+        }
+    }
+
+    size_t MailQueue::drain(sql::PgSqlConnection& conn)
+    {
+        static Latency::Route Timing{"mail_sender"};
+        auto& stmts = Statements::get();
+        auto batch = [&] {
+            Latency::Timer pg(Timing, Latency::Postgres);
+            return stmts(conn, Stmt::MailClaim, mConfig.lease, mConfig.batch);
+        }();
+        std::vector<Mail> mails;
+        for (int i = 0; i < batch.rows(); i++) {
+            Mail mail;
+            mail.Id          = strtoll(batch.value(i, 0), nullptr, 10);
+            mail.To          = String{batch.value(i, 1)}.dup();
+            mail.Subject     = String{batch.value(i, 2)}.dup();
+            mail.ContentType = String{batch.value(i, 3)}.dup();
+            mail.Body        = String{batch.value(i, 4)}.dup();
+            mail.Attempts    = (int) strtol(batch.value(i, 5), nullptr, 10);
+            mail.Age         = strtoll(batch.value(i, 6), nullptr, 10);
+            mails.push_back(std::move(mail));
+        }
+
+        if (mails.empty()) {
+            return 0;
+        }
+
+        std::vector<SmtpPool::Message> messages;
+        for (auto& mail: mails) {
+            messages.push_back(SmtpPool::Message{&mail.To, &mail.Subject, &mail.ContentType, &mail.Body});
+        }
+        auto started = usnow();
+        {
+            Latency::Timer smtp(Timing, Latency::Smtp);
+            SmtpPool::get().send(messages);
+        }
+        mSendTime.inc(usnow() - started);
+
+        OBuffer sent{64};
+        sent << "{";
+        bool first{true};
+        for (size_t i = 0; i < mails.size(); i++) {
+            auto& mail = mails[i];
+            auto& msg  = messages[i];
+            if (msg.Sent) {
+                mQueueLatency.inc(mail.Age);
+                mSent.inc();
+                sent << (first? "" : ",") << mail.Id;
+                first = false;
+                continue;
+            }
+
+            mFailed.inc();
+            bool dead{false};
+            // a message rejected for good becomes a dead letter right away
+            auto res = stmts(conn, Stmt::MailFailed, mail.Id, msg.Error,
+                             (msg.Permanent? 1 : mConfig.attempts), backoff(mail.Attempts + 1));
+            if (res.rows() && res.value(0, 0) != nullptr) {
+                dead = res.value(0, 0)[0] == 't';
+            }
+            if (dead) {
+                mDeadLettered.inc();
+                iwarn("giving up on mail %ld to '%s' after %d attempts: %s",
+                      mail.Id, mail.To(), mail.Attempts + 1, msg.Error());
+            }
+            else {
+                idebug("delivering mail %ld to '%s' failed: %s", mail.Id, mail.To(), msg.Error());
+            }
+        }
+        sent << "}";
+        if (!first) {
+            stmts(conn, Stmt::MailSent, String(sent));
+        }
+        return mails.size();
+    }
+
+    void MailQueue::sample(sql::PgSqlConnection& conn, int64_t& depth, int64_t& dead)
+    {
+        auto res = Statements::get()(conn, Stmt::MailDepth);
+        if (res.rows()) {
+            depth += strtoll(res.value(0, 0), nullptr, 10);
+            dead  += strtoll(res.value(0, 1), nullptr, 10);
+        }
+    }
+}
@@ -0,0 +1,110 @@
+//
+// Created by Carter Mbotho on 2020-04-16.
+//
+
+#ifndef SUIL_MAILQUEUE_H
+#define SUIL_MAILQUEUE_H
+
+#include <vector>
+
+#include "common.h"
+#include "counters.h"
+
+namespace suil::nozama {
+
+    /**
+     * A durable queue of outgoing mail stored in the `mail_outbox` table. Handlers
+     * only enqueue (see Stmt::UserInsert which enqueues the verification email in
+     * the same statement that adds the user), a background sender coroutine drains
+     * the queue in batches over the pool of SMTP sessions (see SmtpPool).
+     *
+     * Batches are claimed with `FOR UPDATE SKIP LOCKED` and leased for a while, so
+     * several instances can drain the same queue and mail claimed by an instance that
+     * died is retried once the lease expires. Failed deliveries are retried with an
+     * exponential backoff, mail that failed too many times is kept in the queue as a
+     * dead letter.
+     *
+     * Mail is queued on the shard of the user it is sent to (see Shards), the sender
+     * drains the queue of every shard.
+     *
+     * @note the sender is started with the gateway, it sleeps until mail is announced on
+     * the NOTIFY channel or the poll interval passes
+     */
+    struct MailQueue final : LOGGER(NZM_GATEWAY) {
+
+        struct Mail {
+            int64_t Id{0};
+            String  To;
+            String  Subject;
+            String  ContentType;
+            String  Body;
+            int     Attempts{0};
+            /// milliseconds the mail has been waiting in the queue
+            int64_t Age{0};
+        };
+
+        struct Config {
+            /// maximum number of mails claimed at once
+            int     batch{32};
+            /// time in milliseconds between polls of an idle queue
+            int64_t poll{1000};
+            /// number of failed deliveries after which a mail becomes a dead letter
+            int     attempts{8};
+            /// delay in milliseconds before the first retry, doubled on each attempt
+            int64_t backoff{1000};
+            /// maximum delay in milliseconds between retries
+            int64_t maxBackoff{300000};
+            /// time in milliseconds a claimed batch is hidden from other senders
+            int64_t lease{60000};
+            /// NOTIFY channel on which enqueued mail wakes up senders
+            String  channel{"semausu_outbox"};
+        };
+
+        static MailQueue& get();
+
+        void setup(Config config);
+
+        /**
+         * Starts the sender in the current process if not already started
+         */
+        void start();
+
+        /**
+         * Wakes up the sender, e.g mail was enqueued
+         */
+        void wake();
+
+        /**
+         * @return the NOTIFY channel on which enqueued mail is announced
+         */
+        const String& channel() const { return mConfig.channel; }
+
+        /**
+         * @return the delay before the next attempt of a mail that failed the given
+         * number of times
+         */
+        int64_t backoff(int attempts) const;
+
+    private:
+        MailQueue();
+        static coroutine void sender(MailQueue& Self);
+        /// claims and delivers a batch, returns the number of mails claimed
+        size_t drain(sql::PgSqlConnection& conn);
+        /// adds the depth of the queue on the connection's database
+        void sample(sql::PgSqlConnection& conn, int64_t& depth, int64_t& dead);
+
+        Config      mConfig{};
+        pid_t       mOwner{0};
+        chan        mWake{nullptr};
+        int64_t     mSampled{0};
+        int64_t     mDepth{0};
+        int64_t     mDead{0};
+
+        Counter& mSent;
+        Counter& mFailed;
+        Counter& mDeadLettered;
+        Counter& mQueueLatency;
+        Counter& mSendTime;
+    };
+}
+#endif //SUIL_MAILQUEUE_H
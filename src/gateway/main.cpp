@@ -4,6 +4,7 @@
 #include <suil/init.h>
 #include <suil/cmdl.h>
 #include "gateway.h"
+#include "passwd.h"
 
 using namespace suil;
 
@@ -17,6 +18,41 @@ static  void cmdStart(cmdl::Parser& parser) {
     parser.add(std::move(start));
 }
 
+static void cmdCalibrate(cmdl::Parser& parser) {
+    cmdl::Cmd calibrate("calibrate", "finds the password hashing cost fitting a latency budget on this machine");
+    calibrate << cmdl::Arg{"scheme", "The hashing scheme to calibrate (pbkdf2-sha1, pbkdf2-sha256, argon2id)",
+                           's', false};
+    calibrate << cmdl::Arg{"budget", "The time in milliseconds a single hash should take (default: 50)",
+                           'b', false};
+    calibrate << cmdl::Arg{"memory", "The memory in KiB used by argon2id (default: 65536)",
+                           'm', false};
+    calibrate([](cmdl::Cmd& cmd) {
+        nozama::PasswdHasher::Params params;
+        auto scheme = cmd.getvalue("scheme", String{"pbkdf2-sha256"});
+        params.scheme = nozama::PasswdHasher::scheme(scheme());
+        if (params.scheme == nozama::PasswdHasher::Legacy) {
+            throw Exception::create("unsupported password hashing scheme '", scheme, "'");
+        }
+        params.memory = cmd.getvalue("memory", 65536);
+        params = nozama::PasswdHasher::calibrate(params, cmd.getvalue("budget", 50));
+        printf("passwd = {\n    scheme = '%s',\n    cost = %u,\n    memory = %u,\n    parallelism = %u\n}\n",
+               nozama::PasswdHasher::name(params.scheme), params.cost, params.memory, params.parallelism);
+    });
+    parser.add(std::move(calibrate));
+}
+
+static void cmdReshard(cmdl::Parser& parser) {
+    cmdl::Cmd reshard("reshard", "moves users to the postgres shard they hash to, run while the gateway is stopped");
+    reshard << cmdl::Arg{"config", "Path to an application configuration file",
+                         'C', false};
+    reshard << cmdl::Arg{"batch", "The number of users read from a shard at once (default: 1000)",
+                         'b', false};
+    reshard << cmdl::Arg{"dry", "True to only count the users that would be moved",
+                         'd', true, false};
+    reshard(&nozama::Gateway::reshard);
+    parser.add(std::move(reshard));
+}
+
 int main(int argc, char *argv[])
 {
     suil::init(opt(printinfo, false));
@@ -26,6 +62,8 @@ int main(int argc, char *argv[])
     try
     {
         cmdStart(parser);
+        cmdCalibrate(parser);
+        cmdReshard(parser);
         parser.parse(argc, argv);
         parser.handle();
     }
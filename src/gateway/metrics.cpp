@@ -0,0 +1,47 @@
+//
+// Created by Carter Mbotho on 2020-04-19.
+//
+
+#include <algorithm>
+#include <chrono>
+
+#include "metrics.h"
+
+namespace {
+
+    inline int64_t usnow() {
+        using namespace std::chrono;
+        return duration_cast<microseconds>(steady_clock::now().time_since_epoch()).count();
+    }
+
+    const char *PHASES[] = {"total", "kdf", "postgres", "redis", "smtp", "render"};
+}
+
+namespace suil::nozama {
+
+    static_assert(sizeof(PHASES)/sizeof(PHASES[0]) == Latency::Count, "a phase is missing a name");
+
+    Latency::Route::Route(const char *name)
+    {
+        auto& counters = Counters::get();
+        Labels[Total] = std::string("route=\"") + name + "\"";
+        Phases[Total] = &counters.histogram("request_duration_seconds",
+                                            "Time spent serving requests", Labels[Total].c_str());
+        for (uint8_t phase = Kdf; phase < Count; phase++) {
+            Labels[phase] = std::string("route=\"") + name + "\",phase=\"" + PHASES[phase] + "\"";
+            Phases[phase] = &counters.histogram("dependency_duration_seconds",
+                                                "Time requests spent in the KDF, postgres, redis, SMTP and templates",
+                                                Labels[phase].c_str());
+        }
+    }
+
+    Latency::Timer::Timer(Route& route, Phase phase)
+        : mHistogram{*route.Phases[phase]},
+          mStart{usnow()}
+    {}
+
+    Latency::Timer::~Timer()
+    {
+        mHistogram.record((uint64_t) std::max<int64_t>(usnow() - mStart, 0));
+    }
+}
@@ -0,0 +1,59 @@
+//
+// Created by Carter Mbotho on 2020-04-19.
+//
+
+#ifndef SUIL_METRICS_H
+#define SUIL_METRICS_H
+
+#include <string>
+
+#include "counters.h"
+
+namespace suil::nozama {
+
+    /**
+     * Latency of the requests served by a route, broken down by where the time went.
+     * Each route gets a `request_duration_seconds` histogram for the whole request and
+     * a `dependency_duration_seconds` histogram for every phase, all exported on
+     * `/gateway/metrics`. Background work (e.g the mail sender) is accounted as a route.
+     *
+     * @code
+     *   static Latency::Route Route{"users_login"};
+     *   Latency::Timer total(Route);
+     *   {
+     *       Latency::Timer pg(Route, Latency::Postgres);
+     *       ...
+     *   }
+     * @endcode
+     */
+    struct Latency {
+        enum Phase : uint8_t {
+            Total,
+            Kdf,
+            Postgres,
+            Redis,
+            Smtp,
+            Render,
+            Count
+        };
+
+        struct Route {
+            Route(const char *name);
+            std::string Labels[Phase::Count];
+            Histogram  *Phases[Phase::Count];
+        };
+
+        /**
+         * Records the time from its creation to its destruction in the histogram
+         * of a phase of a route
+         */
+        struct Timer {
+            Timer(Route& route, Phase phase = Total);
+            ~Timer();
+        private:
+            Histogram& mHistogram;
+            int64_t    mStart{0};
+        };
+    };
+}
+#endif //SUIL_METRICS_H
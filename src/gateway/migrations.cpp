@@ -0,0 +1,69 @@
+//
+// Created by Carter Mbotho on 2020-04-16.
+//
+
+#include "migrations.h"
+
+namespace {
+
+    using Migration = suil::nozama::Migrations::Migration;
+
+    /// append only, a migration must never change once released. Each migration is
+    /// a single statement, indexes that already exist (e.g created concurrently by an
+    /// administrator ahead of an upgrade) are skipped
+    const Migration MIGRATIONS[] = {
+        {1, "unique case insensitive email index",
+            "CREATE UNIQUE INDEX IF NOT EXISTS users_email_lower_idx ON users (lower(Email))"},
+        {2, "verification token index",
+            // only users waiting for verification (State = 1) have a token in notes
+            "CREATE INDEX IF NOT EXISTS users_verify_token_idx ON users (Email, Notes) WHERE State = 1"},
+        {3, "blocked users partial index",
+            "CREATE INDEX IF NOT EXISTS users_blocked_idx ON users (Email) WHERE State = 0"},
+        {4, "unverified users partial index",
+            "CREATE INDEX IF NOT EXISTS users_unverified_idx ON users (Email) WHERE State = 1"},
+        {5, "outgoing mail queue",
+            "CREATE TABLE IF NOT EXISTS mail_outbox ("
+            " Id          BIGSERIAL PRIMARY KEY,"
+            " Recipient   TEXT NOT NULL,"
+            " Subject     TEXT NOT NULL,"
+            " ContentType TEXT NOT NULL,"
+            " Body        TEXT NOT NULL,"
+            " Attempts    INT NOT NULL DEFAULT 0,"
+            " LastError   TEXT,"
+            " Dead        BOOLEAN NOT NULL DEFAULT FALSE,"
+            " NextAttempt TIMESTAMPTZ NOT NULL DEFAULT now(),"
+            " Created     TIMESTAMPTZ NOT NULL DEFAULT now())"},
+        {6, "pending mail index",
+            "CREATE INDEX IF NOT EXISTS mail_outbox_pending_idx ON mail_outbox (NextAttempt) WHERE NOT Dead"},
+        {7, "drop unverified users partial index",
+            // redundant with the verification token index (2), which leads with Email on the same rows
+            "DROP INDEX IF EXISTS users_unverified_idx"}
+    };
+}
+
+namespace suil::nozama {
+
+    int Migrations::latest()
+    {
+        return std::end(MIGRATIONS)[-1].Version;
+    }
+
+    int Migrations::run(sql::PgSqlConnection& conn)
+    {
+        Settings settings(conn);
+        int version = settings["schema_version"] || 0;
+        for (auto& migration: MIGRATIONS) {
+            if (migration.Version <= version) {
+                continue;
+            }
+            sdebug("applying migration %d - %s", migration.Version, migration.Description);
+            if (!conn(migration.Sql)().status()) {
+                throw Exception::create("applying migration ", migration.Version, " (",
+                                        migration.Description, ") failed");
+            }
+            version = migration.Version;
+            settings.set("schema_version", version);
+        }
+        return version;
+    }
+}
@@ -0,0 +1,41 @@
+//
+// Created by Carter Mbotho on 2020-04-16.
+//
+
+#ifndef SUIL_MIGRATIONS_H
+#define SUIL_MIGRATIONS_H
+
+#include "common.h"
+
+namespace suil::nozama {
+
+    /**
+     * Versioned schema migrations. Each migration is applied once, in version order,
+     * and the version of the last applied migration is recorded in the settings
+     * table under `schema_version`.
+     *
+     * @note migrations are run in the startup transaction, a failing migration
+     * rolls back every change made at startup and aborts the boot
+     */
+    struct Migrations final : LOGGER(NZM_GATEWAY) {
+
+        struct Migration {
+            int         Version;
+            const char *Description;
+            const char *Sql;
+        };
+
+        /**
+         * Applies the migrations newer than the recorded schema version
+         * @param conn the connection of the startup transaction
+         * @return the schema version after applying migrations
+         */
+        static int run(sql::PgSqlConnection& conn);
+
+        /**
+         * @return the version of the latest migration
+         */
+        static int latest();
+    };
+}
+#endif //SUIL_MIGRATIONS_H
@@ -0,0 +1,383 @@
+//
+// Created by Carter Mbotho on 2020-04-10.
+//
+
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <suil/http/validators.h>
+#ifdef SEMAUSU_ARGON2
+#include <argon2.h>
+#endif
+
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include "passwd.h"
+#include "gateway.h"
+#include "kdf.h"
+
+namespace {
+
+    using suil::nozama::PasswdHasher;
+
+    constexpr size_t SALT_LEN{16};
+    constexpr size_t HASH_LEN{32};
+
+    const char *B64 = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+    void b64encode(suil::OBuffer& ob, const uint8_t *data, size_t len)
+    {
+        size_t i = 0;
+        for (; i + 2 < len; i += 3) {
+            uint32_t v = (data[i] << 16) | (data[i+1] << 8) | data[i+2];
+            ob << B64[(v >> 18) & 0x3F] << B64[(v >> 12) & 0x3F] << B64[(v >> 6) & 0x3F] << B64[v & 0x3F];
+        }
+        if (i + 1 == len) {
+            uint32_t v = data[i] << 16;
+            ob << B64[(v >> 18) & 0x3F] << B64[(v >> 12) & 0x3F];
+        }
+        else if (i + 2 == len) {
+            uint32_t v = (data[i] << 16) | (data[i+1] << 8);
+            ob << B64[(v >> 18) & 0x3F] << B64[(v >> 12) & 0x3F] << B64[(v >> 6) & 0x3F];
+        }
+    }
+
+    bool b64decode(std::string& out, const char *data, size_t len)
+    {
+        uint32_t v{0};
+        int bits{0};
+        for (size_t i = 0; i < len; i++) {
+            auto pos = strchr(B64, data[i]);
+            if (data[i] == '\0' || pos == nullptr) {
+                return false;
+            }
+            v = (v << 6) | uint32_t(pos - B64);
+            bits += 6;
+            if (bits >= 8) {
+                bits -= 8;
+                out += char((v >> bits) & 0xFF);
+            }
+        }
+        return true;
+    }
+
+    struct Parsed {
+        PasswdHasher::Params params;
+        std::string salt;
+        std::string hash;
+    };
+
+    uint32_t param(const std::string& params, const char *key)
+    {
+        // params are of the form k1=v1,k2=v2
+        auto pos = params.find(std::string(key) + "=");
+        if (pos == std::string::npos) {
+            return 0;
+        }
+        return (uint32_t) strtoul(&params[pos + strlen(key) + 1], nullptr, 10);
+    }
+
+    bool parse(Parsed& parsed, const suil::String& stored)
+    {
+        if (stored.empty() || stored.data()[0] != '$') {
+            parsed.params.scheme = PasswdHasher::Legacy;
+            return true;
+        }
+
+        std::vector<std::string> parts;
+        std::string current;
+        for (size_t i = 1; i < stored.size(); i++) {
+            if (stored.data()[i] == '$') {
+                parts.push_back(std::move(current));
+                current.clear();
+            }
+            else {
+                current += stored.data()[i];
+            }
+        }
+        parts.push_back(std::move(current));
+
+        parsed.params.scheme = PasswdHasher::scheme(parts[0].c_str());
+        if (parsed.params.scheme == PasswdHasher::Argon2id) {
+            // $argon2id$v=19$m=..,t=..,p=..$salt$hash
+            if (parts.size() != 5) return false;
+            parsed.params.memory = param(parts[2], "m");
+            parsed.params.cost = param(parts[2], "t");
+            parsed.params.parallelism = param(parts[2], "p");
+        }
+        else if (parsed.params.scheme != PasswdHasher::Legacy) {
+            // $pbkdf2-<digest>$i=..$salt$hash
+            if (parts.size() != 4) return false;
+            parsed.params.cost = param(parts[1], "i");
+        }
+        else {
+            return false;
+        }
+
+        auto& salt = parts[parts.size()-2];
+        auto& hash = parts[parts.size()-1];
+        return parsed.params.cost > 0 &&
+               b64decode(parsed.salt, salt.data(), salt.size()) &&
+               b64decode(parsed.hash, hash.data(), hash.size()) &&
+               !parsed.hash.empty();
+    }
+
+    /**
+     * Derives a key for all schemes except pbkdf2-sha1 which goes through the
+     * multi-buffer engine. Called from KDF threads
+     */
+    void rawDerive(const PasswdHasher::Params& params, const suil::String& passwd,
+                   const std::string& salt, uint8_t *out, size_t len)
+    {
+        switch (params.scheme) {
+            case PasswdHasher::Pbkdf2Sha256:
+                if (!PKCS5_PBKDF2_HMAC(passwd.data(), (int) passwd.size(),
+                                       (const unsigned char *) salt.data(), (int) salt.size(),
+                                       (int) params.cost, EVP_sha256(), (int) len, out))
+                {
+                    throw suil::Exception::create("PBKDF2-HMAC-SHA256 derivation failed");
+                }
+                break;
+            case PasswdHasher::Argon2id: {
+#ifdef SEMAUSU_ARGON2
+                auto rc = argon2id_hash_raw(params.cost, params.memory, params.parallelism,
+                                            passwd.data(), passwd.size(), salt.data(), salt.size(),
+                                            out, len);
+                if (rc != ARGON2_OK) {
+                    throw suil::Exception::create("argon2id derivation failed: ", argon2_error_message(rc));
+                }
+                break;
+#else
+                throw suil::Exception::create("gateway was built without argon2 support");
+#endif
+            }
+            case PasswdHasher::Pbkdf2Sha1: {
+                suil::nozama::kdf::Pbkdf2Job job{(const uint8_t *) passwd.data(), passwd.size(),
+                                                 (const uint8_t *) salt.data(), salt.size(),
+                                                 params.cost, out, len};
+                suil::nozama::kdf::pbkdf2_sha1_scalar(job);
+                break;
+            }
+            default:
+                throw suil::Exception::create("unsupported password hashing scheme ", (int) params.scheme);
+        }
+    }
+
+    bool equals(const uint8_t *a, const uint8_t *b, size_t len)
+    {
+        // constant time, do not leak the length of the matching prefix
+        uint8_t diff{0};
+        for (size_t i = 0; i < len; i++) {
+            diff |= a[i] ^ b[i];
+        }
+        return diff == 0;
+    }
+
+    inline int64_t usnow() {
+        using namespace std::chrono;
+        return duration_cast<microseconds>(steady_clock::now().time_since_epoch()).count();
+    }
+}
+
+namespace suil::nozama {
+
+    PasswdHasher& PasswdHasher::get()
+    {
+        static PasswdHasher sHasher;
+        return sHasher;
+    }
+
+    const char* PasswdHasher::name(Scheme scheme)
+    {
+        switch (scheme) {
+            case Pbkdf2Sha1:   return "pbkdf2-sha1";
+            case Pbkdf2Sha256: return "pbkdf2-sha256";
+            case Argon2id:     return "argon2id";
+            default:           return "legacy";
+        }
+    }
+
+    PasswdHasher::Scheme PasswdHasher::scheme(const char *name)
+    {
+        for (auto s: {Pbkdf2Sha1, Pbkdf2Sha256, Argon2id}) {
+            if (strcmp(name, PasswdHasher::name(s)) == 0) {
+                return s;
+            }
+        }
+        return Legacy;
+    }
+
+    void PasswdHasher::setup(const Params& params)
+    {
+#ifndef SEMAUSU_ARGON2
+        if (params.scheme == Argon2id) {
+            throw Exception::create("argon2id configured but gateway was built without argon2 support");
+        }
+#endif
+        mCurrent = params;
+        idebug("password hashing {scheme: %s, cost: %u, memory: %u, parallelism: %u}",
+               name(mCurrent.scheme), mCurrent.cost, mCurrent.memory, mCurrent.parallelism);
+    }
+
+    bool PasswdHasher::derive(uint8_t *out, size_t len, const Params& params, const String& passwd,
+                              const uint8_t *salt, size_t saltLen)
+    {
+        if (params.scheme == Pbkdf2Sha1) {
+            kdf::Pbkdf2Job job{(const uint8_t *) passwd.data(), passwd.size(),
+                               salt, saltLen, params.cost, out, len};
+            return KdfExecutor::get().pbkdf2(job);
+        }
+
+        std::string saltBytes{(const char *) salt, saltLen};
+        return KdfExecutor::get().exec([&] {
+            rawDerive(params, passwd, saltBytes, out, len);
+        });
+    }
+
+    bool PasswdHasher::legacy(String& out, const String& passwd, const String& salt)
+    {
+        auto& gty = Gateway::get();
+        if (gty.KdfBatching) {
+            // computed by the multi-buffer engine along with concurrent hashes
+            return KdfExecutor::get().pbkdf2(out, passwd, salt, gty.KdfIterations, gty.KdfKeyLen, gty.PasswdKey);
+        }
+
+        String hashed{};
+        bool ok = KdfExecutor::get().exec([&] {
+            hashed = http::pbkdf2_sha1_hash(gty.PasswdKey())(passwd, salt);
+        });
+        if (ok) {
+            out = std::move(hashed);
+        }
+        return ok;
+    }
+
+    String PasswdHasher::salt(const String& email) const
+    {
+        if (mCurrent.scheme != Legacy) {
+            // embedded in the hash
+            return String{};
+        }
+        return http::rand_8byte_salt()(email);
+    }
+
+    bool PasswdHasher::hash(String& out, const String& passwd, const String& userSalt)
+    {
+        if (mCurrent.scheme == Legacy) {
+            if (userSalt.empty()) {
+                throw Exception::create("legacy password hashes require a salt");
+            }
+            return legacy(out, passwd, userSalt);
+        }
+
+        uint8_t salt[SALT_LEN];
+        if (RAND_bytes(salt, sizeof(salt)) != 1) {
+            throw Exception::create("generating password salt failed");
+        }
+
+        auto params = mCurrent;
+        uint8_t dk[HASH_LEN];
+        size_t len = (params.scheme == Pbkdf2Sha1)? 20 : HASH_LEN;
+        if (!derive(dk, len, params, passwd, salt, sizeof(salt))) {
+            return false;
+        }
+
+        OBuffer ob{128};
+        ob << "$" << name(params.scheme);
+        if (params.scheme == Argon2id) {
+            ob << "$v=19$m=" << params.memory << ",t=" << params.cost << ",p=" << params.parallelism;
+        }
+        else {
+            ob << "$i=" << params.cost;
+        }
+        ob << "$";
+        b64encode(ob, salt, sizeof(salt));
+        ob << "$";
+        b64encode(ob, dk, len);
+        out = String(ob);
+        return true;
+    }
+
+    bool PasswdHasher::verify(bool& ok, const String& stored, const String& passwd, const String& salt)
+    {
+        ok = false;
+        Parsed parsed;
+        if (!parse(parsed, stored)) {
+            iwarn("stored password hash has an invalid format");
+            return true;
+        }
+
+        if (parsed.params.scheme == Legacy) {
+            String hashed{};
+            if (!legacy(hashed, passwd, salt)) {
+                return false;
+            }
+            ok = (hashed.size() == stored.size()) &&
+                 equals((const uint8_t *) hashed.data(), (const uint8_t *) stored.data(), stored.size());
+            return true;
+        }
+
+        std::vector<uint8_t> dk(parsed.hash.size());
+        if (!derive(dk.data(), dk.size(), parsed.params, passwd,
+                    (const uint8_t *) parsed.salt.data(), parsed.salt.size()))
+        {
+            return false;
+        }
+        ok = equals(dk.data(), (const uint8_t *) parsed.hash.data(), dk.size());
+        return true;
+    }
+
+    bool PasswdHasher::needsRehash(const String& stored) const
+    {
+        Parsed parsed;
+        if (!parse(parsed, stored) || parsed.params.scheme != mCurrent.scheme) {
+            return true;
+        }
+        if (mCurrent.scheme == Legacy) {
+            // legacy hashes carry no parameters
+            return false;
+        }
+        if (parsed.params.cost != mCurrent.cost) {
+            return true;
+        }
+        return (mCurrent.scheme == Argon2id) &&
+               (parsed.params.memory != mCurrent.memory || parsed.params.parallelism != mCurrent.parallelism);
+    }
+
+    PasswdHasher::Params PasswdHasher::calibrate(const Params& base, int64_t budget)
+    {
+        const suil::String passwd{"semausu-calibration"};
+        const std::string salt(SALT_LEN, 's');
+        uint8_t dk[HASH_LEN];
+        auto measure = [&](const Params& p) {
+            auto started = usnow();
+            rawDerive(p, passwd, salt, dk, sizeof(dk));
+            return std::max<int64_t>(usnow() - started, 1);
+        };
+
+        Params params = base;
+        const int64_t budgetUs = std::max<int64_t>(budget, 1) * 1000;
+        if (params.scheme == Argon2id) {
+            // a single pass must fit in the budget, otherwise reduce memory (min 8 MiB)
+            params.cost = 1;
+            auto elapsed = measure(params);
+            while (elapsed > budgetUs && params.memory > 8192) {
+                params.memory /= 2;
+                elapsed = measure(params);
+            }
+            params.cost = (uint32_t) std::max<int64_t>(1, budgetUs / elapsed);
+        }
+        else {
+            // measure a cost large enough for the timer to be meaningful, then scale linearly
+            params.cost = 1000;
+            auto elapsed = measure(params);
+            while (elapsed < 10000 && elapsed < budgetUs / 4) {
+                params.cost *= 2;
+                elapsed = measure(params);
+            }
+            params.cost = (uint32_t) std::max<int64_t>(1000, (params.cost * budgetUs) / elapsed);
+        }
+        return params;
+    }
+}
@@ -0,0 +1,110 @@
+//
+// Created by Carter Mbotho on 2020-04-10.
+//
+
+#ifndef SUIL_PASSWD_H
+#define SUIL_PASSWD_H
+
+#include "common.h"
+
+namespace suil::nozama {
+
+    /**
+     * Hashes and verifies user passwords. Hashes are stored in a self describing
+     * (PHC string) format which records the algorithm, its cost and the salt:
+     *
+     *   $pbkdf2-sha1$i=<iterations>$<salt>$<hash>
+     *   $pbkdf2-sha256$i=<iterations>$<salt>$<hash>
+     *   $argon2id$v=19$m=<memory KiB>,t=<passes>,p=<lanes>$<salt>$<hash>
+     *
+     * where salt and hash are unpadded base64. Hashes not starting with '$' are
+     * bare http::pbkdf2_sha1_hash outputs (the legacy scheme), verified with the
+     * salt from the users' Salt column. The legacy scheme stays the default, the
+     * other schemes are opted into under `secrets.passwd`.
+     *
+     * All hashing happens on the KdfExecutor, pbkdf2-sha1 hashes are batched by the
+     * multi-buffer engine
+     */
+    struct PasswdHasher final : LOGGER(NZM_GATEWAY) {
+
+        enum Scheme : int {
+            Legacy,
+            Pbkdf2Sha1,
+            Pbkdf2Sha256,
+            Argon2id
+        };
+
+        struct Params {
+            Scheme   scheme{Legacy};
+            /// iterations for PBKDF2, passes for argon2, the legacy scheme uses secrets.kdfIterations
+            uint32_t cost{100000};
+            /// memory in KiB, argon2 only
+            uint32_t memory{65536};
+            /// number of lanes, argon2 only
+            uint32_t parallelism{1};
+        };
+
+        static PasswdHasher& get();
+
+        /**
+         * Configure the parameters used to hash new passwords
+         * @param params the current hashing parameters
+         */
+        void setup(const Params& params);
+
+        const Params& current() const { return mCurrent; }
+
+        /**
+         * @return the Salt column of a user whose password is hashed now, empty
+         * unless the current scheme is the legacy scheme
+         */
+        String salt(const String& email) const;
+
+        /**
+         * Hashes the given password with the current parameters and a random salt
+         * @param out the encoded hash
+         * @param salt the Salt column of the user (see salt), only used by the legacy scheme
+         * @return false if the KDF executor is saturated
+         */
+        bool hash(String& out, const String& passwd, const String& salt = {});
+
+        /**
+         * Verifies a password against a stored hash
+         * @param ok set to true if the password matches
+         * @param stored the stored hash
+         * @param passwd the password to verify
+         * @param salt the Salt column of the user, only used by legacy hashes
+         * @return false if the KDF executor is saturated
+         */
+        bool verify(bool& ok, const String& stored, const String& passwd, const String& salt);
+
+        /**
+         * @return true if the stored hash was not created with the current parameters
+         */
+        bool needsRehash(const String& stored) const;
+
+        /**
+         * Finds the cost at which hashing a password with the given scheme takes
+         * about @param budget milliseconds on this machine. The memory of argon2 is
+         * only reduced when a single pass exceeds the budget
+         * @param base the scheme and base cost to calibrate
+         * @return the calibrated parameters
+         */
+        static Params calibrate(const Params& base, int64_t budget);
+
+        static const char *name(Scheme scheme);
+
+        static Scheme scheme(const char *name);
+
+    private:
+        PasswdHasher() = default;
+
+        bool derive(uint8_t *out, size_t len, const Params& params, const String& passwd,
+                    const uint8_t *salt, size_t saltLen);
+
+        bool legacy(String& out, const String& passwd, const String& salt);
+
+        Params mCurrent{};
+    };
+}
+#endif //SUIL_PASSWD_H
@@ -0,0 +1,284 @@
+//
+// Created by Carter Mbotho on 2020-04-08.
+//
+
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <emmintrin.h>
+#define PBKDF2_X86
+#endif
+
+#include "pbkdf2.h"
+
+#define SHA1X_DEFINE_CORE
+#include "sha1x.h"
+
+namespace {
+
+    using suil::nozama::kdf::Sha1Block;
+    using suil::nozama::kdf::Pbkdf2Job;
+
+    struct Scalar {
+        using type = uint32_t;
+        static inline type set(uint32_t v) { return v; }
+        static inline type add(type a, type b) { return a + b; }
+        static inline type x(type a, type b) { return a ^ b; }
+        static inline type a(type a, type b) { return a & b; }
+        static inline type o(type a, type b) { return a | b; }
+        static inline type rotl(type v, int n) { return (v << n) | (v >> (32-n)); }
+        static inline type gather(const Sha1Block *b, size_t, uint32_t (Sha1Block::*f)[5], int j) {
+            return (b->*f)[j];
+        }
+        static inline void scatter(Sha1Block *b, size_t, uint32_t (Sha1Block::*f)[5], int j, type v) {
+            (b->*f)[j] = v;
+        }
+    };
+
+#ifdef PBKDF2_X86
+    struct Sse2 {
+        using type = __m128i;
+        static inline type set(uint32_t v) { return _mm_set1_epi32((int) v); }
+        static inline type add(type a, type b) { return _mm_add_epi32(a, b); }
+        static inline type x(type a, type b) { return _mm_xor_si128(a, b); }
+        static inline type a(type a, type b) { return _mm_and_si128(a, b); }
+        static inline type o(type a, type b) { return _mm_or_si128(a, b); }
+        static inline type rotl(type v, int n) {
+            return _mm_or_si128(_mm_slli_epi32(v, n), _mm_srli_epi32(v, 32-n));
+        }
+        static inline type gather(const Sha1Block *b, size_t n, uint32_t (Sha1Block::*f)[5], int j) {
+            alignas(16) uint32_t tmp[4] = {0};
+            for (size_t i = 0; i < n; i++) tmp[i] = (b[i].*f)[j];
+            return _mm_load_si128((const type *) tmp);
+        }
+        static inline void scatter(Sha1Block *b, size_t n, uint32_t (Sha1Block::*f)[5], int j, type v) {
+            alignas(16) uint32_t tmp[4];
+            _mm_store_si128((type *) tmp, v);
+            for (size_t i = 0; i < n; i++) (b[i].*f)[j] = tmp[i];
+        }
+    };
+#endif
+
+    /**
+     * Plain streaming SHA-1, only used for the per-job setup (HMAC keys and
+     * the first PBKDF2 iteration) where messages have arbitrary lengths
+     */
+    struct Sha1 {
+        uint32_t state[5] = {0x67452301u, 0xEFCDAB89u, 0x98BADCFEu, 0x10325476u, 0xC3D2E1F0u};
+        uint8_t  buf[64];
+        size_t   used{0};
+        uint64_t total{0};
+
+        void compress(const uint8_t *block) {
+            uint32_t w[16];
+            for (int i = 0; i < 16; i++) {
+                w[i] = (uint32_t(block[4*i]) << 24) | (uint32_t(block[4*i+1]) << 16) |
+                       (uint32_t(block[4*i+2]) << 8) | uint32_t(block[4*i+3]);
+            }
+            uint32_t a = state[0], b = state[1], c = state[2], d = state[3], e = state[4];
+            for (int i = 0; i < 80; i++) {
+                if (i >= 16) {
+                    w[i&15] = Scalar::rotl(w[(i+13)&15] ^ w[(i+8)&15] ^ w[(i+2)&15] ^ w[i&15], 1);
+                }
+                uint32_t f, k;
+                if (i < 20)      { f = d ^ (b & (c ^ d));          k = 0x5A827999u; }
+                else if (i < 40) { f = b ^ c ^ d;                  k = 0x6ED9EBA1u; }
+                else if (i < 60) { f = (b & c) | (d & (b | c));    k = 0x8F1BBCDCu; }
+                else             { f = b ^ c ^ d;                  k = 0xCA62C1D6u; }
+                uint32_t tmp = Scalar::rotl(a, 5) + f + e + k + w[i&15];
+                e = d; d = c; c = Scalar::rotl(b, 30); b = a; a = tmp;
+            }
+            state[0] += a; state[1] += b; state[2] += c; state[3] += d; state[4] += e;
+        }
+
+        void update(const uint8_t *data, size_t len) {
+            total += len;
+            while (len) {
+                size_t n = std::min(len, sizeof(buf) - used);
+                memcpy(&buf[used], data, n);
+                used += n; data += n; len -= n;
+                if (used == sizeof(buf)) {
+                    compress(buf);
+                    used = 0;
+                }
+            }
+        }
+
+        void final(uint32_t out[5]) {
+            uint64_t bits = total * 8;
+            uint8_t pad = 0x80;
+            update(&pad, 1);
+            pad = 0;
+            while (used != 56) update(&pad, 1);
+            uint8_t len[8];
+            for (int i = 0; i < 8; i++) len[i] = uint8_t(bits >> (56 - 8*i));
+            update(len, 8);
+            memcpy(out, state, sizeof(state));
+        }
+    };
+
+    inline void words2bytes(const uint32_t w[5], uint8_t out[20]) {
+        for (int i = 0; i < 5; i++) {
+            out[4*i]   = uint8_t(w[i] >> 24);
+            out[4*i+1] = uint8_t(w[i] >> 16);
+            out[4*i+2] = uint8_t(w[i] >> 8);
+            out[4*i+3] = uint8_t(w[i]);
+        }
+    }
+
+    /**
+     * Derives the HMAC states for the job's password and computes U_1 for
+     * the block at index @param index (1 based)
+     */
+    void setupBlock(Sha1Block& blk, const Pbkdf2Job& job, uint32_t index)
+    {
+        uint8_t key[64] = {0};
+        if (job.passwdLen > sizeof(key)) {
+            Sha1 h;
+            uint32_t digest[5];
+            h.update(job.passwd, job.passwdLen);
+            h.final(digest);
+            words2bytes(digest, key);
+        }
+        else {
+            memcpy(key, job.passwd, job.passwdLen);
+        }
+
+        uint8_t ipad[64], opad[64];
+        for (int i = 0; i < 64; i++) {
+            ipad[i] = key[i] ^ 0x36;
+            opad[i] = key[i] ^ 0x5c;
+        }
+
+        Sha1 inner, outer;
+        inner.update(ipad, sizeof(ipad));
+        outer.update(opad, sizeof(opad));
+        memcpy(blk.inner, inner.state, sizeof(blk.inner));
+        memcpy(blk.outer, outer.state, sizeof(blk.outer));
+
+        // U_1 = HMAC(P, S || INT(i))
+        uint8_t be[4] = {uint8_t(index >> 24), uint8_t(index >> 16), uint8_t(index >> 8), uint8_t(index)};
+        uint32_t digest[5];
+        uint8_t  bytes[20];
+        inner.update(job.salt, job.saltLen);
+        inner.update(be, sizeof(be));
+        inner.final(digest);
+        words2bytes(digest, bytes);
+        outer.update(bytes, sizeof(bytes));
+        outer.final(blk.u);
+        memcpy(blk.t, blk.u, sizeof(blk.t));
+    }
+
+    struct Pending {
+        Sha1Block  blk;
+        const Pbkdf2Job *job;
+        uint32_t   index;
+    };
+
+    void finishBlock(const Pending& p)
+    {
+        uint8_t bytes[20];
+        words2bytes(p.blk.t, bytes);
+        size_t off = (p.index - 1) * sizeof(bytes);
+        memcpy(&p.job->out[off], bytes, std::min(sizeof(bytes), p.job->outLen - off));
+    }
+
+    /// iterations remaining after U_1, PBKDF2 requires at least one iteration
+    inline uint32_t rounds(const Pbkdf2Job& job) {
+        return job.iterations > 1? job.iterations - 1 : 0;
+    }
+
+    bool hasAvx2()
+    {
+#ifdef PBKDF2_X86
+        static const bool sAvx2 = __builtin_cpu_supports("avx2");
+        return sAvx2;
+#else
+        return false;
+#endif
+    }
+}
+
+namespace suil::nozama::kdf {
+
+    size_t pbkdf2_lanes()
+    {
+#ifdef PBKDF2_X86
+        return hasAvx2()? 8 : 4;
+#else
+        return 1;
+#endif
+    }
+
+    void pbkdf2_sha1_scalar(const Pbkdf2Job& job)
+    {
+        size_t blocks = (job.outLen + 19) / 20;
+        for (uint32_t i = 1; i <= blocks; i++) {
+            Pending p{{}, &job, i};
+            setupBlock(p.blk, job, i);
+            sha1x_iterate<Scalar>(&p.blk, 1, rounds(job));
+            finishBlock(p);
+        }
+    }
+
+    void pbkdf2_sha1(Pbkdf2Job *jobs, size_t n)
+    {
+        if (n == 1) {
+            pbkdf2_sha1_scalar(jobs[0]);
+            return;
+        }
+
+        // every output block of every job is an independent lane
+        std::vector<Pending> pending;
+        for (size_t i = 0; i < n; i++) {
+            size_t blocks = (jobs[i].outLen + 19) / 20;
+            for (uint32_t j = 1; j <= blocks; j++) {
+                pending.push_back(Pending{{}, &jobs[i], j});
+                setupBlock(pending.back().blk, jobs[i], j);
+            }
+        }
+
+        // lanes in a group must run the same number of iterations
+        std::stable_sort(pending.begin(), pending.end(), [](const Pending& a, const Pending& b) {
+            return rounds(*a.job) < rounds(*b.job);
+        });
+
+        const size_t lanes = pbkdf2_lanes();
+        Sha1Block group[8];
+        size_t start = 0;
+        while (start < pending.size()) {
+            auto iterations = rounds(*pending[start].job);
+            size_t count = 0;
+            while ((start + count) < pending.size() && count < lanes &&
+                   rounds(*pending[start+count].job) == iterations)
+            {
+                group[count] = pending[start+count].blk;
+                count++;
+            }
+
+            if (count == 1) {
+                sha1x_iterate<Scalar>(group, 1, iterations);
+            }
+#ifdef PBKDF2_X86
+            else if (count > 4) {
+                sha1x8_iterate(group, count, iterations);
+            }
+            else {
+                sha1x_iterate<Sse2>(group, count, iterations);
+            }
+#else
+            else {
+                for (size_t i = 0; i < count; i++)
+                    sha1x_iterate<Scalar>(&group[i], 1, iterations);
+            }
+#endif
+            for (size_t i = 0; i < count; i++) {
+                pending[start+i].blk = group[i];
+                finishBlock(pending[start+i]);
+            }
+            start += count;
+        }
+    }
+}
@@ -0,0 +1,61 @@
+//
+// Created by Carter Mbotho on 2020-04-08.
+//
+
+#ifndef SUIL_PBKDF2_H
+#define SUIL_PBKDF2_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace suil::nozama::kdf {
+
+    /**
+     * A single PBKDF2-HMAC-SHA1 derivation, memory referenced by the job
+     * is owned by the caller
+     */
+    struct Pbkdf2Job {
+        const uint8_t *passwd{nullptr};
+        size_t         passwdLen{0};
+        const uint8_t *salt{nullptr};
+        size_t         saltLen{0};
+        uint32_t       iterations{1};
+        uint8_t       *out{nullptr};
+        size_t         outLen{20};
+    };
+
+    /**
+     * @return the salt legacy password hashes are derived with, the password key
+     * (secrets.passwdkey) followed by the user's salt
+     */
+    inline std::string legacy_salt(const char *key, size_t keyLen, const char *salt, size_t saltLen) {
+        std::string out{key, keyLen};
+        out.append(salt, saltLen);
+        return out;
+    }
+
+    /**
+     * @return the number of SHA-1 lanes the multi-buffer engine uses on
+     * this CPU (8 with AVX2, 4 with SSE2, 1 otherwise)
+     */
+    size_t pbkdf2_lanes();
+
+    /**
+     * Computes a single derivation without SIMD, this is the reference
+     * implementation of the engine
+     * @param job the job to compute
+     */
+    void pbkdf2_sha1_scalar(const Pbkdf2Job& job);
+
+    /**
+     * Computes several independent derivations at once, interleaving the
+     * SHA-1 computations of different jobs across SIMD lanes. Jobs can have
+     * different passwords, salts, iterations and output lengths. Falls back
+     * to the scalar implementation when there is a single job
+     * @param jobs the jobs to compute
+     * @param n the number of jobs
+     */
+    void pbkdf2_sha1(Pbkdf2Job *jobs, size_t n);
+}
+#endif //SUIL_PBKDF2_H
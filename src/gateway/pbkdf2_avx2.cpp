@@ -0,0 +1,46 @@
+//
+// Created by Carter Mbotho on 2020-04-08.
+//
+// This unit is compiled with -mavx2 and must only be entered after checking
+// that the CPU supports AVX2 (see pbkdf2_lanes)
+//
+
+#include <immintrin.h>
+
+#define SHA1X_DEFINE_CORE
+#include "sha1x.h"
+
+namespace {
+
+    using suil::nozama::kdf::Sha1Block;
+
+    struct Avx2 {
+        using type = __m256i;
+        static inline type set(uint32_t v) { return _mm256_set1_epi32((int) v); }
+        static inline type add(type a, type b) { return _mm256_add_epi32(a, b); }
+        static inline type x(type a, type b) { return _mm256_xor_si256(a, b); }
+        static inline type a(type a, type b) { return _mm256_and_si256(a, b); }
+        static inline type o(type a, type b) { return _mm256_or_si256(a, b); }
+        static inline type rotl(type v, int n) {
+            return _mm256_or_si256(_mm256_slli_epi32(v, n), _mm256_srli_epi32(v, 32-n));
+        }
+        static inline type gather(const Sha1Block *b, size_t n, uint32_t (Sha1Block::*f)[5], int j) {
+            alignas(32) uint32_t tmp[8] = {0};
+            for (size_t i = 0; i < n; i++) tmp[i] = (b[i].*f)[j];
+            return _mm256_load_si256((const type *) tmp);
+        }
+        static inline void scatter(Sha1Block *b, size_t n, uint32_t (Sha1Block::*f)[5], int j, type v) {
+            alignas(32) uint32_t tmp[8];
+            _mm256_store_si256((type *) tmp, v);
+            for (size_t i = 0; i < n; i++) (b[i].*f)[j] = tmp[i];
+        }
+    };
+}
+
+namespace suil::nozama::kdf {
+
+    void sha1x8_iterate(Sha1Block *blocks, size_t n, uint32_t iterations)
+    {
+        sha1x_iterate<Avx2>(blocks, n, iterations);
+    }
+}
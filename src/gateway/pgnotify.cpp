@@ -0,0 +1,131 @@
+//
+// Created by Carter Mbotho on 2020-04-14.
+//
+
+#include <libpq-fe.h>
+
+#include "pgnotify.h"
+
+namespace suil::nozama {
+
+    PgListener& PgListener::get()
+    {
+        static PgListener sListener;
+        return sListener;
+    }
+
+    void PgListener::setup(const String& connStr)
+    {
+        mConnStrs.clear();
+        mConnStrs.push_back(connStr.dup());
+    }
+
+    void PgListener::add(const String& connStr)
+    {
+        mConnStrs.push_back(connStr.dup());
+    }
+
+    void PgListener::subscribe(const String& channel, Handler handler, Resync resync)
+    {
+        mSubscribers.push_back(Subscriber{channel.dup(), std::move(handler), std::move(resync)});
+    }
+
+    void PgListener::start()
+    {
+        if (mOwner == getpid() || mSubscribers.empty()) {
+            return;
+        }
+        mOwner = getpid();
+        mConnected = 0;
+        for (size_t db = 0; db < mConnStrs.size(); db++) {
+            go(listener(Ego, db));
+        }
+    }
+
+    void PgListener::notify(sql::PgSqlConnection& conn, const String& channel, const String& payload)
+    {
+        conn("SELECT pg_notify($1, $2)")(channel, payload);
+    }
+
+    coroutine void PgListener::listener(PgListener& Self, size_t db)
+    {
+        const pid_t owner = getpid();
+        while (Self.mOwner == owner) {
+            PGconn *pg = PQconnectStart(Self.mConnStrs[db]());
+            int sock{-1};
+            bool connected{false};
+            try {
+                if (pg == nullptr || PQstatus(pg) == CONNECTION_BAD) {
+                    throw Exception::create("connection failed: ", (pg? PQerrorMessage(pg) : "out of memory"));
+                }
+
+                sock = PQsocket(pg);
+                auto st = PGRES_POLLING_WRITING;
+                while (st != PGRES_POLLING_OK) {
+                    if (st == PGRES_POLLING_FAILED) {
+                        throw Exception::create("connection failed: ", PQerrorMessage(pg));
+                    }
+                    if (fdwait(sock, (st == PGRES_POLLING_READING)? FDW_IN : FDW_OUT, utils::after(5000)) == 0) {
+                        throw Exception::create("connection timed out");
+                    }
+                    st = PQconnectPoll(pg);
+                }
+                PQsetnonblocking(pg, 1);
+
+                OBuffer ob{128};
+                for (auto& sub: Self.mSubscribers) {
+                    auto channel = PQescapeIdentifier(pg, sub.channel(), sub.channel.size());
+                    ob << "LISTEN " << channel << ";";
+                    PQfreemem(channel);
+                }
+                String listen(ob);
+                if (!PQsendQuery(pg, listen())) {
+                    throw Exception::create("sending LISTEN failed: ", PQerrorMessage(pg));
+                }
+                while (PQflush(pg) == 1) {
+                    fdwait(sock, FDW_OUT, -1);
+                }
+
+                connected = true;
+                Self.mConnected++;
+                // notifications might have been missed while we were not listening
+                for (auto& sub: Self.mSubscribers) {
+                    if (sub.resync) sub.resync();
+                }
+                strace("postgres listener %zu started on %zu channels", db, Self.mSubscribers.size());
+
+                while (Self.mOwner == owner) {
+                    fdwait(sock, FDW_IN, -1);
+                    if (!PQconsumeInput(pg)) {
+                        throw Exception::create("reading notifications failed: ", PQerrorMessage(pg));
+                    }
+                    while (!PQisBusy(pg)) {
+                        // discard results of the LISTEN commands
+                        auto res = PQgetResult(pg);
+                        if (res == nullptr) break;
+                        PQclear(res);
+                    }
+                    PGnotify *notify{nullptr};
+                    while ((notify = PQnotifies(pg)) != nullptr) {
+                        for (auto& sub: Self.mSubscribers) {
+                            if (sub.channel == notify->relname) {
+                                sub.handler(notify->extra);
+                            }
+                        }
+                        PQfreemem(notify);
+                    }
+                }
+            }
+            catch (...) {
+                swarn("postgres listener %zu: %s", db, Exception::fromCurrent().what());
+            }
+
+            if (connected && Self.mOwner == owner) {
+                Self.mConnected--;
+            }
+            if (sock >= 0) fdclean(sock);
+            if (pg != nullptr) PQfinish(pg);
+            msleep(utils::after(1000));
+        }
+    }
+}
@@ -0,0 +1,86 @@
+//
+// Created by Carter Mbotho on 2020-04-14.
+//
+
+#ifndef SUIL_PGNOTIFY_H
+#define SUIL_PGNOTIFY_H
+
+#include <functional>
+#include <vector>
+
+#include "common.h"
+
+namespace suil::nozama {
+
+    /**
+     * Receives Postgres notifications (LISTEN/NOTIFY) on a dedicated connection
+     * and dispatches them to the handlers subscribed on each channel. The listener
+     * coroutine is started lazily in each process that subscribes, reconnects
+     * on failure and tells every subscriber when notifications might have been
+     * missed so that they can resynchronize their state.
+     *
+     * When the users table is sharded, notifications are raised on the shard
+     * that was written to, the listener listens on every shard with a connection
+     * per database.
+     */
+    struct PgListener final : LOGGER(NZM_GATEWAY) {
+        using Handler = std::function<void(const char *payload)>;
+        using Resync  = std::function<void()>;
+
+        static PgListener& get();
+
+        /**
+         * @param connStr the connection string of the database to listen on
+         */
+        void setup(const String& connStr);
+
+        /**
+         * Listen on another database as well, must be invoked before the listener
+         * is started
+         * @param connStr the connection string of the database to listen on
+         */
+        void add(const String& connStr);
+
+        /**
+         * Subscribe to notifications on the given channel, must be invoked before
+         * the listener is started
+         * @param channel the channel to LISTEN on
+         * @param handler invoked with the payload of every notification
+         * @param resync invoked each time the listener (re)connects
+         */
+        void subscribe(const String& channel, Handler handler, Resync resync);
+
+        /**
+         * Starts the listener in the current process if not already started
+         */
+        void start();
+
+        /**
+         * @return true once the listener of the current process listens on every
+         * database, notifications sent before that might have been missed
+         */
+        bool listening() const { return mOwner == getpid() && mConnected == mConnStrs.size(); }
+
+        /**
+         * Broadcasts a notification to all listening instances
+         */
+        static void notify(sql::PgSqlConnection& conn, const String& channel, const String& payload);
+
+    private:
+        struct Subscriber {
+            String  channel;
+            Handler handler;
+            Resync  resync;
+        };
+
+        PgListener() = default;
+        static coroutine void listener(PgListener& Self, size_t db);
+
+        std::vector<String> mConnStrs{};
+        std::vector<Subscriber> mSubscribers{};
+        pid_t   mOwner{-1};
+        /// databases the listener of the current process is listening on
+        size_t  mConnected{0};
+    };
+}
+#endif //SUIL_PGNOTIFY_H
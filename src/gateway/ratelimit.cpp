@@ -0,0 +1,216 @@
+//
+// Created by Carter Mbotho on 2020-04-22.
+//
+
+#include <cmath>
+
+#include "clock.h"
+#include "ratelimit.h"
+#include "usercache.h"
+#include "breaker.h"
+
+namespace suil::nozama {
+
+    RateLimit::RateLimit()
+        : mRejectedIp{Counters::get().counter("ratelimit_rejected_ip_total", "Requests rejected by the per IP buckets")},
+          mRejectedEmail{Counters::get().counter("ratelimit_rejected_email_total", "Requests rejected by the per email buckets")},
+          mRejectedShared{Counters::get().counter("ratelimit_rejected_shared_total", "Requests rejected by the windows shared in redis")},
+          mSharedErrors{Counters::get().counter("ratelimit_shared_errors_total", "Shared window checks that failed and let the request through")}
+    {
+        Counters::get().gauge("ratelimit_keys", "IPs and emails currently tracked by the rate limiter", [this] {
+            int64_t keys{0};
+            for (auto& route: mRoutes) {
+                keys += route.ips.keys.size() + route.emails.keys.size();
+            }
+            return keys;
+        });
+    }
+
+    void RateLimit::setup(Config config, http::mw::Redis *redis)
+    {
+        mConfig = std::move(config);
+        mConfig.keys = std::max(mConfig.keys, size_t{1});
+        mRoutes.clear();
+        mRoutes.resize(mConfig.routes.size());
+        mRedis = redis;
+        for (auto& limits: mConfig.routes) {
+            if ((limits.shared.ip || limits.shared.email) && mRedis == nullptr) {
+                throw Exception::create("rate limits of '", limits.path, "' need redis for the shared window");
+            }
+            limits.shared.window = std::max(limits.shared.window, int64_t{1});
+            idebug("rate limiting %s {ip: %g/s burst %g, email: %g/s burst %g, shared: %ld/%ld per %ld s}",
+                   limits.path(), limits.ip.rate, limits.ip.burst, limits.email.rate, limits.email.burst,
+                   limits.shared.ip, limits.shared.email, limits.shared.window);
+        }
+    }
+
+    void RateLimit::before(http::Request& req, http::Response& resp, Context& ctx)
+    {
+        ctx.route = route(req.url);
+        if (ctx.route < 0) {
+            return;
+        }
+
+        std::string ip{};
+        if (mConfig.proxies) {
+            ip = forwarded(req.header("X-Forwarded-For"), mConfig.proxies);
+        }
+        if (ip.empty()) {
+            char buf[IPADDR_MAXSTRLEN];
+            ip = req.ipstr(buf);
+        }
+
+        if (auto retryAfter = throttleIp(ctx.route, ip)) {
+            reject(resp, "Too many requests from this address", retryAfter);
+        }
+    }
+
+    bool RateLimit::allow(Context& ctx, http::Response& resp, const String& email)
+    {
+        if (ctx.route < 0) {
+            return true;
+        }
+        if (auto retryAfter = throttleEmail(ctx.route, email)) {
+            reject(resp, "Too many requests for this account", retryAfter);
+            return false;
+        }
+        return true;
+    }
+
+    int RateLimit::route(const String& path) const
+    {
+        for (size_t i = 0; i < mConfig.routes.size(); i++) {
+            if (mConfig.routes[i].path == path) {
+                return (int) i;
+            }
+        }
+        return -1;
+    }
+
+    std::string RateLimit::forwarded(const String& header, size_t proxies)
+    {
+        // client, proxy1, proxy2: every proxy appends the address it got the request from
+        std::string fwd{header.data(), header.size()};
+        std::string ip{};
+        auto end = fwd.size();
+        for (size_t i = 0; i < proxies && end != std::string::npos; i++) {
+            auto comma = (end == 0)? std::string::npos : fwd.rfind(',', end - 1);
+            auto start = (comma == std::string::npos)? 0 : comma + 1;
+            ip = fwd.substr(start, end - start);
+            end = (comma == std::string::npos)? std::string::npos : comma;
+        }
+        // fewer addresses than proxies, the leftmost was still appended by a trusted proxy
+        auto first = ip.find_first_not_of(" \t");
+        if (first == std::string::npos) {
+            return std::string{};
+        }
+        return ip.substr(first, ip.find_last_not_of(" \t") - first + 1);
+    }
+
+    int64_t RateLimit::throttleIp(int route, const std::string& ip)
+    {
+        auto& limits = mConfig.routes[route];
+        if (!take(mRoutes[route].ips, limits.ip, ip, Clock::now())) {
+            mRejectedIp.inc();
+            return std::max((int64_t) std::ceil(1 / limits.ip.rate), int64_t{1});
+        }
+        if (limits.shared.ip && !shared(limits, "ip", ip, limits.shared.ip)) {
+            mRejectedShared.inc();
+            return limits.shared.window;
+        }
+        return 0;
+    }
+
+    int64_t RateLimit::throttleEmail(int route, const String& email)
+    {
+        auto& limits = mConfig.routes[route];
+        auto key = UserCache::normalize(email.data(), email.size());
+        if (!take(mRoutes[route].emails, limits.email, key, Clock::now())) {
+            mRejectedEmail.inc();
+            return std::max((int64_t) std::ceil(1 / limits.email.rate), int64_t{1});
+        }
+        if (limits.shared.email && !shared(limits, "email", key, limits.shared.email)) {
+            mRejectedShared.inc();
+            return limits.shared.window;
+        }
+        return 0;
+    }
+
+    bool RateLimit::take(States& states, const Bucket& bucket, const std::string& key, int64_t now)
+    {
+        if (bucket.rate <= 0) {
+            return true;
+        }
+        auto it = states.keys.find(key);
+        if (it == states.keys.end()) {
+            if (states.keys.size() >= mConfig.keys) {
+                // the key idle for the longest is the most likely to have refilled its bucket
+                states.keys.erase(states.lru.front());
+                states.lru.pop_front();
+            }
+            // new keys start with a full bucket
+            it = states.keys.emplace(key, State{bucket.burst, now}).first;
+            it->second.used = states.lru.insert(states.lru.end(), key);
+        }
+        else {
+            states.lru.splice(states.lru.end(), states.lru, it->second.used);
+        }
+        auto& state = it->second;
+        state.tokens = std::min(bucket.burst, state.tokens + (now - state.last) * bucket.rate / 1000);
+        state.last = now;
+        if (state.tokens < 1) {
+            return false;
+        }
+        state.tokens -= 1;
+        return true;
+    }
+
+    bool RateLimit::shared(const Limits& limits, const char *kind, const std::string& key, int64_t limit)
+    {
+        // sliding window approximated from the current and previous fixed windows
+        auto now = Clock::wall();
+        auto window = limits.shared.window;
+        auto n = now / window;
+        OBuffer current{128}, previous{128};
+        current  << "semausu:rl:" << limits.path << ":" << kind << ":" << key << ":" << n;
+        previous << "semausu:rl:" << limits.path << ":" << kind << ":" << key << ":" << (n - 1);
+        Breaker::Call call(Breakers::get().Redis);
+        if (!call) {
+            // redis is down, the local buckets still apply
+            mSharedErrors.inc();
+            return true;
+        }
+        try {
+            scoped(redis, mRedis->conn(0));
+            String ckey{current};
+            auto count = (int64_t) redis.incr(ckey);
+            if (count == 1) {
+                redis.expire(ckey, window * 2);
+            }
+
+            int64_t before{0};
+            try {
+                before = redis.get<int64_t>(String{previous});
+            }
+            catch (...) {
+                // no requests in the previous window
+            }
+            call.ok();
+            auto weight = 1.0 - (double) (now % window) / window;
+            return before * weight + count <= limit;
+        }
+        catch (...) {
+            // the local buckets still apply, an unavailable redis must not take the routes down
+            mSharedErrors.inc();
+            iwarn("rate limit window check failed: %s", Exception::fromCurrent().what());
+            return true;
+        }
+    }
+
+    void RateLimit::reject(http::Response& resp, const char *why, int64_t retryAfter)
+    {
+        Endpoint::Controller::fail(resp, "TooManyRequests", why);
+        resp.header("Retry-After", std::max(retryAfter, int64_t{1}));
+        resp.end(http::Status::TOO_MANY_REQUESTS);
+    }
+}
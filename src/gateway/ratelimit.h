@@ -0,0 +1,148 @@
+//
+// Created by Carter Mbotho on 2020-04-22.
+//
+
+#ifndef SUIL_RATELIMIT_H
+#define SUIL_RATELIMIT_H
+
+#include <list>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "common.h"
+#include "counters.h"
+
+namespace suil::nozama {
+
+    /**
+     * Limits the rate at which a client (IP) or a target account (email) can hit the
+     * expensive routes. Each limited route has an in-process token bucket per IP and
+     * per email, and optionally a sliding window per IP and per email shared by all
+     * instances through redis.
+     *
+     * The IP is checked by the middleware before any other middleware does work. The
+     * email is in the request body which is only parsed by the handler, handlers call
+     * `allow` with the email before talking to postgres or hashing passwords.
+     *
+     * @code
+     *   auto& limits = api.middleware<RateLimit>();
+     *   if (!limits.allow(api.context<RateLimit>(req), resp, data.Email)) {
+     *       return;
+     *   }
+     * @endcode
+     *
+     * @note buckets are per process and only accessed from the event loop, a request
+     * rejected by the shared window does not give back its local token
+     */
+    struct RateLimit final : LOGGER(NZM_GATEWAY) {
+
+        struct Bucket {
+            /// tokens added per second, 0 disables the bucket
+            double  rate{0};
+            /// maximum number of tokens, i.e the burst allowed after being idle
+            double  burst{0};
+        };
+
+        struct Window {
+            /// requests allowed per window across all instances, 0 disables the window
+            int64_t ip{0};
+            int64_t email{0};
+            /// length of the window in seconds
+            int64_t window{60};
+        };
+
+        struct Limits {
+            String path;
+            Bucket ip{};
+            Bucket email{};
+            Window shared{};
+        };
+
+        struct Config {
+            std::vector<Limits> routes{};
+            /// maximum number of keys tracked per route and bucket, the least recently used are dropped first
+            size_t keys{100000};
+            /// number of trusted proxies in front of the gateway, each appends to X-Forwarded-For
+            size_t proxies{0};
+        };
+
+        struct Context {
+            /// index of the limits of the route being served, -1 if it is not limited
+            int route{-1};
+        };
+
+        RateLimit();
+
+        /**
+         * @param config the limited routes
+         * @param redis the pool used for the shared windows, can be null if no route
+         *        has a shared window
+         */
+        void setup(Config config, http::mw::Redis *redis);
+
+        void before(http::Request& req, http::Response& resp, Context& ctx);
+
+        void after(http::Request&, http::Response&, Context&) {}
+
+        /**
+         * Checks the limits of the given email on the current route, the response is
+         * ended with 429 if the email is over its limit
+         * @return true if the request can proceed
+         */
+        bool allow(Context& ctx, http::Response& resp, const String& email);
+
+        /**
+         * @return the index of the limits of the given route, -1 if it is not limited
+         */
+        int route(const String& path) const;
+
+        /**
+         * Takes a token for the given client address (or email) on a limited route
+         * @return 0 if the request can proceed, otherwise the seconds after which it can be retried
+         */
+        int64_t throttleIp(int route, const std::string& ip);
+        int64_t throttleEmail(int route, const String& email);
+
+        /**
+         * Finds the client address in a X-Forwarded-For header. Addresses left of the
+         * ones appended by the trusted proxies are set by the client and ignored
+         * @param header the X-Forwarded-For header
+         * @param proxies the number of trusted proxies
+         * @return the address appended by the outermost trusted proxy, empty if none
+         */
+        static std::string forwarded(const String& header, size_t proxies);
+
+    private:
+        struct State {
+            double  tokens{0};
+            int64_t last{0};
+            /// position of the key in the least recently used order
+            std::list<std::string>::iterator used{};
+        };
+        struct States {
+            std::unordered_map<std::string, State> keys{};
+            /// least recently used key first
+            std::list<std::string> lru{};
+        };
+
+        struct Route {
+            States ips{};
+            States emails{};
+        };
+
+        bool take(States& states, const Bucket& bucket, const std::string& key, int64_t now);
+        bool shared(const Limits& limits, const char *kind, const std::string& key, int64_t limit);
+        void reject(http::Response& resp, const char *why, int64_t retryAfter);
+
+        Config             mConfig{};
+        std::vector<Route> mRoutes{};
+        http::mw::Redis   *mRedis{nullptr};
+
+        Counter& mRejectedIp;
+        Counter& mRejectedEmail;
+        Counter& mRejectedShared;
+        Counter& mSharedErrors;
+    };
+}
+#endif //SUIL_RATELIMIT_H
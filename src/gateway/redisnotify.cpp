@@ -0,0 +1,175 @@
+//
+// Created by Carter Mbotho on 2020-04-26.
+//
+
+#include "redisnotify.h"
+
+namespace {
+
+    constexpr int64_t CONNECT_TIMEOUT{5000};
+
+    void bulk(suil::OBuffer& ob, const char *data, size_t len)
+    {
+        ob << "$" << len << "\r\n";
+        ob << suil::String{data, len, false};
+        ob << "\r\n";
+    }
+
+    std::string line(suil::TcpSock& sock, int64_t timeout)
+    {
+        char buf[512];
+        size_t len{sizeof(buf)};
+        if (!sock.receiveUntil(buf, len, "\n", 1, timeout)) {
+            throw suil::Exception::create("reading from redis failed: ", errno_s);
+        }
+        std::string out{buf, len};
+        while (!out.empty() && (out.back() == '\r' || out.back() == '\n')) out.pop_back();
+        if (out.empty()) {
+            throw suil::Exception::create("redis sent an empty line");
+        }
+        return out;
+    }
+
+    /**
+     * Reads a reply made of simple values, an array of bulk strings and integers
+     * such as pub/sub messages, or a single status
+     */
+    std::vector<std::string> reply(suil::TcpSock& sock, int64_t timeout)
+    {
+        auto head = line(sock, timeout);
+        switch (head[0]) {
+            case '+':
+            case ':':
+                return {head.substr(1)};
+            case '-':
+                throw suil::Exception::create("redis error: ", head.substr(1));
+            case '*':
+                break;
+            default:
+                throw suil::Exception::create("unexpected redis reply '", head, "'");
+        }
+
+        auto count = strtol(head.c_str() + 1, nullptr, 10);
+        std::vector<std::string> out;
+        out.reserve(std::max(count, 0L));
+        for (long i = 0; i < count; i++) {
+            auto item = line(sock, timeout);
+            if (item[0] != '$') {
+                out.push_back(item.substr(1));
+                continue;
+            }
+            auto len = strtol(item.c_str() + 1, nullptr, 10);
+            if (len < 0) {
+                out.emplace_back();
+                continue;
+            }
+            std::string value(len + 2, '\0');
+            size_t got{value.size()};
+            if (!sock.receive(&value[0], got, timeout) || got != value.size()) {
+                throw suil::Exception::create("reading from redis failed: ", errno_s);
+            }
+            value.resize(len);
+            out.push_back(std::move(value));
+        }
+        return out;
+    }
+}
+
+namespace suil::nozama {
+
+    RedisListener& RedisListener::get()
+    {
+        static RedisListener sListener;
+        return sListener;
+    }
+
+    void RedisListener::setup(const String& host, int port, const String& passwd)
+    {
+        mHost   = host.dup();
+        mPort   = port;
+        mPasswd = passwd.dup();
+    }
+
+    void RedisListener::subscribe(const String& channel, Handler handler, Resync resync)
+    {
+        mSubscribers.push_back(Subscriber{channel.dup(), std::move(handler), std::move(resync)});
+    }
+
+    void RedisListener::start()
+    {
+        if (mOwner == getpid() || mSubscribers.empty()) {
+            return;
+        }
+        mOwner = getpid();
+        go(listener(Ego));
+    }
+
+    void RedisListener::publish(redis::Client& redis, const String& channel, const String& payload)
+    {
+        redis.send("PUBLISH", channel, payload);
+    }
+
+    coroutine void RedisListener::listener(RedisListener& Self)
+    {
+        const pid_t owner = getpid();
+        while (Self.mOwner == owner) {
+            TcpSock sock;
+            try {
+                errno = 0;
+                auto addr = ipremote(Self.mHost(), Self.mPort, 0, utils::after(CONNECT_TIMEOUT));
+                if (errno != 0) {
+                    throw Exception::create("resolving '", Self.mHost, "' failed: ", errno_s);
+                }
+                if (!sock.connect(addr, CONNECT_TIMEOUT)) {
+                    throw Exception::create("connection failed: ", errno_s);
+                }
+
+                OBuffer ob{128};
+                if (!Self.mPasswd.empty()) {
+                    ob << "*2\r\n";
+                    bulk(ob, "AUTH", 4);
+                    bulk(ob, Self.mPasswd.data(), Self.mPasswd.size());
+                }
+                ob << "*" << (Self.mSubscribers.size() + 1) << "\r\n";
+                bulk(ob, "SUBSCRIBE", 9);
+                for (auto& sub: Self.mSubscribers) {
+                    bulk(ob, sub.channel.data(), sub.channel.size());
+                }
+                if (sock.send(ob.data(), ob.size(), CONNECT_TIMEOUT) != ob.size() || !sock.flush(CONNECT_TIMEOUT)) {
+                    throw Exception::create("sending SUBSCRIBE failed: ", errno_s);
+                }
+                if (!Self.mPasswd.empty()) {
+                    reply(sock, CONNECT_TIMEOUT);
+                }
+                for (size_t i = 0; i < Self.mSubscribers.size(); i++) {
+                    // one confirmation per channel
+                    reply(sock, CONNECT_TIMEOUT);
+                }
+
+                // messages might have been missed while we were not subscribed
+                for (auto& sub: Self.mSubscribers) {
+                    if (sub.resync) sub.resync();
+                }
+                strace("redis listener started on %zu channels", Self.mSubscribers.size());
+
+                while (Self.mOwner == owner) {
+                    auto msg = reply(sock, -1);
+                    if (msg.size() != 3 || msg[0] != "message") {
+                        continue;
+                    }
+                    for (auto& sub: Self.mSubscribers) {
+                        if (sub.channel == msg[1].c_str()) {
+                            sub.handler(msg[2].data(), msg[2].size());
+                        }
+                    }
+                }
+            }
+            catch (...) {
+                swarn("redis listener: %s", Exception::fromCurrent().what());
+            }
+
+            sock.close();
+            msleep(utils::after(1000));
+        }
+    }
+}
@@ -0,0 +1,71 @@
+//
+// Created by Carter Mbotho on 2020-04-26.
+//
+
+#ifndef SUIL_REDISNOTIFY_H
+#define SUIL_REDISNOTIFY_H
+
+#include <functional>
+#include <vector>
+
+#include "common.h"
+
+namespace suil::nozama {
+
+    /**
+     * Receives Redis pub/sub messages on a dedicated connection and dispatches
+     * them to the handlers subscribed on each channel, the Redis counterpart of
+     * PgListener for state that lives in Redis. The listener coroutine is started
+     * lazily in each process that subscribes, reconnects on failure and tells every
+     * subscriber when messages might have been missed so that they can resynchronize.
+     */
+    struct RedisListener final : LOGGER(NZM_GATEWAY) {
+        using Handler = std::function<void(const char *payload, size_t len)>;
+        using Resync  = std::function<void()>;
+
+        static RedisListener& get();
+
+        /**
+         * @param host the host of the redis server to subscribe on
+         * @param port the port of the redis server
+         * @param passwd the password of the redis server, empty if none
+         */
+        void setup(const String& host, int port, const String& passwd);
+
+        /**
+         * Subscribe to messages on the given channel, must be invoked before
+         * the listener is started
+         * @param channel the channel to SUBSCRIBE to
+         * @param handler invoked with the payload of every message
+         * @param resync invoked each time the listener (re)connects
+         */
+        void subscribe(const String& channel, Handler handler, Resync resync);
+
+        /**
+         * Starts the listener in the current process if not already started
+         */
+        void start();
+
+        /**
+         * Broadcasts a message to all subscribed instances
+         */
+        static void publish(redis::Client& redis, const String& channel, const String& payload);
+
+    private:
+        struct Subscriber {
+            String  channel;
+            Handler handler;
+            Resync  resync;
+        };
+
+        RedisListener() = default;
+        static coroutine void listener(RedisListener& Self);
+
+        String  mHost{};
+        int     mPort{6379};
+        String  mPasswd{};
+        std::vector<Subscriber> mSubscribers{};
+        pid_t   mOwner{-1};
+    };
+}
+#endif //SUIL_REDISNOTIFY_H
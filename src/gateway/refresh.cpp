@@ -0,0 +1,229 @@
+//
+// Created by Carter Mbotho on 2020-04-28.
+//
+
+#include <chrono>
+#include <openssl/rand.h>
+#include <openssl/sha.h>
+
+#include "refresh.h"
+#include "usercache.h"
+
+namespace {
+
+    constexpr const char *LIVE_KEY{"semausu:refresh:"};
+    constexpr const char *USED_KEY{"semausu:refresh:used:"};
+    constexpr const char *FAMILY_KEY{"semausu:refresh:family:"};
+    constexpr const char *REVOKED_KEY{"semausu:refresh:revoked:"};
+    /// random bytes in a refresh token and in a family id
+    constexpr size_t TOKEN_BYTES{32};
+    constexpr size_t FAMILY_BYTES{16};
+
+    /// wall clock milliseconds, tokens are compared across instances
+    inline int64_t wallms() {
+        using namespace std::chrono;
+        return duration_cast<milliseconds>(system_clock::now().time_since_epoch()).count();
+    }
+
+    std::string hex(const unsigned char *data, size_t len)
+    {
+        static const char DIGITS[] = "0123456789abcdef";
+        std::string out(len * 2, '\0');
+        for (size_t i = 0; i < len; i++) {
+            out[2*i]   = DIGITS[data[i] >> 4];
+            out[2*i+1] = DIGITS[data[i] & 0x0F];
+        }
+        return out;
+    }
+
+    std::string random(size_t len)
+    {
+        unsigned char buf[TOKEN_BYTES];
+        len = std::min(len, sizeof(buf));
+        if (RAND_bytes(buf, (int) len) != 1) {
+            throw suil::Exception::create("generating refresh token failed");
+        }
+        return hex(buf, len);
+    }
+
+    std::string digest(const suil::String& token)
+    {
+        unsigned char md[SHA256_DIGEST_LENGTH];
+        SHA256((const unsigned char *) token.data(), token.size(), md);
+        return hex(md, sizeof(md));
+    }
+
+    suil::String name(const char *prefix, const std::string& id)
+    {
+        suil::OBuffer ob{64};
+        ob << prefix << suil::String{id.data(), id.size(), false};
+        return suil::String(ob);
+    }
+
+    /// <email> <family> <issued>, the record of a live token
+    suil::String record(const suil::String& email, const std::string& family)
+    {
+        suil::OBuffer ob{128};
+        ob << email << " " << suil::String{family.data(), family.size(), false} << " " << wallms();
+        return suil::String(ob);
+    }
+
+    /**
+     * Spends a live token and stores the next token of its family in one step, of
+     * concurrent refreshes of the same token only one gets the next token
+     *   KEYS: live, family, revoked, used, next
+     *   ARGV: digest, issued, family, next digest, next record, lifetime
+     */
+    constexpr const char *ROTATE_SCRIPT{R"(
+if redis.call('DEL', KEYS[1]) == 0 then
+    return 'spent'
+end
+local revoked = redis.call('GET', KEYS[3])
+if redis.call('GET', KEYS[2]) ~= ARGV[1] or (revoked and tonumber(ARGV[2]) < tonumber(revoked)) then
+    return 'revoked'
+end
+redis.call('SET', KEYS[4], ARGV[3], 'EX', ARGV[6])
+redis.call('SET', KEYS[5], ARGV[5], 'EX', ARGV[6])
+redis.call('SET', KEYS[2], ARGV[4], 'EX', ARGV[6])
+return 'valid'
+)"};
+}
+
+namespace suil::nozama {
+
+    RefreshTokens& RefreshTokens::get()
+    {
+        static RefreshTokens sTokens;
+        return sTokens;
+    }
+
+    RefreshTokens::RefreshTokens()
+        : mIssued{Counters::get().counter("refresh_tokens_issued_total", "Refresh tokens issued")},
+          mRotated{Counters::get().counter("refresh_tokens_rotated_total", "Refresh tokens swapped for a new access token")},
+          mRejected{Counters::get().counter("refresh_tokens_rejected_total", "Unknown, expired or revoked refresh tokens presented")},
+          mReused{Counters::get().counter("refresh_tokens_reused_total", "Spent refresh tokens presented again, their family was revoked")}
+    {}
+
+    void RefreshTokens::setup(int64_t lifetime)
+    {
+        mLifetime = std::max(lifetime, int64_t{0});
+        idebug("refresh tokens %s {lifetime: %ld s}", (mLifetime? "enabled" : "disabled"), mLifetime);
+    }
+
+    String RefreshTokens::issue(redis::Client& redis, const String& email)
+    {
+        return mint(redis, email, random(FAMILY_BYTES));
+    }
+
+    String RefreshTokens::mint(redis::Client& redis, const String& email, const std::string& family)
+    {
+        auto token = random(TOKEN_BYTES);
+        auto hash = digest(String{token.data(), token.size(), false});
+
+        // keys are written with their expiry, none outlives the token lifetime
+        redis.send("SET", name(LIVE_KEY, hash), record(email, family), "EX", mLifetime);
+        redis.send("SET", name(FAMILY_KEY, family), String{hash.data(), hash.size(), false}, "EX", mLifetime);
+        mIssued.inc();
+        return String{token.data(), token.size(), false}.dup();
+    }
+
+    RefreshTokens::Result RefreshTokens::rotate(redis::Client& redis, String& next, String& email, const String& token)
+    {
+        auto hash = digest(token);
+        auto live = name(LIVE_KEY, hash);
+        auto entry = redis.get<String>(live);
+        if (!entry) {
+            return unknown(redis, hash);
+        }
+
+        // <email> <family> <issued>
+        std::string fields{entry.data(), entry.size()};
+        auto sp1 = fields.find(' '), sp2 = fields.rfind(' ');
+        if (sp1 == std::string::npos || sp2 == sp1) {
+            mRejected.inc();
+            return Invalid;
+        }
+        auto user   = fields.substr(0, sp1);
+        auto family = fields.substr(sp1 + 1, sp2 - sp1 - 1);
+        auto issued = fields.substr(sp2 + 1);
+
+        email = String{user.data(), user.size(), false}.dup();
+        auto token = random(TOKEN_BYTES);
+        auto nextHash = digest(String{token.data(), token.size(), false});
+
+        // spent tokens are remembered to detect their reuse
+        auto resp = redis.send("EVAL", String{ROTATE_SCRIPT}, 5,
+                               live,
+                               name(FAMILY_KEY, family),
+                               name(REVOKED_KEY, UserCache::normalize(user.data(), user.size())),
+                               name(USED_KEY, hash),
+                               name(LIVE_KEY, nextHash),
+                               String{hash.data(), hash.size(), false},
+                               String{issued.data(), issued.size(), false},
+                               String{family.data(), family.size(), false},
+                               String{nextHash.data(), nextHash.size(), false},
+                               record(email, family),
+                               mLifetime);
+        if (!resp) {
+            throw Exception::create("rotating refresh token failed");
+        }
+        auto outcome = resp.get<String>(0);
+        if (outcome == "spent") {
+            // a concurrent refresh of the same token won, this one is a reuse
+            return unknown(redis, hash);
+        }
+        if (outcome != "valid") {
+            // the family or the user's tokens were revoked
+            mRejected.inc();
+            return Invalid;
+        }
+
+        next = String{token.data(), token.size(), false}.dup();
+        mIssued.inc();
+        mRotated.inc();
+        return Valid;
+    }
+
+    RefreshTokens::Result RefreshTokens::peek(redis::Client& redis, String& email, const String& token)
+    {
+        auto hash = digest(token);
+        auto entry = redis.get<String>(name(LIVE_KEY, hash));
+        if (!entry) {
+            return unknown(redis, hash);
+        }
+        // <email> <family> <issued>
+        std::string fields{entry.data(), entry.size()};
+        auto sp = fields.find(' ');
+        if (sp == std::string::npos) {
+            mRejected.inc();
+            return Invalid;
+        }
+        email = String{fields.data(), sp, false}.dup();
+        return Valid;
+    }
+
+    RefreshTokens::Result RefreshTokens::unknown(redis::Client& redis, const std::string& hash)
+    {
+        auto spent = redis.get<String>(name(USED_KEY, hash));
+        if (spent) {
+            // a leaked token, whoever holds the live token of the family has to login again
+            redis.del(name(FAMILY_KEY, std::string{spent.data(), spent.size()}));
+            mReused.inc();
+            iwarn("refresh token of family %s reused, family revoked", spent());
+            return Reused;
+        }
+        mRejected.inc();
+        return Invalid;
+    }
+
+    void RefreshTokens::revoke(redis::Client& redis, const String& email)
+    {
+        if (!enabled()) {
+            return;
+        }
+        // tokens issued before now are rejected, the families die with them
+        auto revoked = name(REVOKED_KEY, UserCache::normalize(email.data(), email.size()));
+        auto now = std::to_string(wallms());
+        redis.send("SET", revoked, String{now.data(), now.size(), false}, "EX", mLifetime);
+    }
+}
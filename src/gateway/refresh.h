@@ -0,0 +1,89 @@
+//
+// Created by Carter Mbotho on 2020-04-28.
+//
+
+#ifndef SUIL_REFRESH_H
+#define SUIL_REFRESH_H
+
+#include "common.h"
+#include "counters.h"
+
+namespace suil::nozama {
+
+    /**
+     * Long lived, opaque refresh tokens swapped on /users/refresh for a new access
+     * token without going through the password KDF again. Tokens are stored in
+     * redis by their SHA-256 digest, bound to a user and to a family started at
+     * login. Every refresh rotates the token, the presented token is spent and
+     * a new one of the same family is handed out.
+     *
+     * Presenting a spent token means it leaked (or the client raced itself), the
+     * whole family is revoked so that whoever holds its current token has to login
+     * again. Logging out or blocking a user revokes all of the user's families.
+     *
+     *   semausu:refresh:<digest>          <email> <family> <issued>, a live token
+     *   semausu:refresh:used:<digest>     <family>, a spent token
+     *   semausu:refresh:family:<family>   <digest> of the family's live token
+     *   semausu:refresh:revoked:<email>   time the user's tokens were revoked
+     *
+     * All the keys expire with the token lifetime.
+     */
+    struct RefreshTokens final : LOGGER(NZM_GATEWAY) {
+
+        enum Result {
+            Valid,      /// the token was rotated
+            Invalid,    /// unknown, expired or revoked token
+            Reused      /// a spent token, its family was revoked
+        };
+
+        static RefreshTokens& get();
+
+        /**
+         * @param lifetime seconds a refresh token is valid, 0 disables refresh tokens
+         */
+        void setup(int64_t lifetime);
+
+        bool enabled() const { return mLifetime > 0; }
+
+        /**
+         * Issues a refresh token to a user that just logged in, starting a new family
+         */
+        String issue(redis::Client& redis, const String& email);
+
+        /**
+         * Looks up the user a token is bound to without spending it, a spent token
+         * revokes its family as it does on rotate
+         * @param email set to the user the token is bound to
+         * @param token the presented refresh token
+         * @return Valid if the token is live, it can still be revoked when rotated
+         */
+        Result peek(redis::Client& redis, String& email, const String& token);
+
+        /**
+         * Spends the given token and issues the next token of its family, atomically:
+         * of concurrent refreshes of the same token one is Valid, the others Reused
+         * @param next set to the new token when the token is valid
+         * @param email set to the user the token is bound to
+         * @param token the presented refresh token
+         */
+        Result rotate(redis::Client& redis, String& next, String& email, const String& token);
+
+        /**
+         * Revokes all the refresh tokens issued to the given user so far
+         */
+        void revoke(redis::Client& redis, const String& email);
+
+    private:
+        RefreshTokens();
+        String mint(redis::Client& redis, const String& email, const std::string& family);
+        Result unknown(redis::Client& redis, const std::string& hash);
+
+        int64_t  mLifetime{0};
+
+        Counter& mIssued;
+        Counter& mRotated;
+        Counter& mRejected;
+        Counter& mReused;
+    };
+}
+#endif //SUIL_REFRESH_H
@@ -0,0 +1,273 @@
+//
+// Created by Carter Mbotho on 2020-04-29.
+//
+
+#include "replicas.h"
+#include "pgnotify.h"
+#include "statements.h"
+#include "usercache.h"
+
+namespace {
+
+    /**
+     * replay lag of a standby, 0 when it replayed everything it received and -1 when
+     * it is not receiving, what it received says nothing about the primary then.
+     * The status of the receiver is only visible to roles with pg_read_all_stats
+     */
+    constexpr const char *LAG_SQL{
+        "SELECT CASE WHEN NOT EXISTS (SELECT 1 FROM pg_stat_wal_receiver WHERE status = 'streaming') THEN -1 "
+        "WHEN pg_last_wal_receive_lsn() = pg_last_wal_replay_lsn() THEN 0 "
+        "ELSE COALESCE(EXTRACT(EPOCH FROM now() - pg_last_xact_replay_timestamp()) * 1000, -1) END::BIGINT AS Lag"};
+
+    typedef decltype(iod::D(
+            prop(Lag, int64_t)
+    )) LagRow;
+
+    std::string metric(const suil::String& name, const char *suffix)
+    {
+        // replica-1 becomes pg_replica_replica_1_<suffix>
+        std::string out{"pg_replica_"};
+        for (size_t i = 0; i < name.size(); i++) {
+            out += isalnum(name.data()[i])? name.data()[i] : '_';
+        }
+        return out + "_" + suffix;
+    }
+}
+
+namespace suil::nozama {
+
+    Replicas::Replica::Replica(const String& n)
+        : name{n.dup()},
+          names{metric(n, "reads_total"), metric(n, "failures_total"), metric(n, "lag_ms"),
+                metric(n, "healthy"), metric(n, "inflight")},
+          reads{Counters::get().counter(names[0].c_str(), "Reads routed to the replica")},
+          failures{Counters::get().counter(names[1].c_str(), "Failed health checks of the replica")}
+    {}
+
+    Replicas::Lease::Lease(sql::mw::Postgres& primary, const String& email)
+        : mPrimary{primary}
+    {
+        auto& self = Replicas::get();
+        // only the primary shard is replicated
+        mReplica = (&primary == self.mPrimary)? self.route(email) : nullptr;
+        if (mReplica != nullptr) {
+            mReplica->inflight++;
+            mReplica->reads.inc();
+        }
+        else {
+            self.mPrimaryInflight++;
+            self.mPrimaryReads.inc();
+        }
+    }
+
+    Replicas::Lease::~Lease()
+    {
+        if (mReplica != nullptr) {
+            mReplica->inflight--;
+        }
+        else {
+            Replicas::get().mPrimaryInflight--;
+        }
+    }
+
+    sql::mw::Postgres& Replicas::Lease::pool()
+    {
+        return mReplica != nullptr? mReplica->pool : mPrimary;
+    }
+
+    sql::PgSqlConnection& Replicas::Lease::conn(const Deadline::Context& deadline)
+    {
+        if (mReplica != nullptr) {
+            try {
+                return deadline.conn(mReplica->pool);
+            }
+            catch (...) {
+                if (deadline.expired()) {
+                    throw;
+                }
+                // down since its last check, the read still has the primary
+                auto& self = Replicas::get();
+                self.unhealthy(*mReplica, Exception::fromCurrent().what());
+                mReplica->inflight--;
+                mReplica = nullptr;
+                self.mPrimaryInflight++;
+                self.mPrimaryReads.inc();
+                self.mFallbacks.inc();
+            }
+        }
+        return deadline.conn(mPrimary);
+    }
+
+    Replicas& Replicas::get()
+    {
+        static Replicas sReplicas;
+        return sReplicas;
+    }
+
+    Replicas::Replicas()
+        : mPrimaryReads{Counters::get().counter("pg_primary_reads_total", "Routed reads that went to the primary")},
+          mPinnedReads{Counters::get().counter("pg_pinned_reads_total", "Reads sent to the primary because the user was just written")},
+          mFallbacks{Counters::get().counter("pg_replica_fallbacks_total", "Reads sent to the primary because their replica could not be connected to")}
+    {
+        Counters::get().gauge("pg_primary_reads_inflight", "Routed reads in flight on the primary", [this] {
+            return (int64_t) mPrimaryInflight;
+        });
+    }
+
+    void Replicas::setup(Config config, sql::mw::Postgres& primary)
+    {
+        mConfig = std::move(config);
+        mPrimary = &primary;
+        if (mReplicas.empty()) {
+            return;
+        }
+        // writes broadcast by any instance pin the user, reads must see them
+        PgListener::get().subscribe(mConfig.channel,
+            [this](const char *email) { pin(String{email}); },
+            // writes might have been missed, read everything from the primary for a while
+            [this] { mPinAll = mnow() + mConfig.pin; });
+        idebug("replica routing {interval: %ld ms, max lag: %ld ms, pin: %ld ms}",
+               mConfig.interval, mConfig.maxLag, mConfig.pin);
+    }
+
+    void Replicas::add(const String& name, const String& connStr, int64_t timeout, int64_t keepAlive)
+    {
+        mReplicas.push_back(std::make_unique<Replica>(name));
+        auto replica = mReplicas.back().get();
+        replica->pool.setup(connStr(),
+                            opt(ASYNC, true),
+                            opt(TIMEOUT, timeout),
+                            opt(EXPIRES, keepAlive));
+        Counters::get().gauge(replica->names[2].c_str(), "Replay lag of the replica in milliseconds, -1 if unknown", [replica] {
+            return replica->lag;
+        });
+        Counters::get().gauge(replica->names[3].c_str(), "1 if the replica passed its last health check", [replica] {
+            return (int64_t) replica->healthy;
+        });
+        Counters::get().gauge(replica->names[4].c_str(), "Reads in flight on the replica", [replica] {
+            return (int64_t) replica->inflight;
+        });
+        idebug("added postgres replica %s", name());
+    }
+
+    void Replicas::pin(const String& email)
+    {
+        if (mReplicas.empty()) {
+            return;
+        }
+        auto now = mnow();
+        if (mPinned.size() > 1024) {
+            // forget the pins that ended
+            for (auto it = mPinned.begin(); it != mPinned.end();) {
+                it = it->second < now? mPinned.erase(it) : std::next(it);
+            }
+        }
+        mPinned[UserCache::normalize(email.data(), email.size())] = now + mConfig.pin;
+    }
+
+    Replicas::Replica* Replicas::route(const String& email)
+    {
+        if (mReplicas.empty()) {
+            return nullptr;
+        }
+        if (mOwner != getpid()) {
+            mOwner = getpid();
+            go(checker(Ego));
+        }
+        // pins of other instances arrive over the users channel
+        PgListener::get().start();
+
+        if (mPinAll >= mnow()) {
+            mPinnedReads.inc();
+            return nullptr;
+        }
+        if (!email.empty()) {
+            auto it = mPinned.find(UserCache::normalize(email.data(), email.size()));
+            if (it != mPinned.end()) {
+                if (it->second >= mnow()) {
+                    mPinnedReads.inc();
+                    return nullptr;
+                }
+                mPinned.erase(it);
+            }
+        }
+
+        // least busy replica within the lag budget, ties go round robin
+        Replica *best{nullptr};
+        auto n = mReplicas.size();
+        for (size_t i = 0; i < n; i++) {
+            auto replica = mReplicas[(mNext + i) % n].get();
+            if (!replica->healthy || replica->lag < 0 || replica->lag > mConfig.maxLag) {
+                continue;
+            }
+            if (best == nullptr || replica->inflight < best->inflight) {
+                best = replica;
+            }
+        }
+        mNext++;
+        return best;
+    }
+
+    void Replicas::check(Replica& replica)
+    {
+        try {
+            std::vector<LagRow> rows;
+            scoped(conn, replica.pool.conn());
+            // logins abandoned on the replica leave their result behind
+            Statements::get().settle(conn);
+            conn(LAG_SQL)() >> rows;
+            if (rows.empty()) {
+                throw Exception::create("lag query returned no rows");
+            }
+            if (rows[0].Lag < 0) {
+                throw Exception::create("not streaming from the primary");
+            }
+            if (!replica.healthy) {
+                iinfo("postgres replica %s is healthy, lag %ld ms", replica.name(), rows[0].Lag);
+            }
+            replica.lag = rows[0].Lag;
+            replica.healthy = true;
+        }
+        catch (...) {
+            unhealthy(replica, Exception::fromCurrent().what());
+        }
+    }
+
+    void Replicas::unhealthy(Replica& replica, const char *why)
+    {
+        if (replica.healthy) {
+            iwarn("postgres replica %s is unhealthy: %s", replica.name(), why);
+        }
+        replica.healthy = false;
+        replica.lag = -1;
+        replica.failures.inc();
+    }
+
+    coroutine void Replicas::checker(Replicas& Self)
+    {
+        const pid_t owner = getpid();
+        while (Self.mOwner == owner) {
+            for (auto& replica: Self.mReplicas) {
+                Self.check(*replica);
+            }
+            msleep(utils::after(Self.mConfig.interval));
+        }
+    }
+
+    void Replicas::toJson(OBuffer& ob) const
+    {
+        ob << "[";
+        bool first{true};
+        for (auto& replica: mReplicas) {
+            if (!first) ob << ",";
+            first = false;
+            ob << "{\"name\":\"" << replica->name << "\""
+               << ",\"healthy\":" << (replica->healthy? "true" : "false")
+               << ",\"lag\":" << replica->lag
+               << ",\"inflight\":" << replica->inflight
+               << ",\"reads\":" << replica->reads.value()
+               << ",\"failures\":" << replica->failures.value() << "}";
+        }
+        ob << "]";
+    }
+}
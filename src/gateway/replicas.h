@@ -0,0 +1,155 @@
+//
+// Created by Carter Mbotho on 2020-04-29.
+//
+
+#ifndef SUIL_REPLICAS_H
+#define SUIL_REPLICAS_H
+
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "common.h"
+#include "counters.h"
+#include "deadline.h"
+
+namespace suil::nozama {
+
+    /**
+     * Routes the reads of the request hot paths (e.g the login lookup) to Postgres
+     * read replicas, each with a pool of its own. A background coroutine checks the
+     * health and replay lag of every replica, reads go to the least busy healthy
+     * replica within the lag budget and fall back to the primary when there is none
+     * or when the replica cannot be connected to. A replica that is not streaming
+     * from the primary is unhealthy, its lag cannot be known.
+     *
+     * Writes always go to the primary. So that a flow reads its own writes (e.g
+     * login right after verify), the reads of a user that was just written are
+     * pinned to the primary for a while. Users are pinned locally when written and
+     * on other instances through the NOTIFY channel on which the users cache is
+     * invalidated.
+     *
+     * Replicas are replicas of the primary, when the users table is sharded the
+     * reads of users living on other shards go to their shard.
+     *
+     * @code
+     *   Replicas::Lease lease(pq, email);
+     *   scoped(conn, lease.conn(deadline));
+     *   stmts(conn, deadline, Stmt::UserLogin, email) >> user;
+     * @endcode
+     *
+     * @note replicas are per process and only accessed from the event loop
+     */
+    struct Replicas final : LOGGER(NZM_GATEWAY) {
+
+        struct Config {
+            /// milliseconds between health checks
+            int64_t interval{1000};
+            /// replicas lagging by more than this many milliseconds are not read from
+            int64_t maxLag{1000};
+            /// milliseconds the reads of a user that was written go to the primary
+            int64_t pin{2000};
+            /// the NOTIFY channel on which writes to users are broadcast
+            String  channel{"semausu_users"};
+        };
+
+        struct Replica {
+            Replica(const String& name);
+
+            String   name;
+            sql::mw::Postgres pool{};
+            bool     healthy{false};
+            /// replay lag in milliseconds, -1 if unknown
+            int64_t  lag{-1};
+            size_t   inflight{0};
+
+            std::string names[5];
+            Counter&    reads;
+            Counter&    failures;
+        };
+
+        /**
+         * A read routed to a pool, accounted for as in flight until it goes out of scope
+         */
+        struct Lease {
+            /**
+             * @param primary the pool of the user's shard
+             * @param email the user the read is for, pinned users read from the primary
+             */
+            Lease(sql::mw::Postgres& primary, const String& email);
+            ~Lease();
+
+            sql::mw::Postgres& pool();
+
+            /**
+             * @param deadline the deadline of the request, bounds acquiring the connection
+             * @return a connection of the pool the read was routed to, of the primary
+             * if the replica cannot be reached, the replica is then marked unhealthy
+             */
+            sql::PgSqlConnection& conn(const Deadline::Context& deadline);
+
+            /**
+             * @return true if the read was routed to a replica
+             */
+            bool replica() const { return mReplica != nullptr; }
+
+        private:
+            sql::mw::Postgres& mPrimary;
+            Replica           *mReplica{nullptr};
+        };
+
+        static Replicas& get();
+
+        /**
+         * Configure the routing, must be invoked after the replicas are added
+         * @param config the routing configuration
+         * @param primary the pool of the database that is replicated
+         */
+        void setup(Config config, sql::mw::Postgres& primary);
+
+        /**
+         * Adds a replica, must be invoked before the health checks start
+         * @param name the name of the replica, used in metrics
+         * @param connStr the connection string of the replica
+         * @param timeout timeout of the replica's connections in milliseconds
+         * @param keepAlive time idle connections are kept in milliseconds
+         */
+        void add(const String& name, const String& connStr, int64_t timeout, int64_t keepAlive);
+
+        bool enabled() const { return !mReplicas.empty(); }
+
+        /**
+         * Pins the reads of the given user to the primary
+         */
+        void pin(const String& email);
+
+        /**
+         * Renders the state of the replicas as a JSON array
+         */
+        void toJson(OBuffer& ob) const;
+
+    private:
+        Replicas();
+        Replica *route(const String& email);
+        static coroutine void checker(Replicas& Self);
+        void check(Replica& replica);
+        void unhealthy(Replica& replica, const char *why);
+
+        Config   mConfig{};
+        sql::mw::Postgres *mPrimary{nullptr};
+        std::vector<std::unique_ptr<Replica>> mReplicas{};
+        /// pinned users mapped to the time their pin ends
+        std::unordered_map<std::string, int64_t> mPinned{};
+        /// time until which all reads are pinned to the primary
+        int64_t  mPinAll{0};
+        size_t   mNext{0};
+        pid_t    mOwner{-1};
+        size_t   mPrimaryInflight{0};
+
+        Counter& mPrimaryReads;
+        Counter& mPinnedReads;
+        Counter& mFallbacks;
+    };
+}
+#endif //SUIL_REPLICAS_H
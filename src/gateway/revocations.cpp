@@ -0,0 +1,234 @@
+//
+// Created by Carter Mbotho on 2020-04-27.
+//
+
+#include "bloom.h"
+#include "clock.h"
+#include "revocations.h"
+#include "redisnotify.h"
+#include "usercache.h"
+
+namespace {
+
+    constexpr const char *BUCKET_KEY{"semausu:revocations:"};
+
+    /// key of the revocation of a user at a given second
+    inline std::string at(const std::string& user, int64_t t) {
+        return user + "@" + std::to_string(t);
+    }
+
+    /// key of the revocation of a user at a given millisecond of a second
+    inline std::string at(const std::string& user, int64_t t, int64_t ms) {
+        return at(user, t) + "." + std::to_string(ms);
+    }
+}
+
+namespace suil::nozama {
+
+    Revocations& Revocations::get()
+    {
+        static Revocations sRevocations;
+        return sRevocations;
+    }
+
+    Revocations::Revocations()
+        : mChecks{Counters::get().counter("revocations_checks_total", "Tokens checked against the revocation filter")},
+          mRevoked{Counters::get().counter("revocations_rejected_total", "Requests rejected because their token was revoked")},
+          mRevocations{Counters::get().counter("revocations_total", "Revocations added to the revocation filter")}
+    {
+        Counters::get().gauge("revocations_bytes", "Memory used by the revocation filter", [this] {
+            return (int64_t) (mBuckets.size() * (mNumBits / 8));
+        });
+    }
+
+    void Revocations::setup(Config config, http::mw::Redis *redis)
+    {
+        mConfig = std::move(config);
+        mRedis  = redis;
+        mBuckets.clear();
+        mNumBits = 0;
+        if (mConfig.capacity == 0) {
+            idebug("revocation filter disabled");
+            return;
+        }
+
+        // each revocation adds 3 keys
+        mConfig.width = std::max(mConfig.width, int64_t{1});
+        auto fpr = std::min(std::max(mConfig.fpr, 1e-12), 0.5);
+        Bloom::size(mNumBits, mNumHashes, 3 * mConfig.capacity, fpr);
+        // a token issued at the end of a bucket is checked against the buckets up to its expiry
+        mBuckets.resize((size_t) ((mConfig.lifetime + mConfig.width - 1) / mConfig.width) + 1);
+
+        RedisListener::get().subscribe(mConfig.channel,
+            [this](const char *payload, size_t len) { load(payload, len); },
+            // revocations broadcast while not listening are in the redis buckets
+            [this] {
+                if (mRedis == nullptr) return;
+                try {
+                    scoped(redis, mRedis->conn(0));
+                    resync(redis);
+                }
+                catch (...) {
+                    iwarn("resyncing revocations failed: %s", Exception::fromCurrent().what());
+                }
+            });
+        idebug("revocation filter configured {buckets: %zu x %ld s, bytes: %zu, hashes: %u}",
+               mBuckets.size(), mConfig.width, mBuckets.size() * (mNumBits / 8), mNumHashes);
+    }
+
+    Revocations::Bucket* Revocations::bucket(int64_t index, bool reset)
+    {
+        auto& b = mBuckets[(size_t) index % mBuckets.size()];
+        if (b.index != index) {
+            if (!reset || b.index > index) {
+                // not recorded, or too old to matter
+                return nullptr;
+            }
+            b.index = index;
+            b.bits.assign(mNumBits / 64, 0);
+        }
+        return &b;
+    }
+
+    void Revocations::add(Bucket& bucket, const std::string& key)
+    {
+        Bloom::add(bucket.bits, mNumBits, mNumHashes, key);
+    }
+
+    bool Revocations::test(const Bucket& bucket, const std::string& key) const
+    {
+        return Bloom::test(bucket.bits, mNumBits, mNumHashes, key);
+    }
+
+    void Revocations::insert(const std::string& user, int64_t ms)
+    {
+        auto t = ms / 1000;
+        if (mNumBits == 0 || t <= Clock::wall() - mConfig.lifetime) {
+            return;
+        }
+        auto b = bucket(t / mConfig.width, true);
+        if (b == nullptr) {
+            return;
+        }
+        add(*b, user);
+        add(*b, at(user, t));
+        add(*b, at(user, t, ms % 1000));
+        mRevocations.inc();
+    }
+
+    int64_t Revocations::issued(http::Jwt& jwt)
+    {
+        auto ms = jwt.claims<int64_t>(IssuedClaim);
+        // tokens issued before the claim was added only have a second
+        return ms? ms : (int64_t) jwt.iat() * 1000;
+    }
+
+    void Revocations::stamp(http::Jwt& jwt)
+    {
+        jwt.claims(IssuedClaim, Clock::wallms());
+    }
+
+    bool Revocations::revoked(const String& user, int64_t issued)
+    {
+        if (mNumBits == 0) {
+            return false;
+        }
+        // without the listener revocations on other instances would never be seen
+        RedisListener::get().start();
+        mChecks.inc();
+
+        auto now  = Clock::wall();
+        auto key  = UserCache::normalize(user.data(), user.size());
+        auto iat  = issued / 1000;
+        auto from = iat / mConfig.width, to = now / mConfig.width;
+        for (auto index = std::max(from, to - (int64_t) mBuckets.size() + 1); index <= to; index++) {
+            auto b = bucket(index, false);
+            if (b == nullptr || !test(*b, key)) {
+                continue;
+            }
+            if (index > from) {
+                mRevoked.inc();
+                return true;
+            }
+            // the bucket the token was issued in, only revocations after it count
+            auto last = std::min((index + 1) * mConfig.width - 1, now);
+            for (auto t = iat; t <= last; t++) {
+                if (!test(*b, at(key, t))) {
+                    continue;
+                }
+                if (t > iat) {
+                    mRevoked.inc();
+                    return true;
+                }
+                // revoked in the second the token was issued, a login right after a logout is valid
+                for (auto ms = issued % 1000 + 1; ms < 1000; ms++) {
+                    if (test(*b, at(key, t, ms))) {
+                        mRevoked.inc();
+                        return true;
+                    }
+                }
+            }
+        }
+        return false;
+    }
+
+    std::string Revocations::key(int64_t index) const
+    {
+        return BUCKET_KEY + std::to_string(index);
+    }
+
+    void Revocations::revoke(redis::Client& redis, const String& email)
+    {
+        if (mNumBits == 0) {
+            return;
+        }
+        auto now = Clock::wallms();
+        auto user = UserCache::normalize(email.data(), email.size());
+        insert(user, now);
+
+        OBuffer ob{64};
+        ob << String{user.data(), user.size(), false} << " " << now << "\n";
+        String entry(ob);
+        // recorded for instances that resync, forgotten with the bucket
+        auto name = key(now / 1000 / mConfig.width);
+        String bucketKey{name.data(), name.size(), false};
+        redis.send("APPEND", bucketKey, entry);
+        redis.expire(bucketKey, mConfig.lifetime + mConfig.width);
+        RedisListener::publish(redis, mConfig.channel, entry);
+    }
+
+    void Revocations::resync(redis::Client& redis)
+    {
+        if (mNumBits == 0) {
+            return;
+        }
+        auto to = Clock::wall() / mConfig.width;
+        auto before = mRevocations.value();
+        for (auto index = to - (int64_t) mBuckets.size() + 1; index <= to; index++) {
+            auto data = redis.get<String>(key(index).c_str());
+            if (data) {
+                load(data.data(), data.size());
+            }
+        }
+        idebug("revocation filter resynced %lu revocations", (unsigned long) (mRevocations.value() - before));
+    }
+
+    void Revocations::load(const char *data, size_t len)
+    {
+        // <email> <time>\n...
+        std::string lines{data, len};
+        size_t pos{0};
+        while (pos < lines.size()) {
+            auto eol = lines.find('\n', pos);
+            if (eol == std::string::npos) eol = lines.size();
+            auto sp = lines.rfind(' ', eol);
+            if (sp != std::string::npos && sp > pos) {
+                auto t = strtoll(lines.c_str() + sp + 1, nullptr, 10);
+                // seconds, as recorded by instances that did not record milliseconds yet
+                if (t < 100000000000ll) t *= 1000;
+                insert(UserCache::normalize(lines.data() + pos, sp - pos), t);
+            }
+            pos = eol + 1;
+        }
+    }
+}
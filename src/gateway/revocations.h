@@ -0,0 +1,123 @@
+//
+// Created by Carter Mbotho on 2020-04-27.
+//
+
+#ifndef SUIL_REVOCATIONS_H
+#define SUIL_REVOCATIONS_H
+
+#include <string>
+#include <vector>
+
+#include "common.h"
+#include "counters.h"
+
+namespace suil::nozama {
+
+    /**
+     * The users whose tokens were revoked (logout, block) within the lifetime of a
+     * token, kept in memory so that authorizing a request never asks redis whether
+     * its token is still valid. Revoking a user at time `t` revokes all of the
+     * user's tokens issued before `t`, to the millisecond (see stamp).
+     *
+     * Revocations are recorded in a ring of time buckets, each a Bloom filter of the
+     * users revoked during the bucket and of the (user, second) and (user, millisecond)
+     * of each revocation. A token is revoked if its user was revoked in a bucket after
+     * the one it was issued in, or within that bucket after the millisecond it was
+     * issued. Buckets older than the token lifetime are recycled, the tokens they
+     * could revoke have expired anyway.
+     *
+     * Revocations are broadcast to other instances over a redis channel (see
+     * RedisListener) and appended to per bucket keys in redis that expire with the
+     * bucket, from which the filter is rebuilt at startup and whenever the listener
+     * reconnects.
+     *
+     * @note a false positive revokes a valid token, the filter is sized for a very
+     * low false positive rate
+     */
+    struct Revocations final : LOGGER(NZM_GATEWAY) {
+
+        struct Config {
+            /// seconds a token is valid, revocations are forgotten after that
+            int64_t lifetime{900};
+            /// seconds covered by each bucket
+            int64_t width{60};
+            /// expected revocations per bucket, 0 disables the filter
+            size_t  capacity{1000};
+            /// targeted false positive rate of each bucket at capacity
+            double  fpr{1e-7};
+            /// the redis channel on which revocations are broadcast
+            String  channel{"semausu_revocations"};
+        };
+
+        /// claim of the tokens issued by the gateway, the millisecond they were issued at
+        static constexpr const char *IssuedClaim{"iatms"};
+
+        static Revocations& get();
+
+        /**
+         * Configure the filter, the filter is empty until resync is invoked
+         * @param redis the redis middleware used to resync when the listener reconnects
+         */
+        void setup(Config config, http::mw::Redis *redis);
+
+        bool enabled() const { return mNumBits != 0; }
+
+        /**
+         * @param user the user (aud) of the token
+         * @param issued the time the token was issued, in milliseconds since the epoch
+         * @return true if the token was revoked
+         */
+        bool revoked(const String& user, int64_t issued);
+
+        /**
+         * Records the millisecond a token is issued at in the token, `iat` only has seconds
+         */
+        static void stamp(http::Jwt& jwt);
+
+        /**
+         * @return the millisecond the token was issued at
+         */
+        static int64_t issued(http::Jwt& jwt);
+
+        /**
+         * Revokes all the tokens of the given user issued so far, on this instance
+         * and on all the other instances
+         */
+        void revoke(redis::Client& redis, const String& email);
+
+        /**
+         * Loads all the revocations recorded in redis within the token lifetime
+         */
+        void resync(redis::Client& redis);
+
+        /**
+         * Adds revocations recorded as `<email> <time>` lines (milliseconds), as
+         * broadcast by other instances and appended to the buckets in redis
+         */
+        void load(const char *data, size_t len);
+
+    private:
+        struct Bucket {
+            int64_t index{-1};
+            std::vector<uint64_t> bits{};
+        };
+
+        Revocations();
+        void insert(const std::string& user, int64_t ms);
+        void add(Bucket& bucket, const std::string& key);
+        bool test(const Bucket& bucket, const std::string& key) const;
+        Bucket *bucket(int64_t index, bool reset);
+        std::string key(int64_t index) const;
+
+        Config   mConfig{};
+        std::vector<Bucket> mBuckets{};
+        uint64_t mNumBits{0};
+        uint32_t mNumHashes{0};
+        http::mw::Redis *mRedis{nullptr};
+
+        Counter& mChecks;
+        Counter& mRevoked;
+        Counter& mRevocations;
+    };
+}
+#endif //SUIL_REVOCATIONS_H
@@ -0,0 +1,120 @@
+//
+// Created by Carter Mbotho on 2020-04-08.
+//
+
+#ifndef SUIL_SHA1X_H
+#define SUIL_SHA1X_H
+
+#include <cstddef>
+#include <cstdint>
+
+/*
+ * Multi-lane SHA-1 compression used by the PBKDF2 engine. The core is written
+ * once against a small set of vector operations (V) and instantiated for scalar,
+ * SSE2 (4 lanes) and AVX2 (8 lanes) registers.
+ *
+ * @note this header is included by translation units compiled with different
+ * instruction sets, keep it free of standard library includes and define
+ * everything in the including unit's anonymous namespace
+ */
+
+namespace suil::nozama::kdf {
+
+    /**
+     * A single PBKDF2-HMAC-SHA1 output block being iterated. The HMAC inner and
+     * outer states are precomputed from the password, u holds the current U_i and
+     * t accumulates the XOR of all U_i
+     */
+    struct Sha1Block {
+        uint32_t inner[5];
+        uint32_t outer[5];
+        uint32_t u[5];
+        uint32_t t[5];
+    };
+
+    /**
+     * Runs @param iterations rounds of U_i = HMAC(P, U_{i-1}); T ^= U_i on the given
+     * blocks using the 8-lane AVX2 kernel
+     * @param blocks the blocks to iterate
+     * @param n the number of blocks, at most 8
+     */
+    void sha1x8_iterate(Sha1Block *blocks, size_t n, uint32_t iterations);
+}
+
+#ifdef SHA1X_DEFINE_CORE
+
+namespace {
+
+    template <typename V>
+    inline typename V::type sha1x_schedule(typename V::type w[16], int i)
+    {
+        if (i >= 16) {
+            w[i&15] = V::rotl(V::x(V::x(w[(i+13)&15], w[(i+8)&15]), V::x(w[(i+2)&15], w[i&15])), 1);
+        }
+        return w[i&15];
+    }
+
+#define SHA1X_STEP(F, K)                                                                  \
+    {                                                                                     \
+        auto tmp = V::add(V::add(V::rotl(a, 5), (F)), V::add(V::add(e, (K)), sha1x_schedule<V>(w, i))); \
+        e = d; d = c; c = V::rotl(b, 30); b = a; a = tmp;                                 \
+    }
+
+    /**
+     * Compresses a 20 byte message (a SHA-1 digest) padded to a single block
+     * as it happens on every HMAC step after the first one
+     */
+    template <typename V>
+    inline void sha1x_digest_block(typename V::type st[5], const typename V::type in[5], typename V::type out[5])
+    {
+        using T = typename V::type;
+        T w[16];
+        for (int i = 0; i < 5; i++) w[i] = in[i];
+        w[5] = V::set(0x80000000u);
+        for (int i = 6; i < 15; i++) w[i] = V::set(0);
+        // (64 byte key block + 20 byte digest) * 8
+        w[15] = V::set(672);
+
+        T a = st[0], b = st[1], c = st[2], d = st[3], e = st[4];
+        const T k0 = V::set(0x5A827999u), k1 = V::set(0x6ED9EBA1u),
+                k2 = V::set(0x8F1BBCDCu), k3 = V::set(0xCA62C1D6u);
+        int i = 0;
+        for (; i < 20; i++) SHA1X_STEP(V::x(d, V::a(b, V::x(c, d))), k0)
+        for (; i < 40; i++) SHA1X_STEP(V::x(V::x(b, c), d), k1)
+        for (; i < 60; i++) SHA1X_STEP(V::o(V::a(b, c), V::a(d, V::o(b, c))), k2)
+        for (; i < 80; i++) SHA1X_STEP(V::x(V::x(b, c), d), k3)
+        out[0] = V::add(a, st[0]);
+        out[1] = V::add(b, st[1]);
+        out[2] = V::add(c, st[2]);
+        out[3] = V::add(d, st[3]);
+        out[4] = V::add(e, st[4]);
+    }
+#undef SHA1X_STEP
+
+    template <typename V>
+    inline void sha1x_iterate(suil::nozama::kdf::Sha1Block *blocks, size_t n, uint32_t iterations)
+    {
+        using T = typename V::type;
+        T inner[5], outer[5], u[5], t[5], tmp[5];
+        for (int j = 0; j < 5; j++) {
+            inner[j] = V::gather(blocks, n, &suil::nozama::kdf::Sha1Block::inner, j);
+            outer[j] = V::gather(blocks, n, &suil::nozama::kdf::Sha1Block::outer, j);
+            u[j]     = V::gather(blocks, n, &suil::nozama::kdf::Sha1Block::u, j);
+            t[j]     = V::gather(blocks, n, &suil::nozama::kdf::Sha1Block::t, j);
+        }
+
+        for (uint32_t it = 0; it < iterations; it++) {
+            sha1x_digest_block<V>(inner, u, tmp);
+            sha1x_digest_block<V>(outer, tmp, u);
+            for (int j = 0; j < 5; j++) t[j] = V::x(t[j], u[j]);
+        }
+
+        for (int j = 0; j < 5; j++) {
+            V::scatter(blocks, n, &suil::nozama::kdf::Sha1Block::u, j, u[j]);
+            V::scatter(blocks, n, &suil::nozama::kdf::Sha1Block::t, j, t[j]);
+        }
+    }
+}
+#endif // SHA1X_DEFINE_CORE
+
+#endif //SUIL_SHA1X_H
@@ -0,0 +1,248 @@
+//
+// Created by Carter Mbotho on 2020-04-30.
+//
+
+#include <algorithm>
+#include <map>
+#include <set>
+
+#include "bloom.h"
+#include "shards.h"
+#include "statements.h"
+#include "usercache.h"
+
+namespace {
+
+    /// every column of users but the Id, which is assigned by the shard a user moves to
+    constexpr const char *COLUMNS{
+        "Email, FirstName, LastName, Passwd, Roles, Salt, State, PasswdExpires, PrevPasswds, IconPath, Notes"};
+
+    inline uint64_t hash(const std::string& key) {
+        // fnv1a, stable across builds and platforms, placement must never change
+        using suil::nozama::Bloom;
+        return Bloom::mix(Bloom::fnv1a(key));
+    }
+
+    std::string metric(const suil::String& name)
+    {
+        // shard-1 becomes pg_shard_shard_1_routed_total
+        std::string out{"pg_shard_"};
+        for (size_t i = 0; i < name.size(); i++) {
+            out += isalnum(name.data()[i])? name.data()[i] : '_';
+        }
+        return out + "_routed_total";
+    }
+
+    typedef decltype(iod::D(
+            prop(Id,    int),
+            prop(Email, suil::String),
+            prop(Data,  suil::String)
+    )) MoveRow;
+
+    typedef decltype(iod::D(
+            prop(Email, suil::String)
+    )) MovedRow;
+}
+
+namespace suil::nozama {
+
+    Shards::Shard::Shard(const String& n, const String& c, bool r)
+        : name{n.dup()},
+          connStr{c.dup()},
+          retired{r},
+          metric{::metric(n)},
+          routed{Counters::get().counter(metric.c_str(), "Requests routed to the shard")}
+    {}
+
+    Shards& Shards::get()
+    {
+        static Shards sShards;
+        return sShards;
+    }
+
+    void Shards::add(const String& name, sql::mw::Postgres& pool, const String& connStr)
+    {
+        mShards.push_back(std::make_unique<Shard>(name, connStr, false));
+        mShards.back()->pool = &pool;
+    }
+
+    void Shards::add(const String& name, const String& connStr, int64_t timeout, int64_t keepAlive, bool retired)
+    {
+        for (auto& shard: mShards) {
+            if (shard->name == name) {
+                throw Exception::create("postgres shard '", name, "' configured twice");
+            }
+        }
+        mShards.push_back(std::make_unique<Shard>(name, connStr, retired));
+        auto shard = mShards.back().get();
+        shard->owned = std::make_unique<sql::mw::Postgres>();
+        shard->owned->setup(connStr(),
+                            opt(ASYNC, true),
+                            opt(TIMEOUT, timeout),
+                            opt(EXPIRES, keepAlive));
+        shard->pool = shard->owned.get();
+        idebug("added postgres shard %s%s", name(), (retired? " (retired)" : ""));
+    }
+
+    void Shards::setup(Config config)
+    {
+        mConfig = std::move(config);
+        if (mShards.empty()) {
+            throw Exception::create("at least one postgres shard is required");
+        }
+
+        mSettings = 0;
+        if (!mConfig.settings.empty()) {
+            auto it = std::find_if(mShards.begin(), mShards.end(), [&](auto& shard) {
+                return shard->name == mConfig.settings;
+            });
+            if (it == mShards.end() || (*it)->retired) {
+                throw Exception::create("settings shard '", mConfig.settings, "' is not an active postgres shard");
+            }
+            mSettings = (size_t) (it - mShards.begin());
+        }
+
+        mRing.clear();
+        auto vnodes = std::max(mConfig.vnodes, size_t{1});
+        for (size_t i = 0; i < mShards.size(); i++) {
+            auto& shard = *mShards[i];
+            if (shard.retired) {
+                continue;
+            }
+            for (size_t v = 0; v < vnodes; v++) {
+                std::string key{shard.name.data(), shard.name.size()};
+                key += "#" + std::to_string(v);
+                mRing.emplace_back(hash(key), i);
+            }
+        }
+        if (mRing.empty()) {
+            throw Exception::create("every postgres shard is retired");
+        }
+        std::sort(mRing.begin(), mRing.end());
+        idebug("postgres sharding {shards: %zu, vnodes: %zu, settings: %s}",
+               mShards.size(), vnodes, mShards[mSettings]->name());
+    }
+
+    size_t Shards::locate(const String& email) const
+    {
+        if (mRing.size() == 0 || mShards.size() == 1) {
+            return 0;
+        }
+        auto h = hash(UserCache::normalize(email.data(), email.size()));
+        // first point at or after the hash, wrapping around the ring
+        auto it = std::lower_bound(mRing.begin(), mRing.end(), std::make_pair(h, size_t{0}));
+        if (it == mRing.end()) {
+            it = mRing.begin();
+        }
+        return it->second;
+    }
+
+    sql::mw::Postgres& Shards::pool(const String& email)
+    {
+        auto& shard = *mShards[locate(email)];
+        shard.routed.inc();
+        return *shard.pool;
+    }
+
+    sql::mw::Postgres& Shards::settings()
+    {
+        return *mShards[mSettings]->pool;
+    }
+
+    size_t Shards::reshard(size_t batch, bool dryRun)
+    {
+        batch = std::max(batch, size_t{1});
+        size_t moved{0};
+        for (size_t i = 0; i < mShards.size(); i++) {
+            moved += drain(i, batch, dryRun);
+        }
+        return moved;
+    }
+
+    size_t Shards::drain(size_t from, size_t batch, bool dryRun)
+    {
+        auto& source = *mShards[from];
+        idebug("resharding users of shard %s", source.name());
+        int64_t lastId{0};
+        size_t  moved{0}, kept{0};
+        std::vector<MoveRow> rows;
+        do {
+            rows.clear();
+            {
+                scoped(conn, source.pool->conn());
+                Statements::get().settle(conn);
+                conn("SELECT Id, Email, row_to_json(u)::text AS Data FROM users u"
+                     " WHERE Id > $1 ORDER BY Id LIMIT $2")(lastId, (int64_t) batch) >> rows;
+            }
+
+            // the users of the page that belong elsewhere, by the shard they go to
+            std::map<size_t, std::vector<const MoveRow*>> targets;
+            for (auto& row: rows) {
+                lastId = std::max<int64_t>(lastId, row.Id);
+                auto to = locate(row.Email);
+                if (to != from) {
+                    targets[to].push_back(&row);
+                }
+            }
+
+            for (auto& [to, users]: targets) {
+                auto& target = *mShards[to];
+                if (dryRun) {
+                    moved += users.size();
+                    continue;
+                }
+
+                OBuffer data{512};
+                data << "[";
+                for (size_t i = 0; i < users.size(); i++) {
+                    data << (i? "," : "") << users[i]->Data;
+                }
+                data << "]";
+
+                // users copied by an interrupted run are already there, identical
+                std::vector<MovedRow> copied;
+                {
+                    OBuffer sql{512};
+                    sql << "WITH s AS (SELECT * FROM json_populate_recordset(NULL::users, $1::json)),"
+                        << " i AS (INSERT INTO users (" << COLUMNS << ") SELECT " << COLUMNS
+                        << " FROM s ON CONFLICT DO NOTHING RETURNING lower(Email) AS Email)"
+                        << " SELECT Email FROM i UNION SELECT lower(u.Email) AS Email FROM users u"
+                        << " JOIN s ON lower(u.Email) = lower(s.Email) WHERE (to_jsonb(u) - 'id') = (to_jsonb(s) - 'id')";
+                    String query(sql);
+                    scoped(conn, target.pool->conn());
+                    Statements::get().settle(conn);
+                    conn(query())(String(data)) >> copied;
+                }
+
+                std::set<std::string> done;
+                for (auto& row: copied) {
+                    done.insert(UserCache::normalize(row.Email.data(), row.Email.size()));
+                }
+                OBuffer ids{64};
+                ids << "{";
+                bool first{true};
+                for (auto user: users) {
+                    if (done.count(UserCache::normalize(user->Email.data(), user->Email.size())) == 0) {
+                        // another user with the same email lives on the target
+                        iwarn("user '%s' of shard %s conflicts with a user of shard %s, not moved",
+                              user->Email(), source.name(), target.name());
+                        kept++;
+                        continue;
+                    }
+                    ids << (first? "" : ",") << user->Id;
+                    first = false;
+                    moved++;
+                }
+                ids << "}";
+                if (!first) {
+                    scoped(conn, source.pool->conn());
+                    Statements::get().settle(conn);
+                    conn("DELETE FROM users WHERE Id = ANY($1::bigint[])")(String(ids));
+                }
+            }
+        } while (rows.size() == batch);
+
+        idebug("shard %s resharded {moved: %zu, conflicts: %zu}", source.name(), moved, kept);
+        return moved;
+    }
+}
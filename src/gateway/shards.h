@@ -0,0 +1,131 @@
+//
+// Created by Carter Mbotho on 2020-04-30.
+//
+
+#ifndef SUIL_SHARDS_H
+#define SUIL_SHARDS_H
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "common.h"
+#include "counters.h"
+
+namespace suil::nozama {
+
+    /**
+     * Spreads the users table over several Postgres databases (shards). A user lives
+     * on the shard its normalized email hashes to on a consistent hash ring, every
+     * shard owns a number of points on the ring so that adding or retiring a shard
+     * only moves the users between it and its neighbours.
+     *
+     * Every shard has the full schema (users, mail_outbox and settings, migrated
+     * independently), the application settings (e.g `initialized`) are only read
+     * from and written to the designated settings shard. The first shard is the
+     * database configured under `postgres.connect` and uses the pool of the
+     * Postgres middleware.
+     *
+     * Retired shards are on no point of the ring, they are only drained (mail and
+     * users, see reshard). When the shards change, the gateway must be stopped and
+     * `gateway reshard` run before it is started again.
+     *
+     * @code
+     *   auto& pq = Shards::get().pool(email);
+     *   scoped(conn, pq.conn());
+     * @endcode
+     */
+    struct Shards final : LOGGER(NZM_GATEWAY) {
+
+        struct Config {
+            /// points of each shard on the ring
+            size_t  vnodes{128};
+            /// name of the shard holding the application settings, the first shard if empty
+            String  settings{};
+        };
+
+        struct Shard {
+            Shard(const String& name, const String& connStr, bool retired);
+
+            String   name;
+            String   connStr;
+            bool     retired{false};
+            sql::mw::Postgres *pool{nullptr};
+            /// the pool, unless the shard uses the Postgres middleware's
+            std::unique_ptr<sql::mw::Postgres> owned{};
+
+            std::string metric;
+            Counter&    routed;
+        };
+
+        static Shards& get();
+
+        /**
+         * Adds a shard using an existing pool, the first shard added must be the
+         * primary database
+         * @param name the stable name of the shard, its points on the ring derive from it
+         * @param pool the pool of the shard's database
+         * @param connStr the connection string of the shard's database
+         */
+        void add(const String& name, sql::mw::Postgres& pool, const String& connStr);
+
+        /**
+         * Adds a shard with a pool of its own
+         * @param name the stable name of the shard, its points on the ring derive from it
+         * @param connStr the connection string of the shard's database
+         * @param timeout timeout of the shard's connections in milliseconds
+         * @param keepAlive time idle connections are kept in milliseconds
+         * @param retired true if the shard is only to be drained
+         */
+        void add(const String& name, const String& connStr, int64_t timeout, int64_t keepAlive, bool retired = false);
+
+        /**
+         * Builds the ring, must be invoked after the shards are added
+         */
+        void setup(Config config);
+
+        size_t size() const { return mShards.size(); }
+
+        Shard& operator[](size_t index) { return *mShards[index]; }
+
+        /**
+         * @return the index of the shard the given user lives on
+         */
+        size_t locate(const String& email) const;
+
+        /**
+         * @return the pool of the shard the given user lives on
+         */
+        sql::mw::Postgres& pool(const String& email);
+
+        /**
+         * @return the pool of the shard holding the application settings
+         */
+        sql::mw::Postgres& settings();
+
+        /**
+         * Moves every user that is not on the shard it hashes to, in batches. Rows
+         * are copied before they are deleted from their old shard, an interrupted run
+         * can be run again. A user that already exists with different data on its
+         * new shard is left where it is and reported.
+         *
+         * @param batch the number of users read from a shard at once
+         * @param dryRun only count the users that would be moved
+         * @return the number of users moved (or to move)
+         *
+         * @note must only be run while no gateway is serving requests
+         */
+        size_t reshard(size_t batch, bool dryRun);
+
+    private:
+        Shards() = default;
+        size_t drain(size_t from, size_t batch, bool dryRun);
+
+        Config mConfig{};
+        std::vector<std::unique_ptr<Shard>> mShards{};
+        /// points on the ring, sorted, mapped to the index of their shard
+        std::vector<std::pair<uint64_t, size_t>> mRing{};
+        size_t mSettings{0};
+    };
+}
+#endif //SUIL_SHARDS_H
@@ -0,0 +1,401 @@
+//
+// Created by Carter Mbotho on 2020-04-17.
+//
+
+#include <unistd.h>
+
+#include "smtp.h"
+#include "breaker.h"
+
+namespace {
+
+    constexpr size_t LINE_MAX_LEN{1024};
+
+    bool capability(const std::string& line, const char *name)
+    {
+        // EHLO reply lines are "250-NAME params" or "250 NAME params"
+        auto len = strlen(name);
+        return line.size() >= len + 4 && strncasecmp(line.data() + 4, name, len) == 0 &&
+               (line.size() == len + 4 || isspace(line[len + 4]));
+    }
+}
+
+namespace suil::nozama {
+
+    SmtpPool& SmtpPool::get()
+    {
+        static SmtpPool sPool;
+        return sPool;
+    }
+
+    SmtpPool::SmtpPool()
+        : mConnects{Counters::get().counter("smtp_connects_total", "SMTP sessions opened")},
+          mReconnects{Counters::get().counter("smtp_reconnects_total", "SMTP sessions re-opened after failing")},
+          mMessages{Counters::get().counter("smtp_messages_total", "Messages accepted by the SMTP server")},
+          mRejected{Counters::get().counter("smtp_rejected_total", "Messages rejected by the SMTP server")},
+          mPipelined{Counters::get().counter("smtp_pipelined_total", "Messages sent with pipelined commands")}
+    {
+        Counters::get().gauge("smtp_sessions_open", "SMTP sessions currently open", [this] {
+            int64_t open{0};
+            for (auto& s: mSessions) {
+                open += s->open;
+            }
+            return open;
+        });
+    }
+
+    void SmtpPool::setup(Config config)
+    {
+        mConfig = std::move(config);
+        mConfig.connections = std::max(mConfig.connections, size_t{1});
+        mConfig.maxPerSession = std::max(mConfig.maxPerSession, size_t{1});
+        char name[256] = {0};
+        if (gethostname(name, sizeof(name) - 1) != 0 || name[0] == '\0') {
+            strcpy(name, "localhost");
+        }
+        mHostname = String{name}.dup();
+        // sessions are re-created with the new configuration
+        for (auto& session: mSessions) {
+            close(*session);
+        }
+        mSessions.clear();
+        mOwner = 0;
+        idebug("SMTP pool configured {server: %s:%d, connections: %zu, pipelining: %d}",
+               mConfig.host(), mConfig.port, mConfig.connections, mConfig.pipelining);
+    }
+
+    void SmtpPool::verify()
+    {
+        Session session;
+        connect(session);
+        close(session);
+    }
+
+    void SmtpPool::send(std::vector<Message>& messages)
+    {
+        if (messages.empty()) {
+            return;
+        }
+        if (mOwner != getpid()) {
+            // sessions opened by a parent process are never used
+            mOwner = getpid();
+            mSessions.clear();
+            for (size_t i = 0; i < mConfig.connections; i++) {
+                mSessions.push_back(std::make_unique<Session>());
+            }
+        }
+
+        // spread messages evenly across sessions
+        auto used = std::min(mSessions.size(), messages.size());
+        std::vector<Batch> batches(used);
+        for (size_t i = 0; i < messages.size(); i++) {
+            batches[i % used].push_back(&messages[i]);
+        }
+
+        chan done = chmake(bool, used);
+        for (size_t i = 0; i < used; i++) {
+            go(worker(Ego, *mSessions[i], batches[i], done));
+        }
+        for (size_t i = 0; i < used; i++) {
+            chr(done, bool);
+        }
+        chclose(done);
+    }
+
+    coroutine void SmtpPool::worker(SmtpPool& Self, Session& session, Batch& batch, chan done)
+    {
+        Self.deliver(session, batch);
+        chs(done, bool, true);
+    }
+
+    void SmtpPool::deliver(Session& session, Batch& batch)
+    {
+        size_t next{0};
+        bool retried{false};
+        while (next < batch.size()) {
+            try {
+                if (!session.open) {
+                    connect(session);
+                }
+                transmit(session, batch, next);
+            }
+            catch (...) {
+                auto error = Exception::fromCurrent();
+                close(session, false);
+                if (retried) {
+                    // server unreachable, messages are retried later by the caller
+                    for (; next < batch.size(); next++) {
+                        batch[next]->Error = String{error.what()}.dup();
+                    }
+                    break;
+                }
+                idebug("SMTP session failed, reconnecting: %s", error.what());
+                retried = true;
+                mReconnects.inc();
+            }
+        }
+    }
+
+    void SmtpPool::transmit(Session& session, Batch& batch, size_t& next)
+    {
+        bool queued{false};
+        while (next < batch.size()) {
+            auto& msg = *batch[next];
+            OBuffer ob{4096};
+            if (session.sent >= mConfig.maxPerSession) {
+                // servers limit the number of messages per session
+                close(session);
+                connect(session);
+                queued = false;
+            }
+
+            std::string text;
+            int code{0};
+            if (session.pipelining) {
+                if (!queued) {
+                    envelope(ob, msg);
+                    write(session, ob);
+                }
+                queued = false;
+                int mail = reply(session, &text);
+                int rcpt = reply(session, mail == 250? &text : nullptr);
+                code = reply(session, (mail == 250 && (rcpt == 250 || rcpt == 251))? &text : nullptr);
+                if (code == 354 && (mail != 250 || (rcpt != 250 && rcpt != 251))) {
+                    // server accepted data without a valid envelope, end it empty
+                    command(session, ".");
+                    code = mail != 250? mail : rcpt;
+                }
+                mPipelined.inc();
+            }
+            else {
+                ob << "MAIL FROM:<" << mConfig.senderEmail << ">";
+                code = command(session, String(ob), &text);
+                if (code == 250) {
+                    OBuffer rcpt{64};
+                    rcpt << "RCPT TO:<" << *msg.To << ">";
+                    code = command(session, String(rcpt), &text);
+                }
+                if (code == 250 || code == 251) {
+                    code = command(session, "DATA", &text);
+                }
+            }
+
+            if (code != 354) {
+                // message rejected, abort the transaction and carry on with the next message
+                msg.Error = String{text}.dup();
+                msg.Permanent = code >= 500;
+                mRejected.inc();
+                command(session, "RSET");
+                next++;
+                continue;
+            }
+
+            OBuffer data{msg.Body->size() + 1024};
+            content(data, msg);
+            data << ".\r\n";
+            if (session.pipelining && next + 1 < batch.size() && session.sent + 1 < mConfig.maxPerSession) {
+                // the next envelope goes out with the end of data
+                envelope(data, *batch[next + 1]);
+                queued = true;
+            }
+            write(session, data);
+            code = reply(session, &text);
+            if (code == 250) {
+                msg.Sent = true;
+                mMessages.inc();
+            }
+            else {
+                msg.Error = String{text}.dup();
+                msg.Permanent = code >= 500;
+                mRejected.inc();
+            }
+            session.sent++;
+            next++;
+        }
+    }
+
+    void SmtpPool::connect(Session& session)
+    {
+        Breaker::Call call(Breakers::get().Smtp);
+        if (!call) {
+            // the mail queue retries later, without waiting for the connect to time out
+            throw Exception::create("SMTP server unavailable, circuit breaker open");
+        }
+        errno = 0;
+        auto addr = ipremote(mConfig.host(), mConfig.port, 0, utils::after(mConfig.timeout));
+        if (errno != 0) {
+            throw Exception::create("resolving SMTP server '", mConfig.host, "' failed: ", errno_s);
+        }
+        if (!session.sock.connect(addr, mConfig.timeout)) {
+            throw Exception::create("connecting to SMTP server '", mConfig.host, "' failed: ", errno_s);
+        }
+        session.open = true;
+        session.sent = 0;
+
+        std::string text;
+        if (reply(session, &text) != 220) {
+            throw Exception::create("SMTP server not ready: ", text);
+        }
+
+        OBuffer ob{64};
+        ob << "EHLO " << mHostname << "\r\n";
+        write(session, ob);
+        // multi-line reply, one capability per line
+        bool authPlain{false};
+        session.pipelining = false;
+        std::string line;
+        do {
+            size_t len{LINE_MAX_LEN};
+            char buf[LINE_MAX_LEN];
+            if (!session.sock.receiveUntil(buf, len, "\n", 1, mConfig.timeout)) {
+                throw Exception::create("reading EHLO reply failed: ", errno_s);
+            }
+            line.assign(buf, len);
+            while (!line.empty() && isspace(line.back())) line.pop_back();
+            if (line.size() < 3 || line[0] != '2') {
+                throw Exception::create("SMTP server rejected EHLO: ", line);
+            }
+            session.pipelining |= mConfig.pipelining && capability(line, "PIPELINING");
+            if (capability(line, "AUTH")) {
+                authPlain = strstr(line.c_str(), "PLAIN") != nullptr;
+            }
+        } while (line.size() > 3 && line[3] == '-');
+
+        if (mConfig.username) {
+            int code{0};
+            if (authPlain) {
+                // authorization identity, user name and password separated by NUL
+                std::string creds;
+                creds.append(1, '\0').append(mConfig.username.data(), mConfig.username.size());
+                creds.append(1, '\0').append(mConfig.passwd.data(), mConfig.passwd.size());
+                OBuffer auth{64};
+                auth << "AUTH PLAIN " << utils::base64::encode((const uint8_t *) creds.data(), creds.size());
+                code = command(session, String(auth), &text);
+            }
+            else {
+                code = command(session, "AUTH LOGIN", &text);
+                if (code == 334) {
+                    code = command(session, utils::base64::encode(
+                            (const uint8_t *) mConfig.username.data(), mConfig.username.size()), &text);
+                }
+                if (code == 334) {
+                    code = command(session, utils::base64::encode(
+                            (const uint8_t *) mConfig.passwd.data(), mConfig.passwd.size()), &text);
+                }
+            }
+            if (code != 235) {
+                throw Exception::create("SMTP login failed: ", text);
+            }
+        }
+        call.ok();
+        mConnects.inc();
+        itrace("SMTP session opened {server: %s, pipelining: %d}", mConfig.host(), session.pipelining);
+    }
+
+    void SmtpPool::close(Session& session, bool quit)
+    {
+        if (!session.open) {
+            return;
+        }
+        if (quit) {
+            try {
+                command(session, "QUIT");
+            }
+            catch (...) {
+                // closing anyway
+            }
+        }
+        session.sock.close();
+        session.open = false;
+    }
+
+    int SmtpPool::reply(Session& session, std::string *text)
+    {
+        // replies can span several lines, the last line has a space after the code
+        char buf[LINE_MAX_LEN];
+        std::string line;
+        do {
+            size_t len{sizeof(buf)};
+            if (!session.sock.receiveUntil(buf, len, "\n", 1, mConfig.timeout)) {
+                throw Exception::create("reading SMTP reply failed: ", errno_s);
+            }
+            line.assign(buf, len);
+        } while (line.size() > 3 && line[3] == '-');
+
+        while (!line.empty() && isspace(line.back())) line.pop_back();
+        if (line.size() < 3 || !isdigit(line[0])) {
+            throw Exception::create("invalid SMTP reply: ", line);
+        }
+        if (text != nullptr) {
+            *text = line;
+        }
+        return (int) strtol(line.substr(0, 3).c_str(), nullptr, 10);
+    }
+
+    int SmtpPool::command(Session& session, const String& cmd, std::string *text)
+    {
+        OBuffer ob{cmd.size() + 2};
+        ob << cmd << "\r\n";
+        write(session, ob);
+        return reply(session, text);
+    }
+
+    void SmtpPool::write(Session& session, OBuffer& ob)
+    {
+        if (session.sock.send(ob.data(), ob.size(), mConfig.timeout) != ob.size() ||
+            !session.sock.flush(mConfig.timeout))
+        {
+            throw Exception::create("sending to SMTP server failed: ", errno_s);
+        }
+    }
+
+    void SmtpPool::envelope(OBuffer& ob, const Message& msg)
+    {
+        ob << "MAIL FROM:<" << mConfig.senderEmail << ">\r\n"
+           << "RCPT TO:<" << *msg.To << ">\r\n"
+           << "DATA\r\n";
+    }
+
+    void SmtpPool::content(OBuffer& ob, const Message& msg)
+    {
+        char date[64];
+        auto t = time(nullptr);
+        struct tm tm{};
+        strftime(date, sizeof(date), "%a, %d %b %Y %H:%M:%S +0000", gmtime_r(&t, &tm));
+
+        ob << "From: ";
+        if (mConfig.senderName) {
+            ob << "\"" << mConfig.senderName << "\" ";
+        }
+        ob << "<" << mConfig.senderEmail << ">\r\n"
+           << "To: <" << *msg.To << ">\r\n"
+           << "Subject: " << *msg.Subject << "\r\n"
+           << "Date: " << date << "\r\n"
+           << "Message-ID: <" << utils::uuidstr() << "@" << mHostname << ">\r\n"
+           << "MIME-Version: 1.0\r\n"
+           << "Content-Type: " << *msg.ContentType << "; charset=utf-8\r\n"
+           << "\r\n";
+
+        // lines end with CRLF and lines starting with a dot are escaped (RFC 5321 4.5.2)
+        auto body = msg.Body->data();
+        auto len  = msg.Body->size();
+        bool bol{true};
+        for (size_t i = 0; i < len; i++) {
+            char c = body[i];
+            if (bol && c == '.') {
+                ob << '.';
+            }
+            if (c == '\n') {
+                if (i == 0 || body[i-1] != '\r') ob << '\r';
+                ob << '\n';
+                bol = true;
+                continue;
+            }
+            ob << c;
+            bol = false;
+        }
+        if (!bol) {
+            ob << "\r\n";
+        }
+    }
+}
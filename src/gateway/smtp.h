@@ -0,0 +1,117 @@
+//
+// Created by Carter Mbotho on 2020-04-17.
+//
+
+#ifndef SUIL_SMTP_H
+#define SUIL_SMTP_H
+
+#include <suil/sock.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "common.h"
+#include "counters.h"
+
+namespace suil::nozama {
+
+#ifndef SWEPT
+    using SmtpSock = SslSock;
+#else
+    using SmtpSock = TcpSock;
+#endif
+
+    /**
+     * A pool of authenticated SMTP sessions. A batch of messages is spread across the
+     * sessions which deliver their share concurrently, several messages per session.
+     * When the server advertises PIPELINING (RFC 2920) the envelope of a message
+     * (MAIL, RCPT and DATA) is sent in a single write, together with the end of data
+     * of the previous message, so delivering a message costs about two round trips.
+     *
+     * A session that fails is reconnected and the messages it had not confirmed are
+     * sent again on the new session, a message is only reported failed when the
+     * server rejects it or the session cannot be re-established.
+     *
+     * @note sessions are opened lazily in the process that sends
+     */
+    struct SmtpPool final : LOGGER(NZM_GATEWAY) {
+
+        struct Config {
+            String  host;
+            int     port{25};
+            String  username;
+            String  passwd;
+            String  senderEmail;
+            String  senderName;
+            /// number of sessions in the pool
+            size_t  connections{4};
+            /// time in milliseconds to wait for each server reply
+            int64_t timeout{5000};
+            /// use PIPELINING if the server advertises it
+            bool    pipelining{true};
+            /// messages sent on a session before it is recycled
+            size_t  maxPerSession{100};
+        };
+
+        struct Message {
+            const String *To;
+            const String *Subject;
+            const String *ContentType;
+            const String *Body;
+            bool          Sent{false};
+            /// the server rejected the message for good, retrying is pointless
+            bool          Permanent{false};
+            String        Error{};
+        };
+
+        static SmtpPool& get();
+
+        void setup(Config config);
+
+        /**
+         * Opens a session and logs in to the server to check the configuration
+         * @throws Exception if the server cannot be reached or rejects the login
+         */
+        void verify();
+
+        /**
+         * Delivers the given messages, on return each message is either sent or
+         * has an error describing why it was not
+         */
+        void send(std::vector<Message>& messages);
+
+    private:
+        struct Session {
+            SmtpSock sock{};
+            bool     open{false};
+            bool     pipelining{false};
+            size_t   sent{0};
+        };
+        using Batch = std::vector<Message*>;
+
+        SmtpPool();
+        static coroutine void worker(SmtpPool& Self, Session& session, Batch& batch, chan done);
+        void deliver(Session& session, Batch& batch);
+        void transmit(Session& session, Batch& batch, size_t& next);
+        void connect(Session& session);
+        void close(Session& session, bool quit = true);
+        int  reply(Session& session, std::string *text = nullptr);
+        int  command(Session& session, const String& cmd, std::string *text = nullptr);
+        void write(Session& session, OBuffer& ob);
+        void envelope(OBuffer& ob, const Message& msg);
+        void content(OBuffer& ob, const Message& msg);
+
+        Config   mConfig{};
+        String   mHostname{};
+        pid_t    mOwner{0};
+        std::vector<std::unique_ptr<Session>> mSessions{};
+
+        Counter& mConnects;
+        Counter& mReconnects;
+        Counter& mMessages;
+        Counter& mRejected;
+        Counter& mPipelined;
+    };
+}
+#endif //SUIL_SMTP_H
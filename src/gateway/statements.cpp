@@ -0,0 +1,394 @@
+//
+// Created by Carter Mbotho on 2020-04-15.
+//
+
+#include <cstring>
+#include <libpq-fe.h>
+
+#include "statements.h"
+
+namespace {
+
+    struct Declaration {
+        const char *name;
+        const char *sql;
+        /// the columns substituted for {columns} in the sql
+        const std::string& (*columns)();
+    };
+
+    /// must be in the same order as suil::nozama::Stmt
+    const Declaration DECLARATIONS[] = {
+        {"users_by_email",   "SELECT * FROM users WHERE email = $1"},
+        {"users_login",      "SELECT {columns} FROM users WHERE email = $1",
+                             &suil::nozama::Statements::columns<suil::nozama::LoginUser>},
+        // conflicts on the email or its lower case index, the welcome mail is queued only for added users
+        {"users_insert",     "WITH u AS (INSERT INTO users (Email, FirstName, LastName, Passwd, Roles, Salt, State,"
+                             " PasswdExpires, PrevPasswds, IconPath, Notes)"
+                             " VALUES ($1, $2, $3, $4, '{}', $5, $6, $7, '{}', '', $8)"
+                             " ON CONFLICT DO NOTHING RETURNING Id, Email),"
+                             " m AS (INSERT INTO mail_outbox (Recipient, Subject, ContentType, Body)"
+                             " SELECT Email, $10, $11, $12 FROM u)"
+                             " SELECT Id, pg_notify($9, Email), pg_notify($13, '') FROM u"},
+        // the state is a literal so the partial token index matches generic plans
+        {"users_verify",     "UPDATE users SET State = $1, Notes = '' WHERE email = $2 and notes = $3"
+                             " and State = 1 RETURNING Id, pg_notify($4, Email)"},
+        {"users_block",      "UPDATE users SET State = $1, Notes = $2 WHERE email = $3"
+                             " RETURNING Id, pg_notify($4, Email)"},
+        {"users_set_passwd", "UPDATE users SET Passwd = $1, Salt = $2 WHERE email = $3"
+                             " RETURNING Id, pg_notify($4, Email)"},
+        {"mail_claim",       "UPDATE mail_outbox SET NextAttempt = now() + $1 * interval '1 millisecond'"
+                             " WHERE Id IN (SELECT Id FROM mail_outbox WHERE NOT Dead AND NextAttempt <= now()"
+                             " ORDER BY NextAttempt LIMIT $2 FOR UPDATE SKIP LOCKED)"
+                             " RETURNING Id, Recipient, Subject, ContentType, Body, Attempts,"
+                             " (extract(epoch from now() - Created) * 1000)::bigint"},
+        {"mail_sent",        "DELETE FROM mail_outbox WHERE Id = ANY($1::bigint[])"},
+        {"mail_failed",      "UPDATE mail_outbox SET Attempts = Attempts + 1, LastError = $2, Dead = Attempts + 1 >= $3,"
+                             " NextAttempt = now() + $4 * interval '1 millisecond' WHERE Id = $1 RETURNING Dead"},
+        {"mail_depth",       "SELECT COUNT(*) FILTER (WHERE NOT Dead), COUNT(*) FILTER (WHERE Dead) FROM mail_outbox"}
+    };
+    static_assert(sizeof(DECLARATIONS)/sizeof(Declaration) == (size_t) suil::nozama::Stmt::Count,
+                  "every statement must be declared");
+
+    const std::string& text(size_t id)
+    {
+        // built on first use, once the columns of the projections are initialized
+        static std::string sText[(size_t) suil::nozama::Stmt::Count];
+        auto& decl = DECLARATIONS[id];
+        auto& out  = sText[id];
+        if (out.empty()) {
+            out = decl.sql;
+            auto pos = out.find("{columns}");
+            if (decl.columns != nullptr && pos != std::string::npos) {
+                out.replace(pos, strlen("{columns}"), decl.columns());
+            }
+        }
+        return out;
+    }
+
+    const char *column(PGresult *res, const char *name) {
+        int col = PQfnumber(res, name);
+        if (col < 0 || PQgetisnull(res, 0, col)) {
+            return nullptr;
+        }
+        return PQgetvalue(res, 0, col);
+    }
+}
+
+namespace suil::nozama {
+
+    const Column<LoginUser> LoginUser::Columns[] = {
+        {"Email",         &LoginUser::Email},
+        {"Passwd",        &LoginUser::Passwd},
+        {"Salt",          &LoginUser::Salt},
+        {"State",         &LoginUser::State},
+        {"PasswdExpires", &LoginUser::PasswdExpires},
+        {"Roles",         &LoginUser::Roles},
+        {"Notes",         &LoginUser::Notes},
+        {nullptr}
+    };
+
+    void Statements::Result::array(std::vector<String>& out, const char *value)
+    {
+        out.clear();
+        if (value == nullptr || *value++ != '{') {
+            return;
+        }
+        std::string elem;
+        bool quoted{false};
+        while (*value && (quoted || *value != '}')) {
+            char c = *value++;
+            if (quoted && c == '\\' && *value) {
+                elem += *value++;
+            }
+            else if (c == '"') {
+                quoted = !quoted;
+            }
+            else if (!quoted && c == ',') {
+                out.emplace_back(suil::String{elem.data(), elem.size(), false}.dup());
+                elem.clear();
+            }
+            else {
+                elem += c;
+            }
+        }
+        if (!elem.empty() || !out.empty()) {
+            out.emplace_back(suil::String{elem.data(), elem.size(), false}.dup());
+        }
+    }
+
+    Statements::Result::Result(PGresult *res)
+        : mRes{res, PQclear}
+    {}
+
+    bool Statements::Result::status() const
+    {
+        auto st = PQresultStatus(mRes.get());
+        return st == PGRES_COMMAND_OK || st == PGRES_TUPLES_OK;
+    }
+
+    int Statements::Result::rows() const
+    {
+        return status()? PQntuples(mRes.get()) : 0;
+    }
+
+    size_t Statements::Result::bytes() const
+    {
+        size_t total{0};
+        auto res = mRes.get();
+        for (int row = 0; row < rows(); row++) {
+            for (int col = 0; col < PQnfields(res); col++) {
+                total += PQgetlength(res, row, col);
+            }
+        }
+        return total;
+    }
+
+    const char* Statements::Result::value(int row, int col) const
+    {
+        if (row >= rows() || col >= PQnfields(mRes.get()) || PQgetisnull(mRes.get(), row, col)) {
+            return nullptr;
+        }
+        return PQgetvalue(mRes.get(), row, col);
+    }
+
+    bool Statements::Result::operator>>(int& out) const
+    {
+        if (!status() || PQntuples(mRes.get()) == 0 || PQnfields(mRes.get()) == 0) {
+            return false;
+        }
+        out = (int) strtol(PQgetvalue(mRes.get(), 0, 0), nullptr, 10);
+        return true;
+    }
+
+    bool Statements::Result::operator>>(User& user) const
+    {
+        auto res = mRes.get();
+        if (!status() || PQntuples(res) == 0) {
+            return false;
+        }
+
+        // postgres folds unquoted column names to lower case
+        const char *value{nullptr};
+        if ((value = column(res, "id")))            user.Id = (int) strtol(value, nullptr, 10);
+        if ((value = column(res, "email")))         user.Email = String{value}.dup();
+        if ((value = column(res, "firstname")))     user.FirstName = String{value}.dup();
+        if ((value = column(res, "lastname")))      user.LastName = String{value}.dup();
+        if ((value = column(res, "passwd")))        user.Passwd = String{value}.dup();
+        if ((value = column(res, "roles")))         array(user.Roles, value);
+        if ((value = column(res, "salt")))          user.Salt = String{value}.dup();
+        if ((value = column(res, "state")))         user.State = (int) strtol(value, nullptr, 10);
+        if ((value = column(res, "passwdexpires"))) user.PasswdExpires = strtoll(value, nullptr, 10);
+        if ((value = column(res, "prevpasswds")))   array(user.PrevPasswds, value);
+        if ((value = column(res, "iconpath")))      user.IconPath = String{value}.dup();
+        if ((value = column(res, "notes")))         user.Notes = String{value}.dup();
+        return true;
+    }
+
+    Statements& Statements::get()
+    {
+        static Statements sStatements;
+        return sStatements;
+    }
+
+    Statements::Statements()
+        : mPrepares{Counters::get().counter("pg_prepares_total", "Postgres connections the statements were prepared on")},
+          mExecutions{Counters::get().counter("pg_prepared_executions_total", "Prepared statements executed")},
+          mAbandoned{Counters::get().counter("pg_abandoned_statements_total", "Statements abandoned because the request deadline passed")}
+    {}
+
+    void Statements::setup(int64_t timeout)
+    {
+        mTimeout = timeout;
+        mPrepared.clear();
+    }
+
+    const char* Statements::sql(Stmt id)
+    {
+        return text((size_t) id).c_str();
+    }
+
+    void Statements::prepare(sql::PgSqlConnection& conn)
+    {
+        auto pg = native(conn);
+        settle(pg);
+        auto it = mPrepared.find(pg);
+        if (it != mPrepared.end() && it->second.pid == PQbackendPID(pg)) {
+            return;
+        }
+
+        for (size_t i = 0; i < (size_t) Stmt::Count; i++) {
+            auto& decl = DECLARATIONS[i];
+            if (!PQsendPrepare(pg, decl.name, text(i).c_str(), 0, nullptr)) {
+                throw Exception::create("preparing statement '", decl.name, "' failed: ", PQerrorMessage(pg));
+            }
+            Result res(wait(pg, mTimeout < 0? -1 : utils::after(mTimeout)));
+            if (!res.status()) {
+                throw Exception::create("preparing statement '", decl.name, "' failed: ", PQerrorMessage(pg));
+            }
+        }
+        // trips survive a reconnect, they are only ever compared
+        mPrepared[pg].pid = PQbackendPID(pg);
+        mPrepares.inc();
+        idebug("prepared %zu statements on postgres backend %d", (size_t) Stmt::Count, PQbackendPID(pg));
+    }
+
+    Statements::Result Statements::exec(sql::PgSqlConnection& conn, Stmt id, const std::string *values, size_t n, int64_t deadline)
+    {
+        prepare(conn);
+        auto pg = native(conn);
+        std::vector<const char *> params(n);
+        for (size_t i = 0; i < n; i++) {
+            params[i] = values[i].c_str();
+        }
+
+        auto& decl = DECLARATIONS[(size_t) id];
+        if (!PQsendQueryPrepared(pg, decl.name, (int) n, params.data(), nullptr, nullptr, 0)) {
+            throw Exception::create("executing statement '", decl.name, "' failed: ", PQerrorMessage(pg));
+        }
+        auto& backend = mPrepared[pg];
+        backend.trips++;
+        if (deadline < 0 && mTimeout >= 0) {
+            deadline = utils::after(mTimeout);
+        }
+        PGresult *out{nullptr};
+        try {
+            out = wait(pg, deadline);
+        }
+        catch (...) {
+            // the result is still owed, whoever uses the connection next drains it
+            backend.pending = true;
+            mAbandoned.inc();
+            throw;
+        }
+        Result res(out);
+        if (!res.status()) {
+            throw Exception::create("executing statement '", decl.name, "' failed: ", PQerrorMessage(pg));
+        }
+        mExecutions.inc();
+        return res;
+    }
+
+    uint64_t Statements::trips(sql::PgSqlConnection& conn)
+    {
+        auto it = mPrepared.find(native(conn));
+        return it == mPrepared.end()? 0 : it->second.trips;
+    }
+
+    void Statements::settle(PGconn *pg)
+    {
+        auto it = mPrepared.find(pg);
+        if (it == mPrepared.end() || !it->second.pending) {
+            return;
+        }
+        try {
+            auto res = wait(pg, mTimeout < 0? -1 : utils::after(mTimeout));
+            if (res != nullptr) PQclear(res);
+            it->second.pending = false;
+            return;
+        }
+        catch (...) {
+            // the backend is stuck on the abandoned statement, start over on a new one
+            iwarn("draining abandoned statement failed, resetting connection: %s", Exception::fromCurrent().what());
+        }
+        // still pending if the reset fails, whoever uses the connection next tries again
+        reset(pg);
+        it->second.pending = false;
+    }
+
+    void Statements::reset(PGconn *pg)
+    {
+        // libpq closes the socket, its number can be reused by the new one
+        auto sock = PQsocket(pg);
+        if (sock >= 0) fdclean(sock);
+        if (!PQresetStart(pg)) {
+            throw Exception::create("resetting postgres connection failed: ", PQerrorMessage(pg));
+        }
+
+        auto deadline = mTimeout < 0? -1 : utils::after(mTimeout);
+        auto status = PGRES_POLLING_WRITING;
+        while (status != PGRES_POLLING_OK) {
+            sock = PQsocket(pg);
+            if (status == PGRES_POLLING_FAILED || sock < 0) {
+                throw Exception::create("resetting postgres connection failed: ", PQerrorMessage(pg));
+            }
+            if (fdwait(sock, status == PGRES_POLLING_READING? FDW_IN : FDW_OUT, deadline) == 0) {
+                fdclean(sock);
+                throw Exception::create("resetting postgres connection timed out");
+            }
+            status = PQresetPoll(pg);
+            if (PQsocket(pg) != sock) {
+                // libpq moved on to another socket (e.g next host)
+                fdclean(sock);
+            }
+        }
+        // the new backend has no prepared statements, prepare notices the new pid
+        idebug("postgres connection reset on backend %d", PQbackendPID(pg));
+    }
+
+    PGresult* Statements::wait(PGconn *pg, int64_t deadline)
+    {
+        auto sock = PQsocket(pg);
+        int rc{0};
+        while ((rc = PQflush(pg)) == 1) {
+            if (fdwait(sock, FDW_OUT, deadline) == 0) {
+                throw Exception::create("sending statement timed out");
+            }
+        }
+        if (rc < 0) {
+            throw Exception::create("sending statement failed: ", PQerrorMessage(pg));
+        }
+
+        while (PQisBusy(pg)) {
+            if (fdwait(sock, FDW_IN, deadline) == 0) {
+                throw Exception::create("waiting for statement result timed out");
+            }
+            if (!PQconsumeInput(pg)) {
+                throw Exception::create("reading statement result failed: ", PQerrorMessage(pg));
+            }
+        }
+
+        // one statement per query, drain until the terminating null result
+        PGresult *res{nullptr}, *next{nullptr};
+        while ((next = PQgetResult(pg)) != nullptr) {
+            if (res != nullptr) PQclear(res);
+            res = next;
+            while (PQisBusy(pg)) {
+                if (fdwait(sock, FDW_IN, deadline) == 0) {
+                    PQclear(res);
+                    throw Exception::create("waiting for statement result timed out");
+                }
+                if (!PQconsumeInput(pg)) {
+                    // a broken connection stays busy, it would be waited on forever
+                    PQclear(res);
+                    throw Exception::create("reading statement result failed: ", PQerrorMessage(pg));
+                }
+            }
+        }
+        return res;
+    }
+
+    RoundTrips::Route::Route(const char *name)
+        : RequestsName{std::string("pg_requests_") + name + "_total"},
+          TripsName{std::string("pg_round_trips_") + name + "_total"},
+          ExtraName{std::string("pg_extra_trip_requests_") + name + "_total"},
+          Requests{Counters::get().counter(RequestsName.c_str(), "Requests that used postgres")},
+          Trips{Counters::get().counter(TripsName.c_str(), "Postgres round trips made by requests")},
+          Extra{Counters::get().counter(ExtraName.c_str(), "Requests that needed more than one postgres round trip")}
+    {}
+
+    RoundTrips::RoundTrips(Route& route, sql::PgSqlConnection& conn)
+        : mRoute{route},
+          mConn{conn},
+          mStart{Statements::get().trips(conn)}
+    {}
+
+    RoundTrips::~RoundTrips()
+    {
+        auto trips = Statements::get().trips(mConn) - mStart;
+        mRoute.Requests.inc();
+        mRoute.Trips.inc(trips);
+        if (trips > 1) {
+            mRoute.Extra.inc();
+        }
+    }
+}
@@ -0,0 +1,305 @@
+//
+// Created by Carter Mbotho on 2020-04-15.
+//
+
+#ifndef SUIL_STATEMENTS_H
+#define SUIL_STATEMENTS_H
+
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "common.h"
+#include "counters.h"
+
+typedef struct pg_conn PGconn;
+typedef struct pg_result PGresult;
+
+namespace suil::nozama {
+
+    /**
+     * Identifiers of the statements declared in the registry
+     */
+    enum class Stmt : uint8_t {
+        UserByEmail,        /// the full record of a user
+        UserLogin,          /// the columns of a user needed to login (see LoginUser)
+        UserInsert,         /// adds a user unless the email is taken, queues its welcome mail, broadcasts the email
+        UserVerify,         /// activates a user given the verification token, broadcasts the email
+        UserBlock,          /// blocks a user, broadcasts the email
+        UserSetPasswd,      /// changes the password hash and salt of a user, broadcasts the email
+        MailClaim,          /// leases a batch of mail due for delivery
+        MailSent,           /// removes delivered mail from the queue
+        MailFailed,         /// records a failed delivery and schedules a retry
+        MailDepth,          /// number of queued and dead mails
+        Count
+    };
+
+    /**
+     * A column of a projection, binds a column to the member of the projection
+     * it is decoded into. A projection is a struct that declares the columns it
+     * reads, in the order they are selected:
+     *
+     * @code
+     *   struct Names {
+     *       static const Column<Names> Columns[];
+     *       String FirstName;
+     *       String LastName;
+     *   };
+     *   const Column<Names> Names::Columns[] = {{"FirstName", &Names::FirstName},
+     *                                           {"LastName",  &Names::LastName}, {nullptr}};
+     * @endcode
+     *
+     * Only the declared columns are transferred and decoded, see Statements::columns
+     */
+    template <typename T>
+    struct Column {
+        enum Kind : uint8_t { Text, Int, Int64, Array };
+
+        Column(const char *n = nullptr) : name{n}, kind{Text}, text{nullptr} {}
+        Column(const char *n, String T::* m) : name{n}, kind{Text}, text{m} {}
+        Column(const char *n, int T::* m) : name{n}, kind{Int}, i32{m} {}
+        Column(const char *n, int64_t T::* m) : name{n}, kind{Int64}, i64{m} {}
+        Column(const char *n, std::vector<String> T::* m) : name{n}, kind{Array}, array{m} {}
+
+        const char *name;
+        Kind        kind;
+        union {
+            String T::*              text;
+            int T::*                 i32;
+            int64_t T::*             i64;
+            std::vector<String> T::* array;
+        };
+    };
+
+    /**
+     * The columns of a user needed to log them in, the names, icon and password
+     * history of the user are not read
+     */
+    struct LoginUser {
+        static const Column<LoginUser> Columns[];
+
+        String  Email;
+        String  Passwd;
+        String  Salt;
+        int     State{0};
+        int64_t PasswdExpires{0};
+        std::vector<String> Roles;
+        /// why the user was blocked
+        String  Notes;
+    };
+
+    /**
+     * A registry of named server side prepared statements. Statements are declared
+     * once in the registry and prepared on each pooled postgres connection the first
+     * time it is used, after which handlers execute them by handle, sparing postgres
+     * from parsing and planning them on every request.
+     *
+     * A statement can be bounded by the deadline of the request executing it. When
+     * the deadline passes the caller stops waiting, the result still owed by the
+     * connection is drained by the next statement executed on it.
+     *
+     * @note a connection whose backend changed (reconnected) is prepared again
+     */
+    struct Statements final : LOGGER(NZM_GATEWAY) {
+
+        /**
+         * The result of executing a prepared statement
+         */
+        struct Result {
+            Result(PGresult *res);
+
+            /**
+             * @return true if the statement was executed successfully
+             */
+            bool status() const;
+
+            /**
+             * @return the number of rows returned by the statement
+             */
+            int rows() const;
+
+            /**
+             * @return the text value of the given column and row, null for NULL values
+             */
+            const char *value(int row, int col) const;
+
+            /**
+             * Reads the first column of the first row
+             * @return false if the result has no rows
+             */
+            bool operator>>(int& out) const;
+
+            /**
+             * Reads the first row into the columns of the given user that
+             * were returned by the statement
+             * @return false if the result has no rows
+             */
+            bool operator>>(User& user) const;
+
+            /**
+             * Reads the first row into the given projection, the statement must
+             * select the projection's columns (see Statements::columns)
+             * @return false if the result has no rows
+             */
+            template <typename T, typename = decltype(T::Columns)>
+            bool operator>>(T& out) const {
+                if (rows() == 0) {
+                    return false;
+                }
+                // columns are selected in the order they are declared
+                int col{0};
+                for (auto column = T::Columns; column->name != nullptr; column++, col++) {
+                    auto v = value(0, col);
+                    if (v == nullptr) {
+                        continue;
+                    }
+                    switch (column->kind) {
+                        case Column<T>::Text:  out.*(column->text) = String{v}.dup(); break;
+                        case Column<T>::Int:   out.*(column->i32) = (int) strtol(v, nullptr, 10); break;
+                        case Column<T>::Int64: out.*(column->i64) = strtoll(v, nullptr, 10); break;
+                        case Column<T>::Array: array(out.*(column->array), v); break;
+                    }
+                }
+                return true;
+            }
+
+            /**
+             * @return the number of bytes of the values returned by the statement
+             */
+            size_t bytes() const;
+
+        private:
+            /// parses postgres text array format, e.g {admin,"with space"}
+            static void array(std::vector<String>& out, const char *value);
+            std::shared_ptr<PGresult> mRes;
+        };
+
+        static Statements& get();
+
+        /**
+         * @param timeout time in milliseconds to wait for a statement's result, -1 waits forever
+         */
+        void setup(int64_t timeout);
+
+        /**
+         * Prepares all the statements on the given connection if not already prepared
+         */
+        void prepare(sql::PgSqlConnection& conn);
+
+        /**
+         * Executes the given prepared statement, preparing the connection first if needed
+         * @param conn the connection to execute the statement on
+         * @param id the statement to execute
+         * @param args the statement parameters
+         */
+        template <typename... Args>
+        Result operator()(sql::PgSqlConnection& conn, Stmt id, const Args&... args) {
+            std::string values[sizeof...(Args)+1];
+            size_t i{0};
+            ((values[i++] = param(args)), ...);
+            return exec(conn, id, values, sizeof...(Args), -1);
+        }
+
+        /**
+         * Executes the given prepared statement, giving up when the request deadline passes
+         * @param deadline the deadline of the request executing the statement
+         * @throws Exception if the deadline passes before the result is received
+         */
+        template <typename... Args>
+        Result operator()(sql::PgSqlConnection& conn, const Deadline::Context& deadline, Stmt id, const Args&... args) {
+            std::string values[sizeof...(Args)+1];
+            size_t i{0};
+            ((values[i++] = param(args)), ...);
+            return exec(conn, id, values, sizeof...(Args), deadline.bound(mTimeout));
+        }
+
+        /**
+         * @return the SQL of the given statement
+         */
+        static const char *sql(Stmt id);
+
+        /**
+         * @return the comma separated columns of the given projection, substituted
+         * for `{columns}` in the SQL of the statements reading the projection
+         */
+        template <typename T>
+        static const std::string& columns() {
+            static const std::string sColumns = [] {
+                std::string out;
+                for (auto column = T::Columns; column->name != nullptr; column++) {
+                    if (!out.empty()) out += ", ";
+                    out += column->name;
+                }
+                return out;
+            }();
+            return sColumns;
+        }
+
+        /**
+         * @return the number of statements executed on the given connection
+         */
+        uint64_t trips(sql::PgSqlConnection& conn);
+
+        /**
+         * Drains the result of a statement abandoned on the given connection, resetting
+         * the connection if it cannot be drained. Statements settle their connection,
+         * must be invoked before raw queries are run on a pooled connection
+         * @throws Exception if the connection could not be reset, it is retried on next use
+         */
+        void settle(sql::PgSqlConnection& conn) { settle(native(conn)); }
+
+    private:
+        Statements();
+        Result exec(sql::PgSqlConnection& conn, Stmt id, const std::string *values, size_t n, int64_t deadline);
+        PGresult *wait(PGconn *pg, int64_t deadline);
+        void settle(PGconn *pg);
+        void reset(PGconn *pg);
+        static PGconn *native(sql::PgSqlConnection& conn) { return conn.conn; }
+
+        static std::string param(const String& s) { return std::string(s.data(), s.size()); }
+        static std::string param(const char *s) { return std::string(s); }
+        template <typename T, typename = std::enable_if_t<std::is_arithmetic_v<T>>>
+        static std::string param(T v) { return std::to_string(v); }
+
+        struct Backend {
+            int      pid{0};
+            uint64_t trips{0};
+            /// a statement was abandoned, its result must be drained before reuse
+            bool     pending{false};
+        };
+
+        /// connections already prepared, mapped to the backend they were prepared on
+        std::unordered_map<PGconn*, Backend> mPrepared{};
+        int64_t  mTimeout{-1};
+        Counter& mPrepares;
+        Counter& mExecutions;
+        Counter& mAbandoned;
+    };
+
+    /**
+     * Counts the postgres round trips made through the statement registry while
+     * serving a request, for a route. Created once a request has a connection,
+     * the trips are accounted when it goes out of scope.
+     */
+    struct RoundTrips {
+        struct Route {
+            Route(const char *name);
+            std::string RequestsName;
+            std::string TripsName;
+            std::string ExtraName;
+            Counter&    Requests;
+            Counter&    Trips;
+            Counter&    Extra;
+        };
+
+        RoundTrips(Route& route, sql::PgSqlConnection& conn);
+        ~RoundTrips();
+
+    private:
+        Route&                mRoute;
+        sql::PgSqlConnection& mConn;
+        uint64_t              mStart{0};
+    };
+}
+#endif //SUIL_STATEMENTS_H
@@ -0,0 +1,241 @@
+//
+// Created by Carter Mbotho on 2020-04-18.
+//
+
+#include <dirent.h>
+#include <sys/inotify.h>
+
+#include <fstream>
+#include <sstream>
+
+#include "templates.h"
+
+namespace {
+
+    uint64_t sVersion{0};
+
+    inline bool isSpace(char c) {
+        return c == ' ' || c == '\t';
+    }
+
+    std::string trim(const std::string& s, size_t from, size_t to)
+    {
+        while (from < to && isSpace(s[from])) from++;
+        while (to > from && isSpace(s[to-1])) to--;
+        return s.substr(from, to - from);
+    }
+}
+
+namespace suil::nozama {
+
+    Template::Ptr Template::compile(const String& name, std::string source)
+    {
+        auto tmpl = std::make_shared<Template>();
+        tmpl->Name = std::string(name.data(), name.size());
+        tmpl->Source = std::move(source);
+        auto& src = tmpl->Source;
+
+        size_t pos{0};
+        while (pos < src.size()) {
+            auto open = src.find("{{", pos);
+            if (open == std::string::npos) {
+                open = src.size();
+            }
+            if (open > pos) {
+                tmpl->Ops.push_back(Op{(uint32_t) pos, (uint32_t) (open - pos), -1, false});
+            }
+            if (open == src.size()) {
+                break;
+            }
+
+            bool triple = src.compare(open, 3, "{{{") == 0;
+            auto close = src.find(triple? "}}}" : "}}", open);
+            if (close == std::string::npos) {
+                throw Exception::create("template '", name, "' has an unterminated tag at offset ", open);
+            }
+            auto from = open + (triple? 3 : 2);
+            pos = close + (triple? 3 : 2);
+
+            bool escape{!triple};
+            char kind = from < close? src[from] : '\0';
+            if (kind == '!') {
+                // comment
+                continue;
+            }
+            if (kind == '#' || kind == '^' || kind == '/' || kind == '>' || kind == '=') {
+                throw Exception::create("template '", name, "' uses unsupported tag '", kind, "' at offset ", open);
+            }
+            if (kind == '&') {
+                escape = false;
+                from++;
+            }
+
+            auto var = trim(src, from, close);
+            if (var.empty()) {
+                throw Exception::create("template '", name, "' has an empty tag at offset ", open);
+            }
+            int32_t index{-1};
+            for (size_t i = 0; i < tmpl->Vars.size(); i++) {
+                if (tmpl->Vars[i] == var) {
+                    index = (int32_t) i;
+                    break;
+                }
+            }
+            if (index < 0) {
+                index = (int32_t) tmpl->Vars.size();
+                tmpl->Vars.push_back(std::move(var));
+            }
+            tmpl->Ops.push_back(Op{0, 0, index, escape});
+        }
+        tmpl->Version = ++sVersion;
+        return tmpl;
+    }
+
+    Templates& Templates::get()
+    {
+        static Templates sTemplates;
+        return sTemplates;
+    }
+
+    Templates::Templates()
+        : mReloads{Counters::get().counter("template_reloads_total", "Templates recompiled after changing on disk")},
+          mErrors{Counters::get().counter("template_errors_total", "Templates that failed to recompile")}
+    {
+        Counters::get().gauge("templates_loaded", "Number of compiled templates", [this] {
+            return (int64_t) mTemplates.size();
+        });
+    }
+
+    void Templates::setup(const String& dir, bool watch)
+    {
+        mDir = std::string(dir.data(), dir.size());
+        mWatch = watch;
+        mTemplates.clear();
+
+        auto d = opendir(mDir.c_str());
+        if (d == nullptr) {
+            throw Exception::create("opening templates directory '", dir, "' failed: ", errno_s);
+        }
+        struct dirent *entry{nullptr};
+        while ((entry = readdir(d)) != nullptr) {
+            if (entry->d_name[0] == '.') {
+                continue;
+            }
+            if (!load(entry->d_name)) {
+                closedir(d);
+                throw Exception::create("compiling template '", entry->d_name, "' failed");
+            }
+        }
+        closedir(d);
+        idebug("compiled %zu templates from %s {watch: %d}", mTemplates.size(), mDir.c_str(), mWatch);
+    }
+
+    bool Templates::load(const std::string& name)
+    {
+        try {
+            std::ifstream in(mDir + "/" + name, std::ios::binary);
+            if (!in) {
+                throw Exception::create("reading template failed: ", errno_s);
+            }
+            std::stringstream ss;
+            ss << in.rdbuf();
+            mTemplates[name] = Template::compile(String{name.c_str()}, ss.str());
+            return true;
+        }
+        catch (...) {
+            // a broken template keeps its previous version
+            ierror("compiling template '%s' failed: %s", name.c_str(), Exception::fromCurrent().what());
+            mErrors.inc();
+            return false;
+        }
+    }
+
+    const Template& Templates::find(const char *name)
+    {
+        if (mWatch) {
+            start();
+        }
+        auto it = mTemplates.find(name);
+        if (it == mTemplates.end()) {
+            throw Exception::create("template '", name, "' does not exist");
+        }
+        return *it->second;
+    }
+
+    void Templates::write(OBuffer& out, const String& value, bool escape)
+    {
+        if (!escape) {
+            out << value;
+            return;
+        }
+
+        auto data = value.data();
+        size_t from{0};
+        for (size_t i = 0; i < value.size(); i++) {
+            const char *entity{nullptr};
+            switch (data[i]) {
+                case '&':  entity = "&amp;";  break;
+                case '<':  entity = "&lt;";   break;
+                case '>':  entity = "&gt;";   break;
+                case '"':  entity = "&quot;"; break;
+                case '\'': entity = "&#39;";  break;
+                default:   continue;
+            }
+            if (i > from) {
+                out << String{data + from, i - from, false};
+            }
+            out << entity;
+            from = i + 1;
+        }
+        if (from < value.size()) {
+            out << String{data + from, value.size() - from, false};
+        }
+    }
+
+    void Templates::start()
+    {
+        if (mOwner == getpid()) {
+            return;
+        }
+        mOwner = getpid();
+        go(watcher(Ego));
+    }
+
+    coroutine void Templates::watcher(Templates& Self)
+    {
+        const pid_t owner = getpid();
+        int fd = inotify_init1(IN_NONBLOCK|IN_CLOEXEC);
+        if (fd < 0 || inotify_add_watch(fd, Self.mDir.c_str(), IN_CLOSE_WRITE|IN_MOVED_TO|IN_CREATE) < 0) {
+            swarn("watching templates directory %s failed: %s", Self.mDir.c_str(), errno_s);
+            if (fd >= 0) close(fd);
+            return;
+        }
+
+        strace("watching templates directory %s", Self.mDir.c_str());
+        alignas(struct inotify_event) char buf[4096];
+        while (Self.mOwner == owner) {
+            fdwait(fd, FDW_IN, -1);
+            ssize_t nread = read(fd, buf, sizeof(buf));
+            if (nread <= 0) {
+                continue;
+            }
+            for (char *ptr = buf; ptr < buf + nread; ) {
+                auto ev = (struct inotify_event *) ptr;
+                ptr += sizeof(struct inotify_event) + ev->len;
+                if (ev->len == 0 || ev->name[0] == '.' || (ev->mask & IN_ISDIR)) {
+                    continue;
+                }
+                if ((ev->mask & IN_CREATE) && !(ev->mask & IN_CLOSE_WRITE)) {
+                    // still being written, compiled when closed
+                    continue;
+                }
+                if (Self.load(ev->name)) {
+                    Self.mReloads.inc();
+                    sdebug("template '%s' recompiled", ev->name);
+                }
+            }
+        }
+        fdclean(fd);
+        close(fd);
+    }
+}
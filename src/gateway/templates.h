@@ -0,0 +1,153 @@
+//
+// Created by Carter Mbotho on 2020-04-18.
+//
+
+#ifndef SUIL_TEMPLATES_H
+#define SUIL_TEMPLATES_H
+
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "common.h"
+#include "counters.h"
+
+namespace suil::nozama {
+
+    /**
+     * A mustache template compiled to a list of operations, literal text is
+     * kept in the compiled source and variables are numbered in order of
+     * first appearance. Only variables are supported, `{{name}}` is HTML
+     * escaped while `{{&name}}` and `{{{name}}}` are not, `{{! comments}}` are
+     * dropped.
+     */
+    struct Template {
+        sptr(Template);
+
+        struct Op {
+            uint32_t offset{0};
+            uint32_t len{0};
+            /// index of the variable rendered, -1 for literal text
+            int32_t  var{-1};
+            bool     escape{true};
+        };
+
+        /**
+         * @param name the name of the template, used in errors
+         * @param source the template source
+         * @throws Exception if the template is invalid
+         */
+        static Ptr compile(const String& name, std::string source);
+
+        std::string              Name;
+        std::string              Source;
+        std::vector<Op>          Ops;
+        std::vector<std::string> Vars;
+        /// bumped every time a template is (re)compiled
+        uint64_t                 Version{0};
+    };
+
+    /**
+     * Mail templates under the templates directory, compiled at startup and
+     * rendered straight from the fields of a model into a reusable buffer. A
+     * model is a struct that declares the template it renders and its fields:
+     *
+     * @code
+     *   struct Welcome {
+     *       static constexpr const char *Template = "_welcome.html";
+     *       static const Templates::Field<Welcome> Fields[];
+     *       String name;
+     *   };
+     *   const Templates::Field<Welcome> Welcome::Fields[] = {{"name", &Welcome::name}, {nullptr}};
+     * @endcode
+     *
+     * Templates changed on disk are recompiled in the background by a watcher
+     * (inotify) so requests never touch the file system.
+     */
+    struct Templates final : LOGGER(NZM_GATEWAY) {
+
+        template <typename T>
+        struct Field {
+            const char *name;
+            String T::* member;
+        };
+
+        static Templates& get();
+
+        /**
+         * Compiles all the templates in the given directory
+         * @param dir the templates directory
+         * @param watch true to recompile templates changed on disk
+         * @throws Exception if a template fails to compile
+         */
+        void setup(const String& dir, bool watch);
+
+        /**
+         * Renders the template of the given model
+         * @param out the buffer to render to, appended to
+         * @param model the values of the template variables, variables the model
+         *        does not declare are rendered empty
+         */
+        template <typename T>
+        void render(OBuffer& out, const T& model) {
+            static Binding<T> sBinding;
+            auto& tmpl = find(T::Template);
+            if (sBinding.version != tmpl.Version || sBinding.tmpl != &tmpl) {
+                // resolved once per compiled version of the template
+                bind(sBinding, tmpl);
+            }
+            for (auto& op: tmpl.Ops) {
+                if (op.var < 0) {
+                    out << String{tmpl.Source.data() + op.offset, op.len, false};
+                }
+                else if (auto member = sBinding.members[op.var]) {
+                    write(out, model.*member, op.escape);
+                }
+            }
+        }
+
+        /**
+         * Starts the watcher in the current process if not already started
+         */
+        void start();
+
+    private:
+        template <typename T>
+        struct Binding {
+            const Template *tmpl{nullptr};
+            uint64_t version{0};
+            std::vector<String T::*> members{};
+        };
+
+        template <typename T>
+        static void bind(Binding<T>& binding, const Template& tmpl) {
+            binding.members.assign(tmpl.Vars.size(), nullptr);
+            for (size_t i = 0; i < tmpl.Vars.size(); i++) {
+                for (auto field = T::Fields; field->name != nullptr; field++) {
+                    if (tmpl.Vars[i] == field->name) {
+                        binding.members[i] = field->member;
+                        break;
+                    }
+                }
+            }
+            binding.tmpl = &tmpl;
+            binding.version = tmpl.Version;
+        }
+
+        Templates();
+        const Template& find(const char *name);
+        bool load(const std::string& name);
+        static void write(OBuffer& out, const String& value, bool escape);
+        static coroutine void watcher(Templates& Self);
+
+        std::string mDir{};
+        bool        mWatch{false};
+        pid_t       mOwner{0};
+        std::unordered_map<std::string, Template::Ptr> mTemplates{};
+
+        Counter& mReloads;
+        Counter& mErrors;
+    };
+}
+#endif //SUIL_TEMPLATES_H
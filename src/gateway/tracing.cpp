@@ -0,0 +1,218 @@
+//
+// Created by Carter Mbotho on 2020-04-19.
+//
+
+#include <algorithm>
+#include <chrono>
+
+#include "tracing.h"
+
+namespace {
+
+    /// spans are exported with wall clock timestamps so traces line up with logs
+    inline int64_t wallnow() {
+        using namespace std::chrono;
+        return duration_cast<microseconds>(system_clock::now().time_since_epoch()).count();
+    }
+
+    void hex(suil::OBuffer& ob, uint64_t v)
+    {
+        static const char *HEX = "0123456789abcdef";
+        char buf[16];
+        for (int i = 15; i >= 0; i--) {
+            buf[i] = HEX[v & 0x0F];
+            v >>= 4;
+        }
+        ob << suil::String{buf, sizeof(buf), false};
+    }
+}
+
+namespace suil::nozama {
+
+    Tracing::Span::Span(Context& ctx, const char *name)
+        : mCtx{ctx}
+    {
+        if (ctx.route == nullptr) {
+            ctx.route = name;
+        }
+        if (ctx.count == MaxSpans) {
+            ctx.truncated = true;
+            return;
+        }
+        mIndex  = (int8_t) ctx.count++;
+        mParent = ctx.current;
+        auto& rec = ctx.spans[mIndex];
+        rec.name     = name;
+        rec.start    = wallnow();
+        rec.duration = -1;
+        rec.parent   = mParent;
+        ctx.current  = mIndex;
+    }
+
+    void Tracing::Span::end()
+    {
+        if (mIndex < 0) {
+            return;
+        }
+        auto& rec = mCtx.spans[mIndex];
+        rec.duration = wallnow() - rec.start;
+        mCtx.current = mParent;
+        mIndex = -1;
+    }
+
+    Tracing::Tracing()
+        : mKept{Counters::get().counter("traces_kept_total", "Request traces kept in the trace ring buffer")},
+          mTruncated{Counters::get().counter("traces_truncated_total", "Request traces that had more spans than could be kept")}
+    {
+        mRing.resize(mConfig.capacity);
+    }
+
+    void Tracing::setup(Config config)
+    {
+        mConfig = std::move(config);
+        mRing.clear();
+        mRing.resize(std::max<size_t>(mConfig.capacity, 1));
+        mNext = mSize = 0;
+        idebug("tracing {sample: %f, slow: %ld ms, capacity: %zu}", mConfig.sample, mConfig.slow, mRing.size());
+    }
+
+    void Tracing::before(http::Request&, http::Response&, Context& ctx)
+    {
+        ctx.start   = wallnow();
+        ctx.route   = nullptr;
+        ctx.count   = 0;
+        ctx.current = -1;
+        ctx.truncated = false;
+    }
+
+    void Tracing::after(http::Request&, http::Response&, Context& ctx)
+    {
+        if (ctx.start == 0 || ctx.count == 0) {
+            // not a traced route
+            return;
+        }
+        auto end = wallnow();
+        if (!keep(end - ctx.start)) {
+            return;
+        }
+
+        auto& trace = mRing[mNext];
+        mNext = (mNext + 1) % mRing.size();
+        mSize = std::min(mSize + 1, mRing.size());
+        trace.id[0] = random();
+        trace.id[1] = random();
+        trace.route = ctx.route;
+        trace.count = 0;
+        trace.spans[trace.count++] = Record{"request", ctx.start, end - ctx.start, -1};
+
+        int64_t first{end}, last{ctx.start};
+        for (uint8_t i = 0; i < ctx.count; i++) {
+            auto rec = ctx.spans[i];
+            if (rec.duration < 0) {
+                // still open (e.g. an exception skipped the destructor), ends with the request
+                rec.duration = end - rec.start;
+            }
+            if (rec.parent < 0) {
+                first = std::min(first, rec.start);
+                last  = std::max(last, rec.start + rec.duration);
+            }
+            rec.parent = (int8_t) (rec.parent + 1);
+            trace.spans[trace.count++] = rec;
+        }
+        trace.spans[trace.count++] = Record{"middlewares", ctx.start, first - ctx.start, 0};
+        trace.spans[trace.count++] = Record{"middlewares", last, end - last, 0};
+
+        mKept.inc();
+        if (ctx.truncated) {
+            mTruncated.inc();
+        }
+        ctx.start = 0;
+    }
+
+    bool Tracing::keep(int64_t duration)
+    {
+        if (mConfig.slow > 0 && duration >= mConfig.slow * 1000) {
+            return true;
+        }
+        if (mConfig.sample <= 0) {
+            return false;
+        }
+        return (random() >> 11) * 0x1.0p-53 < mConfig.sample;
+    }
+
+    uint64_t Tracing::random()
+    {
+        if (mOwner != getpid()) {
+            // forked processes must not generate the same trace ids
+            mOwner = getpid();
+            mSeed  = ((uint64_t) wallnow() << 16) ^ (uint64_t) mOwner ^ 0x9E3779B97F4A7C15ull;
+        }
+        // xorshift64*
+        mSeed ^= mSeed >> 12;
+        mSeed ^= mSeed << 25;
+        mSeed ^= mSeed >> 27;
+        return mSeed * 0x2545F4914F6CDD1Dull;
+    }
+
+    void Tracing::toJson(OBuffer& ob, Format format) const
+    {
+        if (format == Otlp) {
+            otlp(ob);
+        }
+        else {
+            chrome(ob);
+        }
+    }
+
+    void Tracing::chrome(OBuffer& ob) const
+    {
+        bool first{true};
+        auto pid = getpid();
+        ob << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+        for (size_t n = 0; n < mSize; n++) {
+            // oldest first, each trace on its own track
+            auto& trace = mRing[(mNext + mRing.size() - mSize + n) % mRing.size()];
+            for (uint8_t i = 0; i < trace.count; i++) {
+                auto& rec = trace.spans[i];
+                ob << (first? "" : ",")
+                   << "{\"name\":\"" << rec.name << "\",\"cat\":\"" << trace.route
+                   << "\",\"ph\":\"X\",\"ts\":" << rec.start << ",\"dur\":" << rec.duration
+                   << ",\"pid\":" << pid << ",\"tid\":" << n << "}";
+                first = false;
+            }
+        }
+        ob << "]}";
+    }
+
+    void Tracing::otlp(OBuffer& ob) const
+    {
+        bool first{true};
+        ob << "{\"resourceSpans\":[{\"resource\":{\"attributes\":["
+           << "{\"key\":\"service.name\",\"value\":{\"stringValue\":\"semausu-gateway\"}},"
+           << "{\"key\":\"process.pid\",\"value\":{\"intValue\":\"" << getpid() << "\"}}]},"
+           << "\"scopeSpans\":[{\"scope\":{\"name\":\"semausu\"},\"spans\":[";
+        for (size_t n = 0; n < mSize; n++) {
+            auto& trace = mRing[(mNext + mRing.size() - mSize + n) % mRing.size()];
+            for (uint8_t i = 0; i < trace.count; i++) {
+                auto& rec = trace.spans[i];
+                ob << (first? "" : ",") << "{\"traceId\":\"";
+                hex(ob, trace.id[0]);
+                hex(ob, trace.id[1]);
+                ob << "\",\"spanId\":\"";
+                hex(ob, trace.id[1] + i);
+                ob << "\"";
+                if (rec.parent >= 0) {
+                    ob << ",\"parentSpanId\":\"";
+                    hex(ob, trace.id[1] + rec.parent);
+                    ob << "\"";
+                }
+                ob << ",\"name\":\"" << rec.name << "\",\"kind\":" << (i == 0? 2 : 1)
+                   << ",\"startTimeUnixNano\":\"" << rec.start << "000\""
+                   << ",\"endTimeUnixNano\":\"" << (rec.start + rec.duration) << "000\""
+                   << ",\"attributes\":[{\"key\":\"route\",\"value\":{\"stringValue\":\"" << trace.route << "\"}}]}";
+                first = false;
+            }
+        }
+        ob << "]}]}]}";
+    }
+}
@@ -0,0 +1,133 @@
+//
+// Created by Carter Mbotho on 2020-04-19.
+//
+
+#ifndef SUIL_TRACING_H
+#define SUIL_TRACING_H
+
+#include <string>
+#include <vector>
+
+#include "common.h"
+#include "counters.h"
+
+namespace suil::nozama {
+
+    /**
+     * Request scoped span tracing. The Tracing middleware starts a trace when a request
+     * comes in, handlers open spans on it around the work they do (waiting for a
+     * connection, the KDF, queries, JWT session calls) and the trace is closed after
+     * all the other middlewares ran. Time between the request arriving and the first
+     * span, and between the last span and the response leaving, is reported as the
+     * `middlewares` span.
+     *
+     * The first span a handler opens names the trace. Spans are collected into a
+     * fixed array of the request context so tracing a
+     * request does not allocate. Finished traces are kept in a ring buffer when they
+     * are sampled or slower than a threshold, the ring can be downloaded from
+     * `/gateway/traces` as Chrome trace-event JSON or OTLP-JSON and opened in Perfetto
+     * without running a collector.
+     *
+     * @code
+     *   auto& trace = api.context<Tracing>(req);
+     *   Tracing::Span span(trace, "users_login");
+     *   {
+     *       Tracing::Span pg(trace, "postgres.user_by_email");
+     *       ...
+     *   }
+     * @endcode
+     */
+    struct Tracing final : LOGGER(NZM_GATEWAY) {
+        static constexpr size_t MaxSpans{32};
+
+        struct Config {
+            /// fraction of the requests that are kept
+            double  sample{0.01};
+            /// requests slower than this many milliseconds are always kept, 0 to disable
+            int64_t slow{500};
+            /// number of traces kept in the ring buffer
+            size_t  capacity{256};
+        };
+
+        struct Record {
+            const char *name{nullptr};
+            /// wall clock time (us since epoch) the span started
+            int64_t     start{0};
+            int64_t     duration{0};
+            /// index of the parent span in the trace, -1 for the root
+            int8_t      parent{-1};
+        };
+
+        struct Context {
+            int64_t     start{0};
+            const char *route{nullptr};
+            Record      spans[MaxSpans];
+            uint8_t     count{0};
+            /// span currently open, -1 if none is
+            int8_t      current{-1};
+            /// set when spans were dropped because the trace was full
+            bool        truncated{false};
+        };
+
+        /**
+         * Records the time from its creation to its destruction as a span of the trace,
+         * spans opened while it is alive become its children
+         */
+        struct Span {
+            Span(Context& ctx, const char *name);
+            ~Span() { end(); }
+            /// closes the span before it goes out of scope
+            void end();
+        private:
+            Context& mCtx;
+            int8_t   mIndex{-1};
+            int8_t   mParent{-1};
+        };
+
+        enum Format : uint8_t {
+            Chrome,
+            Otlp
+        };
+
+        Tracing();
+
+        void setup(Config config);
+
+        void before(http::Request& req, http::Response& resp, Context& ctx);
+
+        void after(http::Request& req, http::Response& resp, Context& ctx);
+
+        /**
+         * Renders the traces in the ring buffer
+         * @param ob the buffer to render to
+         * @param format the format to render, Chrome trace-event or OTLP JSON
+         */
+        void toJson(OBuffer& ob, Format format) const;
+
+    private:
+        struct Trace {
+            uint64_t   id[2]{0, 0};
+            const char *route{nullptr};
+            /// the request, the spans of the context and the middlewares before and after
+            Record     spans[MaxSpans + 3];
+            uint8_t    count{0};
+        };
+
+        bool keep(int64_t duration);
+        uint64_t random();
+        void chrome(OBuffer& ob) const;
+        void otlp(OBuffer& ob) const;
+
+        Config             mConfig{};
+        std::vector<Trace> mRing{};
+        size_t             mNext{0};
+        size_t             mSize{0};
+
+        uint64_t           mSeed{0};
+        pid_t              mOwner{0};
+
+        Counter& mKept;
+        Counter& mTruncated;
+    };
+}
+#endif //SUIL_TRACING_H
@@ -0,0 +1,171 @@
+//
+// Created by Carter Mbotho on 2020-04-13.
+//
+
+#include "pgnotify.h"
+#include "usercache.h"
+#include "users.h"
+
+namespace suil::nozama {
+
+    UserCache& UserCache::get()
+    {
+        static UserCache sCache;
+        return sCache;
+    }
+
+    UserCache::UserCache()
+        : mHits{Counters::get().counter("user_cache_hits_total", "Logins served from the user cache")},
+          mMisses{Counters::get().counter("user_cache_misses_total", "Logins that had to read the user from postgres")},
+          mEvictions{Counters::get().counter("user_cache_evictions_total", "Users evicted from the user cache")},
+          mInvalidations{Counters::get().counter("user_cache_invalidations_total", "Users invalidated in the user cache")}
+    {
+        Counters::get().gauge("user_cache_size", "Number of users in the user cache", [this] {
+            return (int64_t) mIndex.size();
+        });
+    }
+
+    std::string UserCache::normalize(const char *email, size_t len)
+    {
+        while (len && isspace(*email)) { email++; len--; }
+        while (len && isspace(email[len-1])) { len--; }
+        std::string key(email, len);
+        for (auto& c: key) c = (char) tolower(c);
+        return key;
+    }
+
+    void UserCache::setup(size_t capacity, int64_t ttl, const String& channel)
+    {
+        clear();
+        mCapacity = capacity;
+        mTtl      = ttl;
+        mChannel  = channel.dup();
+        if (mCapacity) {
+            PgListener::get().subscribe(mChannel,
+                [this](const char *email) { invalidated(normalize(email, strlen(email))); },
+                // notifications might have been missed, cached entries could be stale
+                [this] { clear(); });
+        }
+        idebug("user cache configured {capacity: %zu, ttl: %ld ms, channel: %s}", mCapacity, mTtl, mChannel());
+    }
+
+    bool UserCache::find(LoginUser& user, const String& email)
+    {
+        if (mCapacity == 0) {
+            return false;
+        }
+        // without the listener entries would never be invalidated by other instances
+        auto& listener = PgListener::get();
+        listener.start();
+        if (!listener.listening()) {
+            // invalidations might be missed until the listener is connected and clears the cache
+            mMisses.inc();
+            return false;
+        }
+
+        auto it = mIndex.find(normalize(email.data(), email.size()));
+        if (it == mIndex.end()) {
+            mMisses.inc();
+            return false;
+        }
+
+        auto node = it->second;
+        if (node->expires < mnow() || node->entry.Email != email) {
+            // lookups are exact on the database, a different spelling is a miss
+            mMisses.inc();
+            if (node->expires < mnow()) {
+                drop(it->first);
+            }
+            return false;
+        }
+
+        // most recently used goes to the front
+        mLru.splice(mLru.begin(), mLru, node);
+        auto& entry = node->entry;
+        user.Email         = entry.Email.dup();
+        user.Passwd        = entry.Passwd.dup();
+        user.Salt          = entry.Salt.dup();
+        user.State         = entry.State;
+        user.PasswdExpires = entry.PasswdExpires;
+        user.Roles.clear();
+        for (auto& role: entry.Roles) {
+            user.Roles.push_back(role.dup());
+        }
+        mHits.inc();
+        return true;
+    }
+
+    void UserCache::put(const LoginUser& user, uint64_t generation)
+    {
+        if (mCapacity == 0 || user.State != Users::Active) {
+            // only active users are cached, others are rejected from the database record
+            return;
+        }
+        if (generation != mGeneration) {
+            // an invalidation raced the read, the record might predate it
+            itrace("user cache fill of '%s' dropped, invalidated while reading", user.Email());
+            return;
+        }
+
+        auto key = normalize(user.Email.data(), user.Email.size());
+        drop(key);
+        while (mIndex.size() >= mCapacity) {
+            mIndex.erase(mLru.back().key);
+            mLru.pop_back();
+            mEvictions.inc();
+        }
+
+        Entry entry;
+        entry.Email         = user.Email.dup();
+        entry.Passwd        = user.Passwd.dup();
+        entry.Salt          = user.Salt.dup();
+        entry.State         = user.State;
+        entry.PasswdExpires = user.PasswdExpires;
+        for (auto& role: user.Roles) {
+            entry.Roles.push_back(role.dup());
+        }
+        mLru.push_front(Node{key, std::move(entry), mnow() + mTtl});
+        mIndex.emplace(std::move(key), mLru.begin());
+    }
+
+    void UserCache::invalidate(sql::PgSqlConnection& conn, const String& email)
+    {
+        if (mCapacity == 0) {
+            return;
+        }
+        invalidated(normalize(email.data(), email.size()));
+        // other instances (and processes) drop the entry when they receive this
+        PgListener::notify(conn, mChannel, email);
+    }
+
+    void UserCache::evict(const String& email)
+    {
+        if (mCapacity) {
+            invalidated(normalize(email.data(), email.size()));
+        }
+    }
+
+    void UserCache::drop(const std::string& key)
+    {
+        auto it = mIndex.find(key);
+        if (it != mIndex.end()) {
+            mLru.erase(it->second);
+            mIndex.erase(it);
+            mInvalidations.inc();
+        }
+    }
+
+    void UserCache::invalidated(const std::string& key)
+    {
+        // reads in flight could have read the record before the change
+        mGeneration++;
+        drop(key);
+    }
+
+    void UserCache::clear()
+    {
+        mGeneration++;
+        mIndex.clear();
+        mLru.clear();
+    }
+}
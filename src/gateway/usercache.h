@@ -0,0 +1,114 @@
+//
+// Created by Carter Mbotho on 2020-04-13.
+//
+
+#ifndef SUIL_USERCACHE_H
+#define SUIL_USERCACHE_H
+
+#include <list>
+#include <string>
+#include <unordered_map>
+
+#include "common.h"
+#include "counters.h"
+#include "statements.h"
+
+namespace suil::nozama {
+
+    /**
+     * A bounded LRU cache of the fields needed to login active users, keyed by the
+     * normalized (trimmed, lower case) email. Entries are invalidated locally and on
+     * every other gateway instance through a Postgres NOTIFY channel (see PgListener).
+     *
+     * @note the cache is per process and only accessed from the event loop
+     */
+    struct UserCache final : LOGGER(NZM_GATEWAY) {
+
+        struct Entry {
+            String  Email;
+            String  Passwd;
+            String  Salt;
+            int     State{0};
+            int64_t PasswdExpires{0};
+            std::vector<String> Roles;
+        };
+
+        static UserCache& get();
+
+        /**
+         * Configure the cache
+         * @param capacity the maximum number of entries, 0 disables the cache
+         * @param ttl the time in milliseconds after which entries are dropped
+         * @param channel the NOTIFY channel on which invalidations are broadcast
+         */
+        void setup(size_t capacity, int64_t ttl, const String& channel);
+
+        /**
+         * Looks up a user and copies the cached fields into the given user
+         * @return true if the user was found in cache
+         */
+        bool find(LoginUser& user, const String& email);
+
+        /**
+         * @return the invalidation generation, to be read before the user is read
+         * from the database and given back to put
+         */
+        uint64_t generation() const { return mGeneration; }
+
+        /**
+         * Caches the login fields of the given user, unless a user was invalidated
+         * since the given generation was read (the record read might be stale)
+         * @param user the user read from the database
+         * @param generation the generation read before the user was read
+         */
+        void put(const LoginUser& user, uint64_t generation);
+
+        /**
+         * Drops the given user from this instance's cache and broadcasts the
+         * invalidation to other instances
+         * @param conn the connection on which to send the notification
+         * @param email the email of the user whose record changed
+         */
+        void invalidate(sql::PgSqlConnection& conn, const String& email);
+
+        /**
+         * Drops the given user from this instance's cache only, for updates
+         * that broadcast the invalidation themselves
+         */
+        void evict(const String& email);
+
+        /**
+         * @return the NOTIFY channel on which invalidations are broadcast
+         */
+        const String& channel() const { return mChannel; }
+
+        static std::string normalize(const char *email, size_t len);
+
+    private:
+        struct Node {
+            std::string key;
+            Entry       entry;
+            int64_t     expires;
+        };
+        using Lru = std::list<Node>;
+
+        UserCache();
+        void drop(const std::string& key);
+        void invalidated(const std::string& key);
+        void clear();
+
+        Lru          mLru{};
+        std::unordered_map<std::string, Lru::iterator> mIndex{};
+        size_t       mCapacity{0};
+        int64_t      mTtl{60000};
+        /// bumped on every invalidation, fills read before it are dropped
+        uint64_t     mGeneration{0};
+        String       mChannel{"semausu_users"};
+
+        Counter& mHits;
+        Counter& mMisses;
+        Counter& mEvictions;
+        Counter& mInvalidations;
+    };
+}
+#endif //SUIL_USERCACHE_H
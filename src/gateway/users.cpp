@@ -1,14 +1,63 @@
 //
 // Created by Carter Mbotho on 2020-03-25.
 //
-#include <suil/mustache.h>
 #include <suil/http/validators.h>
 
 #include "users.h"
 #include "gateway.h"
+#include "passwd.h"
+#include "usercache.h"
+#include "emailfilter.h"
+#include "statements.h"
+#include "mailqueue.h"
+#include "metrics.h"
+#include "breaker.h"
+#include "jwtcache.h"
+#include "revocations.h"
+#include "refresh.h"
+#include "replicas.h"
+#include "shards.h"
+
+namespace {
+
+    using suil::sql::PgSqlConnection;
+    using suil::nozama::Breaker;
+    using suil::nozama::Deadline;
+
+    /* a connection within the request deadline, a deadline that passed says nothing about postgres */
+    PgSqlConnection& connect(Breaker::Call& call, const Deadline::Context& deadline, suil::sql::mw::Postgres& pq)
+    {
+        try {
+            return deadline.conn(pq);
+        }
+        catch (...) {
+            if (deadline.expired()) call.abandon();
+            throw;
+        }
+    }
+
+    PgSqlConnection& connect(Breaker::Call& call, const Deadline::Context& deadline, suil::nozama::Replicas::Lease& lease)
+    {
+        try {
+            return lease.conn(deadline);
+        }
+        catch (...) {
+            if (deadline.expired()) call.abandon();
+            throw;
+        }
+    }
+}
 
 namespace suil::nozama {
 
+    const Templates::Field<VerifyAccountMail> VerifyAccountMail::Fields[] = {
+        {"name",     &VerifyAccountMail::name},
+        {"endpoint", &VerifyAccountMail::endpoint},
+        {"token",    &VerifyAccountMail::token},
+        {"email",    &VerifyAccountMail::email},
+        {nullptr,    nullptr}
+    };
+
     Users::Users(suil::nozama::Endpoint &ep)
         : Base(ep)
     {}
@@ -25,6 +74,11 @@ namespace suil::nozama {
         .attrs(opt(PARSE_FORM, true))
         (std::bind(&Users::loginUser, this, std::placeholders::_1, std::placeholders::_2));
 
+        eproute(api, "/users/refresh")
+        ("POST"_method, "OPTIONS"_method)
+        .attrs(opt(PARSE_FORM, true))
+        (std::bind(&Users::refreshToken, this, std::placeholders::_1, std::placeholders::_2));
+
         eproute(api, "/users/verify")
         ("POST"_method)
         (std::bind(&Users::verifyUser, this, std::placeholders::_1, std::placeholders::_2));
@@ -71,6 +125,11 @@ namespace suil::nozama {
     {
         static http::validators::Email EmailValidator;
         static http::validators::Password PasswdValidator;
+        static Latency::Route Timing{"users_register"};
+        Latency::Timer total(Timing);
+        auto& trace = api.template context<Tracing>(req);
+        Tracing::Span span(trace, "users_register");
+        auto& deadline = api.template context<Deadline>(req);
 
         try {
             if (!EmailValidator(user.Email)) {
@@ -80,6 +139,12 @@ namespace suil::nozama {
                 return;
             }
 
+            /* checked before the password is hashed */
+            auto& limits = api.template middleware<RateLimit>();
+            if (!limits.allow(api.template context<RateLimit>(req), resp, user.Email)) {
+                return;
+            }
+
             OBuffer tmp;
             if (!PasswdValidator(tmp, user.Passwd)) {
                 /* invalid user email address */
@@ -88,53 +153,74 @@ namespace suil::nozama {
                 return;
             }
 
-            scoped(conn,  api.template middleware<sql::mw::Postgres>().conn());
-            int found{0};
-            conn("SELECT COUNT(*) FROM users WHERE email like $1")(user.Email) >> found;
-            if (found) {
-                /* user already registered */
-                Base::fail(resp, "UserAlreadyRegistered", "User with email '", user.Email, "' already registered");
-                resp.end(http::Status::BAD_REQUEST);
-                return;
-            }
-
             /* initialize user entities, verification guid */
             user.Notes         = utils::uuidstr();
             user.State         = State::Verify;
-            user.Salt          = http::rand_8byte_salt()(user.Email);
-            user.Passwd        = http::pbkdf2_sha1_hash(Gateway::get().PasswdKey())(user.Passwd, user.Salt);
+            /* salt is embedded in the hash, column is only used by legacy hashes */
+            auto& hasher       = PasswdHasher::get();
+            user.Salt          = hasher.salt(user.Email);
+            bool hashed{false};
+            {
+                Latency::Timer kdf(Timing, Latency::Kdf);
+                Tracing::Span hash(trace, "kdf.hash");
+                hashed = hasher.hash(user.Passwd, user.Passwd, user.Salt);
+            }
+            if (!hashed) {
+                /* KDF executor saturated */
+                Base::fail(resp, "ServerBusy", "Server is busy, try again later");
+                resp.end(http::Status::SERVICE_UNAVAILABLE);
+                return;
+            }
             user.PasswdExpires = time(nullptr) + 7776000;
 
-            Table users(conn);
-            if (!users.insert(user)) {
-                /* adding user to database failed */
-                ierror("failed to add user '%s' to database", user.Email);
-                Base::fail(resp, "UserRegisterFailure", "Registering user '",
-                           user.Email, "' failed, contact system admin");
-                resp.end(http::Status::INTERNAL_ERROR);
-                return;
+            /* the verification email is queued with the user, the sender delivers it. The body
+             * is per request, the handler yields before the insert is sent */
+            OBuffer body{4096};
+            VerifyAccountMail mail;
+            mail.name     = user.FirstName.peek();
+            mail.endpoint = Gateway::get().Url.peek();
+            mail.token    = utils::urlencode(user.Notes);
+            mail.email    = utils::urlencode(user.Email);
+            {
+                Latency::Timer render(Timing, Latency::Render);
+                Tracing::Span tmpl(trace, "template.render");
+                Templates::get().render(body, mail);
             }
 
-            if (auto outbox = Gateway::get().Outbox().lock()) {
-                auto msg = outbox->draft(user.Email, "Account successfully Registered");
-                auto &tmpl = MustacheCache::get().load("_verify_account.html");
-                tmpl.render(msg->body(),
-                            json::Object(json::Obj,
-                                         "name",     user.FirstName.peek(),
-                                         "endpoint", Gateway::get().Url.peek(),
-                                         "token",    utils::urlencode(user.Notes),
-                                         "email",    utils::urlencode(user.Email)));
-                msg->content("text/html");
-                outbox->send(std::move(msg));
+            static RoundTrips::Route Route{"users_register"};
+            /* users live on the shard their email hashes to */
+            auto& pq = Shards::get().pool(user.Email);
+            auto& mailq = MailQueue::get();
+            deadline.check("postgres.conn");
+            Breaker::Call pgCall(Breakers::get().Postgres);
+            if (!pgCall) {
+                unavailable(resp, Breakers::get().Postgres);
+                return;
             }
-            else {
-                // failed to send email message
-                ierror("Attempt to send email to user while mailbox is null");
-                Base::fail(resp, "UserRegisterFailure",
-                           "Sending registration email failed, try again later or contact system admin");
-                resp.end(http::Status::INTERNAL_ERROR);
+            Tracing::Span acquire(trace, "postgres.conn");
+            scoped(conn,  connect(pgCall, deadline, pq));
+            pgCall.ok();
+            acquire.end();
+            RoundTrips trips(Route, conn);
+            auto& filter = EmailFilter::get();
+            Latency::Timer insert(Timing, Latency::Postgres);
+            Tracing::Span query(trace, "postgres.users_insert");
+            /* the insert is skipped if the email is taken, no row is returned then */
+            auto inserted = Statements::get()(conn, deadline, Stmt::UserInsert,
+                                              user.Email, user.FirstName, user.LastName, user.Passwd, user.Salt,
+                                              user.State, user.PasswdExpires, user.Notes, filter.channel(),
+                                              "Account successfully Registered", "text/html",
+                                              String{body.data(), body.size(), false},
+                                              mailq.channel());
+            if (!inserted.rows()) {
+                /* user already registered */
+                Base::fail(resp, "UserAlreadyRegistered", "User with email '", user.Email, "' already registered");
+                resp.end(http::Status::BAD_REQUEST);
                 return;
             }
+            filter.add(user.Email);
+            Replicas::get().pin(user.Email);
+
 #ifndef SWEPT
             resp << "Welcome " << user.FirstName << " " << user.LastName << ", your account was successfully registered."
                  << " A confirmation email has been sent to " << user.Email;
@@ -148,6 +234,9 @@ namespace suil::nozama {
         catch(...) {
             /* unhandled error */
             ierror("/users/register %s", Exception::fromCurrent().what());
+            if (timedOut(req, resp)) {
+                return;
+            }
             Base::fail(resp, "InternalError",
                        "Processing register request failed, contact system administrator");
             resp.end(http::Status::INTERNAL_ERROR);
@@ -161,11 +250,17 @@ namespace suil::nozama {
                 prop(Email, String),
                 prop(Passwd, String))
         ) LoginData;
+        static Latency::Route Timing{"users_login"};
+        Latency::Timer total(Timing);
+        auto& trace = api.template context<Tracing>(req);
+        Tracing::Span span(trace, "users_login");
+        auto& deadline = api.template context<Deadline>(req);
 
         resp.setContentType("application/json");
         try {
             LoginData data;
-            User      user;
+            /* only the columns needed to login are read */
+            LoginUser user;
             auto why = requestForm >> data;
             if (why) {
                 /* missing required fields */
@@ -174,15 +269,59 @@ namespace suil::nozama {
                 return;
             }
 
-            scoped(conn,  api.middleware<sql::mw::Postgres>().conn());
-            if (!(conn("SELECT * FROM users WHERE email = $1")(data.Email) >> user)) {
-                /* failed to read user from database */
-                Base::fail(resp, "UserNotRegistered",
-                                 "User with email '", data.Email, "' not registered");
-                resp.end(http::Status::FORBIDDEN);
+            /* checked before the user is looked up and the password hashed */
+            auto& limits = api.template middleware<RateLimit>();
+            if (!limits.allow(api.template context<RateLimit>(req), resp, data.Email)) {
                 return;
             }
 
+            auto& cache = UserCache::get();
+            auto& stmts = Statements::get();
+            auto& pq = Shards::get().pool(data.Email);
+            /* cache hits need no connection, they are served while postgres is unavailable */
+            if (!cache.find(user, data.Email)) {
+                /* read before the user, a concurrent invalidation drops the fill */
+                auto generation = cache.generation();
+                auto& filter = EmailFilter::get();
+                if (!filter.mayContain(data.Email)) {
+                    /* user definitely not registered, no connection needed */
+                    Base::fail(resp, "UserNotRegistered",
+                               "User with email '", data.Email, "' not registered");
+                    resp.end(http::Status::FORBIDDEN);
+                    return;
+                }
+
+                static RoundTrips::Route Route{"users_login"};
+                deadline.check("postgres.conn");
+                Breaker::Call pgCall(Breakers::get().Postgres);
+                if (!pgCall) {
+                    unavailable(resp, Breakers::get().Postgres);
+                    return;
+                }
+                /* the lookup can be served by a replica */
+                Replicas::Lease lease(pq, data.Email);
+                Tracing::Span acquire(trace, "postgres.conn");
+                scoped(conn,  connect(pgCall, deadline, lease));
+                pgCall.ok();
+                acquire.end();
+                RoundTrips trips(Route, conn);
+                bool found{false};
+                {
+                    Latency::Timer pg(Timing, Latency::Postgres);
+                    Tracing::Span query(trace, "postgres.users_login");
+                    found = stmts(conn, deadline, Stmt::UserLogin, data.Email) >> user;
+                }
+                if (!found) {
+                    /* the filter let an unregistered email through */
+                    filter.falsePositive();
+                    Base::fail(resp, "UserNotRegistered",
+                               "User with email '", data.Email, "' not registered");
+                    resp.end(http::Status::FORBIDDEN);
+                    return;
+                }
+                cache.put(user, generation);
+            }
+
             if (user.State == State::Blocked) {
                 /* user blocked */
                 Base::fail(resp, "UserBlocked",
@@ -207,38 +346,243 @@ namespace suil::nozama {
                 return;
             }
 
-            auto passwd2 = http::pbkdf2_sha1_hash(Gateway::get().PasswdKey())(data.Passwd, user.Salt);
-            if (user.Passwd != passwd2) {
+            auto& hasher = PasswdHasher::get();
+            bool matched{false}, verified{false};
+            deadline.check("kdf.verify");
+            {
+                Latency::Timer kdf(Timing, Latency::Kdf);
+                Tracing::Span verify(trace, "kdf.verify");
+                verified = hasher.verify(matched, user.Passwd, data.Passwd, user.Salt);
+            }
+            if (!verified) {
+                /* KDF executor saturated */
+                Base::fail(resp, "ServerBusy", "Server is busy, try again later");
+                resp.end(http::Status::SERVICE_UNAVAILABLE);
+                return;
+            }
+
+            if (!matched) {
                 /* invalid password provided */
                 Base::fail(resp, "InvalidPassword", "Invalid username/password");
                 resp.end(http::Status::FORBIDDEN);
                 return;
             }
 
+            if (hasher.needsRehash(user.Passwd)) {
+                /* password was hashed with old parameters, upgrade while we have the plain text */
+                try {
+                    String rehashed{};
+                    auto salt = hasher.salt(user.Email);
+                    bool hashed{false};
+                    {
+                        Latency::Timer kdf(Timing, Latency::Kdf);
+                        Tracing::Span rehash(trace, "kdf.rehash");
+                        hashed = hasher.hash(rehashed, data.Passwd, salt);
+                    }
+                    if (hashed) {
+                        Latency::Timer pg(Timing, Latency::Postgres);
+                        Tracing::Span query(trace, "postgres.users_set_passwd");
+                        /* writes go to the primary of the user's shard */
+                        scoped(primary, deadline.conn(pq));
+                        stmts(primary, deadline, Stmt::UserSetPasswd, rehashed, salt, user.Email, cache.channel());
+                        cache.evict(user.Email);
+                        Replicas::get().pin(user.Email);
+                    }
+                }
+                catch (...) {
+                    iwarn("/users/login rehashing password of '%s' failed: %s",
+                          user.Email(), Exception::fromCurrent().what());
+                }
+            }
+
             /* Login successful, generate token */
-            auto& acl = api.context<http::mw::JwtSession>(req);
+            deadline.check("redis.jwt_session");
+            Breaker::Call redisCall(Breakers::get().Redis);
+            if (!redisCall) {
+                unavailable(resp, Breakers::get().Redis);
+                return;
+            }
+            Latency::Timer redis(Timing, Latency::Redis);
+            Tracing::Span session(trace, "redis.jwt_session");
+            auto& acl = api.context<JwtSessions>(req);
             if (!acl.authorize(user.Email)) {
                 /* no token, create new token */
                 http::Jwt token;
                 token.aud(user.Email());
                 token.claims("id", 8999);
                 token.roles(user.Roles);
+                Revocations::stamp(token);
                 acl.authorize(std::move(token));
             }
+            if (RefreshTokens::get().enabled()) {
+                /* swapped on /users/refresh for new access tokens without the password */
+                scoped(client, api.template middleware<http::mw::Redis>().conn(0));
+                resp.header("X-Refresh-Token", RefreshTokens::get().issue(client, user.Email));
+            }
+            redisCall.ok();
             resp.setContentType("text/plain");
             resp.end();
         }
         catch (...) {
             /* unhandled error */
             ierror("/login %s", Exception::fromCurrent().what());
+            if (timedOut(req, resp)) {
+                return;
+            }
             Base::fail(resp, "InternalError",
                              "Processing login request failed, contact system administrator");
             resp.end(http::Status::INTERNAL_ERROR);
         }
     }
 
+    void Users::refreshToken(const http::Request &req, http::Response &resp)
+    {
+        http::RequestForm requestForm(req, {"Token"}, "\n");
+        typedef decltype(iod::D(
+                prop(Token, String))
+        ) RefreshData;
+        static Latency::Route Timing{"users_refresh"};
+        Latency::Timer total(Timing);
+        auto& trace = api.template context<Tracing>(req);
+        Tracing::Span span(trace, "users_refresh");
+        auto& deadline = api.template context<Deadline>(req);
+
+        resp.setContentType("application/json");
+        try {
+            RefreshData data;
+            auto why = requestForm >> data;
+            if (why) {
+                /* missing required fields */
+                Base::fail(resp, "MissingFields", std::move(why));
+                resp.end(http::Status::BAD_REQUEST);
+                return;
+            }
+
+            auto& refresh = RefreshTokens::get();
+            if (!refresh.enabled()) {
+                Base::fail(resp, "NotSupported", "Refresh tokens are not enabled");
+                resp.end(http::Status::NOT_FOUND);
+                return;
+            }
+
+            /* find the user the token is bound to, a reused token revokes its family */
+            deadline.check("redis.refresh_peek");
+            Breaker::Call redisCall(Breakers::get().Redis);
+            if (!redisCall) {
+                unavailable(resp, Breakers::get().Redis);
+                return;
+            }
+            String email{};
+            auto result = RefreshTokens::Invalid;
+            {
+                Latency::Timer redis(Timing, Latency::Redis);
+                Tracing::Span peek(trace, "redis.refresh_peek");
+                scoped(client, api.template middleware<http::mw::Redis>().conn(0));
+                result = refresh.peek(client, email, data.Token);
+                redisCall.ok();
+            }
+            if (result != RefreshTokens::Valid) {
+                Base::fail(resp, "InvalidToken", "Refresh token is invalid, expired or revoked, login again");
+                resp.end(http::Status::UNAUTHORIZED);
+                return;
+            }
+
+            /* only the state of the user is checked, the password was checked at login */
+            LoginUser user;
+            auto& cache = UserCache::get();
+            if (!cache.find(user, email)) {
+                auto generation = cache.generation();
+                static RoundTrips::Route Route{"users_refresh"};
+                deadline.check("postgres.conn");
+                Breaker::Call pgCall(Breakers::get().Postgres);
+                if (!pgCall) {
+                    unavailable(resp, Breakers::get().Postgres);
+                    return;
+                }
+                Replicas::Lease lease(Shards::get().pool(email), email);
+                Tracing::Span acquire(trace, "postgres.conn");
+                scoped(conn, connect(pgCall, deadline, lease));
+                pgCall.ok();
+                acquire.end();
+                RoundTrips trips(Route, conn);
+                bool found{false};
+                {
+                    Latency::Timer pg(Timing, Latency::Postgres);
+                    Tracing::Span query(trace, "postgres.users_login");
+                    found = Statements::get()(conn, deadline, Stmt::UserLogin, email) >> user;
+                }
+                if (!found) {
+                    Base::fail(resp, "UserNotRegistered", "User with email '", email, "' not registered");
+                    resp.end(http::Status::FORBIDDEN);
+                    return;
+                }
+                cache.put(user, generation);
+            }
+
+            if (user.State != State::Active) {
+                /* user blocked (or not verified) since the token was issued */
+                Base::fail(resp, "UserBlocked", "User with email '", email, "' is not active");
+                resp.end(http::Status::FORBIDDEN);
+                return;
+            }
+
+            /* spend the token last, a refresh refused above leaves it usable */
+            deadline.check("redis.refresh_rotate");
+            Breaker::Call sessionCall(Breakers::get().Redis);
+            if (!sessionCall) {
+                unavailable(resp, Breakers::get().Redis);
+                return;
+            }
+            {
+                Latency::Timer redis(Timing, Latency::Redis);
+                Tracing::Span rotate(trace, "redis.refresh_rotate");
+                scoped(client, api.template middleware<http::mw::Redis>().conn(0));
+                String next{}, bound{};
+                result = refresh.rotate(client, next, bound, data.Token);
+                if (result != RefreshTokens::Valid) {
+                    /* revoked or raced by another refresh since it was looked up */
+                    sessionCall.ok();
+                    Base::fail(resp, "InvalidToken", "Refresh token is invalid, expired or revoked, login again");
+                    resp.end(http::Status::UNAUTHORIZED);
+                    return;
+                }
+                /* set first, the spent token cannot be presented again even if the session fails */
+                resp.header("X-Refresh-Token", next);
+
+                /* a new access token, the old one expired or is about to */
+                Tracing::Span session(trace, "redis.jwt_session");
+                auto& acl = api.context<JwtSessions>(req);
+                http::Jwt token;
+                token.aud(user.Email());
+                token.claims("id", 8999);
+                token.roles(user.Roles);
+                Revocations::stamp(token);
+                acl.authorize(std::move(token));
+                sessionCall.ok();
+            }
+            resp.setContentType("text/plain");
+            resp.end();
+        }
+        catch (...) {
+            /* unhandled error */
+            ierror("/users/refresh %s", Exception::fromCurrent().what());
+            if (timedOut(req, resp)) {
+                return;
+            }
+            Base::fail(resp, "InternalError",
+                             "Processing refresh request failed, contact system administrator");
+            resp.end(http::Status::INTERNAL_ERROR);
+        }
+    }
+
     void Users::verifyUser(const suil::http::Request &req, suil::http::Response &resp)
     {
+        static Latency::Route Timing{"users_verify"};
+        Latency::Timer total(Timing);
+        auto& trace = api.template context<Tracing>(req);
+        Tracing::Span span(trace, "users_verify");
+        auto& deadline = api.template context<Deadline>(req);
+
         try {
             /* lookup user and token in database */
             auto email = req.query<String>("email");
@@ -251,24 +595,35 @@ namespace suil::nozama {
                 return;
             }
 
-            scoped(conn, api.template middleware<sql::mw::Postgres>().conn());
-            int found{0};
-            conn("SELECT COUNT(*) FROM users WHERE email = $1 and notes = $2")(email, token) >> found;
-            if (!found) {
-                /* does not exist */
-                Base::fail(resp, "InvalidRequest", "Account being verified does not exist or has invalid token");
-                resp.end(http::Status::BAD_REQUEST);
+            /* guessing verification tokens of an account */
+            if (!api.template middleware<RateLimit>().allow(api.template context<RateLimit>(req), resp, email)) {
                 return;
             }
 
-            /* account verified, update */
-            bool status = conn("UPDATE users SET State = $1, Notes = $2 WHERE email = $3")((int)State::Active, "", email)
-                    .status();
-            if (!status) {
-                /* updating server failed */
-                Base::fail(resp, "InternalError",
-                                 "Processing verify request failed, contact system administrator");
-                resp.end(http::Status::INTERNAL_ERROR);
+            static RoundTrips::Route Route{"users_verify"};
+            deadline.check("postgres.conn");
+            Breaker::Call pgCall(Breakers::get().Postgres);
+            if (!pgCall) {
+                unavailable(resp, Breakers::get().Postgres);
+                return;
+            }
+            Tracing::Span acquire(trace, "postgres.conn");
+            scoped(conn, connect(pgCall, deadline, Shards::get().pool(email)));
+            pgCall.ok();
+            acquire.end();
+            RoundTrips trips(Route, conn);
+            auto& cache = UserCache::get();
+            Latency::Timer pg(Timing, Latency::Postgres);
+            Tracing::Span query(trace, "postgres.users_verify");
+            /* account verified and updated only if the token matches */
+            auto updated = Statements::get()(conn, deadline, Stmt::UserVerify, (int)State::Active, email, token, cache.channel());
+            cache.evict(email);
+            /* login usually follows, it must see the account active */
+            Replicas::get().pin(email);
+            if (!updated.rows()) {
+                /* does not exist */
+                Base::fail(resp, "InvalidRequest", "Account being verified does not exist or has invalid token");
+                resp.end(http::Status::BAD_REQUEST);
                 return;
             }
 
@@ -278,6 +633,9 @@ namespace suil::nozama {
         } catch(...) {
             /* unhandled error */
             ierror("/users/verify %s", Exception::fromCurrent().what());
+            if (timedOut(req, resp)) {
+                return;
+            }
             Base::fail(resp, "InternalError",
                              "Processing account verification request failed, contact system administrator");
             resp.end(http::Status::INTERNAL_ERROR);
@@ -286,6 +644,12 @@ namespace suil::nozama {
 
     void Users::logoutUser(const suil::http::Request &req, suil::http::Response &resp)
     {
+        static Latency::Route Timing{"users_logout"};
+        Latency::Timer total(Timing);
+        auto& trace = api.template context<Tracing>(req);
+        Tracing::Span span(trace, "users_logout");
+        auto& deadline = api.template context<Deadline>(req);
+
         try {
             /* lookup user and token in database */
             auto email = req.query<String>("email");
@@ -297,8 +661,23 @@ namespace suil::nozama {
             }
 
             /* Nothing complicated, here, just revoke token */
-            auto& acl = api.template context<http::mw::JwtSession>(req);
-            acl.revoke(email);
+            deadline.check("redis.jwt_revoke");
+            Breaker::Call redisCall(Breakers::get().Redis);
+            if (!redisCall) {
+                unavailable(resp, Breakers::get().Redis);
+                return;
+            }
+            {
+                Latency::Timer redis(Timing, Latency::Redis);
+                Tracing::Span revoke(trace, "redis.jwt_revoke");
+                auto& acl = api.template context<JwtSessions>(req);
+                acl.revoke(email);
+                scoped(client, api.template middleware<http::mw::Redis>().conn(0));
+                JwtCache::get().revoke(client, email);
+                Revocations::get().revoke(client, email);
+                RefreshTokens::get().revoke(client, email);
+                redisCall.ok();
+            }
 
             resp << "Successfully logged out";
             resp.setContentType("text/plain");
@@ -306,6 +685,9 @@ namespace suil::nozama {
         } catch(...) {
             /* unhandled error */
             ierror("/users/logout %s", Exception::fromCurrent().what());
+            if (timedOut(req, resp)) {
+                return;
+            }
             Base::fail(resp, "InternalError", "Processing logout request failed, contact system administrator");
             resp.end(http::Status::INTERNAL_ERROR);
         }
@@ -313,6 +695,12 @@ namespace suil::nozama {
 
     void Users::blockUser(const http::Request &req, http::Response &resp)
     {
+        static Latency::Route Timing{"users_block"};
+        Latency::Timer total(Timing);
+        auto& trace = api.template context<Tracing>(req);
+        Tracing::Span span(trace, "users_block");
+        auto& deadline = api.template context<Deadline>(req);
+
         try {
             auto email = req.query<String>("email");
             auto reason = req.query<String>("reason");
@@ -325,34 +713,58 @@ namespace suil::nozama {
             }
 
             // Revoke all tokens associated with the account to block
-            auto& acl = api.template context<http::mw::JwtSession>(req);
-            acl.revoke(email);
+            deadline.check("redis.jwt_revoke");
+            Breaker::Call redisCall(Breakers::get().Redis);
+            if (!redisCall) {
+                unavailable(resp, Breakers::get().Redis);
+                return;
+            }
+            {
+                Latency::Timer redis(Timing, Latency::Redis);
+                Tracing::Span revoke(trace, "redis.jwt_revoke");
+                auto& acl = api.template context<JwtSessions>(req);
+                acl.revoke(email);
+                scoped(client, api.template middleware<http::mw::Redis>().conn(0));
+                JwtCache::get().revoke(client, email);
+                Revocations::get().revoke(client, email);
+                RefreshTokens::get().revoke(client, email);
+                redisCall.ok();
+            }
 
             // set account status to blocked
-            scoped(conn, api.template middleware<sql::mw::Postgres>().conn());
-            int found{0};
-            conn("SELECT COUNT(*) FROM users WHERE email = $1")(email) >> found;
-            if (!found) {
-                /* does not exist */
-                Base::fail(resp, "InvalidRequest", "Account being verified does not exist");
-                resp.end(http::Status::BAD_REQUEST);
+            static RoundTrips::Route Route{"users_block"};
+            deadline.check("postgres.conn");
+            Breaker::Call pgCall(Breakers::get().Postgres);
+            if (!pgCall) {
+                unavailable(resp, Breakers::get().Postgres);
                 return;
             }
-
+            Tracing::Span acquire(trace, "postgres.conn");
+            scoped(conn, connect(pgCall, deadline, Shards::get().pool(email)));
+            pgCall.ok();
+            acquire.end();
+            RoundTrips trips(Route, conn);
+            auto& cache = UserCache::get();
+            Latency::Timer pg(Timing, Latency::Postgres);
+            Tracing::Span query(trace, "postgres.users_block");
             /* update account, set it's status to blocked */
-            bool status = conn("UPDATE users SET State = $1, Notes = $2 WHERE email = $3")
-                              ((int)State::Blocked, reason, email).status();
-            if (!status) {
-                /* updating server failed */
-                Base::fail(resp, "InternalError",
-                           "Processing account block status failed");
-                resp.end(http::Status::INTERNAL_ERROR);
+            auto updated = Statements::get()(conn, deadline, Stmt::UserBlock, (int)State::Blocked, reason, email, cache.channel());
+            /* a cached record would let the blocked user keep logging in */
+            cache.evict(email);
+            Replicas::get().pin(email);
+            if (!updated.rows()) {
+                /* does not exist */
+                Base::fail(resp, "InvalidRequest", "Account being verified does not exist");
+                resp.end(http::Status::BAD_REQUEST);
                 return;
             }
         }
         catch (...) {
             /* unhandled error */
             ierror("/users/block %s", Exception::fromCurrent().what());
+            if (timedOut(req, resp)) {
+                return;
+            }
             Base::fail(resp, "InternalError", "Processing logout request failed, contact system administrator");
             resp.end(http::Status::INTERNAL_ERROR);
         }
@@ -373,4 +785,23 @@ namespace suil::nozama {
         catch(...) {
         }
     }
+
+    bool Users::timedOut(const http::Request& req, http::Response& resp)
+    {
+        if (!api.template context<Deadline>(req).expired()) {
+            return false;
+        }
+        resp.clear();
+        Base::fail(resp, "DeadlineExceeded", "Request could not be completed in time, try again later");
+        resp.end(http::Status::GATEWAY_TIMEOUT);
+        return true;
+    }
+
+    void Users::unavailable(http::Response& resp, const Breaker& breaker)
+    {
+        /* the dependency is known to be down, fail without waiting on it */
+        Base::fail(resp, "ServiceUnavailable", "Service temporarily unavailable, try again later");
+        resp.header("Retry-After", std::max(breaker.retryAfter(), int64_t{1}));
+        resp.end(http::Status::SERVICE_UNAVAILABLE);
+    }
 }
\ No newline at end of file
@@ -6,9 +6,27 @@
 #define SUIL_USERS_H
 
 #include "common.h"
+#include "templates.h"
 
 namespace suil::nozama {
 
+    /**
+     * Fields of the account verification email
+     */
+    struct VerifyAccountMail {
+        static constexpr const char *Template = "_verify_account.html";
+        static const Templates::Field<VerifyAccountMail> Fields[];
+
+        String name;
+        String endpoint;
+        /// url encoded verification token
+        String token;
+        /// url encoded email address
+        String email;
+    };
+
+    struct Breaker;
+
     struct Users final : Endpoint::Controller, LOGGER(NZM_GATEWAY) {
         using Base = typename Endpoint::Controller;
 
@@ -41,6 +59,10 @@ namespace suil::nozama {
         [[desc("Login a user into semausu system")]]
         void loginUser(const http::Request& req, http::Response& resp);
 
+        [[method("POST")]]
+        [[desc("Swaps a refresh token for a new access token and refresh token")]]
+        void refreshToken(const http::Request& req, http::Response& resp);
+
         [[method("GET")]]
         [[desc("Verifies a user account that was registered")]]
         void verifyUser(const http::Request& req, http::Response& resp);
@@ -56,6 +78,17 @@ namespace suil::nozama {
         [[method("POST")]]
         [[desc("Changes a user password")]]
         void changePasswd(const http::Request& req, http::Response& resp);
+
+        /**
+         * Answers 504 if the request failed because its deadline passed
+         * @return true if the response was ended
+         */
+        bool timedOut(const http::Request& req, http::Response& resp);
+
+        /**
+         * Answers 503 because the circuit breaker of a dependency is open
+         */
+        void unavailable(http::Response& resp, const Breaker& breaker);
 #ifdef SWEPT
         /*
          * The following list of routes are available on swept builds only
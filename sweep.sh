@@ -7,7 +7,7 @@ WAITFOR=`pwd`/wait_for
 
 cd "${ROOT_DIR}"
 # Create directories needed by docker-compose containers
-mkdir -p ${RUNTIME_DIR}/{postgres,redis,semausu,smtp4dev}
+mkdir -p ${RUNTIME_DIR}/{postgres,postgres-shard,redis,semausu,smtp4dev}
 # Append variables used in docker-compose
 echo "RUNTIME_DIR=${RUNTIME_DIR}" >> .env
 echo "SEMAUSU_VERSION=${CI_COMMIT_SHORT_SHA}" >> .env
@@ -0,0 +1,139 @@
+//
+// Created by Carter Mbotho on 2020-04-23.
+//
+
+#include <catch/catch.hpp>
+
+#include <chrono>
+
+#include "../src/gateway/admission.h"
+#include "fixtures.h"
+
+using namespace suil;
+using namespace suil::nozama;
+
+namespace {
+
+    Admission::Config config(double limit, size_t queue, int64_t wait) {
+        Admission::Config config;
+        Admission::Limits login;
+        login.path  = "/users/login";
+        login.limit = limit;
+        login.min   = 2;
+        login.max   = 100;
+        login.queue = queue;
+        login.wait  = wait;
+        config.routes.push_back(std::move(login));
+        config.retryAfter = 3;
+        return config;
+    }
+
+    /// releases an admitted request as if it took the given time
+    void complete(Admission& adm, Admission::Context& ctx, int64_t us, bool failed = false) {
+        using namespace std::chrono;
+        ctx.start = duration_cast<microseconds>(steady_clock::now().time_since_epoch()).count() - us;
+        adm.release(ctx, failed);
+    }
+
+    struct Waiting {
+        Admission::Context ctx{0};
+        bool done{false};
+        bool admitted{false};
+    };
+
+    coroutine void waitSlot(Admission& adm, Waiting& w) {
+        w.admitted = adm.admit(w.ctx);
+        w.done = true;
+    }
+}
+
+TEST_CASE("Admission control", "[admission]")
+{
+    auto& adm = test::fixture<Admission>();
+
+    SECTION("Controlled routes") {
+        adm.setup(config(10, 0, 0));
+        REQUIRE(adm.route("/users/login") == 0);
+        REQUIRE(adm.route("/users/register") == -1);
+        REQUIRE(adm.retryAfter() == 3);
+    }
+
+    SECTION("Gradient limit") {
+        adm.setup(config(10, 0, 0));
+        Admission::Context ctxs[10];
+        // a busy route with steady latency grows its limit
+        for (int round = 0; round < 5; round++) {
+            for (auto& ctx: ctxs) {
+                ctx.route = 0;
+                REQUIRE(adm.admit(ctx));
+            }
+            for (auto& ctx: ctxs) {
+                complete(adm, ctx, 10000);
+            }
+        }
+        auto grown = adm.limit(0);
+        REQUIRE(grown > 10);
+
+        // latency growing over the tolerance shrinks it
+        Admission::Context ctx{0};
+        for (int i = 0; i < 5; i++) {
+            REQUIRE(adm.admit(ctx));
+            complete(adm, ctx, 100000);
+        }
+        auto shrunk = adm.limit(0);
+        REQUIRE(shrunk < grown);
+
+        // server errors shrink it down to the minimum, never below
+        for (int i = 0; i < 50; i++) {
+            REQUIRE(adm.admit(ctx));
+            complete(adm, ctx, 10000, true);
+        }
+        REQUIRE(adm.limit(0) < shrunk);
+        REQUIRE(adm.limit(0) == Approx(2));
+    }
+
+    SECTION("Queue overflow") {
+        adm.setup(config(2, 1, 1000));
+        Admission::Context a{0}, b{0};
+        REQUIRE(adm.admit(a));
+        REQUIRE(adm.admit(b));
+
+        // over the limit, the next request waits for a slot
+        Waiting w;
+        go(waitSlot(adm, w));
+        yield();
+        REQUIRE_FALSE(w.done);
+
+        // the queue is full, shed right away
+        Admission::Context c{0};
+        auto started = mnow();
+        REQUIRE_FALSE(adm.admit(c));
+        REQUIRE(mnow() - started < 100);
+
+        // a released slot goes to the waiter
+        complete(adm, a, 1000);
+        while (!w.done) {
+            yield();
+        }
+        REQUIRE(w.admitted);
+        complete(adm, b, 1000);
+        complete(adm, w.ctx, 1000);
+    }
+
+    SECTION("Wait expiry") {
+        adm.setup(config(2, 4, 50));
+        Admission::Context a{0}, b{0}, c{0};
+        REQUIRE(adm.admit(a));
+        REQUIRE(adm.admit(b));
+        // no slot is freed, the request is shed once its wait expires
+        auto started = mnow();
+        REQUIRE_FALSE(adm.admit(c));
+        REQUIRE(mnow() - started >= 50);
+        complete(adm, a, 1000);
+        complete(adm, b, 1000);
+        // a shed request has nothing to release
+        adm.release(c, false);
+        REQUIRE(adm.admit(c));
+        complete(adm, c, 1000);
+    }
+}
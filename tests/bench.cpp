@@ -0,0 +1,455 @@
+//
+// Created by Carter Mbotho on 2020-04-08.
+//
+
+#include <suil/init.h>
+#include <suil/http/validators.h>
+#include <suil/http/endpoint.h>
+
+#include <chrono>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "../src/gateway/pbkdf2.h"
+#include "../src/gateway/statements.h"
+#include "../src/gateway/smtp.h"
+#include "../src/gateway/templates.h"
+
+using namespace suil;
+using namespace suil::nozama;
+
+namespace {
+
+    /// the parameters of the legacy hash, the only one the multi-buffer engine computes
+    constexpr uint32_t ITERATIONS{1000};
+    constexpr size_t   KEYLEN{20};
+    constexpr const char *PASSWDKEY{"8xF1nfomq1u5LzVB"};
+    constexpr size_t   ROUNDS{64};
+    /// minimum time a primitive is repeated for, in seconds
+    constexpr double   MIN_TIME{0.2};
+
+    /**
+     * Results of the run, printed as they come and saved as JSON at the end
+     * so that runs of two builds can be compared
+     */
+    struct Results {
+        struct Entry {
+            std::string name;
+            double      value;
+            const char *unit;
+        };
+
+        void add(const std::string& name, double value, const char *unit) {
+            printf("%-28s %10.1f %s\n", name.c_str(), value, unit);
+            entries.push_back(Entry{name, value, unit});
+        }
+
+        void toJson(OBuffer& ob) const {
+            char num[32];
+            ob << "{\"version\":\"" << APP_VERSION << "\""
+               << ",\"lanes\":" << kdf::pbkdf2_lanes()
+               << ",\"results\":[";
+            for (size_t i = 0; i < entries.size(); i++) {
+                snprintf(num, sizeof(num), "%.3f", entries[i].value);
+                ob << (i? ",{" : "{")
+                   << "\"name\":\"" << entries[i].name << "\""
+                   << ",\"value\":" << num
+                   << ",\"unit\":\"" << entries[i].unit << "\"}";
+            }
+            ob << "]}\n";
+        }
+
+        std::vector<Entry> entries{};
+    };
+    Results sResults;
+
+    /// allocations made by the process, counted by malloc below
+    size_t sAllocations{0};
+
+    /**
+     * Repeats {@param func} until it ran for at least MIN_TIME
+     * @return the average time of a call in nanoseconds
+     */
+    template <typename Func>
+    double nsPerOp(Func&& func)
+    {
+        size_t ops{0}, batch{16};
+        std::chrono::duration<double> elapsed{0};
+        auto started = std::chrono::steady_clock::now();
+        while (elapsed.count() < MIN_TIME) {
+            for (size_t i = 0; i < batch; i++) {
+                func();
+            }
+            ops += batch;
+            batch *= 2;
+            elapsed = std::chrono::steady_clock::now() - started;
+        }
+        return elapsed.count() * 1e9 / ops;
+    }
+
+    /**
+     * Fields of the account verification email, a copy of the gateway's
+     * model which cannot be linked without the whole controller
+     */
+    struct VerifyMail {
+        static constexpr const char *Template = "_verify_account.html";
+        static const Templates::Field<VerifyMail> Fields[];
+        String name;
+        String endpoint;
+        String token;
+        String email;
+    };
+
+    const Templates::Field<VerifyMail> VerifyMail::Fields[] = {
+        {"name",     &VerifyMail::name},
+        {"endpoint", &VerifyMail::endpoint},
+        {"token",    &VerifyMail::token},
+        {"email",    &VerifyMail::email},
+        {nullptr,    nullptr}
+    };
+
+    template <typename Func>
+    double hashesPerSec(size_t hashes, Func&& func)
+    {
+        auto started = std::chrono::steady_clock::now();
+        func();
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - started;
+        return hashes / elapsed.count();
+    }
+
+    void benchPbkdf2()
+    {
+        String passwd{"correct horse battery staple"};
+        auto userSalt = http::rand_8byte_salt()(String{"bench@semausu.com"});
+        // derived like the gateway derives legacy hashes, comparable to suil's hash
+        auto salt = kdf::legacy_salt(PASSWDKEY, strlen(PASSWDKEY), userSalt.data(), userSalt.size());
+        uint8_t dk[8][KEYLEN];
+
+        auto scalar = hashesPerSec(ROUNDS, [&] {
+            for (size_t i = 0; i < ROUNDS; i++) {
+                kdf::Pbkdf2Job job{(const uint8_t *) passwd.data(), passwd.size(),
+                                   (const uint8_t *) salt.data(), salt.size(),
+                                   ITERATIONS, dk[0], sizeof(dk[0])};
+                kdf::pbkdf2_sha1_scalar(job);
+            }
+        });
+        sResults.add("pbkdf2/scalar", scalar, "hashes/s");
+
+        for (size_t batch: {2, 4, 8}) {
+            std::vector<kdf::Pbkdf2Job> jobs;
+            for (size_t i = 0; i < batch; i++) {
+                jobs.push_back(kdf::Pbkdf2Job{(const uint8_t *) passwd.data(), passwd.size(),
+                                              (const uint8_t *) salt.data(), salt.size(),
+                                              ITERATIONS, dk[i], sizeof(dk[i])});
+            }
+            auto batched = hashesPerSec(ROUNDS, [&] {
+                for (size_t i = 0; i < ROUNDS; i += batch) {
+                    kdf::pbkdf2_sha1(jobs.data(), jobs.size());
+                }
+            });
+            sResults.add("pbkdf2/batch" + std::to_string(batch), batched, "hashes/s");
+        }
+
+        // the hash the gateway falls back to when the engine does not reproduce it
+        auto suilHash = hashesPerSec(ROUNDS, [&] {
+            for (size_t i = 0; i < ROUNDS; i++) {
+                auto hashed = http::pbkdf2_sha1_hash(PASSWDKEY)(passwd, userSalt);
+                (void) hashed;
+            }
+        });
+        sResults.add("http::pbkdf2_sha1_hash", suilHash, "hashes/s");
+
+        kdf::Pbkdf2Job job{(const uint8_t *) passwd.data(), passwd.size(),
+                           (const uint8_t *) salt.data(), salt.size(),
+                           ITERATIONS, dk[0], sizeof(dk[0])};
+        kdf::pbkdf2_sha1_scalar(job);
+        std::string derived;
+        for (auto b: dk[0]) {
+            derived += "0123456789abcdef"[b >> 4];
+            derived += "0123456789abcdef"[b & 0x0F];
+        }
+        auto expected = http::pbkdf2_sha1_hash(PASSWDKEY)(passwd, userSalt);
+        if (expected != String{derived.c_str()}) {
+            fprintf(stderr, "pbkdf2 engine does not reproduce http::pbkdf2_sha1_hash, not like for like\n");
+        }
+    }
+
+    template <typename Func>
+    double usPerRequest(size_t requests, Func&& func)
+    {
+        auto started = std::chrono::steady_clock::now();
+        func();
+        std::chrono::duration<double, std::micro> elapsed = std::chrono::steady_clock::now() - started;
+        return elapsed.count() / requests;
+    }
+
+    void benchStatements(const char *connStr)
+    {
+        constexpr size_t REQUESTS{2000};
+        sql::mw::Postgres pq;
+        pq.setup(connStr, opt(ASYNC, true), opt(TIMEOUT, 5000));
+        scoped(conn, pq.conn());
+        String email{"bench@semausu.com"};
+        auto& stmts = Statements::get();
+
+        // same round trips, postgres parses and plans the text statement every time
+        auto text = usPerRequest(REQUESTS, [&] {
+            for (size_t i = 0; i < REQUESTS; i++) {
+                User user;
+                conn(Statements::sql(Stmt::UserByEmail))(email) >> user;
+            }
+        });
+        stmts.prepare(conn);
+        auto prepared = usPerRequest(REQUESTS, [&] {
+            for (size_t i = 0; i < REQUESTS; i++) {
+                User user;
+                stmts(conn, Stmt::UserByEmail, email) >> user;
+            }
+        });
+        sResults.add("pgsql/text", text, "us/request");
+        sResults.add("pgsql/prepared", prepared, "us/request");
+
+        // what a login lookup transfers and allocates, the full record against the login projection
+        auto lookup = [&](const char *name, auto&& read) {
+            size_t bytes{0}, allocations{sAllocations};
+            for (size_t i = 0; i < REQUESTS; i++) {
+                bytes += read();
+            }
+            allocations = sAllocations - allocations;
+            sResults.add(std::string{"pgsql/"} + name + "/bytes", (double) bytes / REQUESTS, "bytes/request");
+#ifdef __GLIBC__
+            sResults.add(std::string{"pgsql/"} + name + "/allocs", (double) allocations / REQUESTS, "allocs/request");
+#endif
+        };
+        lookup("users_by_email", [&] {
+            User user;
+            auto res = stmts(conn, Stmt::UserByEmail, email);
+            res >> user;
+            return res.bytes();
+        });
+        lookup("users_login", [&] {
+            LoginUser user;
+            auto res = stmts(conn, Stmt::UserLogin, email);
+            res >> user;
+            return res.bytes();
+        });
+    }
+
+    void benchSmtp(const char *server)
+    {
+        constexpr size_t MESSAGES{1000};
+        String to{"bench@semausu.com"}, subject{"Benchmark"}, type{"text/html"};
+        String body{"<html><body><p>Verify your account <a href=\"#\">here</a></p></body></html>"};
+        std::string host{server};
+        int port{25};
+        auto colon = host.find(':');
+        if (colon != std::string::npos) {
+            port = atoi(host.c_str() + colon + 1);
+            host.resize(colon);
+        }
+
+        for (bool pipelining: {false, true}) {
+            for (size_t connections: {1, 4, 8}) {
+                SmtpPool::Config config;
+                config.host        = String{host.c_str()}.dup();
+                config.port        = port;
+                config.senderEmail = "gateway@semausu.com";
+                config.connections = connections;
+                config.pipelining  = pipelining;
+                auto& pool = SmtpPool::get();
+                pool.setup(std::move(config));
+
+                std::vector<SmtpPool::Message> messages;
+                for (size_t i = 0; i < MESSAGES; i++) {
+                    messages.push_back(SmtpPool::Message{&to, &subject, &type, &body});
+                }
+                auto started = std::chrono::steady_clock::now();
+                pool.send(messages);
+                std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - started;
+                size_t sent{0};
+                for (auto& msg: messages) sent += msg.Sent;
+                sResults.add(std::string{"smtp/"} + (pipelining? "pipeline" : "serial") + "/x" + std::to_string(connections),
+                             sent / elapsed.count(), "msgs/s");
+            }
+        }
+    }
+
+    void benchPrimitives()
+    {
+        String email{"bench@semausu.com"};
+        String passwd{"correct horse battery staple"};
+
+        sResults.add("http::rand_8byte_salt", nsPerOp([&] {
+            auto salt = http::rand_8byte_salt()(email);
+            (void) salt;
+        }), "ns/op");
+
+        http::validators::Email emailValidator;
+        sResults.add("validators::Email", nsPerOp([&] {
+            bool valid = emailValidator(email);
+            (void) valid;
+        }), "ns/op");
+
+        http::validators::Password passwdValidator;
+        sResults.add("validators::Password", nsPerOp([&] {
+            OBuffer why;
+            bool valid = passwdValidator(why, passwd);
+            (void) valid;
+        }), "ns/op");
+
+        // same claims as the tokens issued by /users/login
+        String key{"fTjWnZr4u7x!A%C*F-JaNdRgUkXp2s5v"};
+        std::vector<String> roles{String{"User"}, String{"Admin"}};
+        String encoded{};
+        sResults.add("jwt/encode", nsPerOp([&] {
+            http::Jwt token;
+            token.aud(email());
+            token.claims("id", 8999);
+            token.roles(roles);
+            encoded = token.encode(key);
+        }), "ns/op");
+        sResults.add("jwt/verify", nsPerOp([&] {
+            http::Jwt token;
+            bool valid = http::Jwt::decode(token, encoded.dup(), key);
+            (void) valid;
+        }), "ns/op");
+    }
+
+    void benchTemplates(const char *dir)
+    {
+        auto& templates = Templates::get();
+        try {
+            templates.setup(dir, false);
+        }
+        catch (...) {
+            fprintf(stderr, "skipping templates: %s\n", Exception::fromCurrent().what());
+            return;
+        }
+        VerifyMail mail;
+        mail.name     = "Bench";
+        mail.endpoint = "gty.semausu.com";
+        mail.token    = utils::urlencode(utils::uuidstr());
+        mail.email    = utils::urlencode(String{"bench@semausu.com"});
+        OBuffer ob{4096};
+        sResults.add("templates/verify_account", nsPerOp([&] {
+            ob.clear();
+            templates.render(ob, mail);
+        }), "ns/op");
+    }
+
+    coroutine void serve(http::Endpoint<>& ep)
+    {
+        ep.start();
+    }
+
+    void post(int port, const char *path, const char *contentType, const char *body)
+    {
+        auto addr = ipremote("127.0.0.1", port, 0, utils::after(5000));
+        TcpSock sock;
+        if (!sock.connect(addr, 5000)) {
+            throw Exception::create("connecting to bench endpoint failed: ", errno_s);
+        }
+        OBuffer ob{512};
+        ob << "POST " << path << " HTTP/1.1\r\n"
+           << "Host: 127.0.0.1\r\n"
+           << "Connection: close\r\n"
+           << "Content-Type: " << contentType << "\r\n"
+           << "Content-Length: " << strlen(body) << "\r\n\r\n"
+           << body;
+        sock.send(ob.data(), ob.size(), 5000);
+        sock.flush(5000);
+        // the handler does all the work, wait for it to reply
+        char buf[1024];
+        size_t len{sizeof(buf)};
+        sock.receiveUntil(buf, len, "\n", 1, 60000);
+        sock.close();
+    }
+
+    void benchRequests()
+    {
+        // RequestForm and toJson parse requests, they are measured inside handlers
+        constexpr int PORT{10099};
+        http::Endpoint<> ep("", opt(port, PORT), opt(name, "127.0.0.1"));
+
+        eproute(ep, "/form")
+        ("POST"_method)
+        .attrs(opt(PARSE_FORM, true))
+        ([](const http::Request& req, http::Response& resp) {
+            sResults.add("http::RequestForm >> User", nsPerOp([&] {
+                http::RequestForm requestForm(req, {"FirstName", "LastName", "Email", "Passwd"}, ", ");
+                User user;
+                auto why = requestForm >> user;
+                (void) why;
+            }), "ns/op");
+            resp.end();
+        });
+
+        eproute(ep, "/json")
+        ("POST"_method)
+        ([](const http::Request& req, http::Response& resp) {
+            sResults.add("req.toJson<InitRequest>", nsPerOp([&] {
+                auto init = req.toJson<InitRequest>();
+                (void) init;
+            }), "ns/op");
+            resp.end();
+        });
+
+        go(serve(ep));
+        msleep(utils::after(100));
+        post(PORT, "/form", "application/x-www-form-urlencoded",
+             "FirstName=Bench&LastName=User&Email=bench%40semausu.com&Passwd=benchPass1");
+        post(PORT, "/json", "application/json",
+             R"({"Administrator": {"Email": "bench@semausu.com", "FirstName": "Bench", )"
+             R"("LastName": "User", "Passwd": "benchPass1"}})");
+        ep.stop();
+    }
+}
+
+#ifdef __GLIBC__
+extern "C" void *__libc_malloc(size_t size);
+
+extern "C" void *malloc(size_t size) noexcept
+{
+    // counts the allocations of the process, libpq's included
+    sAllocations++;
+    return __libc_malloc(size);
+}
+#endif
+
+int main(int argc, char *argv[])
+{
+    suil::init(opt(printinfo, false));
+    log::setup(opt(verbose, log::ERROR));
+
+    printf("gateway-bench {lanes: %zu, iterations: %u}\n", kdf::pbkdf2_lanes(), ITERATIONS);
+    benchPbkdf2();
+    benchPrimitives();
+    benchRequests();
+    // templates of the source tree, e.g SEMAUSU_BENCH_TEMPLATES=res/templates
+    auto templatesDir = getenv("SEMAUSU_BENCH_TEMPLATES");
+    benchTemplates(templatesDir? templatesDir : "res/templates");
+    // needs a database with the users table, e.g SEMAUSU_BENCH_PG="host=localhost dbname=build user=build"
+    auto connStr = getenv("SEMAUSU_BENCH_PG");
+    if (connStr != nullptr) {
+        benchStatements(connStr);
+    }
+    // a local SMTP sink, e.g SEMAUSU_BENCH_SMTP="localhost:3025" with the swept smtp4dev container
+    auto smtpServer = getenv("SEMAUSU_BENCH_SMTP");
+    if (smtpServer != nullptr) {
+        benchSmtp(smtpServer);
+    }
+
+    // compare with the results of another build, e.g SEMAUSU_BENCH_JSON=bench-$(git rev-parse --short HEAD).json
+    auto output = getenv("SEMAUSU_BENCH_JSON");
+    OBuffer ob{4096};
+    sResults.toJson(ob);
+    String path{output? output : "gateway-bench.json"};
+    if (utils::fs::exists(path())) {
+        utils::fs::remove(path());
+    }
+    size_t size{ob.size()};
+    utils::fs::append(path(), ob.data(), size);
+    printf("results written to %s\n", path());
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,121 @@
+//
+// Created by Carter Mbotho on 2020-04-25.
+//
+
+#include <catch/catch.hpp>
+
+#include "../src/gateway/breaker.h"
+#include "../src/gateway/clock.h"
+#include "fixtures.h"
+
+using namespace suil;
+using namespace suil::nozama;
+
+namespace {
+
+    Breaker::Config config() {
+        Breaker::Config config;
+        config.errorRate = 0.5;
+        config.slow      = 100;
+        config.slowRate  = 0.8;
+        config.minCalls  = 4;
+        config.window    = 60000;
+        config.cooldown  = 50;
+        config.probes    = 2;
+        return config;
+    }
+
+    void calls(Breaker& b, size_t n, bool ok, int64_t us = 1000) {
+        for (size_t i = 0; i < n; i++) {
+            REQUIRE(b.allow());
+            b.record(ok, us);
+        }
+    }
+}
+
+TEST_CASE("Circuit breaker", "[breaker]")
+{
+    auto& b = test::fixture<Breaker>("test");
+    b.setup(config());
+    REQUIRE(b.state() == Breaker::Closed);
+
+    SECTION("Minimum calls") {
+        // every call failed, but too few to judge postgres
+        calls(b, 3, false);
+        REQUIRE(b.state() == Breaker::Closed);
+        REQUIRE(b.retryAfter() == 0);
+        calls(b, 1, false);
+        REQUIRE(b.state() == Breaker::Open);
+    }
+
+    SECTION("Error and slow rates") {
+        // below the error rate
+        calls(b, 3, true);
+        calls(b, 2, false);
+        REQUIRE(b.state() == Breaker::Closed);
+        calls(b, 1, false);
+        REQUIRE(b.state() == Breaker::Open);
+
+        // slow calls open it on their own
+        b.setup(config());
+        calls(b, 4, true, 200000);
+        REQUIRE(b.state() == Breaker::Open);
+    }
+
+    SECTION("Closed, open, half-open and closed again") {
+        calls(b, 4, false);
+        REQUIRE(b.state() == Breaker::Open);
+        // calls are refused until the cool down passes
+        REQUIRE_FALSE(b.allow());
+        REQUIRE(b.retryAfter() >= 1);
+        Clock::advance(60);
+
+        // only as many probes as configured go through
+        REQUIRE(b.allow());
+        REQUIRE(b.state() == Breaker::HalfOpen);
+        REQUIRE(b.allow());
+        REQUIRE_FALSE(b.allow());
+
+        // all the probes succeeded
+        b.record(true, 1000);
+        REQUIRE(b.state() == Breaker::HalfOpen);
+        b.record(true, 1000);
+        REQUIRE(b.state() == Breaker::Closed);
+        REQUIRE(b.allow());
+    }
+
+    SECTION("A failed probe opens the breaker again") {
+        calls(b, 4, false);
+        Clock::advance(60);
+        REQUIRE(b.allow());
+        b.record(false, 1000);
+        REQUIRE(b.state() == Breaker::Open);
+        REQUIRE_FALSE(b.allow());
+    }
+
+    SECTION("Scoped calls") {
+        for (int i = 0; i < 4; i++) {
+            // a call not marked ok is a failure
+            Breaker::Call call(b);
+            REQUIRE(call);
+        }
+        REQUIRE(b.state() == Breaker::Open);
+        Breaker::Call refused(b);
+        REQUIRE_FALSE(refused);
+    }
+
+    SECTION("Abandoned calls are not recorded") {
+        calls(b, 4, false);
+        Clock::advance(60);
+        {
+            // e.g the request deadline passed, the probe slot is handed back
+            Breaker::Call call(b);
+            REQUIRE(call);
+            call.abandon();
+        }
+        REQUIRE(b.state() == Breaker::HalfOpen);
+        REQUIRE(b.allow());
+        REQUIRE(b.allow());
+        REQUIRE_FALSE(b.allow());
+    }
+}
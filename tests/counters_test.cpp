@@ -0,0 +1,63 @@
+//
+// Created by Carter Mbotho on 2020-04-19.
+//
+
+#include <catch/catch.hpp>
+
+#include <string>
+
+#include "../src/gateway/counters.h"
+
+using namespace suil;
+using namespace suil::nozama;
+
+TEST_CASE("Latency histograms", "[counters][histogram]")
+{
+    SECTION("Bucketing values") {
+        for (uint64_t v = 0; v < 8; v++) {
+            REQUIRE(Histogram::index(v) == v);
+        }
+        REQUIRE(Histogram::index(8) == 8);
+        REQUIRE(Histogram::index(15) == 15);
+        REQUIRE(Histogram::index(16) == 16);
+        REQUIRE(Histogram::index(17) == 16);
+        for (uint64_t v: {9ul, 100ul, 1000ul, 123456ul, 10000000ul}) {
+            auto i = Histogram::index(v);
+            REQUIRE(Histogram::lowest(i) <= v);
+            REQUIRE(Histogram::lowest(i + 1) > v);
+            // at most 12.5% off
+            REQUIRE((v - Histogram::lowest(i)) * 8 <= v);
+        }
+        REQUIRE(Histogram::index(UINT64_MAX) == Histogram::Buckets - 1);
+    }
+
+    SECTION("Quantiles") {
+        Histogram h{"test_duration_seconds", "test", ""};
+        for (uint64_t v = 1; v <= 1000; v++) {
+            h.record(v);
+        }
+        REQUIRE(h.count() == 1000);
+        REQUIRE(h.sum() == 500500);
+        auto p50 = h.quantile(0.5);
+        REQUIRE(p50 >= 440);
+        REQUIRE(p50 <= 500);
+        REQUIRE(h.quantile(0.999) >= 896);
+    }
+
+    SECTION("Prometheus exposition") {
+        auto& counters = Counters::get();
+        counters.histogram("test_latency_seconds", "test", "route=\"a\"").record(150);
+        counters.histogram("test_latency_seconds", "test", "route=\"b\"").record(2000000);
+        counters.histogram("test_latency_seconds", "test", "route=\"a\"").record(90);
+        OBuffer ob{1024};
+        counters.toPrometheus(ob);
+        std::string out(ob.data(), ob.size());
+        REQUIRE(out.find("# TYPE semausu_test_latency_seconds histogram") != std::string::npos);
+        REQUIRE(out.find("semausu_test_latency_seconds_bucket{route=\"a\",le=\"0.0001\"} 1\n") != std::string::npos);
+        REQUIRE(out.find("semausu_test_latency_seconds_bucket{route=\"a\",le=\"0.00025\"} 2\n") != std::string::npos);
+        REQUIRE(out.find("semausu_test_latency_seconds_bucket{route=\"b\",le=\"2.5\"} 1\n") != std::string::npos);
+        REQUIRE(out.find("semausu_test_latency_seconds_count{route=\"a\"} 2\n") != std::string::npos);
+        // the family is only described once
+        REQUIRE(out.find("# TYPE semausu_test_latency_seconds") == out.rfind("# TYPE semausu_test_latency_seconds"));
+    }
+}
@@ -0,0 +1,23 @@
+//
+// Created by Carter Mbotho on 2020-05-02.
+//
+
+#ifndef SUIL_FIXTURES_H
+#define SUIL_FIXTURES_H
+
+#include <utility>
+
+namespace suil::nozama::test {
+
+    /**
+     * The instance of a gateway component shared by the sections of a test case.
+     * Components register gauges that sample them, the instance lives until the
+     * process exits. The arguments only construct the first instance
+     */
+    template <typename T, typename... Args>
+    T& fixture(Args&&... args) {
+        static T sInstance{std::forward<Args>(args)...};
+        return sInstance;
+    }
+}
+#endif //SUIL_FIXTURES_H
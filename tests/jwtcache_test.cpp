@@ -0,0 +1,76 @@
+//
+// Created by Carter Mbotho on 2020-04-26.
+//
+
+#include <catch/catch.hpp>
+
+#include "../src/gateway/clock.h"
+#include "../src/gateway/jwtcache.h"
+
+using namespace suil;
+using namespace suil::nozama;
+
+namespace {
+
+    http::Jwt jwt(const char *user, int64_t ttl) {
+        http::Jwt token;
+        token.aud(user);
+        token.exp(Clock::wall() + ttl);
+        return token;
+    }
+}
+
+TEST_CASE("JWT cache", "[jwtcache]")
+{
+    auto& cache = JwtCache::get();
+    cache.setup(4, "semausu_jwt_test");
+
+    SECTION("Tokens are cached per route") {
+        cache.put("token1", "/users/block", jwt("admin@suilteam.com", 60), 100);
+        auto found = cache.find("token1", "/users/block");
+        REQUIRE(found != nullptr);
+        REQUIRE(found->aud() == "admin@suilteam.com");
+        // authorized for another route only
+        REQUIRE(cache.find("token1", "/users/logout") == nullptr);
+        REQUIRE(cache.find("token2", "/users/block") == nullptr);
+    }
+
+    SECTION("Tokens expire on time") {
+        cache.put("token1", "/users/logout", jwt("user1@suilteam.com", 2), 100);
+        // already expired tokens are never cached
+        cache.put("token2", "/users/logout", jwt("user2@suilteam.com", 0), 100);
+        REQUIRE(cache.find("token1", "/users/logout") != nullptr);
+        REQUIRE(cache.find("token2", "/users/logout") == nullptr);
+        Clock::advance(2100);
+        REQUIRE(cache.find("token1", "/users/logout") == nullptr);
+    }
+
+    SECTION("Logout and block evict the user's tokens") {
+        cache.put("token1", "/users/logout", jwt("user1@suilteam.com", 60), 100);
+        cache.put("token1", "/users/refresh", jwt("user1@suilteam.com", 60), 100);
+        cache.put("token2", "/users/logout", jwt("user2@suilteam.com", 60), 100);
+        // revocations received from other instances carry the email as entered
+        cache.evict(" User1@Suilteam.com");
+        REQUIRE(cache.find("token1", "/users/logout") == nullptr);
+        REQUIRE(cache.find("token1", "/users/refresh") == nullptr);
+        REQUIRE(cache.find("token2", "/users/logout") != nullptr);
+    }
+
+    SECTION("Least recently used tokens are evicted") {
+        for (int i = 0; i < 4; i++) {
+            cache.put(String{std::to_string(i).c_str()}.dup(), "/users/logout", jwt("user1@suilteam.com", 60), 100);
+        }
+        // token 0 becomes the most recently used
+        REQUIRE(cache.find("0", "/users/logout") != nullptr);
+        cache.put("4", "/users/logout", jwt("user1@suilteam.com", 60), 100);
+        REQUIRE(cache.find("1", "/users/logout") == nullptr);
+        REQUIRE(cache.find("0", "/users/logout") != nullptr);
+        REQUIRE(cache.find("4", "/users/logout") != nullptr);
+    }
+
+    SECTION("Disabled cache") {
+        cache.setup(0, "semausu_jwt_test");
+        cache.put("token1", "/users/logout", jwt("user1@suilteam.com", 60), 100);
+        REQUIRE(cache.find("token1", "/users/logout") == nullptr);
+    }
+}
@@ -0,0 +1,95 @@
+//
+// Created by Carter Mbotho on 2020-04-08.
+//
+
+#include <catch/catch.hpp>
+#include <openssl/evp.h>
+
+#include <string>
+#include <vector>
+
+#include "../src/gateway/pbkdf2.h"
+
+using namespace suil::nozama;
+
+namespace {
+
+    std::string hexstr(const std::vector<uint8_t>& dk) {
+        static const char *HEX = "0123456789abcdef";
+        std::string out;
+        for (auto b: dk) {
+            out += HEX[b >> 4];
+            out += HEX[b & 0x0F];
+        }
+        return out;
+    }
+
+    kdf::Pbkdf2Job mkjob(const std::string& passwd, const std::string& salt,
+                         uint32_t iterations, std::vector<uint8_t>& out)
+    {
+        return kdf::Pbkdf2Job{(const uint8_t *) passwd.data(), passwd.size(),
+                              (const uint8_t *) salt.data(), salt.size(),
+                              iterations, out.data(), out.size()};
+    }
+}
+
+TEST_CASE("PBKDF2-HMAC-SHA1 multi-buffer engine", "[kdf][pbkdf2]")
+{
+    SECTION("RFC 6070 test vectors") {
+        struct { std::string p, s; uint32_t c; size_t len; const char *dk; } vectors[] = {
+            {"password", "salt", 1, 20, "0c60c80f961f0e71f3a9b524af6012062fe037a6"},
+            {"password", "salt", 2, 20, "ea6c014dc72d6f8ccd1ed92ace1d41f0d8de8957"},
+            {"password", "salt", 4096, 20, "4b007901b765489abead49d926f721d065a429c1"},
+            {"passwordPASSWORDpassword", "saltSALTsaltSALTsaltSALTsaltSALTsalt", 4096, 25,
+             "3d2eec4fe41c849b80c8d83662c0e44a8b291a964cf2f07038"},
+            {std::string("pass\0word", 9), std::string("sa\0lt", 5), 4096, 16,
+             "56fa6aa75548099dcc37d7f03425e0c3"}
+        };
+
+        // scalar reference
+        for (auto& v: vectors) {
+            std::vector<uint8_t> dk(v.len);
+            kdf::pbkdf2_sha1_scalar(mkjob(v.p, v.s, v.c, dk));
+            REQUIRE(hexstr(dk) == v.dk);
+        }
+
+        // all vectors at once through the SIMD lanes
+        std::vector<std::vector<uint8_t>> dks;
+        std::vector<kdf::Pbkdf2Job> jobs;
+        for (auto& v: vectors) dks.emplace_back(v.len);
+        for (size_t i = 0; i < dks.size(); i++) {
+            jobs.push_back(mkjob(vectors[i].p, vectors[i].s, vectors[i].c, dks[i]));
+        }
+        kdf::pbkdf2_sha1(jobs.data(), jobs.size());
+        for (size_t i = 0; i < dks.size(); i++) {
+            REQUIRE(hexstr(dks[i]) == vectors[i].dk);
+        }
+    }
+
+    SECTION("Batches agree with OpenSSL for every lane count") {
+        // the hash used by http::pbkdf2_sha1_hash
+        for (size_t n = 1; n <= 2*kdf::pbkdf2_lanes() + 1; n++) {
+            std::vector<std::string> passwds, salts;
+            std::vector<std::vector<uint8_t>> dks, expected;
+            std::vector<kdf::Pbkdf2Job> jobs;
+            for (size_t i = 0; i < n; i++) {
+                // mix of short and over-long (pre-hashed) passwords and output lengths
+                passwds.push_back(std::string(i*11 % 97, 'a' + (i % 26)) + std::to_string(i));
+                salts.push_back("salt-" + std::to_string(i*31));
+                dks.emplace_back(1 + (i*17) % 64);
+                expected.emplace_back(dks.back().size());
+            }
+            for (size_t i = 0; i < n; i++) {
+                uint32_t iterations = (i % 3)? 1000 : 1 + (uint32_t) i;
+                jobs.push_back(mkjob(passwds[i], salts[i], iterations, dks[i]));
+                PKCS5_PBKDF2_HMAC_SHA1(passwds[i].data(), (int) passwds[i].size(),
+                                       (const unsigned char *) salts[i].data(), (int) salts[i].size(),
+                                       (int) iterations, (int) expected[i].size(), expected[i].data());
+            }
+            kdf::pbkdf2_sha1(jobs.data(), jobs.size());
+            for (size_t i = 0; i < n; i++) {
+                REQUIRE(dks[i] == expected[i]);
+            }
+        }
+    }
+}
@@ -0,0 +1,401 @@
+//
+// Created by Carter Mbotho on 2020-04-21.
+//
+
+#include <chrono>
+#include <memory>
+
+#include "loadgen.h"
+
+namespace {
+
+    constexpr size_t LINE_MAX_LEN{4096};
+    const char *OPS[] = {"register", "verify", "login", "logout"};
+
+    inline int64_t usnow()
+    {
+        using namespace std::chrono;
+        return duration_cast<microseconds>(steady_clock::now().time_since_epoch()).count();
+    }
+
+    std::string encode(const std::string& str)
+    {
+        return std::string{suil::utils::urlencode(suil::String{str.c_str()})()};
+    }
+
+    std::string failCode(const std::string& body)
+    {
+        // fail() replies are {"status": "<code>", ...}
+        auto pos = body.find("\"status\"");
+        if (pos == std::string::npos) {
+            return {};
+        }
+        pos = body.find('"', body.find(':', pos));
+        if (pos == std::string::npos) {
+            return {};
+        }
+        auto end = body.find('"', pos + 1);
+        return end == std::string::npos? std::string{} : body.substr(pos + 1, end - pos - 1);
+    }
+}
+
+namespace suil::nozama {
+
+    LoadGen::LoadGen(Config config)
+        : mConfig{std::move(config)}
+    {
+        mConfig.concurrency = std::max(mConfig.concurrency, size_t{1});
+        for (auto w: mConfig.mix) {
+            mWeights += w;
+        }
+        if (mWeights == 0) {
+            throw Exception::create("loadgen mix has no operation");
+        }
+        if (mConfig.users == 0 && (mConfig.mix[Login] || mConfig.mix[Logout])) {
+            throw Exception::create("login and logout requests need seeded users");
+        }
+    }
+
+    void LoadGen::mix(Config& config, const String& spec)
+    {
+        auto parts = spec.split(",");
+        for (auto& part: parts) {
+            auto kv = part.split("=");
+            if (kv.size() != 2) {
+                throw Exception::create("invalid loadgen mix entry '", part, "'");
+            }
+            size_t op{0};
+            for (; op < Op::Count; op++) {
+                if (kv[0] == OPS[op]) break;
+            }
+            if (op == Op::Count) {
+                throw Exception::create("unknown loadgen operation '", kv[0], "'");
+            }
+            config.mix[op] = (uint32_t) strtoul(kv[1].data(), nullptr, 10);
+        }
+    }
+
+    void LoadGen::seed()
+    {
+        mUsers.clear();
+        for (size_t i = 0; i < mConfig.users; i++) {
+            mUsers.push_back(User{"loadgen" + std::to_string(i) + "@semausu.com", {}});
+        }
+        if (!mConfig.seed || mUsers.empty()) {
+            return;
+        }
+
+        auto started = usnow();
+        mNextSeed = 0;
+        auto workers = std::min(mConfig.concurrency, mUsers.size());
+        std::vector<std::unique_ptr<Conn>> conns;
+        chan done = chmake(bool, workers);
+        for (size_t i = 0; i < workers; i++) {
+            conns.push_back(std::make_unique<Conn>());
+            go(seeder(Ego, *conns.back(), done));
+        }
+        for (size_t i = 0; i < workers; i++) {
+            chr(done, bool);
+        }
+        chclose(done);
+        sdebug("seeded %zu users in %.2f s", mUsers.size(), (usnow() - started)/1e6);
+    }
+
+    coroutine void LoadGen::seeder(LoadGen& Self, Conn& conn, chan done)
+    {
+        while (Self.mNextSeed < Self.mUsers.size()) {
+            auto& user = Self.mUsers[Self.mNextSeed++];
+            Reply reply;
+            if (!Self.registerUser(conn, user.email, reply)) {
+                // users from a previous run are already verified
+                if (reply.code != "UserAlreadyRegistered") {
+                    swarn("seeding user %s failed: %d %s", user.email.c_str(), reply.status, reply.code.c_str());
+                }
+                continue;
+            }
+            auto token = reply.body;
+            if (!Self.request(conn, "POST", "/users/verify?email=" + encode(user.email) + "&id=" + encode(token),
+                              {}, {}, reply) || reply.status != 200)
+            {
+                swarn("verifying user %s failed: %d %s", user.email.c_str(), reply.status, reply.code.c_str());
+            }
+        }
+        chs(done, bool, true);
+    }
+
+    void LoadGen::run()
+    {
+        std::vector<std::unique_ptr<Conn>> conns;
+        mNextSlot = 0;
+        mStarted  = usnow();
+        mEnds     = mStarted + mConfig.duration * 1000000;
+        chan done = chmake(bool, mConfig.concurrency);
+        for (size_t i = 0; i < mConfig.concurrency; i++) {
+            conns.push_back(std::make_unique<Conn>());
+            go(worker(Ego, *conns.back(), done));
+        }
+        for (size_t i = 0; i < mConfig.concurrency; i++) {
+            chr(done, bool);
+        }
+        chclose(done);
+        mElapsed = usnow() - mStarted;
+    }
+
+    coroutine void LoadGen::worker(LoadGen& Self, Conn& conn, chan done)
+    {
+        auto& config = Self.mConfig;
+        while (true) {
+            int64_t due{usnow()};
+            if (config.rate) {
+                // take the next slot on the schedule, it might already be late
+                due = Self.mStarted + (int64_t) ((Self.mNextSlot++ * 1000000) / config.rate);
+                auto now = usnow();
+                if (due > now) {
+                    msleep(utils::after((due - now + 999) / 1000));
+                }
+            }
+            if (due >= Self.mEnds) {
+                break;
+            }
+
+            auto op = Self.pick();
+            Reply reply;
+            bool ok = Self.send(conn, op, reply);
+            Self.record(op, due, reply, ok);
+        }
+        chs(done, bool, true);
+    }
+
+    LoadGen::Op LoadGen::pick()
+    {
+        auto r = (uint32_t) (rand() % mWeights);
+        for (uint8_t op = 0; op < Op::Count; op++) {
+            if (r < mConfig.mix[op]) {
+                if (op == Verify && mPending.empty()) {
+                    // nothing to verify yet, a registration creates something to verify
+                    return Register;
+                }
+                return (Op) op;
+            }
+            r -= mConfig.mix[op];
+        }
+        return Login;
+    }
+
+    bool LoadGen::send(Conn& conn, Op op, Reply& reply)
+    {
+        switch (op) {
+            case Register: {
+                auto email = "loadgen-" + std::to_string(getpid()) + "-" +
+                             std::to_string(mRegistered++) + "@semausu.com";
+                if (!registerUser(conn, email, reply)) {
+                    return false;
+                }
+                mPending.push_back(User{email, reply.body});
+                return true;
+            }
+            case Verify: {
+                auto user = std::move(mPending.back());
+                mPending.pop_back();
+                return request(conn, "POST", "/users/verify?email=" + encode(user.email) + "&id=" + encode(user.token),
+                               {}, {}, reply) && reply.status == 200;
+            }
+            case Login: {
+                auto& user = mUsers[rand() % mUsers.size()];
+                if (!request(conn, "POST", "/users/login",
+                             "Email=" + encode(user.email) + "&Passwd=loadgenPass1", {}, reply) || reply.status != 200)
+                {
+                    return false;
+                }
+                user.token = reply.authorization;
+                return true;
+            }
+            case Logout:
+            default: {
+                auto& user = mUsers[rand() % mUsers.size()];
+                bool ok = request(conn, "DELETE", "/users/logout?email=" + encode(user.email),
+                                  {}, user.token, reply) && reply.status == 200;
+                user.token.clear();
+                return ok;
+            }
+        }
+    }
+
+    bool LoadGen::registerUser(Conn& conn, const std::string& email, Reply& reply)
+    {
+        std::string form{"FirstName=Load&LastName=Generator&Passwd=loadgenPass1&Email="};
+        form += encode(email);
+        return request(conn, "POST", "/users/register", form, {}, reply) && reply.status == 201;
+    }
+
+    bool LoadGen::request(Conn& conn, const char *method, const std::string& path,
+                          const std::string& form, const std::string& auth, Reply& reply)
+    {
+        reply = Reply{};
+        try {
+            if (!conn.open) {
+                connect(conn);
+            }
+            OBuffer ob{512 + form.size()};
+            ob << method << " " << path << " HTTP/1.1\r\n"
+               << "Host: " << mConfig.host << ":" << mConfig.port << "\r\n"
+               << "Connection: keep-alive\r\n";
+            if (!auth.empty()) {
+                ob << "Authorization: " << auth << "\r\n";
+            }
+            if (!form.empty()) {
+                ob << "Content-Type: application/x-www-form-urlencoded\r\n";
+            }
+            ob << "Content-Length: " << form.size() << "\r\n\r\n";
+            ob << form;
+            if (conn.sock.send(ob.data(), ob.size(), mConfig.timeout) != ob.size() ||
+                !conn.sock.flush(mConfig.timeout))
+            {
+                throw Exception::create("sending request failed: ", errno_s);
+            }
+
+            // status line and headers, one per line until an empty line
+            size_t length{0};
+            bool   keepAlive{true};
+            char   buf[LINE_MAX_LEN];
+            while (true) {
+                size_t len{sizeof(buf)};
+                if (!conn.sock.receiveUntil(buf, len, "\n", 1, mConfig.timeout)) {
+                    throw Exception::create("reading reply failed: ", errno_s);
+                }
+                std::string line{buf, len};
+                while (!line.empty() && isspace(line.back())) line.pop_back();
+                if (line.empty()) {
+                    if (reply.status == 0) continue;
+                    break;
+                }
+                if (reply.status == 0) {
+                    // HTTP/1.1 200 OK
+                    auto sp = line.find(' ');
+                    reply.status = sp == std::string::npos? -1 : atoi(line.c_str() + sp + 1);
+                    continue;
+                }
+                auto colon = line.find(':');
+                if (colon == std::string::npos) continue;
+                auto value = line.substr(line.find_first_not_of(' ', colon + 1));
+                if (strncasecmp(line.c_str(), "Content-Length", colon) == 0) {
+                    length = strtoul(value.c_str(), nullptr, 10);
+                }
+                else if (strncasecmp(line.c_str(), "Authorization", colon) == 0) {
+                    reply.authorization = value;
+                }
+                else if (strncasecmp(line.c_str(), "Connection", colon) == 0) {
+                    keepAlive = strcasecmp(value.c_str(), "close") != 0;
+                }
+            }
+
+            if (length) {
+                reply.body.resize(length);
+                size_t len{length};
+                if (!conn.sock.receive(&reply.body[0], len, mConfig.timeout) || len != length) {
+                    throw Exception::create("reading reply body failed: ", errno_s);
+                }
+            }
+            if (!keepAlive) {
+                conn.sock.close();
+                conn.open = false;
+            }
+            if (reply.status >= 300) {
+                reply.code = failCode(reply.body);
+            }
+            return true;
+        }
+        catch (...) {
+            auto ex = Exception::fromCurrent();
+            strace("loadgen %s %s: %s", method, path.c_str(), ex.what());
+            conn.sock.close();
+            conn.open = false;
+            reply.status = 0;
+            reply.code = errno == ETIMEDOUT? "Timeout" : "ConnectionError";
+            return false;
+        }
+    }
+
+    void LoadGen::connect(Conn& conn)
+    {
+        errno = 0;
+        auto addr = ipremote(mConfig.host(), mConfig.port, 0, utils::after(mConfig.timeout));
+        if (errno != 0) {
+            throw Exception::create("resolving gateway '", mConfig.host, "' failed: ", errno_s);
+        }
+        if (!conn.sock.connect(addr, mConfig.timeout)) {
+            throw Exception::create("connecting to gateway '", mConfig.host, "' failed: ", errno_s);
+        }
+        conn.open = true;
+    }
+
+    void LoadGen::record(Op op, int64_t started, const Reply& reply, bool ok)
+    {
+        auto& stats = mStats[op];
+        stats.latency.record((uint64_t) std::max(usnow() - started, int64_t{0}));
+        stats.requests++;
+        if (!ok) {
+            stats.errors++;
+            // replies without a fail() code are counted by HTTP status
+            auto code = reply.code.empty()? ("Http" + std::to_string(reply.status)) : reply.code;
+            stats.codes[code]++;
+        }
+    }
+
+    void LoadGen::report() const
+    {
+        auto secs = mElapsed / 1e6;
+        printf("loadgen {mode: %s, rate: %zu, concurrency: %zu, duration: %.1fs, users: %zu}\n",
+               (mConfig.rate? "fixed-rate" : "closed-loop"), mConfig.rate, mConfig.concurrency, secs, mUsers.size());
+        printf("%-10s %10s %10s %10s %10s %10s %10s\n", "op", "requests", "errors", "req/s", "p50(ms)", "p99(ms)", "p999(ms)");
+        for (size_t op = 0; op < Op::Count; op++) {
+            auto& stats = mStats[op];
+            if (stats.requests == 0) continue;
+            printf("%-10s %10lu %10lu %10.1f %10.2f %10.2f %10.2f\n", OPS[op],
+                   stats.requests, stats.errors, stats.requests / secs,
+                   stats.latency.quantile(0.5)/1e3, stats.latency.quantile(0.99)/1e3,
+                   stats.latency.quantile(0.999)/1e3);
+            for (auto& code: stats.codes) {
+                printf("%-10s   %-30s %10lu\n", "", code.first.c_str(), code.second);
+            }
+        }
+    }
+
+    void LoadGen::toJson(OBuffer& ob) const
+    {
+        auto secs = mElapsed / 1e6;
+        ob << "{\"label\":\"" << mConfig.label << "\""
+           << ",\"mode\":\"" << (mConfig.rate? "fixed-rate" : "closed-loop") << "\""
+           << ",\"rate\":" << mConfig.rate
+           << ",\"concurrency\":" << mConfig.concurrency
+           << ",\"users\":" << mUsers.size()
+           << ",\"duration_us\":" << mElapsed
+           << ",\"mix\":{";
+        for (size_t op = 0; op < Op::Count; op++) {
+            ob << (op? ",\"" : "\"") << OPS[op] << "\":" << mConfig.mix[op];
+        }
+        ob << "},\"ops\":{";
+        for (size_t op = 0; op < Op::Count; op++) {
+            auto& stats = mStats[op];
+            char rate[32];
+            snprintf(rate, sizeof(rate), "%.2f", secs > 0? stats.requests / secs : 0.0);
+            ob << (op? ",\"" : "\"") << OPS[op] << "\":{"
+               << "\"requests\":" << stats.requests
+               << ",\"errors\":" << stats.errors
+               << ",\"throughput\":" << rate
+               // quantiles in microseconds
+               << ",\"p50\":" << stats.latency.quantile(0.5)
+               << ",\"p99\":" << stats.latency.quantile(0.99)
+               << ",\"p999\":" << stats.latency.quantile(0.999)
+               << ",\"mean\":" << (stats.requests? stats.latency.sum()/stats.requests : 0)
+               << ",\"codes\":{";
+            bool first{true};
+            for (auto& code: stats.codes) {
+                ob << (first? "\"" : ",\"") << code.first << "\":" << code.second;
+                first = false;
+            }
+            ob << "}}";
+        }
+        ob << "}}\n";
+    }
+}
@@ -0,0 +1,138 @@
+//
+// Created by Carter Mbotho on 2020-04-21.
+//
+
+#ifndef SEMAUSU_LOADGEN_H
+#define SEMAUSU_LOADGEN_H
+
+#include <suil/sock.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "../src/gateway/counters.h"
+
+namespace suil::nozama {
+
+    /**
+     * Generates a mix of register, verify, login and logout requests against a running
+     * gateway and reports latency quantiles and errors per operation.
+     *
+     * In closed-loop mode each worker sends its next request as soon as the previous one
+     * completes. With a fixed rate requests are due on a schedule and their latency is
+     * measured from the time they were due, so time spent waiting for a busy worker is
+     * accounted for instead of silently lowering the offered load.
+     *
+     * @note the gateway must be a swept build, registration then returns the
+     * verification token
+     */
+    struct LoadGen final {
+        enum Op : uint8_t {
+            Register,
+            Verify,
+            Login,
+            Logout,
+            Count
+        };
+
+        struct Config {
+            String   host{"localhost"};
+            int      port{10080};
+            /// users registered and verified before the run, logins and logouts pick from them
+            size_t   users{100};
+            /// register existing users before the run
+            bool     seed{true};
+            /// requests per second, 0 runs in closed-loop mode
+            size_t   rate{0};
+            /// concurrent connections (and coroutines) sending requests
+            size_t   concurrency{16};
+            /// seconds to run for
+            int64_t  duration{30};
+            /// relative weight of each operation in the mix
+            uint32_t mix[Op::Count]{1, 1, 8, 2};
+            /// time in milliseconds to wait for a reply
+            int64_t  timeout{10000};
+            /// free text copied to the result file, e.g the build being measured
+            String   label{};
+        };
+
+        LoadGen(Config config);
+
+        /**
+         * Parses a mix like `register=1,verify=1,login=8,logout=2`, operations not
+         * listed keep their weight
+         * @throws Exception if an operation is unknown
+         */
+        static void mix(Config& config, const String& spec);
+
+        /**
+         * Registers and verifies the configured number of users, users that were
+         * registered by a previous run are reused
+         */
+        void seed();
+
+        void run();
+
+        /**
+         * Prints a summary table on the standard output
+         */
+        void report() const;
+
+        /**
+         * Writes the configuration and the results as JSON
+         */
+        void toJson(OBuffer& ob) const;
+
+    private:
+        struct Reply {
+            int         status{0};
+            /// the fail() code of an error reply
+            std::string code{};
+            std::string body{};
+            std::string authorization{};
+        };
+
+        struct Conn {
+            TcpSock sock{};
+            bool    open{false};
+        };
+
+        struct Stats {
+            Histogram latency{"loadgen_latency", "", ""};
+            uint64_t  requests{0};
+            uint64_t  errors{0};
+            std::map<std::string, uint64_t> codes{};
+        };
+
+        struct User {
+            std::string email;
+            std::string token;
+        };
+
+        static coroutine void seeder(LoadGen& Self, Conn& conn, chan done);
+        static coroutine void worker(LoadGen& Self, Conn& conn, chan done);
+        Op   pick();
+        bool send(Conn& conn, Op op, Reply& reply);
+        bool registerUser(Conn& conn, const std::string& email, Reply& reply);
+        bool request(Conn& conn, const char *method, const std::string& path,
+                     const std::string& form, const std::string& auth, Reply& reply);
+        void connect(Conn& conn);
+        void record(Op op, int64_t started, const Reply& reply, bool ok);
+
+        Config   mConfig{};
+        uint32_t mWeights{0};
+        std::vector<User>        mUsers{};
+        /// registered during the run and waiting for a verify request
+        std::vector<User>        mPending{};
+        size_t   mNextSeed{0};
+        size_t   mRegistered{0};
+        /// in fixed rate mode, the next request slot and when the run started (us)
+        uint64_t mNextSlot{0};
+        int64_t  mStarted{0};
+        int64_t  mEnds{0};
+        int64_t  mElapsed{0};
+        Stats    mStats[Op::Count];
+    };
+}
+#endif //SEMAUSU_LOADGEN_H
@@ -0,0 +1,109 @@
+//
+// Created by Carter Mbotho on 2020-04-10.
+//
+
+#include <catch/catch.hpp>
+#include <suil/http/validators.h>
+
+#include "../src/gateway/passwd.h"
+#include "../src/gateway/gateway.h"
+#include "../src/gateway/kdf.h"
+
+using namespace suil;
+using namespace suil::nozama;
+
+namespace {
+
+    PasswdHasher::Params params(PasswdHasher::Scheme scheme, uint32_t cost) {
+        PasswdHasher::Params params;
+        params.scheme = scheme;
+        params.cost   = cost;
+        return params;
+    }
+
+    bool matches(const String& stored, const String& passwd, const String& salt = {}) {
+        bool ok{false};
+        REQUIRE(PasswdHasher::get().verify(ok, stored, passwd, salt));
+        return ok;
+    }
+}
+
+TEST_CASE("Password hashes", "[passwd]")
+{
+    // hashes are derived on the calling coroutine
+    KdfExecutor::get().setup(0, 16);
+    Gateway::get().PasswdKey = "semausu-test-key";
+    auto& hasher = PasswdHasher::get();
+
+    SECTION("Round trip") {
+        for (auto scheme: {PasswdHasher::Pbkdf2Sha1, PasswdHasher::Pbkdf2Sha256}) {
+            hasher.setup(params(scheme, 1000));
+            REQUIRE(hasher.salt("user1@suilteam.com").empty());
+            String stored{};
+            REQUIRE(hasher.hash(stored, "user1Pass"));
+            auto prefix = std::string("$") + PasswdHasher::name(scheme) + "$i=1000$";
+            REQUIRE(std::string{stored.data(), stored.size()}.find(prefix) == 0);
+
+            REQUIRE(matches(stored, "user1Pass"));
+            REQUIRE_FALSE(matches(stored, "user1pass"));
+            // salted, the same password never hashes the same
+            String other{};
+            REQUIRE(hasher.hash(other, "user1Pass"));
+            REQUIRE(other != stored);
+        }
+    }
+
+    SECTION("Malformed hashes never match") {
+        hasher.setup(params(PasswdHasher::Pbkdf2Sha256, 1000));
+        for (auto stored: {"$", "$pbkdf2-sha256", "$pbkdf2-sha256$i=1000$c2FsdA",
+                           "$pbkdf2-sha256$i=0$c2FsdA$aGFzaA", "$pbkdf2-sha256$i=1000$c2F@dA$aGFzaA",
+                           "$pbkdf2-sha256$i=1000$c2FsdA$", "$scrypt$i=1000$c2FsdA$aGFzaA",
+                           "$argon2id$v=19$c2FsdA$aGFzaA"})
+        {
+            REQUIRE_FALSE(matches(stored, "user1Pass"));
+            REQUIRE(hasher.needsRehash(stored));
+        }
+    }
+
+    SECTION("Legacy hashes") {
+        // stored before the format was introduced, salted with the Salt column
+        String salt = http::rand_8byte_salt()(String{"user1@suilteam.com"});
+        String stored = http::pbkdf2_sha1_hash(Gateway::get().PasswdKey())(String{"user1Pass"}, salt);
+        hasher.setup(params(PasswdHasher::Pbkdf2Sha256, 1000));
+        REQUIRE(matches(stored, "user1Pass", salt));
+        REQUIRE_FALSE(matches(stored, "user2Pass", salt));
+
+        // the default keeps hashing new passwords with the legacy scheme
+        hasher.setup(PasswdHasher::Params{});
+        REQUIRE(hasher.current().scheme == PasswdHasher::Legacy);
+        auto salt2 = hasher.salt("user2@suilteam.com");
+        REQUIRE_FALSE(salt2.empty());
+        String stored2{};
+        REQUIRE(hasher.hash(stored2, "user2Pass", salt2));
+        REQUIRE(stored2.data()[0] != '$');
+        REQUIRE(matches(stored2, "user2Pass", salt2));
+        REQUIRE_THROWS(hasher.hash(stored2, "user2Pass"));
+    }
+
+    SECTION("Rehash decisions") {
+        String legacy = http::pbkdf2_sha1_hash(Gateway::get().PasswdKey())(String{"user1Pass"}, String{"salt"});
+        hasher.setup(params(PasswdHasher::Pbkdf2Sha256, 1000));
+        String current{};
+        REQUIRE(hasher.hash(current, "user1Pass"));
+        REQUIRE_FALSE(hasher.needsRehash(current));
+        // opted into another scheme, legacy hashes are upgraded
+        REQUIRE(hasher.needsRehash(legacy));
+
+        // a higher cost
+        hasher.setup(params(PasswdHasher::Pbkdf2Sha256, 2000));
+        REQUIRE(hasher.needsRehash(current));
+        // another scheme at the same cost
+        hasher.setup(params(PasswdHasher::Pbkdf2Sha1, 1000));
+        REQUIRE(hasher.needsRehash(current));
+
+        // by default legacy hashes stay, hashes of other schemes go back to it
+        hasher.setup(PasswdHasher::Params{});
+        REQUIRE_FALSE(hasher.needsRehash(legacy));
+        REQUIRE(hasher.needsRehash(current));
+    }
+}
@@ -0,0 +1,97 @@
+//
+// Created by Carter Mbotho on 2020-04-22.
+//
+
+#include <catch/catch.hpp>
+
+#include "../src/gateway/clock.h"
+#include "../src/gateway/ratelimit.h"
+#include "fixtures.h"
+
+using namespace suil;
+using namespace suil::nozama;
+
+namespace {
+
+    RateLimit::Config config(bool shared = false) {
+        RateLimit::Config config;
+        RateLimit::Limits login;
+        login.path  = "/users/login";
+        login.ip    = {1, 5};
+        login.email = {0.5, 3};
+        if (shared) {
+            login.shared = {600, 30, 60};
+        }
+        config.routes.push_back(std::move(login));
+        return config;
+    }
+}
+
+TEST_CASE("Rate limiting", "[ratelimit]")
+{
+    auto& limits = test::fixture<RateLimit>();
+    limits.setup(config(), nullptr);
+
+    SECTION("Limited routes") {
+        REQUIRE(limits.route("/users/login") == 0);
+        REQUIRE(limits.route("/users/verify") == -1);
+    }
+
+    SECTION("Per IP buckets") {
+        for (int i = 0; i < 5; i++) {
+            REQUIRE(limits.throttleIp(0, "10.0.0.1") == 0);
+        }
+        // over the burst, retried once a token is added
+        REQUIRE(limits.throttleIp(0, "10.0.0.1") == 1);
+        // other addresses have their own bucket
+        REQUIRE(limits.throttleIp(0, "10.0.0.2") == 0);
+        // one token per second
+        Clock::advance(1100);
+        REQUIRE(limits.throttleIp(0, "10.0.0.1") == 0);
+        REQUIRE(limits.throttleIp(0, "10.0.0.1") == 1);
+    }
+
+    SECTION("Per email buckets") {
+        for (int i = 0; i < 3; i++) {
+            REQUIRE(limits.throttleEmail(0, "User1@Suilteam.com ") == 0);
+        }
+        // emails are normalized, one token every 2 seconds
+        REQUIRE(limits.throttleEmail(0, "user1@suilteam.com") == 2);
+        REQUIRE(limits.throttleEmail(0, "user2@suilteam.com") == 0);
+        // the address bucket is untouched
+        REQUIRE(limits.throttleIp(0, "10.0.0.1") == 0);
+    }
+
+    SECTION("Forwarded addresses") {
+        // the addresses left of the trusted proxies are set by the client
+        REQUIRE(RateLimit::forwarded("1.1.1.1, 10.0.0.1, 10.0.0.2", 1) == "10.0.0.2");
+        REQUIRE(RateLimit::forwarded("1.1.1.1, 10.0.0.1, 10.0.0.2", 2) == "10.0.0.1");
+        REQUIRE(RateLimit::forwarded("10.0.0.1", 2) == "10.0.0.1");
+        REQUIRE(RateLimit::forwarded("", 1).empty());
+    }
+
+    SECTION("Least recently used keys are dropped") {
+        auto small = config();
+        small.keys = 2;
+        limits.setup(std::move(small), nullptr);
+        for (int i = 0; i < 5; i++) {
+            REQUIRE(limits.throttleIp(0, "10.0.0.1") == 0);
+        }
+        REQUIRE(limits.throttleIp(0, "10.0.0.2") == 0);
+        REQUIRE(limits.throttleIp(0, "10.0.0.1") == 1);
+        // a new key drops 10.0.0.2, the limited address is still tracked
+        REQUIRE(limits.throttleIp(0, "10.0.0.3") == 0);
+        REQUIRE(limits.throttleIp(0, "10.0.0.1") == 1);
+    }
+
+    SECTION("Shared windows") {
+        // windows are shared through redis
+        REQUIRE_THROWS(limits.setup(config(true), nullptr));
+        // without windows only the local buckets apply
+        limits.setup(config(false), nullptr);
+        for (int i = 0; i < 5; i++) {
+            REQUIRE(limits.throttleIp(0, "10.0.0.1") == 0);
+        }
+        REQUIRE(limits.throttleIp(0, "10.0.0.1") == 1);
+    }
+}
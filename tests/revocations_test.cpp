@@ -0,0 +1,110 @@
+//
+// Created by Carter Mbotho on 2020-04-27.
+//
+
+#include <catch/catch.hpp>
+
+#include <string>
+
+#include "../src/gateway/clock.h"
+#include "../src/gateway/revocations.h"
+
+using namespace suil;
+using namespace suil::nozama;
+
+namespace {
+
+    Revocations::Config config(int64_t lifetime, int64_t width) {
+        Revocations::Config config;
+        config.lifetime = lifetime;
+        config.width    = width;
+        config.capacity = 100;
+        config.channel  = "semausu_revocations_test";
+        return config;
+    }
+
+    void load(Revocations& revocations, const std::string& lines) {
+        revocations.load(lines.data(), lines.size());
+    }
+
+    /// a revocation at the given second and millisecond
+    std::string line(const char *email, int64_t t, int64_t ms = 0) {
+        return std::string(email) + " " + std::to_string(t * 1000 + ms) + "\n";
+    }
+
+    /// a token issued at the given second and millisecond
+    int64_t at(int64_t t, int64_t ms = 0) {
+        return t * 1000 + ms;
+    }
+}
+
+TEST_CASE("Revocation filter", "[revocations]")
+{
+    auto& revocations = Revocations::get();
+    auto now = Clock::wall();
+
+    SECTION("Revoked tokens are rejected without redis") {
+        revocations.setup(config(900, 60), nullptr);
+        REQUIRE(revocations.enabled());
+        // a revocation broadcast by another instance
+        load(revocations, line("User1@Suilteam.com", now - 300, 500));
+        // issued before the revocation, in an earlier bucket or earlier in the same second
+        REQUIRE(revocations.revoked("user1@suilteam.com", at(now - 600)));
+        REQUIRE(revocations.revoked("user1@suilteam.com", at(now - 301, 999)));
+        REQUIRE(revocations.revoked("user1@suilteam.com", at(now - 300)));
+        REQUIRE(revocations.revoked("user1@suilteam.com", at(now - 300, 499)));
+        // issued after the revocation, a login right after a logout
+        REQUIRE_FALSE(revocations.revoked("user1@suilteam.com", at(now - 300, 500)));
+        REQUIRE_FALSE(revocations.revoked("user1@suilteam.com", at(now - 300, 501)));
+        REQUIRE_FALSE(revocations.revoked("user1@suilteam.com", at(now - 299)));
+        REQUIRE_FALSE(revocations.revoked("user1@suilteam.com", at(now)));
+        REQUIRE_FALSE(revocations.revoked("user2@suilteam.com", at(now - 600)));
+    }
+
+    SECTION("Revocations recorded in seconds") {
+        revocations.setup(config(900, 60), nullptr);
+        // by instances that did not record milliseconds yet
+        auto old = std::string("user1@suilteam.com ") + std::to_string(now - 300) + "\n";
+        load(revocations, old);
+        REQUIRE(revocations.revoked("user1@suilteam.com", at(now - 301, 999)));
+        REQUIRE_FALSE(revocations.revoked("user1@suilteam.com", at(now - 300)));
+    }
+
+    SECTION("Resync") {
+        revocations.setup(config(900, 60), nullptr);
+        // the bucket recorded in redis, revocations older than the token lifetime are ignored
+        load(revocations, line("user1@suilteam.com", now - 10) +
+                          line("user2@suilteam.com", now - 120) +
+                          line("user3@suilteam.com", now - 1000));
+        REQUIRE(revocations.revoked("user1@suilteam.com", at(now - 11)));
+        REQUIRE(revocations.revoked("user2@suilteam.com", at(now - 500)));
+        REQUIRE_FALSE(revocations.revoked("user3@suilteam.com", at(now - 1001)));
+        // setup starts over with an empty filter
+        revocations.setup(config(900, 60), nullptr);
+        REQUIRE_FALSE(revocations.revoked("user1@suilteam.com", at(now - 11)));
+    }
+
+    SECTION("Ring rotation") {
+        // 3 buckets of a second each
+        revocations.setup(config(2, 1), nullptr);
+        load(revocations, line("user1@suilteam.com", now, 999));
+        REQUIRE(revocations.revoked("user1@suilteam.com", at(now)));
+        Clock::advance(3000);
+
+        // the revocation is older than any valid token
+        REQUIRE_FALSE(revocations.revoked("user1@suilteam.com", at(now)));
+        // a revocation 3 buckets later recycles the bucket of user1
+        load(revocations, line("user2@suilteam.com", now + 3, 999));
+        REQUIRE(revocations.revoked("user2@suilteam.com", at(now + 3)));
+        REQUIRE_FALSE(revocations.revoked("user1@suilteam.com", at(now + 3)));
+    }
+
+    SECTION("Disabled filter") {
+        auto disabled = config(900, 60);
+        disabled.capacity = 0;
+        revocations.setup(disabled, nullptr);
+        REQUIRE_FALSE(revocations.enabled());
+        load(revocations, line("user1@suilteam.com", now));
+        REQUIRE_FALSE(revocations.revoked("user1@suilteam.com", at(now - 60)));
+    }
+}
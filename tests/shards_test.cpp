@@ -0,0 +1,83 @@
+//
+// Created by Carter Mbotho on 2020-04-30.
+//
+
+#include <catch/catch.hpp>
+
+#include <string>
+#include <vector>
+
+#include "../src/gateway/shards.h"
+
+using namespace suil;
+using namespace suil::nozama;
+
+namespace {
+
+    constexpr size_t USERS{3000};
+
+    String email(size_t i) {
+        auto out = "user" + std::to_string(i) + "@suilteam.com";
+        return String{out.c_str()}.dup();
+    }
+
+    std::vector<size_t> placements(Shards& shards) {
+        std::vector<size_t> out;
+        for (size_t i = 0; i < USERS; i++) {
+            out.push_back(shards.locate(email(i)));
+        }
+        return out;
+    }
+}
+
+TEST_CASE("Postgres shards ring", "[shards]")
+{
+    // the ring never connects, the shards can share a pool that is not set up
+    static sql::mw::Postgres pool;
+    auto& shards = Shards::get();
+    shards.add("primary", pool, "dbname=primary");
+    shards.add("shard1", pool, "dbname=shard1");
+    shards.add("shard2", pool, "dbname=shard2");
+    shards.setup({128, ""});
+    REQUIRE(shards.size() == 3);
+
+    // users are spread over every shard
+    auto before = placements(shards);
+    size_t counts[3] = {0, 0, 0};
+    for (auto shard: before) {
+        REQUIRE(shard < 3);
+        counts[shard]++;
+    }
+    for (auto count: counts) {
+        REQUIRE(count > USERS / 5);
+    }
+    // placement is by normalized email
+    REQUIRE(shards.locate(" User1@Suilteam.com") == shards.locate("user1@suilteam.com"));
+
+    // adding a shard only moves users to the new shard, about a quarter of them
+    shards.add("shard3", pool, "dbname=shard3");
+    shards.setup({128, ""});
+    auto after = placements(shards);
+    size_t moved{0};
+    for (size_t i = 0; i < USERS; i++) {
+        if (after[i] != before[i]) {
+            REQUIRE(after[i] == 3);
+            moved++;
+        }
+    }
+    REQUIRE(moved > USERS / 8);
+    REQUIRE(moved < USERS / 2);
+
+    // a retired shard is only drained, no user is placed on it
+    shards.add("shard4", "dbname=shard4", 1000, 1000, true);
+    shards.setup({128, ""});
+    REQUIRE(placements(shards) == after);
+
+    // shard names are the placement, they are unique
+    REQUIRE_THROWS(shards.add("shard1", "dbname=other", 1000, 1000));
+    // the settings live on an active shard
+    REQUIRE_THROWS(shards.setup({128, "shard4"}));
+    REQUIRE_THROWS(shards.setup({128, "missing"}));
+    shards.setup({128, "shard2"});
+    REQUIRE(&shards.settings() == &pool);
+}
@@ -10,6 +10,7 @@
 #include <wait.h>
 
 #include "../src/gateway/gateway.scc.h"
+#include "loadgen.h"
 
 using namespace suil;
 
@@ -181,6 +182,69 @@ static  void cmdStart(cmdl::Parser& parser)
     parser.add(std::move(start));
 }
 
+static void cmdBench(cmdl::Parser& parser)
+{
+    cmdl::Cmd bench("bench", "generates load on a running gateway and reports latency and errors");
+    bench << cmdl::Arg{"gtyurl", "Base gateway URL with port (default: http://locahost:10080)",
+                       'C', false};
+    bench << cmdl::Arg{"users", "Number of users to seed before the run (default: 100)",
+                       'u', false};
+    bench << cmdl::Arg{"no-seed", "Reuse users seeded by a previous run",
+                       'n', true, false};
+    bench << cmdl::Arg{"mix", "Weights of the operations (default: register=1,verify=1,login=8,logout=2)",
+                       'm', false};
+    bench << cmdl::Arg{"rate", "Requests per second, 0 runs in closed-loop mode (default: 0)",
+                       'R', false};
+    bench << cmdl::Arg{"concurrency", "Number of concurrent connections (default: 16)",
+                       'c', false};
+    bench << cmdl::Arg{"duration", "Number of seconds to run for (default: 30)",
+                       'd', false};
+    bench << cmdl::Arg{"label", "A label saved with the results, e.g the build being measured",
+                       'l', false};
+    bench << cmdl::Arg{"output", "Path of the JSON result file (default: loadgen.json)",
+                       'o', false};
+    bench([](cmdl::Cmd& cmd) {
+        nozama::LoadGen::Config config;
+        std::string url{cmd.getvalue<String>("gtyurl", "http://localhost:10080")()};
+        auto scheme = url.find("://");
+        if (scheme != std::string::npos) {
+            url = url.substr(scheme + 3);
+        }
+        auto colon = url.find(':');
+        if (colon != std::string::npos) {
+            config.port = atoi(url.c_str() + colon + 1);
+            url.resize(colon);
+        }
+        config.host        = String{url.c_str()}.dup();
+        config.users       = (size_t) cmd.getvalue("users", (int) config.users);
+        config.seed        = !cmd.getvalue("no-seed", false);
+        config.rate        = (size_t) cmd.getvalue("rate", 0);
+        config.concurrency = (size_t) cmd.getvalue("concurrency", (int) config.concurrency);
+        config.duration    = cmd.getvalue("duration", (int) config.duration);
+        config.label       = cmd.getvalue<String>("label", "").dup();
+        auto mix = cmd.getvalue<String>("mix", "");
+        if (mix) {
+            nozama::LoadGen::mix(config, mix);
+        }
+
+        nozama::LoadGen loadgen(std::move(config));
+        loadgen.seed();
+        loadgen.run();
+        loadgen.report();
+
+        OBuffer ob{2048};
+        loadgen.toJson(ob);
+        auto output = cmd.getvalue<String>("output", "loadgen.json");
+        if (utils::fs::exists(output())) {
+            utils::fs::remove(output());
+        }
+        size_t size{ob.size()};
+        utils::fs::append(output(), ob.data(), size);
+        printf("results written to %s\n", output());
+    });
+    parser.add(std::move(bench));
+}
+
 int main(int argc, char *argv[])
 {
     suil::init(opt(printinfo, false));
@@ -197,6 +261,7 @@ int main(int argc, char *argv[])
     try
     {
         cmdStart(parser);
+        cmdBench(parser);
         parser.parse(argc, argv);
         parser.handle();
     }
@@ -37,6 +37,24 @@ local Gateway = setmetatable({
             end
         })
     end,
+    reshard = function(this, binary, config, dry)
+        config = config or Swept.Data.GtyConfig
+        binary = binary or Swept.Data.GtyBin
+        Log:trc("resharding gateway users {config: %s, binary: %s, dry: %s}", config, binary, tostring(dry))
+
+        -- the running gateway is stopped, reshard is launched in its place
+        local args = {"reshard", "-C", config}
+        if dry then args[#args + 1] = "-d"; end
+
+        local resp = Http(this.url..'/restart', {
+            method = "GET",
+            body = {
+                bin = binary,
+                args = args
+            }
+        })
+        return resp.status == Http.Ok
+    end,
     running = function(this)
         local resp = Http(this.url..'/running', {
             method = "GET"
@@ -0,0 +1,63 @@
+--
+-- @module GatewayRateLimit fixture tests the rate limits of route POST '/users/login'
+-- configured in res/gtytest.lua (ip burst 50, email burst 10)
+--
+
+local Gateway = require("scripts/gateway") { }
+local Http,_,V = import("sys/http")
+
+local GtyRateLimit = Fixture('GatewayRateLimit', "Tests the rate limits of the POST '/users/login' route")
+
+GtyRateLimit:before(function(ctx)
+    -- buckets are per process, a restart gives every test full buckets
+    if ctx.gty == nil or not Gateway:running() or ctx.attrs.reset then
+        ctx.gty = Gateway:restart(Swept.Data.GtyBin, Swept.Data.GtyConfig, ctx.attrs.reset)
+        Test(Gateway:init(ctx), 'Gateway must be successfully initialized before continuing test')
+        local ok, msg = Gateway:register(ctx, Gateway.Data.Users1[1])
+        Test(ok, table.unpack(msg))
+    end
+end)
+
+local function login(ctx, email, passwd)
+    return Http(ctx.gty('/users/login'), {
+        method = 'POST',
+        form = {Email = email, Passwd = passwd}
+    })
+end
+
+GtyRateLimit('RateLimitEmail', 'Verify that logins of an account are limited to the email burst')
+:run(function(ctx)
+    local user = Gateway.Data.Users1[1]
+    for i=1,10 do
+        local resp = login(ctx, user.Email, 'invalid@pass')
+        V(resp):IsStatus(Http.Forbidden, "Login %d with an invalid password must be denied, not limited", i)
+    end
+    local resp = login(ctx, user.Email, user.Passwd)
+    V(resp):IsStatus(429, "Login over the email burst must be limited")
+    Test(resp:json().status, 'TooManyRequests', "Limited logins must return 'TooManyRequests' status")
+    Test(tonumber(resp.headers['Retry-After']) >= 1, "Limited logins must tell when to retry")
+    Test(not resp.headers.Authorization, 'Authorization token must not be issued to a limited login')
+end)
+:attrs({reset = true})
+
+GtyRateLimit('RateLimitIp', 'Verify that logins from an address are limited to the ip burst')
+:run(function(ctx)
+    -- distinct unregistered emails, only the address bucket is shared
+    for i=1,50 do
+        local resp = login(ctx, 'ratelimit'..i..'@suilteam.com', 'passwd')
+        V(resp):IsStatus(Http.Forbidden, "Login %d of an unregistered user must be denied, not limited", i)
+    end
+    local resp = login(ctx, 'ratelimit51@suilteam.com', 'passwd')
+    V(resp):IsStatus(429, "Login over the ip burst must be limited")
+    Test(resp:json().status, 'TooManyRequests', "Limited logins must return 'TooManyRequests' status")
+
+    -- routes have their own buckets
+    resp = Http(ctx.gty('/users/verify'), {
+        method = 'POST',
+        params = {email = 'ratelimit1@suilteam.com', id = 'invalid'}
+    })
+    Test(resp.status ~= 429, "Verify must not be limited by the login buckets")
+end)
+:attrs({reset = true})
+
+return GtyRateLimit
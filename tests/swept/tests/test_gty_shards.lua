@@ -0,0 +1,85 @@
+--
+-- @module GatewayShards fixture tests spreading users over two postgres shards
+-- and moving them with `gateway reshard`
+--
+
+local Gateway = require("scripts/gateway") { }
+local Http,_,V = import("sys/http")
+
+local GtyShards = Fixture('GatewayShards', "Tests users spread over two postgres shards")
+
+-- the test configuration with a second shard, next to it
+local function config()
+    return (Swept.Data.GtyConfig:gsub('gtytest%.lua$', 'gtyshards.lua'))
+end
+
+-- enough users for some of them to hash to each shard
+local Users = {}
+for i=1,12 do
+    Users[i] = {
+        Email = 'shard'..tostring(i)..'@suilteam.com',
+        FirstName = 'Shard'..tostring(i),
+        LastName = 'Testing',
+        Passwd = 'shard'..tostring(i)..'Pass'
+    }
+end
+
+GtyShards:before(function(ctx)
+    -- reset both shards, then register every user on the first shard only
+    ctx.gty = Gateway:restart(Swept.Data.GtyBin, config(), true)
+    Test(Gateway:init(ctx), 'Gateway must be successfully initialized before continuing test')
+    ctx.gty = Gateway:restart(Swept.Data.GtyBin, Swept.Data.GtyConfig, false)
+    for _,user in ipairs(Users) do
+        local ok, msg = Gateway:register(ctx, user)
+        Test(ok, table.unpack(msg))
+    end
+end)
+
+-- logs in every user, returning the number of users that could not be found
+local function logins(ctx)
+    local missing = 0
+    for _,user in ipairs(Users) do
+        local resp = Http(ctx.gty('/users/login'), {
+            method = 'POST',
+            form = {Email = user.Email, Passwd = user.Passwd}
+        })
+        if resp.status ~= Http.Ok then
+            V(resp):IsStatus(Http.Forbidden, "Login of '%s' must succeed or not find the user", user.Email)
+            Equal(resp:json().status, 'UserNotRegistered', "User '%s' can only be missing from its shard", user.Email)
+            missing = missing + 1
+        end
+    end
+    return missing
+end
+
+GtyShards('ShardsReshard', 'Verify that adding a shard moves users to it only when resharding')
+:run(function(ctx)
+    -- users that hash to the new shard are not found there
+    ctx.gty = Gateway:restart(Swept.Data.GtyBin, config(), false)
+    local missing = logins(ctx)
+    Test(missing > 0 and missing < #Users, "Users must hash to both shards, %d/%d on the new shard", missing, #Users)
+
+    -- a dry run moves no user
+    Test(Gateway:reshard(Swept.Data.GtyBin, config(), true), 'A dry run of reshard must succeed')
+    ctx.gty = Gateway:restart(Swept.Data.GtyBin, config(), false)
+    Equal(logins(ctx), missing, 'A dry run of reshard must not move any user')
+
+    -- the users are moved to the shard they hash to
+    Test(Gateway:reshard(Swept.Data.GtyBin, config(), false), 'Resharding users must succeed')
+    ctx.gty = Gateway:restart(Swept.Data.GtyBin, config(), false)
+    Equal(logins(ctx), 0, 'Every user must be found on its shard after resharding')
+
+    -- the logins above were routed to both shards
+    local admin = Gateway:login(ctx, Gateway.Data.Admin)
+    Test(admin, 'The administrator must be able to login')
+    local resp = Http(ctx.gty('/gateway/stats'), {
+        method = 'GET',
+        headers = {Authorization = admin}
+    })
+    V(resp):IsStatus(Http.Ok, 'Administrator must be able to read the gateway statistics')
+    local stats = resp:json()
+    Test((stats['pg_shard_primary_routed_total'] or 0) > 0, 'Users must be routed to the first shard')
+    Test((stats['pg_shard_shard2_routed_total'] or 0) > 0, 'Users must be routed to the second shard')
+end)
+
+return GtyShards
@@ -122,4 +122,38 @@ GtyUsersLogin('UsersLoginValidCredentials', 'Verify that logging in with valid c
     end
 end)
 
+GtyUsersLogin('UsersLoginBlockedAfterCached', 'Verify that blocking a user invalidates their cached login record')
+:run(function(ctx)
+    local user = Gateway.Data.Users1[3]
+    -- login twice, the second login is served from the user cache
+    for i=1,2 do
+        local resp = Http(ctx.gty('/users/login'), {
+            method = 'POST',
+            form = {Email = user.Email, Passwd = user.Passwd}
+        })
+        V(resp):IsStatus(Http.Ok, "Logging in user '%s' (%d) must succeed", user.Email, i)
+    end
+
+    -- block the user as the administrator
+    local admin = Gateway.Data.Admin
+    local resp = Http(ctx.gty('/users/login'), {
+        method = 'POST',
+        form = {Email = admin.Email, Passwd = admin.Passwd}
+    })
+    V(resp):IsStatus(Http.Ok, "Administrator must be able to login")
+    resp = Http(ctx.gty('/users/block'), {
+        method = 'POST',
+        headers = {Authorization = resp.headers.Authorization},
+        params = {email = user.Email, reason = 'Testing cache invalidation'}
+    })
+    V(resp):IsStatus(Http.Ok, "Administrator must be able to block user '%s'", user.Email)
+
+    resp = Http(ctx.gty('/users/login'), {
+        method = 'POST',
+        form = {Email = user.Email, Passwd = user.Passwd}
+    })
+    V(resp):IsStatus(Http.Forbidden, "Blocked user '%s' must not be able to login", user.Email)
+    Test(resp:json().status, 'UserBlocked', "Login of a blocked user must return 'UserBlocked' status")
+end)
+
 return GtyUsersLogin
\ No newline at end of file
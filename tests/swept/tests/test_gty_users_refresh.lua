@@ -0,0 +1,101 @@
+--
+-- @module GatewayUsersRefresh fixture tests swapping refresh tokens for access
+-- tokens at route POST '/users/refresh'
+--
+
+local Gateway = require("scripts/gateway") { }
+local Http,_,V,Jwt = import("sys/http")
+
+local GtyUsersRefresh = Fixture('GatewayUsersRefresh', "Tests the POST '/users/refresh' route")
+
+GtyUsersRefresh:before(function(ctx)
+    -- ensure that the server is running prior to running test
+    if ctx.gty == nil or not Gateway:running() or ctx.attrs.reset then
+        ctx.gty = Gateway:restart(Swept.Data.GtyBin, Swept.Data.GtyConfig, ctx.attrs.reset)
+        Test(Gateway:init(ctx), 'Gateway must be successfully initialized before continuing test')
+        for _,user in ipairs(Gateway.Data.Users1) do
+            local ok, msg = Gateway:register(ctx, user)
+            Test(ok, table.unpack(msg))
+        end
+    end
+end)
+
+-- logs in the given user, returning the refresh token issued
+local function login(ctx, user)
+    local resp = Http(ctx.gty('/users/login'), {
+        method = 'POST',
+        form = {Email = user.Email, Passwd = user.Passwd}
+    })
+    V(resp):IsStatus(Http.Ok, "Logging in user '%s' must succeed", user.Email)
+    local token = resp.headers['X-Refresh-Token']
+    Test(token ~= nil, "Login of '%s' must issue a refresh token", user.Email)
+    return token, resp.headers.Authorization
+end
+
+local function refresh(ctx, token)
+    return Http(ctx.gty('/users/refresh'), {
+        method = 'POST',
+        form = {Token = token}
+    })
+end
+
+GtyUsersRefresh('UsersRefreshRotation', 'Verify that every refresh issues a new access token and rotates the refresh token')
+:run(function(ctx)
+    local user = Gateway.Data.Users1[1]
+    local token = login(ctx, user)
+    for i=1,3 do
+        local resp = refresh(ctx, token)
+        V(resp):IsStatus(Http.Ok, "Refresh %d with the current refresh token must succeed", i)
+        local jwt = Jwt(resp.headers.Authorization)
+        Test(jwt ~= nil, "Refresh must issue a valid JWT")
+        Equal(jwt('aud'), user.Email, "The refreshed token must be addressed to the user")
+        local next = resp.headers['X-Refresh-Token']
+        Test(next ~= nil and next ~= token, "Refresh %d must rotate the refresh token", i)
+        token = next
+    end
+end)
+:attrs({reset = true})
+
+GtyUsersRefresh('UsersRefreshReuse', 'Verify that reusing a spent refresh token revokes its family')
+:run(function(ctx)
+    local first = login(ctx, Gateway.Data.Users1[2])
+    local resp = refresh(ctx, first)
+    V(resp):IsStatus(Http.Ok, "Refresh with a fresh refresh token must succeed")
+    local second = resp.headers['X-Refresh-Token']
+
+    -- the spent token leaked
+    resp = refresh(ctx, first)
+    V(resp):IsStatus(Http.Unauthorized, "Refresh with a spent refresh token must be denied")
+    Test(resp:json().status, 'InvalidToken', "Refresh with a spent token must return 'InvalidToken' status")
+    Test(not resp.headers.Authorization, 'Authorization token must not be issued for a spent refresh token')
+
+    -- the whole family is revoked, its current token included
+    resp = refresh(ctx, second)
+    V(resp):IsStatus(Http.Unauthorized, "Refresh with the live token of a revoked family must be denied")
+
+    -- a new login starts a new family
+    resp = refresh(ctx, login(ctx, Gateway.Data.Users1[2]))
+    V(resp):IsStatus(Http.Ok, "Refresh with the token of a new login must succeed")
+end)
+
+GtyUsersRefresh('UsersRefreshBlocked', 'Verify that a blocked user cannot refresh their tokens')
+:run(function(ctx)
+    local user = Gateway.Data.Users1[3]
+    local token = login(ctx, user)
+    -- block the user as the administrator
+    local _, admin = login(ctx, Gateway.Data.Admin)
+    local resp = Http(ctx.gty('/users/block'), {
+        method = 'POST',
+        headers = {Authorization = admin},
+        params = {email = user.Email, reason = 'Testing refresh of blocked users'}
+    })
+    V(resp):IsStatus(Http.Ok, "Administrator must be able to block user '%s'", user.Email)
+
+    resp = refresh(ctx, token)
+    V(resp):IsStatus(Http.Forbidden, "Blocked user '%s' must not be able to refresh", user.Email)
+    Test(resp:json().status, 'UserBlocked', "Refresh of a blocked user must return 'UserBlocked' status")
+    Test(not resp.headers.Authorization, 'Authorization token must not be issued to a blocked user')
+    Test(not resp.headers['X-Refresh-Token'], 'Refresh token must not be rotated for a blocked user')
+end)
+
+return GtyUsersRefresh
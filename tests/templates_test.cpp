@@ -0,0 +1,70 @@
+//
+// Created by Carter Mbotho on 2020-04-18.
+//
+
+#include <catch/catch.hpp>
+
+#include <cstdio>
+#include <fstream>
+
+#include "../src/gateway/templates.h"
+
+using namespace suil;
+using namespace suil::nozama;
+
+namespace {
+
+    struct Greeting {
+        static constexpr const char *Template = "_greeting.html";
+        static const Templates::Field<Greeting> Fields[];
+        String name;
+        String link;
+    };
+
+    const Templates::Field<Greeting> Greeting::Fields[] = {
+        {"name", &Greeting::name},
+        {"link", &Greeting::link},
+        {nullptr, nullptr}
+    };
+}
+
+TEST_CASE("Compiled mail templates", "[templates]")
+{
+    SECTION("Compiling templates") {
+        auto tmpl = Template::compile("test", "Hi {{ name }}, {{&link}}{{! dropped }} {{{link}}} {{name}}!");
+        REQUIRE(tmpl->Vars.size() == 2);
+        REQUIRE(tmpl->Vars[0] == "name");
+        REQUIRE(tmpl->Vars[1] == "link");
+        // text, name, text, link, text, link, text, name, text
+        REQUIRE(tmpl->Ops.size() == 9);
+        REQUIRE(tmpl->Ops[1].var == 0);
+        REQUIRE(tmpl->Ops[1].escape);
+        REQUIRE(tmpl->Ops[3].var == 1);
+        REQUIRE_FALSE(tmpl->Ops[3].escape);
+        REQUIRE_FALSE(tmpl->Ops[5].escape);
+
+        REQUIRE_THROWS(Template::compile("test", "Hi {{name"));
+        REQUIRE_THROWS(Template::compile("test", "Hi {{}}"));
+        REQUIRE_THROWS(Template::compile("test", "{{#list}}{{/list}}"));
+    }
+
+    SECTION("Rendering templates from typed fields") {
+        char dir[] = "/tmp/semausu-templatesXXXXXX";
+        REQUIRE(mkdtemp(dir) != nullptr);
+        {
+            std::ofstream out(std::string(dir) + "/_greeting.html");
+            out << "<p>{{name}}</p><a href=\"{{&link}}\">{{unknown}}</a>";
+        }
+        Templates::get().setup(dir, false);
+
+        Greeting greeting;
+        greeting.name = "Tom & <Jerry>";
+        greeting.link = "http://localhost/?a=1&b=2";
+        OBuffer ob{128};
+        Templates::get().render(ob, greeting);
+        REQUIRE(String(ob) == "<p>Tom &amp; &lt;Jerry&gt;</p><a href=\"http://localhost/?a=1&b=2\"></a>");
+
+        remove((std::string(dir) + "/_greeting.html").c_str());
+        rmdir(dir);
+    }
+}